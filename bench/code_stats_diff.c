@@ -0,0 +1,166 @@
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Compares a code stats file written by `mips_jit --code-stats-out` against a
+ * baseline, printing each metric that changed. Exits with 1 if any got worse
+ * by more than the tolerance, as every metric is better when lower except the
+ * number of MIPS instructions, which only says how big the code is.
+ *
+ * Loops are only compared if they're in both files, as changes to the
+ * optimiser can add or remove loops without the code getting worse.
+ */
+
+struct metric {
+    char key[256]; // program, scope and name
+    double value;
+};
+
+struct metrics {
+    struct metric *data;
+    size_t len, cap;
+};
+
+static const char *const informational[] = {"mips_instrs"};
+
+static int compare_metric(const void *a_, const void *b_) {
+    const struct metric *a = a_;
+    const struct metric *b = b_;
+
+    return strcmp(a->key, b->key);
+}
+
+/**
+ * Read every metric in 'path', sorted by key.
+ */
+static struct metrics read_metrics(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        exit(2);
+    }
+
+    struct metrics metrics = {0};
+    char program[128], scope[64], name[48];
+    double value;
+
+    while (fscanf(file, "%127s %63s %47s %lf", program, scope, name,
+                  &value) == 4) {
+        if (metrics.len == metrics.cap) {
+            metrics.cap = metrics.cap > 0 ? 2 * metrics.cap : 64;
+            metrics.data =
+                realloc(metrics.data, metrics.cap * sizeof(struct metric));
+        }
+
+        struct metric *m = &metrics.data[metrics.len++];
+        snprintf(m->key, sizeof(m->key), "%s %s %s", program, scope, name);
+        m->value = value;
+    }
+
+    fclose(file);
+    qsort(metrics.data, metrics.len, sizeof(struct metric), compare_metric);
+
+    return metrics;
+}
+
+static bool is_informational(const char *key) {
+    const char *name = strrchr(key, ' ') + 1;
+
+    for (size_t i = 0; i < sizeof(informational) / sizeof(*informational);
+         i++) {
+        if (!strcmp(name, informational[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool is_program_scope(const char *key) {
+    const char *scope = strchr(key, ' ') + 1;
+
+    return !strncmp(scope, "program ", strlen("program "));
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [--tolerance=PCT] <baseline> <current>\n"
+            "  --tolerance=PCT  how far a metric may get worse before it "
+            "counts (0)\n",
+            name);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    double tolerance = 0;
+
+    static const struct option long_options[] = {
+        {"tolerance", required_argument, NULL, 't'}, {0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 't':
+            tolerance = strtod(optarg, NULL) / 100;
+            break;
+        default:
+            usage(*argv);
+        }
+    }
+
+    if (optind != argc - 2) {
+        usage(*argv);
+    }
+
+    struct metrics baseline = read_metrics(argv[optind]);
+    struct metrics current = read_metrics(argv[optind + 1]);
+    size_t regressed = 0, improved = 0;
+
+    for (size_t i = 0; i < current.len; i++) {
+        struct metric *cur = &current.data[i];
+        struct metric *base =
+            bsearch(cur, baseline.data, baseline.len, sizeof(struct metric),
+                    compare_metric);
+
+        if (base == NULL) {
+            if (is_program_scope(cur->key)) {
+                printf("new:       %s %g\n", cur->key, cur->value);
+            }
+            continue;
+        }
+
+        if (cur->value == base->value || is_informational(cur->key)) {
+            continue;
+        }
+
+        if (cur->value > base->value * (1 + tolerance)) {
+            printf("REGRESSED: %s %g -> %g\n", cur->key, base->value,
+                   cur->value);
+            regressed++;
+        } else if (cur->value < base->value) {
+            printf("improved:  %s %g -> %g\n", cur->key, base->value,
+                   cur->value);
+            improved++;
+        }
+    }
+
+    for (size_t i = 0; i < baseline.len; i++) {
+        struct metric *base = &baseline.data[i];
+
+        if (is_program_scope(base->key) &&
+            bsearch(base, current.data, current.len, sizeof(struct metric),
+                    compare_metric) == NULL) {
+            printf("missing:   %s\n", base->key);
+        }
+    }
+
+    printf("%zu metrics regressed, %zu improved\n", regressed, improved);
+
+    free(baseline.data);
+    free(current.data);
+
+    return regressed > 0;
+}
@@ -0,0 +1,262 @@
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Generates MIPS programs for benchmarking the compiler, with a given size,
+ * density of labels, number of registers, depth of loop nesting and share of
+ * conditional branches. Every program ends: loops count down from a small
+ * number of trips, and branches only skip forwards within the block they're
+ * in. Adds never trap, and memory is only accessed at small offsets from $gp.
+ */
+
+// registers values are computed in, loop counters are taken from the end
+static const char *const regs[] = {
+    "$t0", "$t1", "$t2", "$t3", "$t4", "$t5", "$t6", "$t7", "$t8",
+    "$t9", "$s0", "$s1", "$s2", "$s3", "$s4", "$s5", "$s6", "$s7",
+    "$v0", "$v1", "$a0", "$a1", "$a2", "$a3", "$fp"};
+
+#define NUM_REGS (sizeof(regs) / sizeof(*regs))
+
+struct gen_options {
+    uint32_t size;       // instructions in the program
+    uint32_t label_pct;  // chance of an instruction being labelled
+    uint32_t num_regs;   // registers values are computed in
+    uint32_t loop_depth; // most loops nested in each other
+    uint32_t loop_pct;   // chance of a loop starting at an instruction
+    uint32_t trips;      // times each loop runs
+    uint32_t branch_pct; // chance of an instruction being a branch
+    uint32_t seed;
+};
+
+struct gen {
+    struct gen_options options;
+    uint32_t emitted;
+    uint32_t next_label;
+    uint64_t rng;
+};
+
+static uint32_t gen_random(struct gen *g) {
+    // xorshift64*
+    g->rng ^= g->rng >> 12;
+    g->rng ^= g->rng << 25;
+    g->rng ^= g->rng >> 27;
+
+    return (g->rng * 0x2545f4914f6cdd1dull) >> 32;
+}
+
+static bool gen_chance(struct gen *g, uint32_t pct) {
+    return gen_random(g) % 100 < pct;
+}
+
+static const char *gen_reg(struct gen *g) {
+    return regs[gen_random(g) % g->options.num_regs];
+}
+
+/**
+ * Start a line, labelling it with 'label' if it isn't 0, or with a fresh
+ * label by chance.
+ */
+static void gen_line(struct gen *g, uint32_t label) {
+    if (label == 0 && gen_chance(g, g->options.label_pct)) {
+        label = ++g->next_label;
+    }
+
+    if (label != 0) {
+        printf("L%u: ", label);
+    } else {
+        printf("    ");
+    }
+
+    g->emitted++;
+}
+
+/**
+ * An instruction computing a value from registers, constants and memory.
+ */
+static void gen_op(struct gen *g, uint32_t label) {
+    const char *d = gen_reg(g);
+    const char *s = gen_reg(g);
+    const char *t = gen_reg(g);
+    int32_t imm = (int32_t)(gen_random(g) % 512) - 256;
+    uint32_t offset = 4 * (gen_random(g) % 256);
+
+    gen_line(g, label);
+
+    switch (gen_random(g) % 10) {
+    case 0:
+    case 1:
+    case 2:
+        printf("addu %s %s %s\n", d, s, t);
+        break;
+    case 3:
+    case 4:
+        printf("addiu %s %s %d\n", d, s, imm);
+        break;
+    case 5:
+        printf("andi %s %s %u\n", d, s, gen_random(g) % 0x10000);
+        break;
+    case 6:
+        printf("%s %s %s %u\n", gen_random(g) % 2 ? "sll" : "srl", d, s,
+               gen_random(g) % 32);
+        break;
+    case 7:
+        printf("mul %s %s %s\n", d, s, t);
+        break;
+    case 8:
+        printf("lw %s %u($gp)\n", d, offset);
+        break;
+    case 9:
+        printf("sw %s %u($gp)\n", s, offset);
+        break;
+    }
+}
+
+static void gen_block(struct gen *g, uint32_t depth, uint32_t budget);
+
+/**
+ * A loop running 'trips' times, counting down in a register of its own.
+ */
+static void gen_loop(struct gen *g, uint32_t depth, uint32_t budget) {
+    const char *counter = regs[NUM_REGS - 1 - depth];
+    uint32_t head = ++g->next_label;
+
+    gen_line(g, 0);
+    printf("addiu %s $zero %u\n", counter, g->options.trips);
+
+    gen_op(g, head);
+    gen_block(g, depth + 1, budget);
+
+    gen_line(g, 0);
+    printf("addiu %s %s -1\n", counter, counter);
+    gen_line(g, 0);
+    printf("bne %s $zero L%u\n", counter, head);
+}
+
+/**
+ * About 'budget' instructions, with loops nested at most to the loop depth
+ * inside them.
+ */
+static void gen_block(struct gen *g, uint32_t depth, uint32_t budget) {
+    uint32_t end = g->emitted + budget;
+    uint32_t skip_to = 0; // the label a branch skips to, 0 if none
+    uint32_t skip_left = 0;
+
+    while (g->emitted < end) {
+        uint32_t label = 0;
+        if (skip_to != 0 && skip_left-- == 0) {
+            label = skip_to;
+            skip_to = 0;
+        }
+
+        if (label == 0 && depth < g->options.loop_depth &&
+            gen_chance(g, g->options.loop_pct)) {
+            // the loop body takes a share of what's left
+            gen_loop(g, depth, (end - g->emitted) / 4 + 1);
+        } else if (label == 0 && skip_to == 0 &&
+                   gen_chance(g, g->options.branch_pct)) {
+            skip_to = ++g->next_label;
+            skip_left = gen_random(g) % 8;
+
+            gen_line(g, 0);
+            printf("%s %s %s L%u\n", gen_random(g) % 2 ? "beq" : "bne",
+                   gen_reg(g), gen_reg(g), skip_to);
+        } else {
+            gen_op(g, label);
+        }
+    }
+
+    // a branch skipping past the end lands on the last instruction
+    if (skip_to != 0) {
+        gen_op(g, skip_to);
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --size=N        instructions in the program (10000)\n"
+            "  --labels=PCT    chance of an instruction having a label (5)\n"
+            "  --regs=N        registers values are computed in, at most "
+            "%zu (12)\n"
+            "  --loop-depth=N  most loops nested in each other (2)\n"
+            "  --loops=PCT     chance of a loop starting at an instruction "
+            "(1)\n"
+            "  --trips=N       times each loop runs (4)\n"
+            "  --branches=PCT  chance of an instruction being a branch (10)\n"
+            "  --seed=N        seed for the random choices (1)\n",
+            name, NUM_REGS - 4);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    struct gen_options options = {.size = 10000,
+                                  .label_pct = 5,
+                                  .num_regs = 12,
+                                  .loop_depth = 2,
+                                  .loop_pct = 1,
+                                  .trips = 4,
+                                  .branch_pct = 10,
+                                  .seed = 1};
+
+    static const struct option long_options[] = {
+        {"size", required_argument, NULL, 'n'},
+        {"labels", required_argument, NULL, 'l'},
+        {"regs", required_argument, NULL, 'r'},
+        {"loop-depth", required_argument, NULL, 'd'},
+        {"loops", required_argument, NULL, 'L'},
+        {"trips", required_argument, NULL, 't'},
+        {"branches", required_argument, NULL, 'b'},
+        {"seed", required_argument, NULL, 's'},
+        {0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        uint32_t value = optarg != NULL ? strtoul(optarg, NULL, 0) : 0;
+
+        switch (opt) {
+        case 'n':
+            options.size = value;
+            break;
+        case 'l':
+            options.label_pct = value;
+            break;
+        case 'r':
+            options.num_regs = value;
+            break;
+        case 'd':
+            options.loop_depth = value;
+            break;
+        case 'L':
+            options.loop_pct = value;
+            break;
+        case 't':
+            options.trips = value;
+            break;
+        case 'b':
+            options.branch_pct = value;
+            break;
+        case 's':
+            options.seed = value;
+            break;
+        default:
+            usage(*argv);
+        }
+    }
+
+    // loop counters are the last registers, one for each level of nesting
+    if (optind != argc || options.num_regs == 0 || options.loop_depth > 4 ||
+        options.num_regs > NUM_REGS - 4 || options.trips == 0 ||
+        options.trips > 0xffff) {
+        usage(*argv);
+    }
+
+    struct gen g = {.options = options,
+                    .rng = 0x9e3779b97f4a7c15ull ^ options.seed};
+
+    gen_line(&g, 0);
+    printf("addiu $gp $zero 4096\n");
+    gen_block(&g, 0, options.size - 1);
+}
@@ -1,14 +1,351 @@
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "abstract_instr.h"
 #include "common.h"
+#include "cse.h"
+#include "known_bits.h"
 #include "label_storage.h"
+#include "licm.h"
 #include "mips_reg.h"
+#include "range.h"
+#include "unroll.h"
 #include "vec.h"
+#include "x86_instr.h"
 #include "x86_reg.h"
 
-MAKE_VEC(struct abstract_instr, abstract_instr);
+static void *vec_resize(struct arena *arena, void *data, size_t old_size,
+                        size_t size) {
+    if (arena == NULL) {
+        return realloc(data, size);
+    }
+
+    void *resized = arena_alloc(arena, size);
+    if (old_size > 0) {
+        memcpy(resized, data, old_size);
+    }
+    return resized;
+}
+
+static size_t label_words(size_t len) { return (len + 63) / 64; }
+
+/**
+ * Make room for at least 'cap' instructions.
+ */
+static void abstract_instr_vec_reserve(struct abstract_instr_vec *vec,
+                                       size_t cap) {
+    if (cap <= vec->cap) {
+        return;
+    }
+
+    size_t new_cap = vec->cap;
+    while (new_cap < cap) {
+        new_cap <<= 1;
+    }
+
+    vec->types = vec_resize(vec->arena, vec->types,
+                            vec->len * sizeof(*vec->types),
+                            new_cap * sizeof(*vec->types));
+    vec->operands = vec_resize(vec->arena, vec->operands,
+                               vec->len * sizeof(*vec->operands),
+                               new_cap * sizeof(*vec->operands));
+    vec->guest_addresses =
+        vec_resize(vec->arena, vec->guest_addresses,
+                   vec->len * sizeof(*vec->guest_addresses),
+                   new_cap * sizeof(*vec->guest_addresses));
+
+    size_t words = label_words(vec->cap), new_words = label_words(new_cap);
+    vec->labels.bits =
+        vec_resize(vec->arena, vec->labels.bits, words * sizeof(uint64_t),
+                   new_words * sizeof(uint64_t));
+    memset(&vec->labels.bits[words], 0,
+           (new_words - words) * sizeof(uint64_t));
+    vec->labels.ranks =
+        vec_resize(vec->arena, vec->labels.ranks, words * sizeof(uint32_t),
+                   new_words * sizeof(uint32_t));
+
+    vec->cap = new_cap;
+}
+
+struct abstract_instr_vec *abstract_instr_vec_new(void) {
+    const size_t initial_cap = 8;
+
+    return abstract_instr_vec_new_in(NULL, initial_cap);
+}
+
+struct abstract_instr_vec *abstract_instr_vec_new_in(struct arena *arena,
+                                                     size_t cap) {
+    struct abstract_instr_vec *vec =
+        arena != NULL ? arena_alloc(arena, sizeof(struct abstract_instr_vec))
+                      : malloc(sizeof(struct abstract_instr_vec));
+
+    *vec = (struct abstract_instr_vec){.cap = 1, .arena = arena};
+    vec->types = vec_resize(arena, NULL, 0, sizeof(*vec->types));
+    vec->operands = vec_resize(arena, NULL, 0, sizeof(*vec->operands));
+    vec->guest_addresses =
+        vec_resize(arena, NULL, 0, sizeof(*vec->guest_addresses));
+    vec->labels.entries =
+        vec_resize(arena, NULL, 0, sizeof(*vec->labels.entries));
+    vec->labels.cap = 1;
+    vec->labels.bits = vec_resize(arena, NULL, 0, sizeof(uint64_t));
+    vec->labels.bits[0] = 0;
+    vec->labels.ranks = vec_resize(arena, NULL, 0, sizeof(uint32_t));
+    vec->labels.ranks[0] = 0;
+
+    abstract_instr_vec_reserve(vec, cap);
+
+    return vec;
+}
+
+void abstract_instr_vec_push(struct abstract_instr_vec *vec,
+                             struct abstract_instr i) {
+    abstract_instr_vec_reserve(vec, vec->len + 1);
+
+    if (vec->len % 64 == 0) {
+        vec->labels.ranks[vec->len / 64] = vec->labels.len;
+    }
+
+    vec->len++;
+    abstract_instr_set(vec, vec->len - 1, &i);
+}
+
+void abstract_instr_vec_free(struct abstract_instr_vec *vec) {
+    if (vec->arena != NULL) {
+        return;
+    }
+
+    free(vec->types);
+    free(vec->operands);
+    free(vec->guest_addresses);
+    free(vec->labels.entries);
+    free(vec->labels.bits);
+    free(vec->labels.ranks);
+    free(vec);
+}
+
+static bool has_label(struct abstract_instr_vec *vec, size_t i) {
+    return vec->labels.bits[i / 64] >> (i % 64) & 1;
+}
+
+/**
+ * The first label entry for an instruction at or after 'index'.
+ */
+static size_t label_entry_from(struct abstract_instr_labels *labels,
+                               size_t index) {
+    size_t low = 0, high = labels->len;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+
+        if (labels->entries[mid].index < index) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/**
+ * The label entry for instruction 'i', or where it would go, from the bits
+ * and ranks rather than a search.
+ */
+static size_t label_entry_at(struct abstract_instr_labels *labels, size_t i) {
+    uint64_t before = labels->bits[i / 64] & ((1ull << (i % 64)) - 1);
+
+    return labels->ranks[i / 64] + __builtin_popcountll(before);
+}
+
+/**
+ * Set the label bits and ranks again from the entries, for instructions from
+ * 'start' up to 'end' (which may be past the length, after removing
+ * instructions).
+ */
+static void refresh_label_bits(struct abstract_instr_vec *vec, size_t start,
+                               size_t end) {
+    struct abstract_instr_labels *labels = &vec->labels;
+    size_t first_word = start / 64;
+
+    memset(&labels->bits[first_word], 0,
+           (label_words(end) - first_word) * sizeof(uint64_t));
+
+    size_t e = label_entry_from(labels, first_word * 64);
+
+    for (size_t word = first_word; word < label_words(end); word++) {
+        labels->ranks[word] = e;
+
+        while (e < labels->len && labels->entries[e].index / 64 == word) {
+            size_t i = labels->entries[e++].index;
+            labels->bits[word] |= 1ull << (i % 64);
+        }
+    }
+}
+
+/**
+ * Count 'delta' more label entries before every word of bits after the one
+ * holding instruction 'i'.
+ */
+static void shift_label_ranks(struct abstract_instr_vec *vec, size_t i,
+                              int delta) {
+    for (size_t word = i / 64 + 1; word < label_words(vec->len); word++) {
+        vec->labels.ranks[word] += delta;
+    }
+}
+
+struct label *abstract_instr_label(struct abstract_instr_vec *vec, size_t i) {
+    if (!has_label(vec, i)) {
+        return NULL;
+    }
+
+    size_t e = label_entry_at(&vec->labels, i);
+    return all_labels()->data[vec->labels.entries[e].label_id];
+}
+
+void abstract_instr_set_label(struct abstract_instr_vec *vec, size_t i,
+                              struct label *label) {
+    struct abstract_instr_labels *labels = &vec->labels;
+
+    if (label == NULL && !has_label(vec, i)) {
+        return;
+    }
+
+    size_t e = label_entry_at(labels, i);
+
+    if (label == NULL) {
+        memmove(&labels->entries[e], &labels->entries[e + 1],
+                (labels->len - e - 1) * sizeof(*labels->entries));
+        labels->len--;
+        labels->bits[i / 64] &= ~(1ull << (i % 64));
+        shift_label_ranks(vec, i, -1);
+        return;
+    }
+
+    if (!has_label(vec, i)) {
+        if (labels->len == labels->cap) {
+            size_t cap = 2 * labels->cap;
+            labels->entries = vec_resize(
+                vec->arena, labels->entries,
+                labels->len * sizeof(*labels->entries),
+                cap * sizeof(*labels->entries));
+            labels->cap = cap;
+        }
+
+        memmove(&labels->entries[e + 1], &labels->entries[e],
+                (labels->len - e) * sizeof(*labels->entries));
+        labels->len++;
+        labels->entries[e].index = i;
+        labels->bits[i / 64] |= 1ull << (i % 64);
+        shift_label_ranks(vec, i, 1);
+    }
+
+    labels->entries[e].label_id = label->id;
+}
+
+struct abstract_instr abstract_instr_get(struct abstract_instr_vec *vec,
+                                         size_t i) {
+    // filled in field by field, an initializer would clear it all first
+    struct abstract_instr instr;
+
+    instr.label = abstract_instr_label(vec, i);
+    instr.guest_address = vec->guest_addresses[i];
+    instr.type = vec->types[i];
+    memcpy(&instr.binop, &vec->operands[i], sizeof(*vec->operands));
+    return instr;
+}
+
+void abstract_instr_set(struct abstract_instr_vec *vec, size_t i,
+                        struct abstract_instr *instr) {
+    vec->types[i] = instr->type;
+    memcpy(&vec->operands[i], &instr->binop, sizeof(*vec->operands));
+    vec->guest_addresses[i] = instr->guest_address;
+    abstract_instr_set_label(vec, i, instr->label);
+}
+
+bool abstract_instr_iter(struct abstract_instr_vec *vec, size_t i,
+                         struct abstract_instr *instr) {
+    if (i >= vec->len) {
+        return false;
+    }
+
+    *instr = abstract_instr_get(vec, i);
+    return true;
+}
+
+size_t abstract_instrs_next_labelled(struct abstract_instr_vec *vec,
+                                     size_t start) {
+    for (size_t word = start / 64; word < label_words(vec->len); word++) {
+        uint64_t bits = vec->labels.bits[word];
+
+        if (word == start / 64) {
+            bits &= ~0ull << (start % 64);
+        }
+
+        if (bits != 0) {
+            return word * 64 + __builtin_ctzll(bits);
+        }
+    }
+
+    return vec->len;
+}
+
+void abstract_instrs_insert(struct abstract_instr_vec *vec, size_t at,
+                            size_t count) {
+    abstract_instr_vec_reserve(vec, vec->len + count);
+
+    size_t moved = vec->len - at;
+    memmove(&vec->types[at + count], &vec->types[at],
+            moved * sizeof(*vec->types));
+    memmove(&vec->operands[at + count], &vec->operands[at],
+            moved * sizeof(*vec->operands));
+    memmove(&vec->guest_addresses[at + count], &vec->guest_addresses[at],
+            moved * sizeof(*vec->guest_addresses));
+
+    struct abstract_instr_labels *labels = &vec->labels;
+    for (size_t e = label_entry_from(labels, at); e < labels->len; e++) {
+        labels->entries[e].index += count;
+    }
+
+    vec->len += count;
+    refresh_label_bits(vec, at, vec->len);
+}
+
+void abstract_instrs_remove(struct abstract_instr_vec *vec, size_t start,
+                            size_t count) {
+    size_t moved = vec->len - start - count;
+    memmove(&vec->types[start], &vec->types[start + count],
+            moved * sizeof(*vec->types));
+    memmove(&vec->operands[start], &vec->operands[start + count],
+            moved * sizeof(*vec->operands));
+    memmove(&vec->guest_addresses[start], &vec->guest_addresses[start + count],
+            moved * sizeof(*vec->guest_addresses));
+
+    struct abstract_instr_labels *labels = &vec->labels;
+    size_t first = label_entry_from(labels, start);
+    size_t last = label_entry_from(labels, start + count);
+
+    memmove(&labels->entries[first], &labels->entries[last],
+            (labels->len - last) * sizeof(*labels->entries));
+    labels->len -= last - first;
+
+    for (size_t e = first; e < labels->len; e++) {
+        labels->entries[e].index -= count;
+    }
+
+    refresh_label_bits(vec, start, vec->len);
+    vec->len -= count;
+}
+
+size_t abstract_instrs_bytes(struct abstract_instr_vec *vec) {
+    return vec->len * (sizeof(*vec->types) + sizeof(*vec->operands) +
+                       sizeof(*vec->guest_addresses)) +
+           vec->labels.len * sizeof(*vec->labels.entries) +
+           label_words(vec->len) *
+               (sizeof(*vec->labels.bits) + sizeof(*vec->labels.ranks));
+}
 
 const char *const abstract_storage_type_names[] = {
     [ABSTRACT_STORAGE_REG] = "ABSTRACT_STORAGE_REG",
@@ -18,140 +355,1189 @@ const char *const abstract_instr_type_names[] = {
     [ABSTRACT_INSTR_BINOP] = "ABSTRACT_INSTR_BINOP",
     [ABSTRACT_INSTR_BRANCH] = "ABSTRACT_INSTR_BRANCH",
     [ABSTRACT_INSTR_MOV] = "ABSTRACT_INSTR_MOV",
-    [ABSTRACT_INSTR_SHIFT] = "ABSTRACT_INSTR_SHIFT"};
+    [ABSTRACT_INSTR_SHIFT] = "ABSTRACT_INSTR_SHIFT",
+    [ABSTRACT_INSTR_LOAD] = "ABSTRACT_INSTR_LOAD",
+    [ABSTRACT_INSTR_STORE] = "ABSTRACT_INSTR_STORE",
+    [ABSTRACT_INSTR_MULDIV] = "ABSTRACT_INSTR_MULDIV",
+    [ABSTRACT_INSTR_MUL_LOOP] = "ABSTRACT_INSTR_MUL_LOOP",
+    [ABSTRACT_INSTR_INDUCTION] = "ABSTRACT_INSTR_INDUCTION",
+    [ABSTRACT_INSTR_JUMP] = "ABSTRACT_INSTR_JUMP",
+    [ABSTRACT_INSTR_CALL] = "ABSTRACT_INSTR_CALL",
+    [ABSTRACT_INSTR_RETURN] = "ABSTRACT_INSTR_RETURN",
+    [ABSTRACT_INSTR_JUMP_REG] = "ABSTRACT_INSTR_JUMP_REG",
+    [ABSTRACT_INSTR_SWAP] = "ABSTRACT_INSTR_SWAP"};
+
+const char *const abstract_instr_binop_op_names[] = {
+    [ABSTRACT_INSTR_BINOP_ADD] = "+", [ABSTRACT_INSTR_BINOP_ADD_TRAP] = "+!",
+    [ABSTRACT_INSTR_BINOP_AND] = "&", [ABSTRACT_INSTR_BINOP_MUL] = "*",
+    [ABSTRACT_INSTR_BINOP_SCALED_ADD] = "+"};
+
+const char *const abstract_instr_muldiv_op_names[] = {
+    [ABSTRACT_INSTR_MULDIV_MULT] = "*",
+    [ABSTRACT_INSTR_MULDIV_MULTU] = "*u",
+    [ABSTRACT_INSTR_MULDIV_DIV] = "/",
+    [ABSTRACT_INSTR_MULDIV_DIVU] = "/u"};
+
+const char *const abstract_instr_branch_test_type_names[] = {
+    [ABSTRACT_INSTR_BRANCH_TEST_NE] = "!=",
+    [ABSTRACT_INSTR_BRANCH_TEST_EQ] = "==",
+    [ABSTRACT_INSTR_BRANCH_TEST_LOW_NE] = "!=",
+    [ABSTRACT_INSTR_BRANCH_TEST_LOW_EQ] = "==",
+    [ABSTRACT_INSTR_BRANCH_TEST_MASK_ZERO] = "==",
+    [ABSTRACT_INSTR_BRANCH_TEST_MASK_NONZERO] = "!="};
+
+const char *const abstract_mem_width_names[] = {
+    [ABSTRACT_MEM_BYTE] = "byte", [ABSTRACT_MEM_HALF] = "half",
+    [ABSTRACT_MEM_WORD] = "word"};
+
+static struct abstract_storage translate_reg(enum reg_type r) {
+    if (r == REG_ZERO) {
+        return (struct abstract_storage){.type = ABSTRACT_STORAGE_IMM,
+                                         .imm = 0};
+    }
+
+    return (struct abstract_storage){.type = ABSTRACT_STORAGE_REG, .reg = r};
+}
+
+static enum reg_type ensure_nonzero(enum reg_type r,
+                                    const char *const instr_name) {
+    if (r == REG_ZERO) {
+        RUNTIME_ERROR("Zero register not allowed in %s instruction",
+                      instr_name);
+    }
+
+    return r;
+}
+
+static struct abstract_instr translate_load(struct instr instr,
+                                           enum abstract_mem_width width) {
+    return (struct abstract_instr){
+        .type = ABSTRACT_INSTR_LOAD,
+        .label = instr.label,
+        .load = {.width = width,
+                 .dest = instr.mem_instr.t,
+                 .base = translate_reg(instr.mem_instr.s),
+                 .offset = instr.mem_instr.offset}};
+}
+
+static struct abstract_instr translate_store(struct instr instr,
+                                            enum abstract_mem_width width) {
+    return (struct abstract_instr){
+        .type = ABSTRACT_INSTR_STORE,
+        .label = instr.label,
+        .store = {.width = width,
+                  .value = translate_reg(instr.mem_instr.t),
+                  .base = translate_reg(instr.mem_instr.s),
+                  .offset = instr.mem_instr.offset}};
+}
+
+static struct abstract_instr translate_muldiv(struct instr instr,
+                                             enum abstract_instr_muldiv_op op) {
+    return (struct abstract_instr){
+        .type = ABSTRACT_INSTR_MULDIV,
+        .label = instr.label,
+        .muldiv = {.op = op,
+                   .lhs = translate_reg(instr.reg_instr.s),
+                   .rhs = translate_reg(instr.reg_instr.t)}};
+}
+
+static struct abstract_instr translate_move_from(struct instr instr,
+                                                enum reg_type source) {
+    return (struct abstract_instr){
+        .type = ABSTRACT_INSTR_MOV,
+        .label = instr.label,
+        .mov = {.dest = instr.reg_instr.d,
+                .source = {.type = ABSTRACT_STORAGE_REG, .reg = source}}};
+}
+
+uint32_t guest_address_of(size_t index) { return index * 4; }
+
+static uint32_t next_synthetic_guest_address;
+
+uint32_t synthetic_guest_address(void) {
+    uint32_t address = next_synthetic_guest_address;
+    next_synthetic_guest_address += 4;
+    return address;
+}
+
+struct label *abstract_instr_target_label(struct abstract_instr *i) {
+    switch (i->type) {
+    case ABSTRACT_INSTR_BRANCH:
+        return i->branch.label;
+    case ABSTRACT_INSTR_JUMP:
+        return i->jump.label;
+    case ABSTRACT_INSTR_CALL:
+        return i->call.label;
+    default:
+        return NULL;
+    }
+}
+
+struct label *abstract_instrs_target_label(struct abstract_instr_vec *vec,
+                                           size_t i) {
+    switch (vec->types[i]) {
+    case ABSTRACT_INSTR_BRANCH:
+        return vec->operands[i].branch.label;
+    case ABSTRACT_INSTR_JUMP:
+        return vec->operands[i].jump.label;
+    case ABSTRACT_INSTR_CALL:
+        return vec->operands[i].call.label;
+    default:
+        return NULL;
+    }
+}
+
+static struct abstract_instr translate_call(struct instr instr,
+                                           size_t index) {
+    struct label *return_label = add_internal_label();
+    set_label_guest_address(return_label, guest_address_of(index + 1));
+
+    return (struct abstract_instr){
+        .type = ABSTRACT_INSTR_CALL,
+        .call = {.label = instr.jump_instr.label,
+                 .return_label = return_label}};
+}
+
+static struct abstract_instr translate_jump_reg(struct instr instr,
+                                               size_t index) {
+    return (struct abstract_instr){
+        .type = instr.reg_instr.s == REG_RA ? ABSTRACT_INSTR_RETURN
+                                            : ABSTRACT_INSTR_JUMP_REG,
+        .label = instr.label,
+        .jump_reg = {.target = translate_reg(instr.reg_instr.s),
+                     .site_address = guest_address_of(index)}};
+}
+
+struct abstract_instr_vec *translate_instructions(struct instr_vec *instrs) {
+    // in the same arena as the parsed instructions, most translate to one
+    struct abstract_instr_vec *res_vec =
+        abstract_instr_vec_new_in(instrs->arena, instrs->len);
+
+    // past where a call in the last instruction would return to
+    next_synthetic_guest_address = guest_address_of(instrs->len + 1);
+
+    for (size_t i = 0; i < instrs->len; i++) {
+        struct instr instr = instrs->data[i];
+
+        if (instr.label != NULL) {
+            set_label_guest_address(instr.label, guest_address_of(i));
+        }
+
+        size_t first_translated = res_vec->len;
+
+        switch (instr.type) {
+        case INSTR_NOP:
+            if (instr.label != NULL) {
+                RUNTIME_ERROR(
+                    "You have a NOP op with a label, don't do that...");
+            }
+            break;
+        case INSTR_ADD:
+        case INSTR_ADDU:
+            abstract_instr_vec_push(
+                res_vec, (struct abstract_instr){
+                             .type = ABSTRACT_INSTR_BINOP,
+                             .label = instr.label,
+                             .binop = {
+                                 .dest = instr.reg_instr.d,
+                                 .op = instr.type == INSTR_ADD
+                                           ? ABSTRACT_INSTR_BINOP_ADD_TRAP
+                                           : ABSTRACT_INSTR_BINOP_ADD,
+                                 .lhs = translate_reg(instr.reg_instr.s),
+                                 .rhs = translate_reg(instr.reg_instr.t),
+                             }});
+            break;
+        case INSTR_ADDI:
+        case INSTR_ADDIU:
+            abstract_instr_vec_push(
+                res_vec, (struct abstract_instr){
+                             .type = ABSTRACT_INSTR_BINOP,
+                             .label = instr.label,
+                             .binop = {
+                                 .dest = instr.imm_instr.t,
+                                 .op = instr.type == INSTR_ADDI
+                                           ? ABSTRACT_INSTR_BINOP_ADD_TRAP
+                                           : ABSTRACT_INSTR_BINOP_ADD,
+                                 .lhs = translate_reg(instr.imm_instr.s),
+                                 .rhs = {.type = ABSTRACT_STORAGE_IMM,
+                                         .imm = (int16_t)instr.imm_instr.imm},
+                             }});
+            break;
+        case INSTR_ANDI:
+            abstract_instr_vec_push(
+                res_vec, (struct abstract_instr){
+                             .type = ABSTRACT_INSTR_BINOP,
+                             .label = instr.label,
+                             .binop = {
+                                 .dest = instr.imm_instr.t,
+                                 .op = ABSTRACT_INSTR_BINOP_AND,
+                                 .lhs = translate_reg(instr.imm_instr.s),
+                                 .rhs = {.type = ABSTRACT_STORAGE_IMM,
+                                         .imm = instr.imm_instr.imm},
+                             }});
+            break;
+        case INSTR_SRL:
+            abstract_instr_vec_push(
+                res_vec,
+                (struct abstract_instr){
+                    .type = ABSTRACT_INSTR_SHIFT,
+                    .label = instr.label,
+                    .shift = {.direction = ABSTRACT_INSTR_SHIFT_RIGHT,
+                              .dest = instr.imm_instr.t,
+                              .lhs = ensure_nonzero(instr.imm_instr.s, "SRL"),
+                              .rhs = instr.imm_instr.imm}});
+            break;
+        case INSTR_SLL:
+            abstract_instr_vec_push(
+                res_vec,
+                (struct abstract_instr){
+                    .type = ABSTRACT_INSTR_SHIFT,
+                    .label = instr.label,
+                    .shift = {.direction = ABSTRACT_INSTR_SHIFT_LEFT,
+                              .dest = instr.imm_instr.t,
+                              .lhs = ensure_nonzero(instr.imm_instr.s, "SLL"),
+                              .rhs = instr.imm_instr.imm}});
+            break;
+        case INSTR_BEQ:
+            abstract_instr_vec_push(
+                res_vec,
+                (struct abstract_instr){
+                    .type = ABSTRACT_INSTR_BRANCH,
+                    .label = instr.label,
+                    .branch = {.type = ABSTRACT_INSTR_BRANCH_TEST_EQ,
+                               .lhs = translate_reg(instr.branch_instr.t),
+                               .rhs = translate_reg(instr.branch_instr.s),
+                               .label = instr.branch_instr.label}});
+            break;
+        case INSTR_BNE:
+            abstract_instr_vec_push(
+                res_vec,
+                (struct abstract_instr){
+                    .type = ABSTRACT_INSTR_BRANCH,
+                    .label = instr.label,
+                    .branch = {.type = ABSTRACT_INSTR_BRANCH_TEST_NE,
+                               .lhs = translate_reg(instr.branch_instr.t),
+                               .rhs = translate_reg(instr.branch_instr.s),
+                               .label = instr.branch_instr.label}});
+            break;
+        case INSTR_LW:
+            abstract_instr_vec_push(res_vec,
+                                    translate_load(instr, ABSTRACT_MEM_WORD));
+            break;
+        case INSTR_LH:
+            abstract_instr_vec_push(res_vec,
+                                    translate_load(instr, ABSTRACT_MEM_HALF));
+            break;
+        case INSTR_LB:
+            abstract_instr_vec_push(res_vec,
+                                    translate_load(instr, ABSTRACT_MEM_BYTE));
+            break;
+        case INSTR_SW:
+            abstract_instr_vec_push(res_vec,
+                                    translate_store(instr, ABSTRACT_MEM_WORD));
+            break;
+        case INSTR_SH:
+            abstract_instr_vec_push(res_vec,
+                                    translate_store(instr, ABSTRACT_MEM_HALF));
+            break;
+        case INSTR_SB:
+            abstract_instr_vec_push(res_vec,
+                                    translate_store(instr, ABSTRACT_MEM_BYTE));
+            break;
+        case INSTR_MULT:
+            abstract_instr_vec_push(
+                res_vec, translate_muldiv(instr, ABSTRACT_INSTR_MULDIV_MULT));
+            break;
+        case INSTR_MULTU:
+            abstract_instr_vec_push(
+                res_vec, translate_muldiv(instr, ABSTRACT_INSTR_MULDIV_MULTU));
+            break;
+        case INSTR_DIV:
+            abstract_instr_vec_push(
+                res_vec, translate_muldiv(instr, ABSTRACT_INSTR_MULDIV_DIV));
+            break;
+        case INSTR_DIVU:
+            abstract_instr_vec_push(
+                res_vec, translate_muldiv(instr, ABSTRACT_INSTR_MULDIV_DIVU));
+            break;
+        case INSTR_MFHI:
+            abstract_instr_vec_push(res_vec,
+                                    translate_move_from(instr, REG_HI));
+            break;
+        case INSTR_MFLO:
+            abstract_instr_vec_push(res_vec,
+                                    translate_move_from(instr, REG_LO));
+            break;
+        case INSTR_J:
+            abstract_instr_vec_push(
+                res_vec,
+                (struct abstract_instr){.type = ABSTRACT_INSTR_JUMP,
+                                        .label = instr.label,
+                                        .jump = {instr.jump_instr.label}});
+            break;
+        case INSTR_JAL:
+            abstract_instr_vec_push(
+                res_vec,
+                (struct abstract_instr){
+                    .type = ABSTRACT_INSTR_MOV,
+                    .label = instr.label,
+                    .mov = {.dest = REG_RA,
+                            .source = {.type = ABSTRACT_STORAGE_IMM,
+                                       .imm = guest_address_of(i + 1)}}});
+            abstract_instr_vec_push(res_vec, translate_call(instr, i));
+            break;
+        case INSTR_JR:
+            abstract_instr_vec_push(res_vec, translate_jump_reg(instr, i));
+            break;
+        case INSTR_MUL:
+            abstract_instr_vec_push(
+                res_vec, (struct abstract_instr){
+                             .type = ABSTRACT_INSTR_BINOP,
+                             .label = instr.label,
+                             .binop = {
+                                 .dest = instr.reg_instr.d,
+                                 .op = ABSTRACT_INSTR_BINOP_MUL,
+                                 .lhs = translate_reg(instr.reg_instr.s),
+                                 .rhs = translate_reg(instr.reg_instr.t),
+                             }});
+            break;
+        }
+
+        for (size_t j = first_translated; j < res_vec->len; j++) {
+            res_vec->guest_addresses[j] = guest_address_of(i);
+        }
+    }
+
+    return res_vec;
+}
+
+static bool storage_is_reg(struct abstract_storage s, enum reg_type reg) {
+    return s.type == ABSTRACT_STORAGE_REG && s.reg == reg;
+}
+
+static bool storage_is_imm(struct abstract_storage s, uint32_t imm) {
+    return s.type == ABSTRACT_STORAGE_IMM && s.imm == imm;
+}
+
+/**
+ * Test if 'i' is a branch of the given type comparing a register against zero,
+ * returns the register or REG_ZERO if it isn't.
+ */
+static enum reg_type
+branch_against_zero_reg(struct abstract_instr *i,
+                        enum abstract_instr_branch_test_type type) {
+    if (i->type != ABSTRACT_INSTR_BRANCH || i->branch.type != type) {
+        return REG_ZERO;
+    }
+
+    if (i->branch.lhs.type == ABSTRACT_STORAGE_REG &&
+        storage_is_imm(i->branch.rhs, 0)) {
+        return i->branch.lhs.reg;
+    }
+
+    if (i->branch.rhs.type == ABSTRACT_STORAGE_REG &&
+        storage_is_imm(i->branch.lhs, 0)) {
+        return i->branch.rhs.reg;
+    }
+
+    return REG_ZERO;
+}
+
+bool only_branch_to(struct abstract_instr_vec *instrs,
+                           struct label *label, size_t branch_idx) {
+    for (size_t i = 0; i < instrs->len; i++) {
+        if (i != branch_idx &&
+            abstract_instrs_target_label(instrs, i) == label) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+struct label_refs find_label_refs(struct abstract_instr_vec *instrs) {
+    size_t num_labels = all_labels()->len;
+    struct label_refs refs = {.index = malloc(num_labels * sizeof(size_t)),
+                              .first_ref = malloc(num_labels * sizeof(size_t)),
+                              .last_ref = calloc(num_labels, sizeof(size_t))};
+
+    for (size_t i = 0; i < num_labels; i++) {
+        refs.index[i] = SIZE_MAX;
+        refs.first_ref[i] = SIZE_MAX;
+    }
+
+    for (size_t e = 0; e < instrs->labels.len; e++) {
+        struct abstract_instr_label_entry entry = instrs->labels.entries[e];
+        refs.index[entry.label_id] = entry.index;
+    }
+
+    for (size_t i = 0; i < instrs->len; i++) {
+        struct label *target = abstract_instrs_target_label(instrs, i);
+
+        if (target != NULL) {
+            if (refs.first_ref[target->id] == SIZE_MAX) {
+                refs.first_ref[target->id] = i;
+            }
+            refs.last_ref[target->id] = i;
+        }
+    }
+
+    return refs;
+}
+
+void free_label_refs(struct label_refs *refs) {
+    free(refs->index);
+    free(refs->first_ref);
+    free(refs->last_ref);
+}
+
+size_t abstract_instr_successors(struct abstract_instr_vec *instrs,
+                                 struct label_refs *refs, size_t i,
+                                 size_t succ[2], bool *exits) {
+    struct label *target = abstract_instrs_target_label(instrs, i);
+    size_t count = 0;
+
+    *exits = false;
+
+    switch (instrs->types[i]) {
+    case ABSTRACT_INSTR_RETURN:
+    case ABSTRACT_INSTR_JUMP_REG:
+        *exits = true;
+        return 0;
+    case ABSTRACT_INSTR_JUMP:
+    case ABSTRACT_INSTR_CALL:
+        break;
+    default:
+        if (i + 1 < instrs->len) {
+            succ[count++] = i + 1;
+        } else {
+            *exits = true;
+        }
+        break;
+    }
+
+    if (target != NULL) {
+        if (refs->index[target->id] == SIZE_MAX) {
+            *exits = true;
+        } else {
+            succ[count++] = refs->index[target->id];
+        }
+    }
+
+    return count;
+}
+
+bool abstract_instrs_jump_indirectly(struct abstract_instr_vec *instrs) {
+    for (size_t i = 0; i < instrs->len; i++) {
+        enum abstract_instr_type type = instrs->types[i];
+        if (type == ABSTRACT_INSTR_RETURN || type == ABSTRACT_INSTR_JUMP_REG) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool abstract_instr_is_entry(struct abstract_instr_vec *instrs, size_t i,
+                             bool jumps_indirectly) {
+    if (i == 0 || instrs->types[i - 1] == ABSTRACT_INSTR_CALL) {
+        return true;
+    }
+
+    struct label *label = jumps_indirectly ? abstract_instr_label(instrs, i)
+                                           : NULL;
+    return label != NULL && label->has_guest_address;
+}
+
+struct instr_worklist instr_worklist_new(size_t len) {
+    size_t num_words = (len + 63) / 64;
+
+    return (struct instr_worklist){
+        .bits = calloc(num_words, sizeof(uint64_t)),
+        .summary = calloc((num_words + 63) / 64, sizeof(uint64_t)),
+        .num_words = num_words};
+}
+
+void instr_worklist_free(struct instr_worklist *list) {
+    free(list->bits);
+    free(list->summary);
+}
+
+void instr_worklist_add(struct instr_worklist *list, size_t i) {
+    list->bits[i / 64] |= 1ull << (i % 64);
+    list->summary[i / 4096] |= 1ull << (i / 64 % 64);
+}
+
+/**
+ * The first instruction in the list at or after 'start', SIZE_MAX if there
+ * isn't one.
+ */
+static size_t worklist_find_from(struct instr_worklist *list, size_t start) {
+    size_t word = start / 64;
+
+    if (word >= list->num_words) {
+        return SIZE_MAX;
+    }
+
+    uint64_t bits = list->bits[word] & ~0ull << (start % 64);
+    if (bits != 0) {
+        return word * 64 + __builtin_ctzll(bits);
+    }
+
+    // the summary finds the next word with any set
+    word++;
+    for (size_t s = word / 64, from = word % 64;
+         s < (list->num_words + 63) / 64; s++, from = 0) {
+        uint64_t summary = list->summary[s] & ~0ull << from;
+
+        if (summary != 0) {
+            size_t found = s * 64 + __builtin_ctzll(summary);
+            return found * 64 + __builtin_ctzll(list->bits[found]);
+        }
+    }
+
+    return SIZE_MAX;
+}
+
+bool instr_worklist_take(struct instr_worklist *list, size_t *i) {
+    size_t found = worklist_find_from(list, list->next);
+
+    if (found == SIZE_MAX) {
+        found = worklist_find_from(list, 0);
+    }
+
+    if (found == SIZE_MAX) {
+        return false;
+    }
+
+    list->bits[found / 64] &= ~(1ull << (found % 64));
+    if (list->bits[found / 64] == 0) {
+        list->summary[found / 4096] &= ~(1ull << (found / 64 % 64));
+    }
+
+    list->next = found;
+    *i = found;
+    return true;
+}
+
+bool abstract_instr_is_removable(struct abstract_instr_vec *instrs, size_t i) {
+    return i > 0 && instrs->types[i - 1] != ABSTRACT_INSTR_CALL;
+}
+
+void remove_marked_abstract_instrs(struct abstract_instr_vec *instrs,
+                                   bool *removed) {
+    bool has_next = false, next_labelled = false;
+
+    for (size_t i = instrs->len; i-- > 0;) {
+        if (removed[i] && has_label(instrs, i)) {
+            if (has_next && !next_labelled) {
+                next_labelled = true;
+            } else {
+                removed[i] = false;
+            }
+        }
+
+        if (!removed[i]) {
+            has_next = true;
+            next_labelled = has_label(instrs, i);
+        }
+    }
+
+    // the label entries are compacted along with the instructions, each kept
+    // instruction takes at most one of the entries already gone past
+    struct abstract_instr_labels *labels = &instrs->labels;
+    struct label *label = NULL;
+    size_t kept = 0, kept_labels = 0, e = 0;
+
+    for (size_t i = 0; i < instrs->len; i++) {
+        struct label *own = NULL;
+
+        if (has_label(instrs, i)) {
+            own = all_labels()->data[labels->entries[e++].label_id];
+        }
+
+        if (removed[i]) {
+            if (own != NULL) {
+                label = own;
+            }
+            continue;
+        }
+
+        uint32_t guest_address = instrs->guest_addresses[i];
+
+        // blocks are entered at the address of the instruction a guest label
+        // is on
+        if (label != NULL) {
+            own = label;
+            if (label->has_guest_address) {
+                guest_address = label->guest_address;
+            }
+            label = NULL;
+        }
+
+        instrs->types[kept] = instrs->types[i];
+        instrs->operands[kept] = instrs->operands[i];
+        instrs->guest_addresses[kept] = guest_address;
+
+        if (own != NULL) {
+            labels->entries[kept_labels++] =
+                (struct abstract_instr_label_entry){.index = kept,
+                                                    .label_id = own->id};
+        }
+
+        kept++;
+    }
+
+    labels->len = kept_labels;
+    refresh_label_bits(instrs, 0, instrs->len);
+    instrs->len = kept;
+}
+
+bool find_mul_loop(struct abstract_instr_vec *instrs, size_t start,
+                   struct abstract_instr_mul_loop *mul_loop) {
+    if (start + MUL_LOOP_LEN > instrs->len || !has_label(instrs, start) ||
+        instrs->types[start] != ABSTRACT_INSTR_BINOP) {
+        return false;
+    }
+
+    struct abstract_instr loop[MUL_LOOP_LEN];
+    for (size_t i = 0; i < MUL_LOOP_LEN; i++) {
+        loop[i] = abstract_instr_get(instrs, start + i);
+    }
+
+    struct label *head = loop[0].label;
+    struct label *skip = loop[3].label;
+
+    if (head == NULL || skip == NULL || loop[1].label || loop[2].label ||
+        loop[4].label || loop[5].label) {
+        return false;
+    }
+
+    // andi $bit $multiplier 1
+    if (loop[0].type != ABSTRACT_INSTR_BINOP ||
+        loop[0].binop.op != ABSTRACT_INSTR_BINOP_AND ||
+        loop[0].binop.lhs.type != ABSTRACT_STORAGE_REG ||
+        !storage_is_imm(loop[0].binop.rhs, 1)) {
+        return false;
+    }
+
+    enum reg_type bit = loop[0].binop.dest;
+    enum reg_type multiplier = loop[0].binop.lhs.reg;
+
+    // beq $bit $zero skip
+    if (branch_against_zero_reg(&loop[1], ABSTRACT_INSTR_BRANCH_TEST_EQ) !=
+            bit ||
+        loop[1].branch.label != skip ||
+        !only_branch_to(instrs, skip, start + 1)) {
+        return false;
+    }
+
+    // add $acc $acc $multiplicand, or addu
+    if (loop[2].type != ABSTRACT_INSTR_BINOP ||
+        (loop[2].binop.op != ABSTRACT_INSTR_BINOP_ADD &&
+         loop[2].binop.op != ABSTRACT_INSTR_BINOP_ADD_TRAP)) {
+        return false;
+    }
+
+    enum reg_type acc = loop[2].binop.dest;
+    struct abstract_storage other;
+
+    if (storage_is_reg(loop[2].binop.lhs, acc)) {
+        other = loop[2].binop.rhs;
+    } else if (storage_is_reg(loop[2].binop.rhs, acc)) {
+        other = loop[2].binop.lhs;
+    } else {
+        return false;
+    }
+
+    if (other.type != ABSTRACT_STORAGE_REG) {
+        return false;
+    }
+
+    enum reg_type multiplicand = other.reg;
+
+    // srl $multiplier $multiplier 1
+    if (loop[3].type != ABSTRACT_INSTR_SHIFT ||
+        loop[3].shift.direction != ABSTRACT_INSTR_SHIFT_RIGHT ||
+        loop[3].shift.dest != multiplier || loop[3].shift.lhs != multiplier ||
+        loop[3].shift.rhs != 1) {
+        return false;
+    }
+
+    // sll $multiplicand $multiplicand 1
+    if (loop[4].type != ABSTRACT_INSTR_SHIFT ||
+        loop[4].shift.direction != ABSTRACT_INSTR_SHIFT_LEFT ||
+        loop[4].shift.dest != multiplicand ||
+        loop[4].shift.lhs != multiplicand || loop[4].shift.rhs != 1) {
+        return false;
+    }
+
+    // bne $multiplier $zero loop
+    if (branch_against_zero_reg(&loop[5], ABSTRACT_INSTR_BRANCH_TEST_NE) !=
+            multiplier ||
+        loop[5].branch.label != head) {
+        return false;
+    }
+
+    // the closed form only holds if every register is distinct
+    enum reg_type regs[] = {acc, multiplier, multiplicand, bit};
+    for (size_t a = 0; a < ARRAY_SIZE(regs); a++) {
+        for (size_t b = a + 1; b < ARRAY_SIZE(regs); b++) {
+            if (regs[a] == regs[b] || regs[a] == REG_ZERO) {
+                return false;
+            }
+        }
+    }
+
+    // a `jr` to skip would land part way through an iteration
+    if (abstract_instr_is_entry(instrs, start + 3,
+                                abstract_instrs_jump_indirectly(instrs))) {
+        return false;
+    }
+
+    *mul_loop = (struct abstract_instr_mul_loop){.acc = acc,
+                                                 .multiplier = multiplier,
+                                                 .multiplicand = multiplicand,
+                                                 .bit = bit};
+
+    return true;
+}
+
+/**
+ * Recognise a shift-and-add multiply loop starting at 'start' and replace the
+ * whole loop with its closed form, unless its add could overflow.
+ *
+ * Returns true if the loop was replaced.
+ */
+static bool match_mul_loop(struct abstract_instr_vec *instrs, size_t start) {
+    struct abstract_instr_mul_loop mul_loop;
+
+    // an add that traps is only matched once it's known not to overflow
+    if (!find_mul_loop(instrs, start, &mul_loop) ||
+        instrs->operands[start + 2].binop.op != ABSTRACT_INSTR_BINOP_ADD) {
+        return false;
+    }
+
+    DEBUG_LOG("replacing multiply loop at %zu", start);
+
+    struct abstract_instr closed_form = {
+        .type = ABSTRACT_INSTR_MUL_LOOP,
+        .label = abstract_instr_label(instrs, start),
+        .guest_address = instrs->guest_addresses[start],
+        .mul_loop = mul_loop};
+    abstract_instr_set(instrs, start, &closed_form);
+    abstract_instrs_remove(instrs, start + 1, MUL_LOOP_LEN - 1);
+
+    return true;
+}
+
+static void add_storage_use(struct abstract_storage s, enum reg_type *regs,
+                            size_t *count) {
+    if (s.type == ABSTRACT_STORAGE_REG && s.reg != REG_ZERO) {
+        regs[(*count)++] = s.reg;
+    }
+}
+
+size_t abstract_instr_uses(struct abstract_instr *i,
+                           enum reg_type regs[ABSTRACT_INSTR_MAX_REGS]) {
+    size_t count = 0;
+
+    switch (i->type) {
+    case ABSTRACT_INSTR_BINOP:
+        add_storage_use(i->binop.lhs, regs, &count);
+        add_storage_use(i->binop.rhs, regs, &count);
+        break;
+    case ABSTRACT_INSTR_BRANCH:
+        add_storage_use(i->branch.lhs, regs, &count);
+        add_storage_use(i->branch.rhs, regs, &count);
+        break;
+    case ABSTRACT_INSTR_MOV:
+        add_storage_use(i->mov.source, regs, &count);
+        break;
+    case ABSTRACT_INSTR_SHIFT:
+        regs[count++] = i->shift.lhs;
+        break;
+    case ABSTRACT_INSTR_LOAD:
+        add_storage_use(i->load.base, regs, &count);
+        break;
+    case ABSTRACT_INSTR_STORE:
+        add_storage_use(i->store.value, regs, &count);
+        add_storage_use(i->store.base, regs, &count);
+        break;
+    case ABSTRACT_INSTR_MULDIV:
+        add_storage_use(i->muldiv.lhs, regs, &count);
+        add_storage_use(i->muldiv.rhs, regs, &count);
+        break;
+    case ABSTRACT_INSTR_MUL_LOOP:
+        regs[count++] = i->mul_loop.acc;
+        regs[count++] = i->mul_loop.multiplier;
+        regs[count++] = i->mul_loop.multiplicand;
+        break;
+    case ABSTRACT_INSTR_INDUCTION:
+        regs[count++] = i->induction.dest;
+        regs[count++] = i->induction.counter;
+        break;
+    case ABSTRACT_INSTR_RETURN:
+    case ABSTRACT_INSTR_JUMP_REG:
+        add_storage_use(i->jump_reg.target, regs, &count);
+        break;
+    case ABSTRACT_INSTR_SWAP:
+        regs[count++] = i->swap.a;
+        regs[count++] = i->swap.b;
+        break;
+    case ABSTRACT_INSTR_JUMP:
+    case ABSTRACT_INSTR_CALL:
+        break;
+    }
+
+    return count;
+}
+
+size_t abstract_instr_defs(struct abstract_instr *i,
+                           enum reg_type regs[ABSTRACT_INSTR_MAX_REGS]) {
+    size_t count = 0;
+
+    switch (i->type) {
+    case ABSTRACT_INSTR_BINOP:
+        regs[count++] = i->binop.dest;
+        break;
+    case ABSTRACT_INSTR_MOV:
+        regs[count++] = i->mov.dest;
+        break;
+    case ABSTRACT_INSTR_SHIFT:
+        regs[count++] = i->shift.dest;
+        break;
+    case ABSTRACT_INSTR_LOAD:
+        regs[count++] = i->load.dest;
+        break;
+    case ABSTRACT_INSTR_MULDIV:
+        regs[count++] = REG_HI;
+        regs[count++] = REG_LO;
+        break;
+    case ABSTRACT_INSTR_MUL_LOOP:
+        regs[count++] = i->mul_loop.acc;
+        regs[count++] = i->mul_loop.multiplier;
+        regs[count++] = i->mul_loop.multiplicand;
+        regs[count++] = i->mul_loop.bit;
+        break;
+    case ABSTRACT_INSTR_INDUCTION:
+        regs[count++] = i->induction.dest;
+        break;
+    case ABSTRACT_INSTR_SWAP:
+        regs[count++] = i->swap.a;
+        regs[count++] = i->swap.b;
+        break;
+    case ABSTRACT_INSTR_BRANCH:
+    case ABSTRACT_INSTR_STORE:
+    case ABSTRACT_INSTR_JUMP:
+    case ABSTRACT_INSTR_CALL:
+    case ABSTRACT_INSTR_RETURN:
+    case ABSTRACT_INSTR_JUMP_REG:
+        break;
+    }
+
+    return count;
+}
+
+static void rename_storage(struct abstract_storage *s, enum reg_type from,
+                           enum reg_type to) {
+    if (s->type == ABSTRACT_STORAGE_REG && s->reg == from) {
+        s->reg = to;
+    }
+}
+
+static void rename_reg(enum reg_type *reg, enum reg_type from,
+                       enum reg_type to) {
+    if (*reg == from) {
+        *reg = to;
+    }
+}
+
+void abstract_instr_rename_reg(struct abstract_instr *i, enum reg_type from,
+                               enum reg_type to) {
+    switch (i->type) {
+    case ABSTRACT_INSTR_BINOP:
+        rename_reg(&i->binop.dest, from, to);
+        rename_storage(&i->binop.lhs, from, to);
+        rename_storage(&i->binop.rhs, from, to);
+        break;
+    case ABSTRACT_INSTR_BRANCH:
+        rename_storage(&i->branch.lhs, from, to);
+        rename_storage(&i->branch.rhs, from, to);
+        break;
+    case ABSTRACT_INSTR_MOV:
+        rename_reg(&i->mov.dest, from, to);
+        rename_storage(&i->mov.source, from, to);
+        break;
+    case ABSTRACT_INSTR_SHIFT:
+        rename_reg(&i->shift.dest, from, to);
+        rename_reg(&i->shift.lhs, from, to);
+        break;
+    case ABSTRACT_INSTR_LOAD:
+        rename_reg(&i->load.dest, from, to);
+        rename_storage(&i->load.base, from, to);
+        break;
+    case ABSTRACT_INSTR_STORE:
+        rename_storage(&i->store.value, from, to);
+        rename_storage(&i->store.base, from, to);
+        break;
+    case ABSTRACT_INSTR_MULDIV:
+        rename_storage(&i->muldiv.lhs, from, to);
+        rename_storage(&i->muldiv.rhs, from, to);
+        break;
+    case ABSTRACT_INSTR_MUL_LOOP:
+        rename_reg(&i->mul_loop.acc, from, to);
+        rename_reg(&i->mul_loop.multiplier, from, to);
+        rename_reg(&i->mul_loop.multiplicand, from, to);
+        rename_reg(&i->mul_loop.bit, from, to);
+        break;
+    case ABSTRACT_INSTR_INDUCTION:
+        rename_reg(&i->induction.dest, from, to);
+        rename_reg(&i->induction.counter, from, to);
+        break;
+    case ABSTRACT_INSTR_RETURN:
+    case ABSTRACT_INSTR_JUMP_REG:
+        rename_storage(&i->jump_reg.target, from, to);
+        break;
+    case ABSTRACT_INSTR_SWAP:
+        rename_reg(&i->swap.a, from, to);
+        rename_reg(&i->swap.b, from, to);
+        break;
+    case ABSTRACT_INSTR_JUMP:
+    case ABSTRACT_INSTR_CALL:
+        break;
+    }
+}
+
+enum abstract_instr_branch_test_type
+invert_branch_test(enum abstract_instr_branch_test_type type) {
+    switch (type) {
+    case ABSTRACT_INSTR_BRANCH_TEST_NE:
+        return ABSTRACT_INSTR_BRANCH_TEST_EQ;
+    case ABSTRACT_INSTR_BRANCH_TEST_EQ:
+        return ABSTRACT_INSTR_BRANCH_TEST_NE;
+    case ABSTRACT_INSTR_BRANCH_TEST_LOW_NE:
+        return ABSTRACT_INSTR_BRANCH_TEST_LOW_EQ;
+    case ABSTRACT_INSTR_BRANCH_TEST_LOW_EQ:
+        return ABSTRACT_INSTR_BRANCH_TEST_LOW_NE;
+    case ABSTRACT_INSTR_BRANCH_TEST_MASK_ZERO:
+        return ABSTRACT_INSTR_BRANCH_TEST_MASK_NONZERO;
+    case ABSTRACT_INSTR_BRANCH_TEST_MASK_NONZERO:
+        return ABSTRACT_INSTR_BRANCH_TEST_MASK_ZERO;
+    }
+
+    RUNTIME_ERROR("Invalid branch test %d", type);
+}
+
+uint32_t odd_inverse(uint32_t odd) {
+    // each newton step doubles the number of correct low bits, and an odd
+    // number is its own inverse modulo 8
+    uint32_t inverse = odd;
+    for (int i = 0; i < 4; i++) {
+        inverse *= 2 - odd * inverse;
+    }
+    return inverse;
+}
+
+bool induction_trip_count(uint32_t counter, uint32_t limit, uint32_t step,
+                          uint32_t *trips) {
+    // solve counter + trips * step = limit (mod 2^32) for the smallest
+    // trips >= 1, writing step as odd << shift
+    int shift = __builtin_ctz(step);
+    uint32_t distance = limit - counter;
+
+    if (distance & ((1u << shift) - 1)) {
+        return false;
+    }
+
+    // only trips modulo 2^(32 - shift) is determined, and zero there means
+    // the loop runs the whole period
+    uint32_t mask = UINT32_MAX >> shift;
+    *trips =
+        (((distance >> shift) * odd_inverse(step >> shift) - 1) & mask) + 1;
+    return true;
+}
+
+bool abstract_storage_constant(struct abstract_storage s, uint32_t *value) {
+    if (s.type == ABSTRACT_STORAGE_IMM) {
+        *value = s.imm;
+        return true;
+    }
+
+    if (s.reg == REG_ZERO) {
+        *value = 0;
+        return true;
+    }
+
+    return false;
+}
+
+bool abstract_instr_affine_update(struct abstract_instr *i, enum reg_type *reg,
+                                  uint32_t *delta) {
+    if (i->type != ABSTRACT_INSTR_BINOP ||
+        i->binop.op != ABSTRACT_INSTR_BINOP_ADD || i->binop.dest == REG_ZERO) {
+        return false;
+    }
+
+    *reg = i->binop.dest;
+
+    if (storage_is_reg(i->binop.lhs, *reg)) {
+        return abstract_storage_constant(i->binop.rhs, delta);
+    }
+
+    if (storage_is_reg(i->binop.rhs, *reg)) {
+        return abstract_storage_constant(i->binop.lhs, delta);
+    }
 
-const char *const abstract_instr_binop_op_names[] = {
-    [ABSTRACT_INSTR_BINOP_ADD] = "+", [ABSTRACT_INSTR_BINOP_AND] = "&"};
+    return false;
+}
 
-const char *const abstract_instr_branch_test_type_names[] = {
-    [ABSTRACT_INSTR_BRANCH_TEST_NE] = "!=",
-    [ABSTRACT_INSTR_BRANCH_TEST_EQ] = "=="};
+bool counted_loop_exit(struct abstract_instr *i, struct label *head,
+                       enum reg_type *counter, uint32_t *limit) {
+    if (i->type != ABSTRACT_INSTR_BRANCH ||
+        i->branch.type != ABSTRACT_INSTR_BRANCH_TEST_NE ||
+        i->branch.label != head) {
+        return false;
+    }
 
-static struct abstract_storage translate_reg(enum reg_type r) {
-    if (r == REG_ZERO) {
-        return (struct abstract_storage){.type = ABSTRACT_STORAGE_IMM,
-                                         .imm = 0};
+    if (i->branch.lhs.type == ABSTRACT_STORAGE_REG &&
+        i->branch.lhs.reg != REG_ZERO &&
+        abstract_storage_constant(i->branch.rhs, limit)) {
+        *counter = i->branch.lhs.reg;
+        return true;
     }
 
-    return (struct abstract_storage){.type = ABSTRACT_STORAGE_REG, .reg = r};
+    if (i->branch.rhs.type == ABSTRACT_STORAGE_REG &&
+        i->branch.rhs.reg != REG_ZERO &&
+        abstract_storage_constant(i->branch.lhs, limit)) {
+        *counter = i->branch.rhs.reg;
+        return true;
+    }
+
+    return false;
 }
 
-static enum reg_type ensure_nonzero(enum reg_type r,
-                                    const char *const instr_name) {
-    if (r == REG_ZERO) {
-        RUNTIME_ERROR("Zero register not allowed in %s instruction",
-                      instr_name);
+/**
+ * Recognise a counting loop starting at 'start' (see `struct
+ * abstract_instr_induction` for the shape) and replace it with its closed
+ * form: an induction instruction for each register the loop changes, then
+ * the counter is set to its final value.
+ *
+ * Returns true if the loop was replaced.
+ */
+static bool match_counted_loop(struct abstract_instr_vec *instrs,
+                               size_t start) {
+    struct label *head = abstract_instr_label(instrs, start);
+
+    if (head == NULL) {
+        return false;
     }
 
-    return r;
-}
+    // the total change to each register over one iteration
+    uint32_t deltas[LARGEST_MIPS_REG + 1] = {0};
+    struct abstract_instr i;
+    size_t end = start;
 
-struct abstract_instr_vec *translate_instructions(struct instr_vec *instrs) {
-    struct abstract_instr_vec *res_vec = abstract_instr_vec_new();
+    for (;; end++) {
+        if (!abstract_instr_iter(instrs, end, &i)) {
+            return false;
+        }
 
-    for (size_t i = 0; i < instrs->len; i++) {
-        struct instr instr = instrs->data[i];
+        enum reg_type reg;
+        uint32_t delta;
 
-        switch (instr.type) {
-        case INSTR_NOP:
-            if (instr.label != NULL) {
-                RUNTIME_ERROR(
-                    "You have a NOP op with a label, don't do that...");
-            }
-            break;
-        case INSTR_ADD:
-            abstract_instr_vec_push(
-                res_vec, (struct abstract_instr){
-                             .type = ABSTRACT_INSTR_BINOP,
-                             .label = instr.label,
-                             .binop = {
-                                 .dest = instr.reg_instr.d,
-                                 .op = ABSTRACT_INSTR_BINOP_ADD,
-                                 .lhs = translate_reg(instr.reg_instr.s),
-                                 .rhs = translate_reg(instr.reg_instr.t),
-                             }});
-            break;
-        case INSTR_ADDI:
-            abstract_instr_vec_push(
-                res_vec, (struct abstract_instr){
-                             .type = ABSTRACT_INSTR_BINOP,
-                             .label = instr.label,
-                             .binop = {
-                                 .dest = instr.imm_instr.t,
-                                 .op = ABSTRACT_INSTR_BINOP_ADD,
-                                 .lhs = translate_reg(instr.imm_instr.s),
-                                 .rhs = {.type = ABSTRACT_STORAGE_IMM,
-                                         .imm = (int16_t)instr.imm_instr.imm},
-                             }});
-            break;
-        case INSTR_ANDI:
-            abstract_instr_vec_push(
-                res_vec, (struct abstract_instr){
-                             .type = ABSTRACT_INSTR_BINOP,
-                             .label = instr.label,
-                             .binop = {
-                                 .dest = instr.imm_instr.t,
-                                 .op = ABSTRACT_INSTR_BINOP_AND,
-                                 .lhs = translate_reg(instr.imm_instr.s),
-                                 .rhs = {.type = ABSTRACT_STORAGE_IMM,
-                                         .imm = instr.imm_instr.imm},
-                             }});
-            break;
-        case INSTR_SRL:
-            abstract_instr_vec_push(
-                res_vec,
-                (struct abstract_instr){
-                    .type = ABSTRACT_INSTR_SHIFT,
-                    .label = instr.label,
-                    .shift = {.direction = ABSTRACT_INSTR_SHIFT_RIGHT,
-                              .dest = instr.imm_instr.t,
-                              .lhs = ensure_nonzero(instr.imm_instr.s, "SRL"),
-                              .rhs = instr.imm_instr.imm}});
-            break;
-        case INSTR_SLL:
-            abstract_instr_vec_push(
-                res_vec,
-                (struct abstract_instr){
-                    .type = ABSTRACT_INSTR_SHIFT,
-                    .label = instr.label,
-                    .shift = {.direction = ABSTRACT_INSTR_SHIFT_LEFT,
-                              .dest = instr.imm_instr.t,
-                              .lhs = ensure_nonzero(instr.imm_instr.s, "SLL"),
-                              .rhs = instr.imm_instr.imm}});
-            break;
-        case INSTR_BEQ:
-            abstract_instr_vec_push(
-                res_vec,
-                (struct abstract_instr){
-                    .type = ABSTRACT_INSTR_BRANCH,
-                    .label = instr.label,
-                    .branch = {.type = ABSTRACT_INSTR_BRANCH_TEST_EQ,
-                               .lhs = translate_reg(instr.branch_instr.t),
-                               .rhs = translate_reg(instr.branch_instr.s),
-                               .label = instr.branch_instr.label}});
-            break;
-        case INSTR_BNE:
-            abstract_instr_vec_push(
-                res_vec,
-                (struct abstract_instr){
-                    .type = ABSTRACT_INSTR_BRANCH,
-                    .label = instr.label,
-                    .branch = {.type = ABSTRACT_INSTR_BRANCH_TEST_NE,
-                               .lhs = translate_reg(instr.branch_instr.t),
-                               .rhs = translate_reg(instr.branch_instr.s),
-                               .label = instr.branch_instr.label}});
+        // nothing may jump into the middle of the loop
+        if (end != start && i.label) {
+            return false;
+        }
+
+        if (i.type == ABSTRACT_INSTR_BRANCH) {
             break;
         }
+
+        if (!abstract_instr_affine_update(&i, &reg, &delta)) {
+            return false;
+        }
+
+        deltas[reg] += delta;
     }
 
-    return res_vec;
+    enum reg_type counter;
+    uint32_t limit;
+
+    if (end == start || !counted_loop_exit(&i, head, &counter, &limit)) {
+        return false;
+    }
+
+    uint32_t step = deltas[counter];
+
+    if (step == 0) {
+        return false;
+    }
+
+    DEBUG_LOG("replacing counting loop at %zu", start);
+
+    uint32_t guest_address = instrs->guest_addresses[start];
+    size_t out = start;
+
+    // the counter is updated last as the other updates read its first value
+    for (enum reg_type reg = SMALLEST_MIPS_REG; reg <= LARGEST_MIPS_REG;
+         reg++) {
+        if (reg == counter || deltas[reg] == 0) {
+            continue;
+        }
+
+        struct abstract_instr induction = {
+            .type = ABSTRACT_INSTR_INDUCTION,
+            .guest_address = guest_address,
+            .induction = {.dest = reg,
+                          .counter = counter,
+                          .limit = limit,
+                          .step = step,
+                          .delta = deltas[reg]}};
+        abstract_instr_set(instrs, out++, &induction);
+    }
+
+    struct abstract_instr last;
+    if (step & 1) {
+        // an odd step always reaches the limit
+        last = (struct abstract_instr){
+            .type = ABSTRACT_INSTR_MOV,
+            .guest_address = guest_address,
+            .mov = {.dest = counter,
+                    .source = {.type = ABSTRACT_STORAGE_IMM, .imm = limit}}};
+    } else {
+        // otherwise keep the counter's own update, which spins if the limit
+        // is never reached
+        last = (struct abstract_instr){
+            .type = ABSTRACT_INSTR_INDUCTION,
+            .guest_address = guest_address,
+            .induction = {.dest = counter,
+                          .counter = counter,
+                          .limit = limit,
+                          .step = step,
+                          .delta = step}};
+    }
+    abstract_instr_set(instrs, out++, &last);
+
+    abstract_instr_set_label(instrs, start, head);
+    abstract_instrs_remove(instrs, out, end + 1 - out);
+
+    return true;
 }
 
 static bool optimise_abstract_instrs_inner(struct abstract_instr_vec *instrs) {
     bool did_change = false;
 
     for (size_t i = 0; i < instrs->len; i++) {
-        struct abstract_instr instr = instrs->data[i];
+        if (match_mul_loop(instrs, i) || match_counted_loop(instrs, i)) {
+            did_change = true;
+        }
+
+        struct abstract_instr instr = abstract_instr_get(instrs, i);
+        struct abstract_instr mov = {.type = ABSTRACT_INSTR_MOV,
+                                     .label = instr.label,
+                                     .guest_address = instr.guest_address};
 
         switch (instr.type) {
         case ABSTRACT_INSTR_BINOP:
@@ -159,17 +1545,15 @@ static bool optimise_abstract_instrs_inner(struct abstract_instr_vec *instrs) {
             if (instr.binop.op == ABSTRACT_INSTR_BINOP_ADD) {
                 if (instr.binop.lhs.type == ABSTRACT_STORAGE_IMM &&
                     instr.binop.lhs.imm == 0) {
-                    instrs->data[i] = (struct abstract_instr){
-                        .type = ABSTRACT_INSTR_MOV,
-                        .mov = {.dest = instr.binop.dest,
-                                .source = instr.binop.rhs}};
+                    mov.mov = (struct abstract_instr_mov){
+                        .dest = instr.binop.dest, .source = instr.binop.rhs};
+                    abstract_instr_set(instrs, i, &mov);
                     did_change = true;
                 } else if (instr.binop.rhs.type == ABSTRACT_STORAGE_IMM &&
                            instr.binop.rhs.imm == 0) {
-                    instrs->data[i] = (struct abstract_instr){
-                        .type = ABSTRACT_INSTR_MOV,
-                        .mov = {.dest = instr.binop.dest,
-                                .source = instr.binop.lhs}};
+                    mov.mov = (struct abstract_instr_mov){
+                        .dest = instr.binop.dest, .source = instr.binop.lhs};
+                    abstract_instr_set(instrs, i, &mov);
                     did_change = true;
                 }
             }
@@ -186,16 +1570,91 @@ static bool optimise_abstract_instrs_inner(struct abstract_instr_vec *instrs) {
     // return did_change;
 }
 
-void optimise_abstract_instrs(struct abstract_instr_vec *instrs) {
+/**
+ * Fuse 't <- x << n; d <- t + y' into 'd <- (x << n) + y' when d is t, so the
+ * shift's result is never seen, and the shift is small enough to be an
+ * address scale. The add has no label, so nothing can enter between the two.
+ */
+static void fuse_scaled_adds(struct abstract_instr_vec *instrs) {
+    bool *removed = calloc(instrs->len, sizeof(bool));
+    bool any_removed = false;
+
+    for (size_t i = 0; i + 1 < instrs->len; i++) {
+        if (instrs->types[i] != ABSTRACT_INSTR_SHIFT ||
+            instrs->types[i + 1] != ABSTRACT_INSTR_BINOP) {
+            continue;
+        }
+
+        struct abstract_instr_shift shift = instrs->operands[i].shift;
+        struct abstract_instr_binop add = instrs->operands[i + 1].binop;
+        enum reg_type t = shift.dest;
+
+        if (shift.direction != ABSTRACT_INSTR_SHIFT_LEFT || shift.rhs < 1 ||
+            shift.rhs > 3 || add.op != ABSTRACT_INSTR_BINOP_ADD ||
+            has_label(instrs, i + 1) || add.dest != t) {
+            continue;
+        }
+
+        struct abstract_storage other = add.rhs;
+        if (add.rhs.type == ABSTRACT_STORAGE_REG && add.rhs.reg == t) {
+            other = add.lhs;
+        } else if (add.lhs.type != ABSTRACT_STORAGE_REG || add.lhs.reg != t) {
+            continue;
+        }
+
+        if (other.type != ABSTRACT_STORAGE_REG || other.reg == t) {
+            continue;
+        }
+
+        DEBUG_LOG("fusing shift and add at %zu", i);
+
+        instrs->types[i] = ABSTRACT_INSTR_BINOP;
+        instrs->operands[i].binop = (struct abstract_instr_binop){
+            .op = ABSTRACT_INSTR_BINOP_SCALED_ADD,
+            .dest = t,
+            .lhs = {.type = ABSTRACT_STORAGE_REG, .reg = shift.lhs},
+            .rhs = other,
+            .shift = shift.rhs};
+        removed[i + 1] = any_removed = true;
+        i++;
+    }
+
+    if (any_removed) {
+        remove_marked_abstract_instrs(instrs, removed);
+    }
+
+    free(removed);
+}
+
+void optimise_abstract_instrs(struct abstract_instr_vec *instrs,
+                              struct optimise_options *options,
+                              struct optimise_stats *stats) {
+    // first, so the passes matching adds see those that can't trap as such
+    elide_overflow_checks(instrs);
+    rotate_loops(instrs);
+
     // fixpoint the optimisation loop
     while (optimise_abstract_instrs_inner(instrs)) {
     }
+
+    hoist_loop_invariants(instrs);
+    unroll_loops(instrs, options->unroll_factor, options->unroll_budget);
+
+    // after unrolling, which makes copies of the same computation
+    stats->common_subexprs = eliminate_common_subexprs(instrs);
+    simplify_known_bits(instrs);
+    fuse_scaled_adds(instrs);
+}
+
+void print_optimise_stats(struct optimise_stats *stats) {
+    printf("common subexpressions eliminated: %lu\n", stats->common_subexprs);
 }
 
-static void print_abstract_storage(struct abstract_storage s) {
+static void print_abstract_storage(struct abstract_storage s,
+                                   const char *const *names) {
     switch (s.type) {
     case ABSTRACT_STORAGE_REG:
-        printf("<reg: %s>", reg_type_names[s.reg]);
+        printf("<reg: %s>", names[s.reg]);
         break;
     case ABSTRACT_STORAGE_IMM:
         printf("<imm: %u>", s.imm);
@@ -210,7 +1669,9 @@ static void print_abstract_storage(struct abstract_storage s) {
     }
 }
 
-void print_abstract_instr(struct abstract_instr *i) {
+void print_abstract_instr_named(struct abstract_instr *i,
+                                const char *const *use_names,
+                                const char *const *def_names) {
     printf("<ainstr %s", abstract_instr_type_names[i->type]);
 
     if (i->label)
@@ -218,39 +1679,115 @@ void print_abstract_instr(struct abstract_instr *i) {
 
     switch (i->type) {
     case ABSTRACT_INSTR_BINOP:
-        printf(", %s <- ", reg_type_names[i->binop.dest]);
-        print_abstract_storage(i->binop.lhs);
+        printf(", %s <- ", def_names[i->binop.dest]);
+        print_abstract_storage(i->binop.lhs, use_names);
+        if (i->binop.op == ABSTRACT_INSTR_BINOP_SCALED_ADD) {
+            printf(" << %d", i->binop.shift);
+        }
         printf(" %s ", abstract_instr_binop_op_names[i->binop.op]);
-        print_abstract_storage(i->binop.rhs);
+        print_abstract_storage(i->binop.rhs, use_names);
         printf(">\n");
         break;
     case ABSTRACT_INSTR_BRANCH:
         printf(", if ");
-        print_abstract_storage(i->branch.lhs);
-        printf(" %s ", abstract_instr_branch_test_type_names[i->branch.type]);
-        print_abstract_storage(i->branch.rhs);
+        print_abstract_storage(i->branch.lhs, use_names);
+        if (i->branch.type == ABSTRACT_INSTR_BRANCH_TEST_MASK_ZERO ||
+            i->branch.type == ABSTRACT_INSTR_BRANCH_TEST_MASK_NONZERO) {
+            printf(" & ");
+            print_abstract_storage(i->branch.rhs, use_names);
+            printf(" %s 0",
+                   abstract_instr_branch_test_type_names[i->branch.type]);
+        } else {
+            printf(" %s ",
+                   abstract_instr_branch_test_type_names[i->branch.type]);
+            print_abstract_storage(i->branch.rhs, use_names);
+        }
+        if (i->branch.type == ABSTRACT_INSTR_BRANCH_TEST_LOW_NE ||
+            i->branch.type == ABSTRACT_INSTR_BRANCH_TEST_LOW_EQ) {
+            printf(" in the low %d bits", i->branch.low_bits);
+        }
         printf(" goto <label: %.*s, id: %ud>>\n",
                (int)i->branch.label->name.len, i->branch.label->name.s,
                i->branch.label->id);
         break;
     case ABSTRACT_INSTR_MOV:
-        printf(", %s <- ", reg_type_names[i->mov.dest]);
-        print_abstract_storage(i->mov.source);
+        printf(", %s <- ", def_names[i->mov.dest]);
+        print_abstract_storage(i->mov.source, use_names);
         printf(">\n");
         break;
     case ABSTRACT_INSTR_SHIFT:
         printf(
-            ", %s <- %s %s %d\n", reg_type_names[i->shift.dest],
-            reg_type_names[i->shift.lhs],
+            ", %s <- %s %s %d\n", def_names[i->shift.dest],
+            use_names[i->shift.lhs],
             ((i->shift.direction == ABSTRACT_INSTR_SHIFT_LEFT) ? "<<" : ">>"),
             i->shift.rhs);
         break;
+    case ABSTRACT_INSTR_LOAD:
+        printf(", %s <- %s [", def_names[i->load.dest],
+               abstract_mem_width_names[i->load.width]);
+        print_abstract_storage(i->load.base, use_names);
+        printf(" + %d]>\n", i->load.offset);
+        break;
+    case ABSTRACT_INSTR_STORE:
+        printf(", %s [", abstract_mem_width_names[i->store.width]);
+        print_abstract_storage(i->store.base, use_names);
+        printf(" + %d] <- ", i->store.offset);
+        print_abstract_storage(i->store.value, use_names);
+        printf(">\n");
+        break;
+    case ABSTRACT_INSTR_MULDIV:
+        printf(", hi:lo <- ");
+        print_abstract_storage(i->muldiv.lhs, use_names);
+        printf(" %s ", abstract_instr_muldiv_op_names[i->muldiv.op]);
+        print_abstract_storage(i->muldiv.rhs, use_names);
+        printf(">\n");
+        break;
+    case ABSTRACT_INSTR_JUMP:
+        printf(", goto <label: %.*s, id: %ud>>\n", (int)i->jump.label->name.len,
+               i->jump.label->name.s, i->jump.label->id);
+        break;
+    case ABSTRACT_INSTR_CALL:
+        printf(", call <label: %.*s, id: %ud>, return to 0x%x>\n",
+               (int)i->call.label->name.len, i->call.label->name.s,
+               i->call.label->id, i->call.return_label->guest_address);
+        break;
+    case ABSTRACT_INSTR_RETURN:
+        printf(", return to ");
+        print_abstract_storage(i->jump_reg.target, use_names);
+        printf(">\n");
+        break;
+    case ABSTRACT_INSTR_JUMP_REG:
+        printf(", goto ");
+        print_abstract_storage(i->jump_reg.target, use_names);
+        printf(">\n");
+        break;
+    case ABSTRACT_INSTR_MUL_LOOP:
+        printf(", %s += %s * %s, bit: %s>\n",
+               def_names[i->mul_loop.acc],
+               use_names[i->mul_loop.multiplier],
+               use_names[i->mul_loop.multiplicand],
+               def_names[i->mul_loop.bit]);
+        break;
+    case ABSTRACT_INSTR_INDUCTION:
+        printf(", %s += trips(%s to %u by %u) * %u>\n",
+               def_names[i->induction.dest],
+               use_names[i->induction.counter], i->induction.limit,
+               i->induction.step, i->induction.delta);
+        break;
+    case ABSTRACT_INSTR_SWAP:
+        printf(", %s <-> %s>\n", def_names[i->swap.a],
+               def_names[i->swap.b]);
+        break;
     }
 }
 
+void print_abstract_instr(struct abstract_instr *i) {
+    print_abstract_instr_named(i, reg_type_names, reg_type_names);
+}
+
 struct reg_count_tup {
     enum reg_type reg;
-    uint8_t count;
+    uint32_t count;
 };
 
 static int compare_reg_count_tup(const void *a_, const void *b_) {
@@ -293,33 +1830,72 @@ count_instr_regs(struct abstract_instr *i,
         mips_regs[i->shift.dest].count++;
         mips_regs[i->shift.lhs].count++;
         break;
+    case ABSTRACT_INSTR_LOAD:
+        mips_regs[i->load.dest].count++;
+        if (i->load.base.type == ABSTRACT_STORAGE_REG) {
+            mips_regs[i->load.base.reg].count++;
+        }
+        break;
+    case ABSTRACT_INSTR_STORE:
+        if (i->store.value.type == ABSTRACT_STORAGE_REG) {
+            mips_regs[i->store.value.reg].count++;
+        }
+        if (i->store.base.type == ABSTRACT_STORAGE_REG) {
+            mips_regs[i->store.base.reg].count++;
+        }
+        break;
+    case ABSTRACT_INSTR_MULDIV:
+        mips_regs[REG_HI].count++;
+        mips_regs[REG_LO].count++;
+        if (i->muldiv.rhs.type == ABSTRACT_STORAGE_REG) {
+            mips_regs[i->muldiv.rhs.reg].count++;
+        }
+        if (i->muldiv.lhs.type == ABSTRACT_STORAGE_REG) {
+            mips_regs[i->muldiv.lhs.reg].count++;
+        }
+        break;
+    case ABSTRACT_INSTR_RETURN:
+    case ABSTRACT_INSTR_JUMP_REG:
+        if (i->jump_reg.target.type == ABSTRACT_STORAGE_REG) {
+            mips_regs[i->jump_reg.target.reg].count++;
+        }
+        break;
+    case ABSTRACT_INSTR_JUMP:
+    case ABSTRACT_INSTR_CALL:
+        break;
+    case ABSTRACT_INSTR_MUL_LOOP:
+        mips_regs[i->mul_loop.acc].count++;
+        mips_regs[i->mul_loop.multiplier].count++;
+        mips_regs[i->mul_loop.multiplicand].count++;
+        mips_regs[i->mul_loop.bit].count++;
+        break;
+    case ABSTRACT_INSTR_INDUCTION:
+        mips_regs[i->induction.dest].count++;
+        mips_regs[i->induction.counter].count++;
+        break;
+    case ABSTRACT_INSTR_SWAP:
+        mips_regs[i->swap.a].count++;
+        mips_regs[i->swap.b].count++;
+        break;
     }
 }
 
-struct mips_x86_reg_mapping map_regs(struct abstract_instr_vec *instrs) {
-
-    // NOTE: this array starts in the order of the `reg_type` enumeration, but
-    // after collecting all the registers we sort it then use the reg field.
-    struct reg_count_tup mips_regs[LARGEST_MIPS_REG + 1] = {{0}};
-
-    // NOTE: REG_ZERO should never appear in an abstract instruction
-    for (enum reg_type reg = SMALLEST_MIPS_REG; reg <= LARGEST_MIPS_REG;
-         reg++) {
-        mips_regs[reg].reg = reg;
-    }
-
-    for (size_t i = 0; i < instrs->len; i++) {
-        count_instr_regs(&instrs->data[i], mips_regs);
-    }
-
-    qsort(mips_regs, LARGEST_MIPS_REG + 1, sizeof(struct reg_count_tup),
-          compare_reg_count_tup);
-
+/**
+ * Map the registers in 'mips_regs' (sorted most used first) to the first
+ * 'num_x86_regs' allocatable registers, then xmm registers, then stack slots.
+ */
+static struct mips_x86_reg_mapping
+assign_regs(struct reg_count_tup *mips_regs, int num_x86_regs) {
     struct mips_x86_reg_mapping mapping = {{{0}}};
 
     size_t mips_reg_idx = 0;
 
-    for (int x86_reg_idx = 0; x86_reg_idx < num_free_x86_regs; x86_reg_idx++) {
+    // registers that are only sometimes allocated go to used registers only
+    for (int x86_reg_idx = 0;
+         x86_reg_idx < num_x86_regs &&
+         (x86_reg_idx < num_always_free_x86_regs ||
+          mips_regs[mips_reg_idx].count > 0);
+         x86_reg_idx++) {
         DEBUG_LOG("mapping %s to register %s\n",
                   reg_type_names[mips_regs[mips_reg_idx].reg],
                   x86_reg_type_names[linear_free_x86_reg_map[x86_reg_idx]]);
@@ -327,8 +1903,22 @@ struct mips_x86_reg_mapping map_regs(struct abstract_instr_vec *instrs) {
             .is_mapped = true,
             .type = X86_REG_MAPPED,
             .x86_reg = linear_free_x86_reg_map[x86_reg_idx]};
+        mapping.num_x86_regs++;
+    }
+
+    uint8_t xmm_reg = 0;
+    for (; mips_reg_idx <= LARGEST_MIPS_REG &&
+           mips_regs[mips_reg_idx].count > 0 && xmm_reg < num_xmm_spill_regs;
+         mips_reg_idx++, xmm_reg++) {
+        DEBUG_LOG("mapping %s to register %s\n",
+                  reg_type_names[mips_regs[mips_reg_idx].reg],
+                  x86_xmm_reg_type_names[xmm_reg]);
+        mapping.mapping[mips_regs[mips_reg_idx].reg] = (struct reg_mapping){
+            .is_mapped = true, .type = XMM_MAPPED, .xmm_reg = xmm_reg};
     }
 
+    mapping.num_xmm_regs = xmm_reg;
+
     uint8_t stack_offset = 0;
     for (;
          mips_reg_idx <= LARGEST_MIPS_REG && mips_regs[mips_reg_idx].count > 0;
@@ -345,3 +1935,72 @@ struct mips_x86_reg_mapping map_regs(struct abstract_instr_vec *instrs) {
 
     return mapping;
 }
+
+/**
+ * Test if any instruction needs ECX as a temporary under 'map'.
+ */
+static bool needs_ecx(struct abstract_instr_vec *instrs,
+                      struct mips_x86_reg_mapping *map) {
+    struct abstract_instr instr;
+
+    for (size_t i = 0; abstract_instr_iter(instrs, i, &instr); i++) {
+        if (abstract_instr_needs_ecx(&instr, map)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+struct mips_x86_reg_mapping map_regs(struct abstract_instr_vec *instrs) {
+
+    // NOTE: this array starts in the order of the `reg_type` enumeration, but
+    // after collecting all the registers we sort it then use the reg field.
+    struct reg_count_tup mips_regs[LARGEST_MIPS_REG + 1] = {{0}};
+
+    // NOTE: REG_ZERO should never appear in an abstract instruction
+    for (enum reg_type reg = SMALLEST_MIPS_REG; reg <= LARGEST_MIPS_REG;
+         reg++) {
+        mips_regs[reg].reg = reg;
+    }
+
+    struct abstract_instr instr;
+
+    for (size_t i = 0; abstract_instr_iter(instrs, i, &instr); i++) {
+        count_instr_regs(&instr, mips_regs);
+    }
+
+    qsort(mips_regs, LARGEST_MIPS_REG + 1, sizeof(struct reg_count_tup),
+          compare_reg_count_tup);
+
+    // start with every allocatable register, then take ECX back if an
+    // instruction needs it as a temporary, and RBP too if there are stack
+    // slots for it to point at
+    struct mips_x86_reg_mapping mapping =
+        assign_regs(mips_regs, num_free_x86_regs);
+
+    if (mapping.num_stack_spots > 0 || needs_ecx(instrs, &mapping)) {
+        mapping = assign_regs(mips_regs, num_free_x86_regs - 1);
+    }
+
+    if (mapping.num_stack_spots > 0) {
+        mapping = assign_regs(mips_regs, num_always_free_x86_regs);
+    }
+
+    return mapping;
+}
+
+uint32_t *mapped_reg_slot(struct mips_x86_reg_mapping *map, enum reg_type reg,
+                          uint32_t *regs_buf, uint32_t *unmapped_regs_buf) {
+    switch (map->mapping[reg].type) {
+    case X86_REG_MAPPED:
+        return &regs_buf[linear_free_x86_reg_inverse_map[map->mapping[reg]
+                                                              .x86_reg]];
+    case XMM_MAPPED:
+        return &regs_buf[num_free_x86_regs + map->mapping[reg].xmm_reg];
+    case STACK_MAPPED:
+        break;
+    }
+
+    return &unmapped_regs_buf[map->mapping[reg].stack_offset];
+}
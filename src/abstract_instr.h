@@ -19,6 +19,18 @@
  * srl $d $t h = d <- t << h       -- shift
  * beq $s $t o = branch eq $s $t o -- branch
  * bne $s $t o = branch ne $s $t o -- branch
+ * lw $t o($s) = $t <- mem[$s + o]  -- load
+ * sw $t o($s) = mem[$s + o] <- $t  -- store
+ * mul $d $s $t = $d <- $s * $t    -- binop
+ * mult $s $t = hi:lo <- $s * $t   -- muldiv
+ * div $s $t = lo <- $s / $t, hi <- $s % $t -- muldiv
+ * mfhi $d = $d <- hi              -- mov
+ * j l = goto l                    -- jump
+ * jal l = $ra <- pc + 4; call l   -- mov, call
+ * jr $ra = return to $ra          -- return
+ * jr $s = goto $s                 -- jump_reg
+ *
+ * swap is only added after registers are mapped, see `promote_loop_regs`
  */
 
 enum __attribute__((__packed__)) abstract_storage_type {
@@ -28,7 +40,8 @@ enum __attribute__((__packed__)) abstract_storage_type {
 
 extern const char *const abstract_storage_type_names[];
 
-struct abstract_storage {
+// packed so instructions holding two of these don't pad each out to 8 bytes
+struct __attribute__((__packed__)) abstract_storage {
     union {
         uint32_t imm;
         enum reg_type reg;
@@ -40,14 +53,31 @@ enum __attribute__((__packed__)) abstract_instr_type {
     ABSTRACT_INSTR_BINOP,
     ABSTRACT_INSTR_BRANCH,
     ABSTRACT_INSTR_MOV,
-    ABSTRACT_INSTR_SHIFT
+    ABSTRACT_INSTR_SHIFT,
+    ABSTRACT_INSTR_LOAD,
+    ABSTRACT_INSTR_STORE,
+    ABSTRACT_INSTR_MULDIV,
+    ABSTRACT_INSTR_MUL_LOOP,
+    ABSTRACT_INSTR_INDUCTION,
+    ABSTRACT_INSTR_JUMP,
+    ABSTRACT_INSTR_CALL,
+    ABSTRACT_INSTR_RETURN,
+    ABSTRACT_INSTR_JUMP_REG,
+    ABSTRACT_INSTR_SWAP
 };
 
 extern const char *const abstract_instr_type_names[];
 
 enum __attribute__((__packed__)) abstract_instr_binop_op {
     ABSTRACT_INSTR_BINOP_ADD,
+    // an add that traps on signed overflow (`add` and `addi`), left alone by
+    // the passes that match adds until it's known not to overflow
+    ABSTRACT_INSTR_BINOP_ADD_TRAP,
     ABSTRACT_INSTR_BINOP_AND,
+    ABSTRACT_INSTR_BINOP_MUL,
+    // (lhs << shift) + rhs, both registers. only made by the last pass, so
+    // the passes before it never see one.
+    ABSTRACT_INSTR_BINOP_SCALED_ADD,
 };
 
 extern const char *const abstract_instr_binop_op_names[];
@@ -56,19 +86,30 @@ struct abstract_instr_binop {
     struct abstract_storage lhs, rhs;
     enum reg_type dest;
     enum abstract_instr_binop_op op;
+    uint8_t shift; // only for scaled adds, 1 to 3
 };
 
 enum __attribute__((__packed__)) abstract_instr_branch_test_type {
     ABSTRACT_INSTR_BRANCH_TEST_NE,
-    ABSTRACT_INSTR_BRANCH_TEST_EQ
+    ABSTRACT_INSTR_BRANCH_TEST_EQ,
+    // as above but only the low `low_bits` bits are compared, rhs is always an
+    // immediate
+    ABSTRACT_INSTR_BRANCH_TEST_LOW_NE,
+    ABSTRACT_INSTR_BRANCH_TEST_LOW_EQ,
+    // taken if lhs & rhs is zero/ non zero, rhs is always an immediate
+    ABSTRACT_INSTR_BRANCH_TEST_MASK_ZERO,
+    ABSTRACT_INSTR_BRANCH_TEST_MASK_NONZERO
 };
 
 extern const char *const abstract_instr_branch_test_type_names[];
 
-struct abstract_instr_branch {
+// packed so it's no bigger than the other operands, see `struct
+// abstract_instr_vec`
+struct __attribute__((__packed__)) abstract_instr_branch {
+    struct label *label; // we still use branch labels at this point
     enum abstract_instr_branch_test_type type;
+    uint8_t low_bits;
     struct abstract_storage lhs, rhs;
-    struct label *label; // we still use branch labels at this point
 };
 
 struct abstract_instr_mov {
@@ -88,19 +129,249 @@ struct abstract_instr_shift {
     uint8_t rhs;
 };
 
+enum __attribute__((__packed__)) abstract_mem_width {
+    ABSTRACT_MEM_BYTE,
+    ABSTRACT_MEM_HALF,
+    ABSTRACT_MEM_WORD
+};
+
+extern const char *const abstract_mem_width_names[];
+
+// dest <- sign_extend(mem[base + offset])
+struct abstract_instr_load {
+    enum abstract_mem_width width;
+    enum reg_type dest;
+    struct abstract_storage base;
+    int16_t offset;
+};
+
+// mem[base + offset] <- truncate(value)
+struct abstract_instr_store {
+    enum abstract_mem_width width;
+    struct abstract_storage value, base;
+    int16_t offset;
+};
+
+enum __attribute__((__packed__)) abstract_instr_muldiv_op {
+    ABSTRACT_INSTR_MULDIV_MULT,
+    ABSTRACT_INSTR_MULDIV_MULTU,
+    ABSTRACT_INSTR_MULDIV_DIV,
+    ABSTRACT_INSTR_MULDIV_DIVU
+};
+
+extern const char *const abstract_instr_muldiv_op_names[];
+
+// writes REG_HI and REG_LO
+struct abstract_instr_muldiv {
+    enum abstract_instr_muldiv_op op;
+    struct abstract_storage lhs, rhs;
+};
+
+/**
+ * The closed form of a shift-and-add multiply loop:
+ *
+ * loop: andi $bit $multiplier 1
+ *       beq $bit $zero skip
+ *       add $acc $acc $multiplicand
+ * skip: srl $multiplier $multiplier 1
+ *       sll $multiplicand $multiplicand 1
+ *       bne $multiplier $zero loop
+ *
+ * acc += multiplier * multiplicand, then the other registers are left as the
+ * loop would leave them: multiplicand is shifted left once per iteration,
+ * multiplier is zero and bit holds the last bit tested.
+ */
+struct abstract_instr_mul_loop {
+    enum reg_type acc, multiplier, multiplicand, bit;
+};
+
+// the instructions in a shift-and-add multiply loop
+#define MUL_LOOP_LEN 6
+
+/**
+ * Part of the closed form of a counting loop, where every instruction in the
+ * body adds a constant to a register and the loop ends on the counter reaching
+ * a constant:
+ *
+ * loop: addi $counter $counter step
+ *       addi $r $r delta
+ *       ...
+ *       bne $counter limit loop
+ *
+ * dest += trips * delta, where trips is the number of times the loop runs (see
+ * `induction_trip_count`) given the counter's value before the loop. If the
+ * counter never reaches the limit this spins forever, as the loop would.
+ */
+struct abstract_instr_induction {
+    enum reg_type dest, counter;
+    uint32_t limit, step, delta;
+};
+
+struct abstract_instr_jump {
+    struct label *label;
+};
+
+/**
+ * Calls are realized as native calls, the guest return address is pushed
+ * alongside the native one so a return can check it still matches $ra.
+ */
+struct abstract_instr_call {
+    struct label *label;
+    // resolved to just after the call, its guest address is the return address
+    struct label *return_label;
+};
+
+// used for both return and jump_reg
+struct abstract_instr_jump_reg {
+    struct abstract_storage target;
+    uint32_t site_address; // guest address of the jr, to identify the site
+};
+
+// a, b <- b, a
+struct abstract_instr_swap {
+    enum reg_type a, b;
+};
+
+#define ABSTRACT_INSTR_OPERANDS                                                \
+    struct abstract_instr_binop binop;                                         \
+    struct abstract_instr_branch branch;                                       \
+    struct abstract_instr_mov mov;                                             \
+    struct abstract_instr_shift shift;                                         \
+    struct abstract_instr_load load;                                           \
+    struct abstract_instr_store store;                                         \
+    struct abstract_instr_muldiv muldiv;                                       \
+    struct abstract_instr_mul_loop mul_loop;                                   \
+    struct abstract_instr_induction induction;                                 \
+    struct abstract_instr_jump jump;                                           \
+    struct abstract_instr_call call;                                           \
+    struct abstract_instr_jump_reg jump_reg;                                   \
+    struct abstract_instr_swap swap
+
+// the operands of any instruction, only 4 byte aligned so an array of them
+// isn't padded out to the pointers some hold
+union __attribute__((__packed__, __aligned__(4))) abstract_instr_operands {
+    ABSTRACT_INSTR_OPERANDS;
+};
+
+/**
+ * One instruction, as taken out of or put into a `struct abstract_instr_vec`.
+ */
 struct abstract_instr {
     struct label *label;
+    uint32_t guest_address; // of the mips instruction this came from
     enum abstract_instr_type type;
     union {
-        struct abstract_instr_binop binop;
-        struct abstract_instr_branch branch;
-        struct abstract_instr_mov mov;
-        struct abstract_instr_shift shift;
+        ABSTRACT_INSTR_OPERANDS;
     };
 };
 
+/**
+ * The labels on instructions, sorted by the index of the instruction. Most
+ * instructions don't have one, so they're kept to the side with a bit for
+ * each instruction to say if it has one. Counting the bits set before an
+ * instruction, from the rank of its word, finds its entry without a search.
+ */
+struct abstract_instr_label_entry {
+    uint32_t index;
+    uint32_t label_id; // index into `all_labels`
+};
+
+struct abstract_instr_labels {
+    struct abstract_instr_label_entry *entries;
+    size_t cap, len;
+    uint64_t *bits;  // bit i set if instruction i has a label
+    uint32_t *ranks; // entries before each word of bits, up to the length
+};
+
+/**
+ * Abstract instructions as a struct of arrays: every pass walks them in order
+ * and mostly looks at the type first, so the types are packed together
+ * followed by the operands, with the label and guest address of each kept
+ * apart.
+ *
+ * Instructions are read with `abstract_instr_get` (or `abstract_instr_iter`
+ * in a loop) and written back with `abstract_instr_set`. Passes only looking
+ * at types or operands may read `types` and `operands` directly.
+ *
+ * Vectors made with an arena live in it, as with `DEFINE_VEC`.
+ */
+struct abstract_instr_vec {
+    enum abstract_instr_type *types;
+    union abstract_instr_operands *operands;
+    uint32_t *guest_addresses;
+    struct abstract_instr_labels labels;
+    size_t cap;
+    size_t len;
+    struct arena *arena; // NULL if on the heap
+};
+
+struct abstract_instr_vec *abstract_instr_vec_new(void);
+struct abstract_instr_vec *abstract_instr_vec_new_in(struct arena *arena,
+                                                     size_t cap);
+void abstract_instr_vec_push(struct abstract_instr_vec *vec,
+                             struct abstract_instr i);
+void abstract_instr_vec_free(struct abstract_instr_vec *vec);
+
+/**
+ * The instruction at 'i'.
+ */
+struct abstract_instr abstract_instr_get(struct abstract_instr_vec *vec,
+                                         size_t i);
+
+/**
+ * Replace the instruction at 'i', label and all.
+ */
+void abstract_instr_set(struct abstract_instr_vec *vec, size_t i,
+                        struct abstract_instr *instr);
+
+/**
+ * Take the instruction at 'i' into 'instr', returning false past the end:
+ *
+ * for (size_t i = 0; abstract_instr_iter(instrs, i, &instr); i++)
+ */
+bool abstract_instr_iter(struct abstract_instr_vec *vec, size_t i,
+                         struct abstract_instr *instr);
+
+/**
+ * The label on the instruction at 'i', or NULL.
+ */
+struct label *abstract_instr_label(struct abstract_instr_vec *vec, size_t i);
+
+/**
+ * Put 'label' on the instruction at 'i', replacing any it had, or take it off
+ * if 'label' is NULL.
+ */
+void abstract_instr_set_label(struct abstract_instr_vec *vec, size_t i,
+                              struct label *label);
+
+/**
+ * The first instruction at or after 'start' with a label, or the length if
+ * there isn't one.
+ */
+size_t abstract_instrs_next_labelled(struct abstract_instr_vec *vec,
+                                     size_t start);
+
+/**
+ * Make room for 'count' instructions at 'at', moving those after along. The
+ * new instructions have no label and have to be set.
+ */
+void abstract_instrs_insert(struct abstract_instr_vec *vec, size_t at,
+                            size_t count);
+
+/**
+ * Remove 'count' instructions from 'start', along with their labels.
+ */
+void abstract_instrs_remove(struct abstract_instr_vec *vec, size_t start,
+                            size_t count);
+
+/**
+ * The bytes the instructions in 'vec' take up, labels included.
+ */
+size_t abstract_instrs_bytes(struct abstract_instr_vec *vec);
+
 enum __attribute__((__packed__)) reg_mapping_type {
     X86_REG_MAPPED, // mapped to an x86 register
+    XMM_MAPPED,     // mapped to the low lane of an xmm register
     STACK_MAPPED    // mapped to a stack offset
 };
 
@@ -109,6 +380,7 @@ struct reg_mapping {
     enum reg_mapping_type type;
     union {
         enum x86_reg_type x86_reg;
+        enum x86_xmm_reg_type xmm_reg;
         uint8_t stack_offset;
     };
 };
@@ -118,23 +390,235 @@ struct reg_mapping {
  */
 struct mips_x86_reg_mapping {
     struct reg_mapping mapping[LARGEST_MIPS_REG + 1];
+    uint8_t num_x86_regs; // how many of `linear_free_x86_reg_map` are used
+    uint8_t num_xmm_regs;
     uint8_t num_stack_spots;
 };
 
+/**
+ * The guest address of the MIPS instruction at 'index'.
+ */
+uint32_t guest_address_of(size_t index);
+
+/**
+ * A guest address past the end of the program, different each time, for
+ * instructions added that don't stand in for a MIPS instruction.
+ */
+uint32_t synthetic_guest_address(void);
+
+/**
+ * The label an instruction may transfer control to, or NULL.
+ */
+struct label *abstract_instr_target_label(struct abstract_instr *i);
+
+/**
+ * The label instruction 'i' of 'vec' may transfer control to, or NULL, read
+ * from the arrays without building the instruction.
+ */
+struct label *abstract_instrs_target_label(struct abstract_instr_vec *vec,
+                                           size_t i);
+
+// most registers an abstract instruction reads or writes
+#define ABSTRACT_INSTR_MAX_REGS 4
+
+/**
+ * Collect the registers 'i' reads (other than $zero) into 'regs', returning
+ * how many there are.
+ */
+size_t abstract_instr_uses(struct abstract_instr *i,
+                           enum reg_type regs[ABSTRACT_INSTR_MAX_REGS]);
+
+/**
+ * Collect the registers 'i' writes into 'regs', returning how many there are.
+ */
+size_t abstract_instr_defs(struct abstract_instr *i,
+                           enum reg_type regs[ABSTRACT_INSTR_MAX_REGS]);
+
+/**
+ * Replace every read or write of 'from' in 'i' with 'to'.
+ *
+ * NOTE: the hi and lo registers written by a muldiv are fixed, so they aren't
+ * renamed.
+ */
+void abstract_instr_rename_reg(struct abstract_instr *i, enum reg_type from,
+                               enum reg_type to);
+
+/**
+ * Where each label is, and the range of instructions that jump to it.
+ */
+struct label_refs {
+    size_t *index; // SIZE_MAX if the label isn't on an instruction
+    size_t *first_ref, *last_ref;
+};
+
+struct label_refs find_label_refs(struct abstract_instr_vec *instrs);
+
+void free_label_refs(struct label_refs *refs);
+
+/**
+ * Collect where control can go after 'instrs[i]' into 'succ', the fallthrough
+ * first, returning how many places there are. Sets 'exits' if control can
+ * also go somewhere the instructions don't show: out of the program, or
+ * through dispatch.
+ */
+size_t abstract_instr_successors(struct abstract_instr_vec *instrs,
+                                 struct label_refs *refs, size_t i,
+                                 size_t succ[2], bool *exits);
+
+/**
+ * Test if there are returns or `jr`, which may land on any guest label.
+ */
+bool abstract_instrs_jump_indirectly(struct abstract_instr_vec *instrs);
+
+/**
+ * Test if control can arrive at 'instrs[i]' from somewhere successors don't
+ * show: the start of the program, a return from a call, or with
+ * 'jumps_indirectly' any guest label.
+ */
+bool abstract_instr_is_entry(struct abstract_instr_vec *instrs, size_t i,
+                             bool jumps_indirectly);
+
+/**
+ * The instructions a dataflow analysis still has to go through, as a bit for
+ * each instruction with a summary bit for each word of them that has any set.
+ * They're taken in program order, wrapping round, so straight line code and
+ * forward branches are only gone through once and just loops go round again.
+ */
+struct instr_worklist {
+    uint64_t *bits;
+    uint64_t *summary; // bit w set if bits[w] isn't 0
+    size_t num_words;
+    size_t next; // the search for the next instruction starts here
+};
+
+struct instr_worklist instr_worklist_new(size_t len);
+
+void instr_worklist_free(struct instr_worklist *list);
+
+void instr_worklist_add(struct instr_worklist *list, size_t i);
+
+/**
+ * Take the next instruction at or after the last one taken, wrapping round,
+ * into 'i'. Returns false if the list is empty.
+ */
+bool instr_worklist_take(struct instr_worklist *list, size_t *i);
+
+/**
+ * Test if 'instrs[i]' can be removed. The first instruction and the ones after
+ * calls are entered by position, so have to stay.
+ */
+bool abstract_instr_is_removable(struct abstract_instr_vec *instrs, size_t i);
+
+/**
+ * Remove the instructions marked in 'removed'. The label of a removed
+ * instruction moves on to the next one kept, unless that has its own, in which
+ * case the instruction stays; removing is only ever an improvement.
+ */
+void remove_marked_abstract_instrs(struct abstract_instr_vec *instrs,
+                                   bool *removed);
+
+/**
+ * If 's' is a constant (an immediate or $zero) store it in 'value'.
+ */
+bool abstract_storage_constant(struct abstract_storage s, uint32_t *value);
+
+/**
+ * Test if 'i' adds a constant to a register in place, storing the register
+ * and the constant.
+ */
+bool abstract_instr_affine_update(struct abstract_instr *i, enum reg_type *reg,
+                                  uint32_t *delta);
+
+/**
+ * Test if 'i' is `bne $counter limit head` for a constant limit, storing the
+ * counter and the limit.
+ */
+bool counted_loop_exit(struct abstract_instr *i, struct label *head,
+                       enum reg_type *counter, uint32_t *limit);
+
+/**
+ * Test if a shift-and-add multiply loop (see `struct abstract_instr_mul_loop`)
+ * starts at 'start', storing its registers. Its add may be one that traps.
+ */
+bool find_mul_loop(struct abstract_instr_vec *instrs, size_t start,
+                   struct abstract_instr_mul_loop *mul_loop);
+
+/**
+ * Test if the branch at 'branch_idx' is the only branch to 'label'.
+ *
+ * NOTE: labels that guest code could reach through `jr` are not considered.
+ */
+bool only_branch_to(struct abstract_instr_vec *instrs, struct label *label,
+                    size_t branch_idx);
+
+/**
+ * The test that holds exactly when 'type' doesn't.
+ */
+enum abstract_instr_branch_test_type
+invert_branch_test(enum abstract_instr_branch_test_type type);
+
+/**
+ * The inverse of an odd number modulo 2^32.
+ */
+uint32_t odd_inverse(uint32_t odd);
+
+/**
+ * The number of times a counting loop runs when its counter starts at
+ * 'counter' and moves by 'step' each time until it equals 'limit', modulo
+ * 2^32. Returns false if the counter never equals the limit.
+ */
+bool induction_trip_count(uint32_t counter, uint32_t limit, uint32_t step,
+                          uint32_t *trips);
+
 /**
  * Translate MIPS instructions into our abstract instructions.
  */
 struct abstract_instr_vec *translate_instructions(struct instr_vec *instrs);
 
+// copies of a loop body made by unrolling, and the most abstract instructions
+// an unrolled loop may take up
+#define DEFAULT_UNROLL_FACTOR 4
+#define DEFAULT_UNROLL_BUDGET 64
+
+struct optimise_options {
+    uint32_t unroll_factor; // a power of two, 1 disables unrolling
+    uint32_t unroll_budget;
+};
+
+// what the optimiser did, printed after the program runs
+struct optimise_stats {
+    uint64_t common_subexprs; // recomputations replaced by moves or dropped
+};
+
 /**
  * Run the optimisation pass over abstract instructions.
  */
-void optimise_abstract_instrs(struct abstract_instr_vec *instrs);
+void optimise_abstract_instrs(struct abstract_instr_vec *instrs,
+                              struct optimise_options *options,
+                              struct optimise_stats *stats);
+
+void print_optimise_stats(struct optimise_stats *stats);
 
 void print_abstract_instr(struct abstract_instr *i);
 
-DEFINE_VEC(struct abstract_instr, abstract_instr);
+/**
+ * As `print_abstract_instr`, with the registers 'i' reads and writes named by
+ * 'use_names' and 'def_names' (indexed by register).
+ */
+void print_abstract_instr_named(struct abstract_instr *i,
+                                const char *const *use_names,
+                                const char *const *def_names);
 
 struct mips_x86_reg_mapping map_regs(struct abstract_instr_vec *instrs);
 
+/**
+ * Find where the value of a mapped mips register is kept outside of generated
+ * code, given the buffers the mapped and stack mapped registers are stored to.
+ *
+ * The mapped buffer holds the allocatable registers followed by the xmm
+ * registers.
+ */
+uint32_t *mapped_reg_slot(struct mips_x86_reg_mapping *map, enum reg_type reg,
+                          uint32_t *regs_buf, uint32_t *unmapped_regs_buf);
+
 #endif // __ABSTRACT_INSTR_H_
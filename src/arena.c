@@ -0,0 +1,75 @@
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+static struct arena_chunk *new_chunk(size_t cap, struct arena_chunk *prev) {
+    struct arena_chunk *chunk = malloc(sizeof(struct arena_chunk) + cap);
+    *chunk = (struct arena_chunk){.prev = prev, .cap = cap};
+
+    return chunk;
+}
+
+struct arena *arena_new(size_t size) {
+    struct arena *arena = malloc(sizeof(struct arena));
+    arena->chunk = new_chunk(size, NULL);
+
+    return arena;
+}
+
+void *arena_alloc(struct arena *arena, size_t size) {
+    struct arena_chunk *chunk = arena->chunk;
+    size_t start = (chunk->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (start + size > chunk->cap) {
+        size_t cap = 2 * chunk->cap > size ? 2 * chunk->cap : size;
+        chunk = arena->chunk = new_chunk(cap, chunk);
+        start = 0;
+    }
+
+    chunk->used = start + size;
+
+    return &chunk->data[start];
+}
+
+void *arena_calloc(struct arena *arena, size_t size) {
+    void *p = arena_alloc(arena, size);
+    memset(p, 0, size);
+
+    return p;
+}
+
+void arena_reset(struct arena *arena) {
+    struct arena_chunk *chunk = arena->chunk;
+
+    if (chunk->prev == NULL) {
+        chunk->used = 0;
+        return;
+    }
+
+    // replace the chunks with one that fits all of them
+    size_t total = 0;
+    while (chunk != NULL) {
+        struct arena_chunk *prev = chunk->prev;
+        total += chunk->cap;
+        free(chunk);
+        chunk = prev;
+    }
+
+    arena->chunk = new_chunk(total, NULL);
+}
+
+void arena_free(struct arena *arena) {
+    struct arena_chunk *chunk = arena->chunk;
+
+    while (chunk != NULL) {
+        struct arena_chunk *prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
+
+    free(arena);
+}
@@ -0,0 +1,49 @@
+#ifndef __ARENA_H_
+#define __ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A bump allocator for everything made while compiling, freed all at once.
+ *
+ * Memory comes from large chunks, each allocation just moves a pointer along
+ * the current one. When it runs out a new chunk at least twice the size is
+ * added. Nothing is freed on its own: resetting the arena makes all of it free
+ * again, keeping a single chunk as big as everything that was in use so the
+ * next compilation of the same size needs no more.
+ */
+
+struct arena_chunk {
+    struct arena_chunk *prev;
+    size_t cap, used;
+    _Alignas(max_align_t) uint8_t data[];
+};
+
+struct arena {
+    struct arena_chunk *chunk; // the one being allocated from
+};
+
+/**
+ * Create an arena, with room for 'size' bytes before it has to grow.
+ */
+struct arena *arena_new(size_t size);
+
+/**
+ * Allocate 'size' bytes, aligned for any type.
+ */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/**
+ * Allocate 'size' zeroed bytes, aligned for any type.
+ */
+void *arena_calloc(struct arena *arena, size_t size);
+
+/**
+ * Free everything allocated from the arena, but keep the memory for reuse.
+ */
+void arena_reset(struct arena *arena);
+
+void arena_free(struct arena *arena);
+
+#endif // __ARENA_H_
@@ -0,0 +1,179 @@
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "bench.h"
+
+const char *const bench_stage_names[] = {
+    [BENCH_PARSE] = "parse",         [BENCH_TRANSLATE] = "translate",
+    [BENCH_OPTIMISE] = "optimise",   [BENCH_MAP_REGS] = "map_regs",
+    [BENCH_REALIZE] = "realize",     [BENCH_EMIT] = "emit",
+    [BENCH_EXECUTE] = "execute"};
+
+// percentiles of the times of a stage, in nanoseconds
+struct bench_summary {
+    uint64_t min, p50, p90, p99, max;
+};
+
+struct bench *bench_new(uint32_t reps) {
+    struct bench *bench = malloc(sizeof(struct bench));
+    *bench = (struct bench){.reps = reps};
+
+    for (int s = 0; s < NUM_BENCH_STAGES; s++) {
+        bench->samples[s] = calloc(reps, sizeof(uint64_t));
+    }
+
+    return bench;
+}
+
+void bench_free(struct bench *bench) {
+    for (int s = 0; s < NUM_BENCH_STAGES; s++) {
+        free(bench->samples[s]);
+    }
+
+    free(bench);
+}
+
+uint64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t bench_lap(struct bench *bench, enum bench_stage stage,
+                   uint64_t start) {
+    uint64_t now = bench_now();
+    bench->samples[stage][bench->rep] = now - start;
+
+    return now;
+}
+
+static int compare_u64(const void *a_, const void *b_) {
+    const uint64_t *a = a_;
+    const uint64_t *b = b_;
+
+    return (*a > *b) - (*a < *b);
+}
+
+/**
+ * The nearest rank percentile 'p' of 'n' sorted samples.
+ */
+static uint64_t percentile(uint64_t *sorted, uint32_t n, uint32_t p) {
+    uint32_t rank = (p * n + 99) / 100;
+
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static struct bench_summary summarise(uint64_t *samples, uint32_t n) {
+    uint64_t *sorted = malloc(n * sizeof(uint64_t));
+    memcpy(sorted, samples, n * sizeof(uint64_t));
+    qsort(sorted, n, sizeof(uint64_t), compare_u64);
+
+    struct bench_summary summary = {.min = sorted[0],
+                                    .p50 = percentile(sorted, n, 50),
+                                    .p90 = percentile(sorted, n, 90),
+                                    .p99 = percentile(sorted, n, 99),
+                                    .max = sorted[n - 1]};
+    free(sorted);
+
+    return summary;
+}
+
+/**
+ * The summary of every stage, then of the whole compilation (every stage but
+ * executing) in the last entry.
+ */
+static void summarise_all(struct bench *bench,
+                          struct bench_summary summaries[]) {
+    uint64_t *compile = calloc(bench->reps, sizeof(uint64_t));
+
+    for (int s = 0; s < NUM_BENCH_STAGES; s++) {
+        summaries[s] = summarise(bench->samples[s], bench->reps);
+
+        for (uint32_t r = 0; r < bench->reps && s != BENCH_EXECUTE; r++) {
+            compile[r] += bench->samples[s][r];
+        }
+    }
+
+    summaries[NUM_BENCH_STAGES] = summarise(compile, bench->reps);
+    free(compile);
+}
+
+static const char *summary_name(int s) {
+    return s == NUM_BENCH_STAGES ? "compile" : bench_stage_names[s];
+}
+
+/**
+ * Instructions per second at the median time, 0 for executing as its time
+ * depends on what the program does rather than its size.
+ */
+static double throughput(struct bench *bench, int s,
+                         struct bench_summary *summary) {
+    if (s == BENCH_EXECUTE || summary->p50 == 0) {
+        return 0;
+    }
+
+    return bench->instrs * 1e9 / summary->p50;
+}
+
+void bench_print(struct bench *bench) {
+    struct bench_summary summaries[NUM_BENCH_STAGES + 1];
+    summarise_all(bench, summaries);
+
+    printf("%zu instructions, %u repetitions\n", bench->instrs, bench->reps);
+    printf("%-10s %10s %10s %10s %10s %10s %10s\n", "stage", "min us",
+           "p50 us", "p90 us", "p99 us", "max us", "Minstr/s");
+
+    for (int s = 0; s <= NUM_BENCH_STAGES; s++) {
+        struct bench_summary *sum = &summaries[s];
+
+        printf("%-10s %10.1f %10.1f %10.1f %10.1f %10.1f", summary_name(s),
+               sum->min / 1e3, sum->p50 / 1e3, sum->p90 / 1e3,
+               sum->p99 / 1e3, sum->max / 1e3);
+
+        if (s == BENCH_EXECUTE) {
+            printf(" %10s\n", "-");
+        } else {
+            printf(" %10.2f\n", throughput(bench, s, sum) / 1e6);
+        }
+    }
+
+    if (bench->instrs > 0) {
+        printf("bytes per instruction: parsed %.1f, abstract %.1f, x86 %.1f\n",
+               (double)bench->parsed_bytes / bench->instrs,
+               (double)bench->abstract_bytes / bench->instrs,
+               (double)bench->x86_bytes / bench->instrs);
+    }
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        printf("peak RSS: %.1f MB\n", usage.ru_maxrss / 1024.0);
+    }
+}
+
+void bench_write_csv(struct bench *bench, const char *program, FILE *csv) {
+    struct bench_summary summaries[NUM_BENCH_STAGES + 1];
+    summarise_all(bench, summaries);
+
+    fseek(csv, 0, SEEK_END);
+    if (ftell(csv) == 0) {
+        fprintf(csv, "program,stage,instrs,reps,min_ns,p50_ns,p90_ns,p99_ns,"
+                     "max_ns,instrs_per_sec\n");
+    }
+
+    for (int s = 0; s <= NUM_BENCH_STAGES; s++) {
+        struct bench_summary *sum = &summaries[s];
+
+        fprintf(csv,
+                "%s,%s,%zu,%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+                ",%" PRIu64 ",%.0f\n",
+                program, summary_name(s), bench->instrs, bench->reps,
+                sum->min, sum->p50, sum->p90, sum->p99, sum->max,
+                throughput(bench, s, sum));
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef __BENCH_H_
+#define __BENCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Timing of the stages of compiling and running a program, over a number of
+ * repetitions. Each stage is timed on its own in every repetition, and the
+ * times are reported as percentiles so one slow repetition doesn't hide a
+ * regression, or fake one.
+ */
+
+enum bench_stage {
+    BENCH_PARSE,
+    BENCH_TRANSLATE,
+    BENCH_OPTIMISE,
+    BENCH_MAP_REGS, // includes promoting registers in loops
+    BENCH_REALIZE,
+    BENCH_EMIT,
+    BENCH_EXECUTE,
+    NUM_BENCH_STAGES
+};
+
+extern const char *const bench_stage_names[];
+
+struct bench {
+    uint32_t reps;
+    uint32_t rep;  // the repetition being timed
+    size_t instrs; // parsed instructions, the size throughput is measured by
+    uint64_t *samples[NUM_BENCH_STAGES]; // nanoseconds, one per repetition
+
+    // bytes taken by the parsed, abstract and x86 instruction lists
+    size_t parsed_bytes, abstract_bytes, x86_bytes;
+};
+
+struct bench *bench_new(uint32_t reps);
+void bench_free(struct bench *bench);
+
+/**
+ * Nanoseconds from some fixed point in the past.
+ */
+uint64_t bench_now(void);
+
+/**
+ * Record the time since 'start' as the time taken by 'stage' in the current
+ * repetition, returns the time now so the next stage can be timed from it.
+ */
+uint64_t bench_lap(struct bench *bench, enum bench_stage stage,
+                   uint64_t start);
+
+/**
+ * Print a table of the times of each stage and the throughput of the
+ * compiling ones, then the bytes each instruction list takes per parsed
+ * instruction and the peak resident set size.
+ */
+void bench_print(struct bench *bench);
+
+/**
+ * Write the same as `bench_print` as CSV, a row for each stage, with a
+ * header first if 'csv' is empty. 'program' names the program in each row.
+ */
+void bench_write_csv(struct bench *bench, const char *program, FILE *csv);
+
+#endif // __BENCH_H_
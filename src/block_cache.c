@@ -0,0 +1,648 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "block_cache.h"
+#include "common.h"
+#include "label_storage.h"
+#include "trace.h"
+#include "vec.h"
+#include "x86_instr.h"
+
+MAKE_VEC(struct block_exit *, block_exit_ptr);
+MAKE_VEC(struct block *, block_ptr);
+
+// enough for compiling most blocks and traces without the arena growing
+#define BLOCK_ARENA_SIZE (64 * 1024)
+
+/**
+ * Copy into the code cache, which is only made writeable while we write to
+ * it.
+ */
+static void code_cache_write(struct block_cache *cache, uint32_t position,
+                             const void *src, uint32_t len) {
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)&cache->code[position] & ~(page_size - 1);
+    uintptr_t end = (uintptr_t)&cache->code[position + len];
+
+    if (mprotect((void *)start, end - start, PROT_READ | PROT_WRITE) == -1) {
+        perror("Failed remapping code cache to rw");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(&cache->code[position], src, len);
+
+    if (mprotect((void *)start, end - start, PROT_READ | PROT_EXEC) == -1) {
+        perror("Failed remapping code cache to rx");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Point the jump of an exit at a position in the code cache.
+ */
+static void patch_exit(struct block_cache *cache, struct block_exit *exit,
+                       uint32_t target_position) {
+    int32_t rel = target_position - (exit->patch_position + 4);
+    code_cache_write(cache, exit->patch_position, &rel, sizeof(rel));
+}
+
+static void link_exit(struct block_cache *cache, struct block_exit *exit,
+                      struct block *block) {
+    patch_exit(cache, exit, block->code_position);
+    exit->linked_to = block;
+    block_exit_ptr_vec_push(block->incoming, exit);
+    cache->stats.links++;
+}
+
+static void unlink_exit(struct block_cache *cache, struct block_exit *exit) {
+    patch_exit(cache, exit, exit->stub_position);
+    exit->linked_to = NULL;
+    block_exit_ptr_vec_push(cache->unlinked, exit);
+    cache->stats.unlinks++;
+}
+
+/**
+ * Remove an element from a vector of exits, not preserving the order.
+ */
+static void remove_exit_ptr(struct block_exit_ptr_vec *vec,
+                            struct block_exit *exit) {
+    for (size_t i = 0; i < vec->len; i++) {
+        if (vec->data[i] == exit) {
+            vec->data[i] = vec->data[--vec->len];
+            return;
+        }
+    }
+}
+
+static void free_block(struct block *block) {
+    free(block->exits);
+    block_exit_ptr_vec_free(block->incoming);
+    free(block);
+}
+
+static void find_entries(struct block_cache *cache) {
+    struct abstract_instr_vec *ainstrs = cache->ainstrs;
+
+    cache->is_entry = calloc(ainstrs->len, sizeof(bool));
+    cache->entry_addresses = calloc(ainstrs->len, sizeof(uint32_t));
+    cache->entry_indices = guest_map_new(64);
+
+    for (size_t i = 0; i < ainstrs->len; i++) {
+        struct label *label = abstract_instr_label(ainstrs, i);
+        uint32_t guest_address = ainstrs->guest_addresses[i];
+
+        // traces leave through the fallthrough of branches, so when tracing
+        // blocks also start there
+        if (i == 0 || (label != NULL && label->has_guest_address) ||
+            ainstrs->types[i - 1] == ABSTRACT_INSTR_CALL ||
+            (cache->traces &&
+             ainstrs->types[i - 1] == ABSTRACT_INSTR_BRANCH)) {
+            cache->is_entry[i] = true;
+            cache->entry_addresses[i] = guest_address;
+            guest_map_insert(&cache->entry_indices, guest_address, i);
+        }
+    }
+}
+
+/**
+ * Find the targets of backwards jumps, which are profiled when tracing.
+ */
+static void find_loop_heads(struct block_cache *cache) {
+    struct abstract_instr_vec *ainstrs = cache->ainstrs;
+
+    cache->head_counts = guest_map_new(64);
+
+    struct abstract_instr instr;
+
+    for (size_t i = 0; abstract_instr_iter(ainstrs, i, &instr); i++) {
+        struct label *target = abstract_instr_target_label(&instr);
+        uint32_t index;
+
+        if (target != NULL && instr.type != ABSTRACT_INSTR_CALL &&
+            guest_map_lookup(&cache->entry_indices, target->guest_address,
+                             &index) &&
+            index <= i) {
+            guest_map_insert(&cache->head_counts, target->guest_address, 0);
+        }
+    }
+}
+
+struct block_cache *block_cache_new(struct abstract_instr_vec *ainstrs,
+                                    struct mips_x86_reg_mapping *map,
+                                    struct jit_runtime *rt, uint32_t capacity,
+                                    bool traces, bool dump_x86,
+                                    struct perf_output *perf,
+                                    struct pc_map *pc_map) {
+    if (capacity <= X86_PRELUDE_MAX_SIZE) {
+        RUNTIME_ERROR("Code cache size %u is too small", capacity);
+    }
+
+    struct block_cache *cache = malloc(sizeof(struct block_cache));
+
+    *cache = (struct block_cache){.capacity = capacity,
+                                  .rt = rt,
+                                  .ainstrs = ainstrs,
+                                  .map = map,
+                                  .traces = traces,
+                                  .dump_x86 = dump_x86,
+                                  .blocks = block_ptr_vec_new(),
+                                  .block_indices = guest_map_new(64),
+                                  .unlinked = block_exit_ptr_vec_new(),
+                                  .stub_labels = labels_vec_new(),
+                                  .arena = arena_new(BLOCK_ARENA_SIZE),
+                                  .perf = perf,
+                                  .pc_map = pc_map};
+
+    cache->code = mmap(NULL, capacity, PROT_READ | PROT_EXEC,
+                       MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (cache->code == MAP_FAILED) {
+        perror("Mapping code cache failed");
+        exit(EXIT_FAILURE);
+    }
+
+    find_entries(cache);
+    find_loop_heads(cache);
+
+    // the runtime labels are resolved relative to the start of the cache
+    uint8_t prelude[X86_PRELUDE_MAX_SIZE];
+    cache->prelude_len = emit_x86_prelude(rt, prelude);
+    code_cache_write(cache, 0, prelude, cache->prelude_len);
+    cache->used = cache->prelude_len;
+    pc_map_place(pc_map, cache->code, capacity);
+
+    if (perf != NULL) {
+        perf_add_code(perf, "mips_jit:prelude", cache->code,
+                      cache->prelude_len);
+    }
+
+    rt->code_base = cache->code;
+    rt->compiles_on_demand = true;
+
+    return cache;
+}
+
+void block_cache_free(struct block_cache *cache) {
+    for (size_t i = 0; i < cache->blocks->len; i++) {
+        free_block(cache->blocks->data[i]);
+    }
+
+    munmap(cache->code, cache->capacity);
+    free(cache->is_entry);
+    free(cache->entry_addresses);
+    guest_map_free(&cache->entry_indices);
+    guest_map_free(&cache->head_counts);
+    block_ptr_vec_free(cache->blocks);
+    guest_map_free(&cache->block_indices);
+    block_exit_ptr_vec_free(cache->unlinked);
+    labels_vec_free(cache->stub_labels);
+    arena_free(cache->arena);
+    free(cache);
+}
+
+void block_cache_invalidate(struct block_cache *cache, struct block *block) {
+    for (size_t i = 0; i < block->incoming->len; i++) {
+        unlink_exit(cache, block->incoming->data[i]);
+    }
+
+    // the block's own exits disappear with it
+    for (uint32_t i = 0; i < block->num_exits; i++) {
+        struct block_exit *exit = &block->exits[i];
+
+        if (exit->linked_to != NULL) {
+            remove_exit_ptr(exit->linked_to->incoming, exit);
+        } else {
+            remove_exit_ptr(cache->unlinked, exit);
+        }
+    }
+
+    uint32_t index;
+    guest_map_lookup(&cache->block_indices, block->guest_address, &index);
+    guest_map_remove(&cache->block_indices, block->guest_address);
+    guest_map_remove(&cache->rt->entries, block->guest_address);
+
+    struct block *moved = cache->blocks->data[--cache->blocks->len];
+    if (moved != block) {
+        cache->blocks->data[index] = moved;
+        guest_map_insert(&cache->block_indices, moved->guest_address, index);
+    }
+
+    // inline caches may hold the block's address
+    jit_runtime_clear_ics(cache->rt);
+
+    free_block(block);
+}
+
+void block_cache_flush(struct block_cache *cache) {
+    for (size_t i = 0; i < cache->blocks->len; i++) {
+        free_block(cache->blocks->data[i]);
+    }
+
+    cache->blocks->len = 0;
+    cache->unlinked->len = 0;
+    guest_map_clear(&cache->block_indices);
+    guest_map_clear(&cache->rt->entries);
+    jit_runtime_clear_ics(cache->rt);
+
+    // traces are discarded too, so loop heads are profiled again
+    for (uint32_t i = 0; i < cache->head_counts.capacity; i++) {
+        cache->head_counts.code_positions[i] = 0;
+    }
+
+    // guest labels were resolved to positions in discarded blocks
+    struct labels_vec *labels = all_labels();
+    for (size_t i = 0; i < labels->len; i++) {
+        if (labels->data[i]->has_guest_address) {
+            labels->data[i]->code_position = -1;
+        }
+    }
+
+    cache->used = cache->prelude_len;
+    pc_map_truncate(cache->pc_map, cache->used);
+    cache->stats.flushes++;
+}
+
+static struct label *stub_label(struct block_cache *cache, size_t index) {
+    while (cache->stub_labels->len <= index) {
+        labels_vec_push(cache->stub_labels, add_internal_label());
+    }
+
+    return cache->stub_labels->data[index];
+}
+
+/**
+ * Record a jump as an exit, pointing it at the exit stub with the same index.
+ */
+static void add_exit(struct block_cache *cache, struct x86_instr *jump,
+                     uint32_t jump_position, uint32_t target,
+                     struct block_exit_ptr_vec *exits) {
+    struct block_exit *exit =
+        arena_alloc(cache->arena, sizeof(struct block_exit));
+
+    *exit = (struct block_exit){
+        .target = target,
+        // the rel32 is always the last part of the jump
+        .patch_position = jump_position + jump->size - 4};
+
+    jump->jump.label = stub_label(cache, exits->len);
+    block_exit_ptr_vec_push(exits, exit);
+}
+
+/**
+ * Abstract instructions compiled as one piece of code, either a block or a
+ * trace.
+ */
+struct code_source {
+    struct abstract_instr_vec *instrs;
+    size_t start, len;
+    struct label *loop_label; // jumps here stay inside the code, or NULL
+    uint32_t fallthrough;     // guest address after the last instruction
+};
+
+/**
+ * Compile code into x86 instructions with exit and trap stubs, but don't place
+ * it in the cache yet. The position of the code for each instruction is put in
+ * 'offsets', followed by the position of the stubs.
+ */
+static struct x86_instr_vec *realize_code(struct block_cache *cache,
+                                          struct code_source *src,
+                                          uint32_t position,
+                                          struct block_exit_ptr_vec *exits,
+                                          uint32_t *offsets) {
+    struct x86_instr_vec *instrs =
+        x86_instr_vec_new_in(cache->arena, 4 * src->len + 16);
+    uint32_t current_offset = position;
+
+    for (size_t i = 0; i < src->len; i++) {
+        struct abstract_instr instr =
+            abstract_instr_get(src->instrs, src->start + i);
+        if (instr.label != NULL) {
+            resolve_label(instr.label, current_offset);
+        }
+
+        offsets[i] = current_offset;
+        realize_abstract_instruction(&instr, cache->map, cache->rt, instrs,
+                                     &current_offset);
+    }
+    offsets[src->len] = current_offset;
+
+    // jumps to other guest labels leave the code
+    uint32_t jump_position = position;
+    for (size_t i = 0; i < instrs->len; i++) {
+        struct x86_instr *x = &instrs->data[i];
+
+        if ((x->type == JUMP || x->type == JMP || x->type == CALL) &&
+            x->jump.label->has_guest_address &&
+            x->jump.label != src->loop_label) {
+            add_exit(cache, x, jump_position, x->jump.label->guest_address,
+                     exits);
+        }
+
+        jump_position += x->size;
+    }
+
+    enum abstract_instr_type last =
+        src->instrs->types[src->start + src->len - 1];
+    if (last != ABSTRACT_INSTR_JUMP && last != ABSTRACT_INSTR_RETURN &&
+        last != ABSTRACT_INSTR_JUMP_REG) {
+        x86_instr_vec_push(instrs, construct_jmp(NULL));
+        add_exit(cache, &instrs->data[instrs->len - 1], current_offset,
+                 src->fallthrough, exits);
+        current_offset += instrs->data[instrs->len - 1].size;
+    }
+
+    for (size_t i = 0; i < exits->len; i++) {
+        resolve_label(stub_label(cache, i), current_offset);
+        exits->data[i]->stub_position = current_offset;
+
+        struct x86_instr stub[] = {
+            construct_mov_reg_imm(EAX, exits->data[i]->target),
+            construct_mov_abs_eax(&cache->rt->next_pc),
+            construct_jmp(cache->rt->exit_label)};
+
+        for (size_t j = 0; j < sizeof(stub) / sizeof(*stub); j++) {
+            x86_instr_vec_push(instrs, stub[j]);
+            current_offset += stub[j].size;
+        }
+    }
+
+    realize_trap_stubs(cache->rt, instrs, &current_offset);
+
+    return instrs;
+}
+
+static uint32_t x86_instrs_size(struct x86_instr_vec *instrs) {
+    uint32_t size = 0;
+
+    for (size_t i = 0; i < instrs->len; i++) {
+        size += instrs->data[i].size;
+    }
+
+    return size;
+}
+
+/**
+ * Whether an exit to a guest address may be linked, jumps to loop heads that
+ * are still being profiled have to keep going through the dispatcher.
+ */
+static bool may_link(struct block_cache *cache, uint32_t target) {
+    uint32_t count;
+
+    return !cache->traces ||
+           !guest_map_lookup(&cache->head_counts, target, &count) ||
+           count == TRACE_HEAD_DONE;
+}
+
+/**
+ * Link the exits waiting for a block to it.
+ */
+static void link_waiting_exits(struct block_cache *cache,
+                               struct block *block) {
+    if (!may_link(cache, block->guest_address)) {
+        return;
+    }
+
+    for (size_t i = 0; i < cache->unlinked->len;) {
+        struct block_exit *exit = cache->unlinked->data[i];
+
+        if (exit->target == block->guest_address) {
+            link_exit(cache, exit, block);
+            cache->unlinked->data[i] =
+                cache->unlinked->data[--cache->unlinked->len];
+        } else {
+            i++;
+        }
+    }
+}
+
+/**
+ * Compile code, place it in the cache as the block for a guest address, and
+ * link it with the blocks already compiled.
+ */
+static struct block *install_code(struct block_cache *cache,
+                                  uint32_t guest_address,
+                                  struct code_source *src) {
+    struct block_exit_ptr_vec *exits =
+        block_exit_ptr_vec_new_in(cache->arena, 16);
+    uint32_t *offsets =
+        arena_alloc(cache->arena, (src->len + 1) * sizeof(uint32_t));
+    struct x86_instr_vec *instrs =
+        realize_code(cache, src, cache->used, exits, offsets);
+    uint32_t size = x86_instrs_size(instrs);
+
+    if (cache->used + size > cache->capacity) {
+        // start again in an empty cache
+        exits->len = 0;
+
+        block_cache_flush(cache);
+
+        instrs = realize_code(cache, src, cache->used, exits, offsets);
+        size = x86_instrs_size(instrs);
+
+        if (cache->used + size > cache->capacity) {
+            RUNTIME_ERROR("Code for 0x%08x doesn't fit in the code cache",
+                          guest_address);
+        }
+    }
+
+    if (cache->dump_x86) {
+        printf("\n0x%08x x86 instructions:\n", guest_address);
+        for (size_t i = 0; i < instrs->len; i++) {
+            print_x86_instr(&instrs->data[i]);
+        }
+    }
+
+    uint8_t *buf = arena_alloc(cache->arena, size);
+    emit_x86_body(instrs, buf, cache->used);
+    code_cache_write(cache, cache->used, buf, size);
+    pc_map_add_instrs(cache->pc_map, src->instrs, src->start, src->len,
+                      offsets);
+
+    if (cache->perf != NULL) {
+        perf_add_instrs(cache->perf, cache->code, src->instrs, src->start,
+                        src->len, offsets, cache->used + size);
+    }
+
+    struct block *block = malloc(sizeof(struct block));
+    *block = (struct block){.guest_address = guest_address,
+                            .code_position = cache->used,
+                            .code_len = size,
+                            .exits = malloc(exits->len *
+                                            sizeof(struct block_exit)),
+                            .num_exits = exits->len,
+                            .incoming = block_exit_ptr_vec_new()};
+
+    for (size_t i = 0; i < exits->len; i++) {
+        block->exits[i] = *exits->data[i];
+    }
+
+    cache->used += size;
+
+    guest_map_insert(&cache->block_indices, guest_address, cache->blocks->len);
+    block_ptr_vec_push(cache->blocks, block);
+    guest_map_insert(&cache->rt->entries, guest_address, block->code_position);
+
+    // link the new block to compiled blocks...
+    for (uint32_t i = 0; i < block->num_exits; i++) {
+        struct block_exit *exit = &block->exits[i];
+        uint32_t index;
+
+        if (may_link(cache, exit->target) &&
+            guest_map_lookup(&cache->block_indices, exit->target, &index)) {
+            link_exit(cache, exit, cache->blocks->data[index]);
+        } else {
+            block_exit_ptr_vec_push(cache->unlinked, exit);
+        }
+    }
+
+    // ...and exits waiting for it to the new block
+    link_waiting_exits(cache, block);
+
+    return block;
+}
+
+static struct block *compile_block(struct block_cache *cache,
+                                   uint32_t guest_address, size_t start) {
+    struct abstract_instr_vec *ainstrs = cache->ainstrs;
+
+    arena_reset(cache->arena);
+
+    size_t end = start + 1;
+    while (end < ainstrs->len && !cache->is_entry[end]) {
+        end++;
+    }
+
+    // when tracing, jumps back to the start of a block are profiled like any
+    // other jump to a loop head
+    struct code_source src = {
+        .instrs = ainstrs,
+        .start = start,
+        .len = end - start,
+        .loop_label =
+            cache->traces ? NULL : abstract_instr_label(ainstrs, start),
+        .fallthrough = end < ainstrs->len ? cache->entry_addresses[end]
+                                          : GUEST_EXIT_ADDRESS};
+
+    cache->stats.blocks_compiled++;
+
+    return install_code(cache, guest_address, &src);
+}
+
+static struct block *lookup_block(struct block_cache *cache,
+                                  uint32_t guest_address) {
+    uint32_t index;
+
+    if (guest_map_lookup(&cache->block_indices, guest_address, &index)) {
+        return cache->blocks->data[index];
+    }
+
+    if (!guest_map_lookup(&cache->entry_indices, guest_address, &index)) {
+        RUNTIME_ERROR("Jump to invalid guest address 0x%08x", guest_address);
+    }
+
+    return compile_block(cache, guest_address, index);
+}
+
+/**
+ * Stop profiling a loop head, linking the jumps to it that were kept going
+ * through the dispatcher.
+ */
+static void finish_head(struct block_cache *cache, uint32_t head) {
+    guest_map_insert(&cache->head_counts, head, TRACE_HEAD_DONE);
+
+    uint32_t index;
+    if (guest_map_lookup(&cache->block_indices, head, &index)) {
+        link_waiting_exits(cache, cache->blocks->data[index]);
+    }
+}
+
+/**
+ * Record a trace from a hot loop head and use it in place of the head's
+ * block. Returns the guest address execution continues at.
+ */
+static uint32_t trace_head(struct block_cache *cache, uint32_t head,
+                           struct guest_state *state) {
+    arena_reset(cache->arena);
+
+    uint32_t next_pc;
+    struct abstract_instr_vec *trace =
+        trace_record(cache, head, state, &next_pc);
+
+    if (trace == NULL) {
+        cache->stats.traces_aborted++;
+        finish_head(cache, head);
+        return next_pc;
+    }
+
+    printf("\ntrace 0x%08x abstract instructions:\n", head);
+    struct abstract_instr instr;
+    for (size_t i = 0; abstract_instr_iter(trace, i, &instr); i++) {
+        print_abstract_instr(&instr);
+    }
+
+    // the trace replaces the head's block, so jumps to the head now reach
+    // the trace
+    uint32_t index;
+    if (guest_map_lookup(&cache->block_indices, head, &index)) {
+        block_cache_invalidate(cache, cache->blocks->data[index]);
+    }
+
+    struct code_source src = {.instrs = trace,
+                              .len = trace->len,
+                              .loop_label = abstract_instr_label(trace, 0)};
+
+    install_code(cache, head, &src);
+    cache->stats.traces_compiled++;
+    finish_head(cache, head);
+
+    return next_pc;
+}
+
+void block_cache_run(struct block_cache *cache, uint32_t *mapped_regs_store,
+                     uint32_t *unmapped_regs, struct guest_memory *mem) {
+    struct guest_state state = {.map = cache->map,
+                                .regs = mapped_regs_store,
+                                .unmapped_regs = unmapped_regs,
+                                .memory = mem->base};
+    uint32_t pc = cache->ainstrs->len > 0 ? cache->entry_addresses[0]
+                                          : GUEST_EXIT_ADDRESS;
+
+    while (pc != GUEST_EXIT_ADDRESS) {
+        uint32_t count;
+
+        if (cache->traces &&
+            guest_map_lookup(&cache->head_counts, pc, &count) &&
+            count != TRACE_HEAD_DONE) {
+            guest_map_insert(&cache->head_counts, pc, ++count);
+
+            if (count >= TRACE_HOT_THRESHOLD) {
+                pc = trace_head(cache, pc, &state);
+                continue;
+            }
+        }
+
+        struct block *block = lookup_block(cache, pc);
+
+        // a return to the exit address leaves without setting this
+        cache->rt->next_pc = GUEST_EXIT_ADDRESS;
+        cache->stats.dispatcher_entries++;
+
+        ((void (*)(uint32_t *, uint32_t *, uint8_t *, uint8_t *))cache->code)(
+            unmapped_regs, mapped_regs_store, mem->base,
+            cache->code + block->code_position);
+
+        pc = cache->rt->next_pc;
+    }
+}
+
+void block_cache_print_stats(struct block_cache_stats *stats) {
+    printf("blocks compiled: %lu\n", stats->blocks_compiled);
+    printf("traces compiled: %lu\n", stats->traces_compiled);
+    printf("traces aborted: %lu\n", stats->traces_aborted);
+    printf("links: %lu\n", stats->links);
+    printf("unlinks: %lu\n", stats->unlinks);
+    printf("flushes: %lu\n", stats->flushes);
+    printf("dispatcher entries: %lu\n", stats->dispatcher_entries);
+}
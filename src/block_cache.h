@@ -0,0 +1,152 @@
+#ifndef __BLOCK_CACHE_H_
+#define __BLOCK_CACHE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "abstract_instr.h"
+#include "arena.h"
+#include "guest_memory.h"
+#include "label.h"
+#include "pc_map.h"
+#include "perf.h"
+#include "runtime.h"
+#include "vec.h"
+
+/**
+ * Block at a time compilation
+ *
+ * Instead of compiling the whole program up front, each block is compiled the
+ * first time it's reached, into a code cache. A block starts at a guest label,
+ * the start of the program, or the return address of a call, and runs up to
+ * the next place a block starts.
+ *
+ * A jump out of a block first goes through an exit stub back to the dispatcher
+ * loop in `block_cache_run`, once its target is compiled the jump itself is
+ * patched to go straight there (the jump is 'linked'). Blocks record the
+ * exits linked to them so they can be unlinked again if the block is
+ * invalidated. Every block shares the whole program register mapping, so
+ * nothing needs to be saved or restored between blocks.
+ */
+
+// default size of the code cache, the whole cache is flushed when it is full
+#define BLOCK_CACHE_DEFAULT_SIZE (1u << 20)
+
+// number of times a loop head is reached through the dispatcher before a
+// trace is recorded from it
+#define TRACE_HOT_THRESHOLD 50
+
+// loop head count for heads that have been traced, or failed to trace
+#define TRACE_HEAD_DONE UINT32_MAX
+
+struct block;
+
+/**
+ * A jump leaving a block for another one.
+ */
+struct block_exit {
+    uint32_t target;         // guest address jumped to
+    uint32_t patch_position; // position of the jump's rel32
+    uint32_t stub_position;  // position of the exit stub
+    struct block *linked_to; // NULL if the jump goes through the stub
+};
+
+DEFINE_VEC(struct block_exit *, block_exit_ptr);
+
+struct block {
+    uint32_t guest_address;
+    uint32_t code_position;
+    uint32_t code_len;
+
+    struct block_exit *exits;
+    uint32_t num_exits;
+
+    // exits of other blocks linked to this one
+    struct block_exit_ptr_vec *incoming;
+};
+
+DEFINE_VEC(struct block *, block_ptr);
+
+struct block_cache_stats {
+    uint64_t blocks_compiled;
+    uint64_t traces_compiled;
+    uint64_t traces_aborted;
+    uint64_t links;
+    uint64_t unlinks;
+    uint64_t flushes;
+    uint64_t dispatcher_entries; // times generated code was entered
+};
+
+struct block_cache {
+    uint8_t *code;
+    uint32_t capacity;
+    uint32_t prelude_len; // the prologue, epilogue and dispatch stubs
+    uint32_t used;
+
+    struct jit_runtime *rt;
+    struct abstract_instr_vec *ainstrs;
+    struct mips_x86_reg_mapping *map;
+    bool traces;   // if hot loops are traced
+    bool dump_x86; // if the x86 of each block is printed as it's compiled
+
+    // for each abstract instruction: whether a block starts there and the
+    // guest address of that block
+    bool *is_entry;
+    uint32_t *entry_addresses;
+    struct guest_map entry_indices; // guest address -> abstract instruction
+
+    // loop head guest address -> times reached, or TRACE_HEAD_DONE
+    struct guest_map head_counts;
+
+    struct block_ptr_vec *blocks;
+    struct guest_map block_indices; // guest address -> index into blocks
+
+    struct block_exit_ptr_vec *unlinked; // exits not linked to a block yet
+    struct labels_vec *stub_labels;      // reused for each block's exit stubs
+
+    // what compiling a block or trace makes along the way, reset before each
+    struct arena *arena;
+
+    struct perf_output *perf; // told about the code compiled, or NULL
+    struct pc_map *pc_map;    // where the code for each instruction is
+
+    struct block_cache_stats stats;
+};
+
+/**
+ * Create a code cache for a program, if `traces` is set hot loops are traced
+ * (see `trace.h`), and if `dump_x86` is set the x86 instructions of each block
+ * are printed when it's compiled. The code compiled is recorded in `pc_map`,
+ * and in `perf` unless it's NULL.
+ */
+struct block_cache *block_cache_new(struct abstract_instr_vec *ainstrs,
+                                    struct mips_x86_reg_mapping *map,
+                                    struct jit_runtime *rt, uint32_t capacity,
+                                    bool traces, bool dump_x86,
+                                    struct perf_output *perf,
+                                    struct pc_map *pc_map);
+
+void block_cache_free(struct block_cache *cache);
+
+/**
+ * Unlink every exit jumping to a block and forget the block, it will be
+ * compiled again the next time it's reached. This must only happen outside of
+ * generated code.
+ */
+void block_cache_invalidate(struct block_cache *cache, struct block *block);
+
+/**
+ * Discard every compiled block.
+ */
+void block_cache_flush(struct block_cache *cache);
+
+/**
+ * Run the program from its first instruction, compiling blocks as they are
+ * reached.
+ */
+void block_cache_run(struct block_cache *cache, uint32_t *mapped_regs_store,
+                     uint32_t *unmapped_regs, struct guest_memory *mem);
+
+void block_cache_print_stats(struct block_cache_stats *stats);
+
+#endif // __BLOCK_CACHE_H_
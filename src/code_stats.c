@@ -0,0 +1,381 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "abstract_instr.h"
+#include "code_stats.h"
+#include "x86_instr.h"
+#include "x86_reg.h"
+
+MAKE_VEC(struct loop_code_stats, loop_code_stats);
+
+enum code_stats_metric {
+    METRIC_MIPS_INSTRS,
+    METRIC_ABSTRACT_INSTRS,
+    METRIC_X86_INSTRS,
+    METRIC_BYTES,
+    METRIC_BYTES_PER_MIPS,
+    METRIC_X86_PER_ABSTRACT,
+    METRIC_SPILL_LOADS,
+    METRIC_SPILL_STORES,
+    METRIC_WEIGHTED_SPILL_LOADS,
+    METRIC_WEIGHTED_SPILL_STORES,
+    METRIC_SCRATCH_MOVES,
+    METRIC_JUMPS, // one for each `code_stats_jump`
+    METRIC_REL8_FITS = METRIC_JUMPS + NUM_CODE_STATS_JUMPS,
+    NUM_METRICS
+};
+
+static const char *const metric_names[] = {
+    [METRIC_MIPS_INSTRS] = "mips_instrs",
+    [METRIC_ABSTRACT_INSTRS] = "abstract_instrs",
+    [METRIC_X86_INSTRS] = "x86_instrs",
+    [METRIC_BYTES] = "bytes",
+    [METRIC_BYTES_PER_MIPS] = "bytes_per_mips",
+    [METRIC_X86_PER_ABSTRACT] = "x86_per_abstract",
+    [METRIC_SPILL_LOADS] = "spill_loads",
+    [METRIC_SPILL_STORES] = "spill_stores",
+    [METRIC_WEIGHTED_SPILL_LOADS] = "weighted_spill_loads",
+    [METRIC_WEIGHTED_SPILL_STORES] = "weighted_spill_stores",
+    [METRIC_SCRATCH_MOVES] = "scratch_moves",
+    [METRIC_JUMPS + CODE_STATS_JCC_REL32] = "jcc_rel32",
+    [METRIC_JUMPS + CODE_STATS_JMP_REL32] = "jmp_rel32",
+    [METRIC_JUMPS + CODE_STATS_CALL_REL32] = "call_rel32",
+    [METRIC_JUMPS + CODE_STATS_RET] = "ret",
+    [METRIC_JUMPS + CODE_STATS_IC_JUMP] = "ic_jump",
+    [METRIC_REL8_FITS] = "rel8_fits"};
+
+/**
+ * LOOP_DEPTH_WEIGHT to the power of 'depth', kept from overflowing.
+ */
+static uint64_t depth_weight(uint32_t depth) {
+    uint64_t weight = 1;
+
+    for (uint32_t d = 0; d < depth && d < 18; d++) {
+        weight *= LOOP_DEPTH_WEIGHT;
+    }
+
+    return weight;
+}
+
+static bool is_scratch_reg(enum x86_reg_type reg, bool ecx_scratch) {
+    return reg == EAX || (reg == ECX && ecx_scratch);
+}
+
+static bool is_scratch_move(struct x86_instr *i, bool ecx_scratch) {
+    switch (i->type) {
+    case MOV_REG_REG:
+        return is_scratch_reg(i->reg_reg.dest, ecx_scratch) ||
+               is_scratch_reg(i->reg_reg.src, ecx_scratch);
+    case MOV_REG_STACK:
+        return is_scratch_reg(i->reg_stack.dest, ecx_scratch);
+    case MOV_STACK_REG:
+        return is_scratch_reg(i->stack_reg.src, ecx_scratch);
+    case MOVD_REG_XMM:
+    case MOVD_XMM_REG:
+        return is_scratch_reg(i->reg_xmm.reg, ecx_scratch);
+    default:
+        return false;
+    }
+}
+
+/**
+ * Test if the rel32 jump 'i' at 'position' would reach its label with a rel8
+ * measured from the same place, it can't if the label isn't resolved.
+ */
+static bool rel8_fits(struct x86_instr *i, uint32_t position) {
+    if (i->jump.label == NULL || i->jump.label->code_position < 0) {
+        return false;
+    }
+
+    int64_t rel =
+        (int64_t)i->jump.label->code_position - (position + i->size);
+
+    return rel >= INT8_MIN && rel <= INT8_MAX;
+}
+
+static void count_x86_instr(struct code_stats *stats, struct x86_instr *i,
+                            uint32_t position, uint64_t weight,
+                            bool ecx_scratch) {
+    stats->x86_instrs++;
+    stats->bytes += i->size;
+
+    switch (i->type) {
+    case MOV_REG_STACK:
+        stats->spill_loads++;
+        stats->weighted_spill_loads += weight;
+        break;
+    case MOV_STACK_REG:
+        stats->spill_stores++;
+        stats->weighted_spill_stores += weight;
+        break;
+    case JUMP:
+        stats->jumps[CODE_STATS_JCC_REL32]++;
+        stats->rel8_fits += rel8_fits(i, position);
+        break;
+    case JMP:
+        stats->jumps[CODE_STATS_JMP_REL32]++;
+        stats->rel8_fits += rel8_fits(i, position);
+        break;
+    case CALL:
+        stats->jumps[CODE_STATS_CALL_REL32]++;
+        break;
+    case RET:
+        stats->jumps[CODE_STATS_RET]++;
+        break;
+    case IC_JUMP:
+        stats->jumps[CODE_STATS_IC_JUMP]++;
+        break;
+    default:
+        break;
+    }
+
+    stats->scratch_moves += is_scratch_move(i, ecx_scratch);
+}
+
+/**
+ * Find the loops in 'ainstrs', outer loops first, and set how deeply each
+ * instruction is nested in them.
+ */
+static struct loop_code_stats_vec *
+find_loops(struct abstract_instr_vec *ainstrs, uint32_t *depths) {
+    struct loop_code_stats_vec *loops = loop_code_stats_vec_new();
+    struct label_refs refs = find_label_refs(ainstrs);
+    int32_t *depth_changes = calloc(ainstrs->len + 1, sizeof(int32_t));
+
+    for (size_t start = abstract_instrs_next_labelled(ainstrs, 0);
+         start < ainstrs->len;
+         start = abstract_instrs_next_labelled(ainstrs, start + 1)) {
+        struct label *head = abstract_instr_label(ainstrs, start);
+
+        if (refs.first_ref[head->id] == SIZE_MAX ||
+            refs.last_ref[head->id] < start) {
+            continue;
+        }
+
+        struct loop_code_stats loop = {.start = start,
+                                       .end = refs.last_ref[head->id]};
+
+        if (head->name.len > 0) {
+            snprintf(loop.name, sizeof(loop.name), "%.*s",
+                     (int)head->name.len, head->name.s);
+        } else {
+            snprintf(loop.name, sizeof(loop.name), "@%u",
+                     ainstrs->guest_addresses[start]);
+        }
+
+        loop_code_stats_vec_push(loops, loop);
+        depth_changes[loop.start]++;
+        depth_changes[loop.end + 1]--;
+    }
+
+    int32_t depth = 0;
+    for (size_t i = 0; i < ainstrs->len; i++) {
+        depth += depth_changes[i];
+        depths[i] = depth;
+    }
+
+    for (size_t l = 0; l < loops->len; l++) {
+        loops->data[l].depth = depths[loops->data[l].start];
+    }
+
+    free(depth_changes);
+    free_label_refs(&refs);
+
+    return loops;
+}
+
+/**
+ * Tell apart loops with the same name by the order they're in.
+ */
+static void number_loop_names(struct loop_code_stats_vec *loops) {
+    for (size_t l = 0; l < loops->len; l++) {
+        uint32_t same = 0;
+
+        for (size_t k = 0; k < l; k++) {
+            same += !strcmp(loops->data[k].name, loops->data[l].name);
+        }
+
+        if (same > 0) {
+            size_t len = strlen(loops->data[l].name);
+            snprintf(&loops->data[l].name[len],
+                     sizeof(loops->data[l].name) - len, ".%u", same + 1);
+        }
+    }
+}
+
+/**
+ * The number of MIPS instructions abstract instructions 'start' to 'end' came
+ * from, each counted once however many copies unrolling made. 'seen' is
+ * stamped with 'stamp' for each.
+ */
+static uint32_t count_mips_instrs(struct abstract_instr_vec *ainstrs,
+                                  size_t start, size_t end,
+                                  size_t num_mips_instrs, uint32_t *seen,
+                                  uint32_t stamp) {
+    uint32_t count = 0;
+
+    for (size_t i = start; i <= end; i++) {
+        size_t index = ainstrs->guest_addresses[i] / 4;
+
+        if (index < num_mips_instrs && seen[index] != stamp) {
+            seen[index] = stamp;
+            count++;
+        }
+    }
+
+    return count;
+}
+
+struct program_code_stats
+collect_code_stats(struct abstract_instr_vec *ainstrs,
+                   struct x86_instr_vec *x86_instrs, size_t *starts,
+                   struct mips_x86_reg_mapping *map, size_t num_mips_instrs) {
+    uint32_t *depths = calloc(ainstrs->len, sizeof(uint32_t));
+    uint32_t *positions = malloc((x86_instrs->len + 1) * sizeof(uint32_t));
+    uint32_t *seen = calloc(num_mips_instrs, sizeof(uint32_t));
+    bool ecx_scratch =
+        linear_free_x86_reg_inverse_map[ECX] >= map->num_x86_regs;
+
+    struct program_code_stats stats = {
+        .total = {.mips_instrs = num_mips_instrs,
+                  .abstract_instrs = ainstrs->len},
+        .loops = find_loops(ainstrs, depths)};
+
+    positions[0] = 0;
+    for (size_t x = 0; x < x86_instrs->len; x++) {
+        positions[x + 1] = positions[x] + x86_instrs->data[x].size;
+    }
+
+    // the whole program, with the out of line stubs after the last
+    // instruction counting as outside any loop
+    for (size_t i = 0; i <= ainstrs->len; i++) {
+        size_t end = i < ainstrs->len ? starts[i + 1] : x86_instrs->len;
+        uint64_t weight = depth_weight(i < ainstrs->len ? depths[i] : 0);
+
+        for (size_t x = starts[i]; x < end; x++) {
+            count_x86_instr(&stats.total, &x86_instrs->data[x], positions[x],
+                            weight, ecx_scratch);
+        }
+    }
+
+    for (size_t l = 0; l < stats.loops->len; l++) {
+        struct loop_code_stats *loop = &stats.loops->data[l];
+
+        loop->stats = (struct code_stats){
+            .mips_instrs = count_mips_instrs(ainstrs, loop->start, loop->end,
+                                             num_mips_instrs, seen, l + 1),
+            .abstract_instrs = loop->end - loop->start + 1};
+
+        for (size_t i = loop->start; i <= loop->end; i++) {
+            for (size_t x = starts[i]; x < starts[i + 1]; x++) {
+                count_x86_instr(&loop->stats, &x86_instrs->data[x],
+                                positions[x], depth_weight(depths[i]),
+                                ecx_scratch);
+            }
+        }
+    }
+
+    number_loop_names(stats.loops);
+
+    free(seen);
+    free(positions);
+    free(depths);
+
+    return stats;
+}
+
+void free_code_stats(struct program_code_stats *stats) {
+    loop_code_stats_vec_free(stats->loops);
+}
+
+static double ratio(uint32_t a, uint32_t b) {
+    return b == 0 ? 0 : a / (double)b;
+}
+
+/**
+ * Round 'x' (not negative) to a few places, so it compares the same when read
+ * back from a baseline file.
+ */
+static double round_metric(double x) {
+    return (uint64_t)(x * 1000 + 0.5) / 1000.0;
+}
+
+static void code_stats_metrics(struct code_stats *stats,
+                               double metrics[NUM_METRICS]) {
+    metrics[METRIC_MIPS_INSTRS] = stats->mips_instrs;
+    metrics[METRIC_ABSTRACT_INSTRS] = stats->abstract_instrs;
+    metrics[METRIC_X86_INSTRS] = stats->x86_instrs;
+    metrics[METRIC_BYTES] = stats->bytes;
+    metrics[METRIC_BYTES_PER_MIPS] =
+        round_metric(ratio(stats->bytes, stats->mips_instrs));
+    metrics[METRIC_X86_PER_ABSTRACT] =
+        round_metric(ratio(stats->x86_instrs, stats->abstract_instrs));
+    metrics[METRIC_SPILL_LOADS] = stats->spill_loads;
+    metrics[METRIC_SPILL_STORES] = stats->spill_stores;
+    metrics[METRIC_WEIGHTED_SPILL_LOADS] = stats->weighted_spill_loads;
+    metrics[METRIC_WEIGHTED_SPILL_STORES] = stats->weighted_spill_stores;
+    metrics[METRIC_SCRATCH_MOVES] = stats->scratch_moves;
+    for (int j = 0; j < NUM_CODE_STATS_JUMPS; j++) {
+        metrics[METRIC_JUMPS + j] = stats->jumps[j];
+    }
+    metrics[METRIC_REL8_FITS] = stats->rel8_fits;
+}
+
+static void print_stats(struct code_stats *stats) {
+    printf("  %u mips, %u abstract, %u x86 instructions, %u bytes\n",
+           stats->mips_instrs, stats->abstract_instrs, stats->x86_instrs,
+           stats->bytes);
+    printf("  %.2f bytes per mips instruction, %.2f x86 instructions per "
+           "abstract instruction\n",
+           ratio(stats->bytes, stats->mips_instrs),
+           ratio(stats->x86_instrs, stats->abstract_instrs));
+    printf("  spill loads: %u (weighted %" PRIu64 "), spill stores: %u "
+           "(weighted %" PRIu64 ")\n",
+           stats->spill_loads, stats->weighted_spill_loads,
+           stats->spill_stores, stats->weighted_spill_stores);
+    printf("  scratch register moves: %u\n", stats->scratch_moves);
+    printf("  jumps: %u jcc rel32, %u jmp rel32, %u call rel32, %u ret, %u "
+           "inline cache, %u rel32 would fit a rel8\n",
+           stats->jumps[CODE_STATS_JCC_REL32],
+           stats->jumps[CODE_STATS_JMP_REL32],
+           stats->jumps[CODE_STATS_CALL_REL32], stats->jumps[CODE_STATS_RET],
+           stats->jumps[CODE_STATS_IC_JUMP], stats->rel8_fits);
+}
+
+void print_code_stats(struct program_code_stats *stats) {
+    printf("program:\n");
+    print_stats(&stats->total);
+
+    for (size_t l = 0; l < stats->loops->len; l++) {
+        struct loop_code_stats *loop = &stats->loops->data[l];
+
+        printf("loop %s (depth %u, abstract instructions %zu to %zu):\n",
+               loop->name, loop->depth, loop->start, loop->end);
+        print_stats(&loop->stats);
+    }
+}
+
+static void write_stats(struct code_stats *stats, const char *program,
+                        const char *scope, const char *name, FILE *out) {
+    double metrics[NUM_METRICS];
+    code_stats_metrics(stats, metrics);
+
+    for (int m = 0; m < NUM_METRICS; m++) {
+        fprintf(out, "%s %s%s %s %.15g\n", program, scope, name,
+                metric_names[m], metrics[m]);
+    }
+}
+
+void write_code_stats(struct program_code_stats *stats, const char *program,
+                      FILE *out) {
+    write_stats(&stats->total, program, "program", "", out);
+
+    for (size_t l = 0; l < stats->loops->len; l++) {
+        write_stats(&stats->loops->data[l].stats, program, "loop:",
+                    stats->loops->data[l].name, out);
+    }
+}
@@ -0,0 +1,97 @@
+#ifndef __CODE_STATS_H_
+#define __CODE_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "abstract_instr.h"
+#include "vec.h"
+#include "x86_instr.h"
+
+/**
+ * Generated code quality
+ *
+ * Counts of what the x86 code realized for a program looks like, for the
+ * whole program and for each loop, to tell whether a change to the compiler
+ * made the code it generates better or worse.
+ *
+ * Spills are weighted by how deeply they're nested in loops, each level
+ * counting LOOP_DEPTH_WEIGHT times more, as a spill in an inner loop runs far
+ * more often than one outside. A loop is a label with a branch or jump back
+ * to it, and spans the instructions from the label to the last one back.
+ *
+ * Every metric is better when lower, except the number of MIPS instructions,
+ * which only says how big the program or loop is. Baseline files have one
+ * metric on each line:
+ *
+ *     <program> <scope> <metric> <value>
+ *
+ * where the scope is `program` or `loop:` followed by the name of the loop
+ * head's label, or `@` and the guest address of the head if it has no name,
+ * with `.N` after for the Nth loop of the same name.
+ */
+
+#define LOOP_DEPTH_WEIGHT 10
+
+enum code_stats_jump {
+    CODE_STATS_JCC_REL32,
+    CODE_STATS_JMP_REL32,
+    CODE_STATS_CALL_REL32,
+    CODE_STATS_RET,
+    CODE_STATS_IC_JUMP,
+    NUM_CODE_STATS_JUMPS
+};
+
+struct code_stats {
+    uint32_t mips_instrs;
+    uint32_t abstract_instrs;
+    uint32_t x86_instrs;
+    uint32_t bytes;
+    uint32_t spill_loads;  // MOV_REG_STACK
+    uint32_t spill_stores; // MOV_STACK_REG
+    uint64_t weighted_spill_loads;
+    uint64_t weighted_spill_stores;
+    uint32_t scratch_moves; // to or from eax, or ecx if it isn't allocated
+    uint32_t jumps[NUM_CODE_STATS_JUMPS];
+    uint32_t rel8_fits; // rel32 jumps that would fit in a rel8
+};
+
+struct loop_code_stats {
+    size_t start, end; // abstract instructions
+    uint32_t depth;    // 1 for a loop not in another loop
+    char name[48];
+    struct code_stats stats;
+};
+
+DEFINE_VEC(struct loop_code_stats, loop_code_stats);
+
+struct program_code_stats {
+    struct code_stats total;
+    struct loop_code_stats_vec *loops;
+};
+
+/**
+ * Collect stats on 'x86_instrs', realized from 'ainstrs' and encoded so every
+ * label they jump to is resolved. The x86 instructions of abstract instruction
+ * 'i' start at 'starts[i]', and 'starts[ainstrs->len]' is where the rest of
+ * the code (out of line stubs) starts. 'num_mips_instrs' is the size of the
+ * parsed program.
+ */
+struct program_code_stats
+collect_code_stats(struct abstract_instr_vec *ainstrs,
+                   struct x86_instr_vec *x86_instrs, size_t *starts,
+                   struct mips_x86_reg_mapping *map, size_t num_mips_instrs);
+
+void free_code_stats(struct program_code_stats *stats);
+
+void print_code_stats(struct program_code_stats *stats);
+
+/**
+ * Write the stats as a baseline file, with 'program' naming the program on
+ * each line.
+ */
+void write_code_stats(struct program_code_stats *stats, const char *program,
+                      FILE *out);
+
+#endif // __CODE_STATS_H_
@@ -0,0 +1,365 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "abstract_instr.h"
+#include "common.h"
+#include "cse.h"
+#include "mips_reg.h"
+#include "ssa.h"
+
+enum __attribute__((__packed__)) expr_type {
+    EXPR_NONE,
+    EXPR_BINOP,
+    EXPR_SHIFT_LEFT,
+    EXPR_SHIFT_RIGHT
+};
+
+enum __attribute__((__packed__)) operand_type { OPERAND_VALUE, OPERAND_IMM };
+
+// an operand by value number, or a constant
+struct operand {
+    enum operand_type type;
+    uint32_t n;
+};
+
+// a value worked out from other values and constants, shifts keep their
+// amount in rhs
+struct expr {
+    enum expr_type type;
+    enum abstract_instr_binop_op op; // only for binops
+    struct operand lhs, rhs;
+};
+
+struct table_entry {
+    struct expr expr;
+    uint32_t value;  // the first value computing it
+    uint32_t next;   // in the same bucket, TABLE_END for the last
+    uint32_t bucket; // so the entry can be unlinked again
+};
+
+#define TABLE_END UINT32_MAX
+
+DEFINE_VEC(struct table_entry, table_entry);
+MAKE_VEC(struct table_entry, table_entry);
+
+/**
+ * Expressions computed in the blocks dominating the one being looked at.
+ * Entries are only ever removed newest first, when the walk of the dominator
+ * tree leaves the block that added them.
+ */
+struct expr_table {
+    uint32_t *buckets; // newest entry first
+    uint32_t mask;
+    struct table_entry_vec *entries;
+};
+
+static struct expr_table expr_table_new(size_t min_buckets) {
+    uint32_t capacity = 16;
+    while (capacity < min_buckets) {
+        capacity <<= 1;
+    }
+
+    struct expr_table table = {.buckets = malloc(capacity * sizeof(uint32_t)),
+                               .mask = capacity - 1,
+                               .entries = table_entry_vec_new()};
+    memset(table.buckets, 0xff, capacity * sizeof(uint32_t));
+
+    return table;
+}
+
+static void expr_table_free(struct expr_table *table) {
+    free(table->buckets);
+    table_entry_vec_free(table->entries);
+}
+
+static uint32_t expr_hash(struct expr *e) {
+    uint32_t h = e->type * 31u + e->op;
+    h = h * 0x9e3779b1u + ((uint32_t)e->lhs.type << 31 ^ e->lhs.n);
+    h = h * 0x9e3779b1u + ((uint32_t)e->rhs.type << 31 ^ e->rhs.n);
+
+    return h ^ h >> 15;
+}
+
+static bool expr_equal(struct expr *a, struct expr *b) {
+    return a->type == b->type && a->op == b->op &&
+           a->lhs.type == b->lhs.type && a->lhs.n == b->lhs.n &&
+           a->rhs.type == b->rhs.type && a->rhs.n == b->rhs.n;
+}
+
+/**
+ * Find the value first computing 'e', returns SSA_NO_VALUE if there isn't one.
+ */
+static uint32_t expr_table_lookup(struct expr_table *table, struct expr *e) {
+    for (uint32_t idx = table->buckets[expr_hash(e) & table->mask];
+         idx != TABLE_END; idx = table->entries->data[idx].next) {
+        if (expr_equal(&table->entries->data[idx].expr, e)) {
+            return table->entries->data[idx].value;
+        }
+    }
+
+    return SSA_NO_VALUE;
+}
+
+static void expr_table_insert(struct expr_table *table, struct expr *e,
+                              uint32_t value) {
+    uint32_t bucket = expr_hash(e) & table->mask;
+
+    table_entry_vec_push(table->entries,
+                         (struct table_entry){.expr = *e,
+                                              .value = value,
+                                              .next = table->buckets[bucket],
+                                              .bucket = bucket});
+    table->buckets[bucket] = table->entries->len - 1;
+}
+
+/**
+ * Remove entries, newest first, until only 'len' are left.
+ */
+static void expr_table_truncate(struct expr_table *table, size_t len) {
+    while (table->entries->len > len) {
+        struct table_entry *entry =
+            &table->entries->data[--table->entries->len];
+        table->buckets[entry->bucket] = entry->next;
+    }
+}
+
+static bool is_commutative(enum abstract_instr_binop_op op) {
+    switch (op) {
+    case ABSTRACT_INSTR_BINOP_ADD:
+    case ABSTRACT_INSTR_BINOP_ADD_TRAP:
+    case ABSTRACT_INSTR_BINOP_AND:
+    case ABSTRACT_INSTR_BINOP_MUL:
+        return true;
+    case ABSTRACT_INSTR_BINOP_SCALED_ADD:
+        return false;
+    }
+
+    RUNTIME_ERROR("Invalid binop %d", op);
+}
+
+/**
+ * The canonical order of operands: values by number, then constants.
+ */
+static bool operand_before(struct operand a, struct operand b) {
+    if (a.type != b.type) {
+        return a.type == OPERAND_VALUE;
+    }
+
+    return a.n < b.n;
+}
+
+static uint32_t reg_number(enum reg_type reg, uint32_t *values,
+                           uint32_t *numbers) {
+    return values[reg] == SSA_NO_VALUE ? SSA_NO_VALUE : numbers[values[reg]];
+}
+
+static struct operand storage_operand(struct abstract_storage s,
+                                      uint32_t *values, uint32_t *numbers) {
+    if (s.type == ABSTRACT_STORAGE_IMM) {
+        return (struct operand){.type = OPERAND_IMM, .n = s.imm};
+    }
+
+    return (struct operand){.type = OPERAND_VALUE,
+                            .n = reg_number(s.reg, values, numbers)};
+}
+
+/**
+ * The value 'i' computes, given the value of each register before it, if it's
+ * a binop or shift with a register operand. The type is EXPR_NONE for
+ * anything else.
+ */
+static struct expr instr_expr(struct abstract_instr *i, uint32_t *values,
+                              uint32_t *numbers) {
+    struct expr e = {.type = EXPR_NONE};
+
+    switch (i->type) {
+    case ABSTRACT_INSTR_BINOP:
+        // constants are left to the known bits pass
+        if (i->binop.lhs.type == ABSTRACT_STORAGE_IMM &&
+            i->binop.rhs.type == ABSTRACT_STORAGE_IMM) {
+            break;
+        }
+
+        e = (struct expr){
+            .type = EXPR_BINOP,
+            .op = i->binop.op,
+            .lhs = storage_operand(i->binop.lhs, values, numbers),
+            .rhs = storage_operand(i->binop.rhs, values, numbers)};
+
+        if (is_commutative(e.op) && operand_before(e.rhs, e.lhs)) {
+            struct operand tmp = e.lhs;
+            e.lhs = e.rhs;
+            e.rhs = tmp;
+        }
+        break;
+    case ABSTRACT_INSTR_SHIFT:
+        e = (struct expr){
+            .type = i->shift.direction == ABSTRACT_INSTR_SHIFT_LEFT
+                        ? EXPR_SHIFT_LEFT
+                        : EXPR_SHIFT_RIGHT,
+            .lhs = {.type = OPERAND_VALUE,
+                    .n = reg_number(i->shift.lhs, values, numbers)},
+            .rhs = {.type = OPERAND_IMM, .n = i->shift.rhs}};
+        break;
+    default:
+        break;
+    }
+
+    // a register with no value is never read by a reached instruction, but if
+    // it were nothing could be known about it
+    if (e.type != EXPR_NONE &&
+        ((e.lhs.type == OPERAND_VALUE && e.lhs.n == SSA_NO_VALUE) ||
+         (e.rhs.type == OPERAND_VALUE && e.rhs.n == SSA_NO_VALUE))) {
+        e.type = EXPR_NONE;
+    }
+
+    return e;
+}
+
+/**
+ * Find a register holding a value numbered 'number', preferring 'dest'.
+ * Returns REG_ZERO if there isn't one.
+ */
+static enum reg_type find_holder(uint32_t *values, uint32_t *numbers,
+                                 uint32_t number, enum reg_type dest) {
+    if (reg_number(dest, values, numbers) == number) {
+        return dest;
+    }
+
+    for (enum reg_type r = SMALLEST_MIPS_REG; r <= LARGEST_MIPS_REG; r++) {
+        if (r != REG_ZERO && reg_number(r, values, numbers) == number) {
+            return r;
+        }
+    }
+
+    return REG_ZERO;
+}
+
+/**
+ * Number the values 'instrs[i]' writes, replacing it if what it computes is
+ * already held in a register. Returns true if it was replaced.
+ */
+static bool number_instr(struct abstract_instr_vec *instrs, size_t i,
+                         struct ssa_form *ssa, struct expr_table *table,
+                         uint32_t *values, uint32_t *numbers, bool *removed) {
+    struct abstract_instr instr = abstract_instr_get(instrs, i);
+    struct expr e = instr_expr(&instr, values, numbers);
+
+    // a copy has the number of its source
+    if (instr.type == ABSTRACT_INSTR_MOV &&
+        instr.mov.source.type == ABSTRACT_STORAGE_REG &&
+        values[instr.mov.source.reg] != SSA_NO_VALUE) {
+        numbers[ssa->defs[i][0]] = numbers[values[instr.mov.source.reg]];
+        return false;
+    }
+
+    if (e.type == EXPR_NONE) {
+        return false;
+    }
+
+    enum reg_type dest = instr.type == ABSTRACT_INSTR_BINOP
+                             ? instr.binop.dest
+                             : instr.shift.dest;
+    uint32_t value = ssa->defs[i][0];
+    uint32_t found = expr_table_lookup(table, &e);
+
+    if (found == SSA_NO_VALUE) {
+        expr_table_insert(table, &e, value);
+
+        // an add that traps gives the same value as one that doesn't when
+        // it's done, but not the other way around
+        if (e.type == EXPR_BINOP && e.op == ABSTRACT_INSTR_BINOP_ADD_TRAP) {
+            e.op = ABSTRACT_INSTR_BINOP_ADD;
+            if (expr_table_lookup(table, &e) == SSA_NO_VALUE) {
+                expr_table_insert(table, &e, value);
+            }
+        }
+        return false;
+    }
+
+    numbers[value] = numbers[found];
+
+    enum reg_type holder = find_holder(values, numbers, numbers[found], dest);
+
+    if (holder == REG_ZERO || dest == REG_ZERO) {
+        return false;
+    }
+
+    if (holder == dest) {
+        if (!abstract_instr_is_removable(instrs, i)) {
+            return false;
+        }
+
+        DEBUG_LOG("%s already holds its value at %zu", reg_type_names[dest],
+                  i);
+        removed[i] = true;
+        return true;
+    }
+
+    DEBUG_LOG("%s holds the value of %s at %zu", reg_type_names[holder],
+              reg_type_names[dest], i);
+    instr = (struct abstract_instr){
+        .type = ABSTRACT_INSTR_MOV,
+        .label = instr.label,
+        .guest_address = instr.guest_address,
+        .mov = {.dest = dest,
+                .source = {.type = ABSTRACT_STORAGE_REG, .reg = holder}}};
+    abstract_instr_set(instrs, i, &instr);
+
+    return true;
+}
+
+uint64_t eliminate_common_subexprs(struct abstract_instr_vec *instrs) {
+    struct ssa_form ssa = build_ssa(instrs);
+    struct expr_table table = expr_table_new(2 * instrs->len);
+    bool *removed = calloc(instrs->len, sizeof(bool));
+    uint64_t eliminated = 0;
+
+    // every value starts out numbered by itself
+    uint32_t *numbers = malloc(ssa.values->len * sizeof(uint32_t));
+    for (uint32_t v = 0; v < ssa.values->len; v++) {
+        numbers[v] = v;
+    }
+
+    // the blocks on the path down the dominator tree to the current one, and
+    // how many table entries there were before each
+    uint32_t *path = malloc(ssa.num_blocks * sizeof(uint32_t));
+    size_t *path_marks = malloc(ssa.num_blocks * sizeof(size_t));
+    uint32_t depth = 0;
+
+    for (uint32_t d = 0; d < ssa.num_dom_order; d++) {
+        uint32_t b = ssa.dom_order[d];
+        struct ssa_block *block = &ssa.blocks[b];
+        uint32_t values[LARGEST_MIPS_REG + 1];
+
+        // forget what was computed in blocks that don't dominate this one
+        while (depth > 0 && path[depth - 1] != block->idom) {
+            expr_table_truncate(&table, path_marks[--depth]);
+        }
+        path[depth] = b;
+        path_marks[depth++] = table.entries->len;
+
+        memcpy(values, block->in, sizeof(values));
+
+        for (size_t i = block->start; i < block->end; i++) {
+            if (number_instr(instrs, i, &ssa, &table, values, numbers,
+                             removed)) {
+                eliminated++;
+            }
+            ssa_step(&ssa, instrs, i, values);
+        }
+    }
+
+    remove_marked_abstract_instrs(instrs, removed);
+
+    free(path);
+    free(path_marks);
+    free(numbers);
+    free(removed);
+    expr_table_free(&table);
+    free_ssa(&ssa);
+
+    return eliminated;
+}
@@ -0,0 +1,39 @@
+#ifndef __CSE_H_
+#define __CSE_H_
+
+#include <stdint.h>
+
+#include "abstract_instr.h"
+
+/**
+ * Common subexpression elimination
+ *
+ * Value numbering over the SSA form: every add, and, multiply or shift of
+ * registers and constants is looked up by the numbers of its operands' values
+ * in a table of those computed in the blocks dominating it. Found, its value
+ * gets the same number as the one already computed, otherwise it's added. A
+ * copy has the number of its source. The dominator tree is walked depth first,
+ * dropping a block's entries on leaving it, so a value computed before an `if`
+ * is still known after it, and one computed in a loop is only known inside it.
+ *
+ *       add $t0 $s0 $s1
+ *       ...                ($s0, $s1 and $t0 not written)
+ *       add $t1 $s1 $s0    (becomes `$t1 <- $t0`)
+ *
+ * Operands are compared in a canonical order for the commutative ops, and
+ * values always come before constants. An add that traps can stand in for
+ * one that doesn't, but not the other way around, as a plain add may have
+ * wrapped.
+ *
+ * A value is only ever read from a register, so a recomputation is replaced
+ * by a move from any register still holding a value with the same number, or
+ * dropped if that's its own destination. If none does it's left alone.
+ */
+
+/**
+ * Replace recomputations of values already held in a register, returns how
+ * many were replaced.
+ */
+uint64_t eliminate_common_subexprs(struct abstract_instr_vec *instrs);
+
+#endif // __CSE_H_
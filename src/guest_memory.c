@@ -0,0 +1,97 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "guest_memory.h"
+
+// covers the largest negative (and positive) displacement of a load/store
+static const size_t guard_size = 1 << 16;
+static const size_t addressable_size = 1ull << 32;
+
+static struct guest_memory *faulting_memory;
+
+struct guest_memory guest_memory_new(size_t size) {
+    size_t reservation_len = guard_size + addressable_size + guard_size;
+
+    uint8_t *reservation =
+        mmap(NULL, reservation_len, PROT_NONE,
+             MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (reservation == MAP_FAILED) {
+        perror("Reserving guest memory failed");
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t *base = reservation + guard_size;
+
+    if (mprotect(base, size, PROT_READ | PROT_WRITE) == -1) {
+        perror("Failed mapping guest memory rw");
+        exit(EXIT_FAILURE);
+    }
+
+    return (struct guest_memory){.base = base,
+                                 .size = size,
+                                 .reservation = reservation,
+                                 .reservation_len = reservation_len};
+}
+
+void guest_memory_free(struct guest_memory *mem) {
+    if (faulting_memory == mem) {
+        faulting_memory = NULL;
+    }
+
+    munmap(mem->reservation, mem->reservation_len);
+}
+
+static void guest_fault_handler(int sig, siginfo_t *info, void *ucontext) {
+    uint8_t *addr = info->si_addr;
+    struct guest_memory *mem = faulting_memory;
+
+    if (mem == NULL || addr < mem->reservation ||
+        addr >= mem->reservation + mem->reservation_len) {
+        // not ours, let the default action happen when the access reruns
+        signal(sig, SIG_DFL);
+        return;
+    }
+
+    // addresses below the base wrap around, just as the guest computed them
+    uint32_t guest_addr = (uint32_t)(addr - mem->base);
+
+    char msg[256];
+    int len = snprintf(msg, sizeof(msg),
+                       "Runtime Error: guest memory fault at address 0x%08x "
+                       "(memory size 0x%zx)",
+                       guest_addr, mem->size);
+
+    uint32_t instr;
+    if (mem->pc_map != NULL &&
+        pc_map_lookup(mem->pc_map, signal_pc(ucontext), &instr) &&
+        instr != PC_MAP_NO_INSTR) {
+        char where[96];
+        pc_map_describe(mem->pc_map, instr, where, sizeof(where));
+        len += snprintf(msg + len, sizeof(msg) - len,
+                        " by the instruction at guest address 0x%08x (%s)",
+                        guest_address_of(instr), where);
+    }
+
+    len += snprintf(msg + len, sizeof(msg) - len, "\n");
+    write(STDERR_FILENO, msg, len);
+    _exit(1);
+}
+
+void install_guest_fault_handler(struct guest_memory *mem) {
+    faulting_memory = mem;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = guest_fault_handler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+
+    if (sigaction(SIGSEGV, &sa, NULL) == -1) {
+        perror("Failed installing guest fault handler");
+        exit(EXIT_FAILURE);
+    }
+}
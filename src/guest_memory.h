@@ -0,0 +1,48 @@
+#ifndef __GUEST_MEMORY_H_
+#define __GUEST_MEMORY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pc_map.h"
+
+/**
+ * Guest memory
+ *
+ * The guest sees a single flat region of memory starting at address 0. Guest
+ * addresses are 32 bit offsets from a base pointer (pinned in r15 while
+ * running generated code), so we reserve the whole 4GB range that an offset
+ * can reach, plus a guard either side for the signed 16 bit displacement of a
+ * load/store, and only make the first `size` bytes accessible. Any access
+ * outside the accessible region lands in the reservation and faults, which
+ * lets us bounds check without emitting any checks.
+ */
+
+#define GUEST_MEMORY_SIZE (16u << 20)
+
+struct guest_memory {
+    uint8_t *base;
+    size_t size;
+    uint8_t *reservation;
+    size_t reservation_len;
+
+    // finds the guest instruction making a faulting access, or NULL
+    struct pc_map *pc_map;
+};
+
+/**
+ * Reserve and map a guest memory region, `size` bytes of which are readable
+ * and writeable.
+ */
+struct guest_memory guest_memory_new(size_t size);
+
+void guest_memory_free(struct guest_memory *mem);
+
+/**
+ * Install a SIGSEGV handler that reports faulting accesses into the guest
+ * memory reservation as guest faults, with the MIPS instruction that made the
+ * access if the memory has a pc map.
+ */
+void install_guest_fault_handler(struct guest_memory *mem);
+
+#endif // __GUEST_MEMORY_H_
@@ -8,15 +8,38 @@ MAKE_VEC(struct instr, instr);
 
 const char *const instr_type_names[] = {
     [INSTR_NOP] = "INSTR_NOP",   [INSTR_ADD] = "INSTR_ADD",
-    [INSTR_ADDI] = "INSTR_ADDI", [INSTR_ANDI] = "INSTR_ANDI",
+    [INSTR_ADDU] = "INSTR_ADDU", [INSTR_ADDI] = "INSTR_ADDI",
+    [INSTR_ADDIU] = "INSTR_ADDIU", [INSTR_ANDI] = "INSTR_ANDI",
     [INSTR_SRL] = "INSTR_SRL",   [INSTR_SLL] = "INSTR_SLL",
-    [INSTR_BEQ] = "INSTR_BEQ",   [INSTR_BNE] = "INSTR_BNE"};
+    [INSTR_BEQ] = "INSTR_BEQ",   [INSTR_BNE] = "INSTR_BNE",
+    [INSTR_LW] = "INSTR_LW",     [INSTR_LH] = "INSTR_LH",
+    [INSTR_LB] = "INSTR_LB",     [INSTR_SW] = "INSTR_SW",
+    [INSTR_SH] = "INSTR_SH",     [INSTR_SB] = "INSTR_SB",
+    [INSTR_MULT] = "INSTR_MULT", [INSTR_MULTU] = "INSTR_MULTU",
+    [INSTR_DIV] = "INSTR_DIV",   [INSTR_DIVU] = "INSTR_DIVU",
+    [INSTR_MFHI] = "INSTR_MFHI", [INSTR_MFLO] = "INSTR_MFLO",
+    [INSTR_MUL] = "INSTR_MUL",   [INSTR_J] = "INSTR_J",
+    [INSTR_JAL] = "INSTR_JAL",   [INSTR_JR] = "INSTR_JR"};
 
 const enum instr_class instr_class_map[] = {
     [INSTR_NOP] = INSTR_CLASS_NOP,    [INSTR_ADD] = INSTR_CLASS_REG,
-    [INSTR_ADDI] = INSTR_CLASS_IMM,   [INSTR_ANDI] = INSTR_CLASS_IMM,
+    [INSTR_ADDU] = INSTR_CLASS_REG,   [INSTR_ADDI] = INSTR_CLASS_IMM,
+    [INSTR_ADDIU] = INSTR_CLASS_IMM,  [INSTR_ANDI] = INSTR_CLASS_IMM,
     [INSTR_SRL] = INSTR_CLASS_IMM,    [INSTR_SLL] = INSTR_CLASS_IMM,
-    [INSTR_BEQ] = INSTR_CLASS_BRANCH, [INSTR_BNE] = INSTR_CLASS_BRANCH};
+    [INSTR_BEQ] = INSTR_CLASS_BRANCH, [INSTR_BNE] = INSTR_CLASS_BRANCH,
+    [INSTR_LW] = INSTR_CLASS_MEM,     [INSTR_LH] = INSTR_CLASS_MEM,
+    [INSTR_LB] = INSTR_CLASS_MEM,     [INSTR_SW] = INSTR_CLASS_MEM,
+    [INSTR_SH] = INSTR_CLASS_MEM,     [INSTR_SB] = INSTR_CLASS_MEM,
+    [INSTR_MULT] = INSTR_CLASS_HILO_WRITE,
+    [INSTR_MULTU] = INSTR_CLASS_HILO_WRITE,
+    [INSTR_DIV] = INSTR_CLASS_HILO_WRITE,
+    [INSTR_DIVU] = INSTR_CLASS_HILO_WRITE,
+    [INSTR_MFHI] = INSTR_CLASS_HILO_READ,
+    [INSTR_MFLO] = INSTR_CLASS_HILO_READ,
+    [INSTR_MUL] = INSTR_CLASS_REG,
+    [INSTR_J] = INSTR_CLASS_JUMP,
+    [INSTR_JAL] = INSTR_CLASS_JUMP,
+    [INSTR_JR] = INSTR_CLASS_JUMP_REG};
 
 void print_instr(struct instr *i) {
     printf("<instr %s", instr_type_names[i->type]);
@@ -43,5 +66,24 @@ void print_instr(struct instr *i) {
                (int)i->branch_instr.label->name.len,
                i->branch_instr.label->name.s, i->branch_instr.label->id);
         break;
+    case INSTR_CLASS_HILO_WRITE:
+        printf(", s: %s, t: %s>\n", reg_type_names[i->reg_instr.s],
+               reg_type_names[i->reg_instr.t]);
+        break;
+    case INSTR_CLASS_HILO_READ:
+        printf(", d: %s>\n", reg_type_names[i->reg_instr.d]);
+        break;
+    case INSTR_CLASS_JUMP:
+        printf(", label: <label %.*s, id: %ud>>\n",
+               (int)i->jump_instr.label->name.len, i->jump_instr.label->name.s,
+               i->jump_instr.label->id);
+        break;
+    case INSTR_CLASS_JUMP_REG:
+        printf(", s: %s>\n", reg_type_names[i->reg_instr.s]);
+        break;
+    case INSTR_CLASS_MEM:
+        printf(", t: %s, s: %s, offset: %d>\n", reg_type_names[i->mem_instr.t],
+               reg_type_names[i->mem_instr.s], i->mem_instr.offset);
+        break;
     }
 }
@@ -12,18 +12,41 @@
 enum __attribute__((__packed__)) instr_type {
     INSTR_NOP,
     INSTR_ADD,
+    INSTR_ADDU,
     INSTR_ADDI,
+    INSTR_ADDIU,
     INSTR_ANDI,
     INSTR_SRL,
     INSTR_SLL,
     INSTR_BEQ,
-    INSTR_BNE
+    INSTR_BNE,
+    INSTR_LW,
+    INSTR_LH,
+    INSTR_LB,
+    INSTR_SW,
+    INSTR_SH,
+    INSTR_SB,
+    INSTR_MULT,
+    INSTR_MULTU,
+    INSTR_DIV,
+    INSTR_DIVU,
+    INSTR_MFHI,
+    INSTR_MFLO,
+    INSTR_MUL,
+    INSTR_J,
+    INSTR_JAL,
+    INSTR_JR
 };
 
 enum __attribute__((__packed__)) instr_class {
     INSTR_CLASS_REG,
     INSTR_CLASS_IMM,
     INSTR_CLASS_BRANCH,
+    INSTR_CLASS_MEM,
+    INSTR_CLASS_HILO_WRITE, // mult/div, uses reg_instr.s and reg_instr.t
+    INSTR_CLASS_HILO_READ,  // mfhi/mflo, uses reg_instr.d
+    INSTR_CLASS_JUMP,
+    INSTR_CLASS_JUMP_REG, // jr, uses reg_instr.s
     INSTR_CLASS_NOP
 };
 
@@ -42,18 +65,31 @@ struct instr_imm {
     uint16_t imm;
 };
 
+// t = mem[s + offset] (loads), mem[s + offset] = t (stores)
+struct instr_mem {
+    enum reg_type t, s;
+    int16_t offset;
+};
+
 // branch to label instrs
 struct instr_branch {
     struct label *label;
     enum reg_type t, s;
 };
 
+// jump to label instrs
+struct instr_jump {
+    struct label *label;
+};
+
 struct instr {
     enum instr_type type;
     union {
         struct instr_reg reg_instr;
         struct instr_imm imm_instr;
         struct instr_branch branch_instr;
+        struct instr_mem mem_instr;
+        struct instr_jump jump_instr;
     };
     struct label *label;
 };
@@ -1,4 +1,6 @@
 #include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
@@ -52,7 +54,7 @@ static enum reg_type parse_reg_type(const char **instr) {
     switch (*(*instr)++) {
     case 'z':
         if (strncmp(*instr, "ero", strlen("ero")) == 0) {
-            *instr += 4;
+            *instr += strlen("ero");
             return REG_ZERO;
         }
         BAD_REG();
@@ -121,9 +123,26 @@ static enum reg_type parse_reg_type(const char **instr) {
             return REG_S6;
         case '7':
             return REG_S7;
+        case 'p':
+            return REG_SP;
         default:
             BAD_REG();
         }
+    case 'g':
+        if (*(*instr)++ == 'p') {
+            return REG_GP;
+        }
+        BAD_REG();
+    case 'f':
+        if (*(*instr)++ == 'p') {
+            return REG_FP;
+        }
+        BAD_REG();
+    case 'r':
+        if (*(*instr)++ == 'a') {
+            return REG_RA;
+        }
+        BAD_REG();
     default:
         BAD_REG();
     }
@@ -149,6 +168,30 @@ static struct instr_reg parse_instr_reg(const char *instr) {
     return (struct instr_reg){.d = d, .s = s, .t = t};
 }
 
+/**
+ * Parse an instruction writing HI and LO (`mult $s $t`), expects `instr` to
+ * point to the first parameter to the instruction.
+ */
+static struct instr_reg parse_instr_hilo_write(const char *instr) {
+    enum reg_type s = parse_reg_type(&instr);
+    eat_whitespace(&instr);
+    ensure_not_terminated(instr);
+
+    enum reg_type t = parse_reg_type(&instr);
+
+    return (struct instr_reg){.d = REG_ZERO, .s = s, .t = t};
+}
+
+/**
+ * Parse an instruction reading HI or LO (`mfhi $d`), expects `instr` to point
+ * to the first parameter to the instruction.
+ */
+static struct instr_reg parse_instr_hilo_read(const char *instr) {
+    enum reg_type d = parse_reg_type(&instr);
+
+    return (struct instr_reg){.d = d, .s = REG_ZERO, .t = REG_ZERO};
+}
+
 /**
  * Parse an imm instruction, expects `instr` to point to the first parameter to
  * the instruction.
@@ -167,6 +210,40 @@ static struct instr_imm parse_instr_imm(const char *instr) {
     return (struct instr_imm){.s = s, .t = t, .imm = imm};
 }
 
+/**
+ * Parse a memory instruction of the form `$t offset($s)`, expects `instr` to
+ * point to the first parameter to the instruction. The offset may be omitted.
+ */
+static struct instr_mem parse_instr_mem(const char *instr) {
+    const char *initial_instr = instr;
+
+    enum reg_type t = parse_reg_type(&instr);
+    eat_whitespace(&instr);
+    ensure_not_terminated(instr);
+
+    char *offset_end;
+    long offset = strtol(instr, &offset_end, 0);
+    instr = offset_end;
+    eat_whitespace(&instr);
+
+    if (offset < INT16_MIN || offset > INT16_MAX) {
+        RUNTIME_ERROR("Memory offset out of range: %s", initial_instr);
+    }
+
+    if (*ensure_not_terminated(instr) != '(') {
+        RUNTIME_ERROR("Expected '(' in memory operand: %s", initial_instr);
+    }
+    instr++;
+
+    enum reg_type s = parse_reg_type(&instr);
+
+    if (*ensure_not_terminated(instr) != ')') {
+        RUNTIME_ERROR("Expected ')' in memory operand: %s", initial_instr);
+    }
+
+    return (struct instr_mem){.s = s, .t = t, .offset = offset};
+}
+
 /**
  * Parse a branch instruction, expects `instr` to point to the first parameter
  * to the instruction.
@@ -185,6 +262,24 @@ static struct instr_branch parse_instr_branch(const char *instr) {
     return (struct instr_branch){.s = s, .t = t, .label = label};
 }
 
+/**
+ * Parse a jump instruction, expects `instr` to point to the first parameter to
+ * the instruction.
+ */
+static struct instr_jump parse_instr_jump(const char *instr) {
+    return (struct instr_jump){.label = add_label(parse_word(&instr))};
+}
+
+/**
+ * Parse a jump register instruction, expects `instr` to point to the first
+ * parameter to the instruction.
+ */
+static struct instr_reg parse_instr_jump_reg(const char *instr) {
+    enum reg_type s = parse_reg_type(&instr);
+
+    return (struct instr_reg){.d = REG_ZERO, .s = s, .t = REG_ZERO};
+}
+
 /**
  * Parse a single instruction, possible with a label
  *
@@ -238,10 +333,18 @@ struct instr parse_instr(const char *instr) {
         return (struct instr){.type = INSTR_ADD,
                               .label = label,
                               .reg_instr = parse_instr_reg(instr)};
+    case 414:
+        return (struct instr){.type = INSTR_ADDU,
+                              .label = label,
+                              .reg_instr = parse_instr_reg(instr)};
     case 402:
         return (struct instr){.type = INSTR_ADDI,
                               .label = label,
                               .imm_instr = parse_instr_imm(instr)};
+    case 519:
+        return (struct instr){.type = INSTR_ADDIU,
+                              .label = label,
+                              .imm_instr = parse_instr_imm(instr)};
     case 412:
         return (struct instr){.type = INSTR_ANDI,
                               .label = label,
@@ -262,6 +365,70 @@ struct instr parse_instr(const char *instr) {
         return (struct instr){.type = INSTR_BNE,
                               .label = label,
                               .branch_instr = parse_instr_branch(instr)};
+    case 227:
+        return (struct instr){.type = INSTR_LW,
+                              .label = label,
+                              .mem_instr = parse_instr_mem(instr)};
+    case 212:
+        return (struct instr){.type = INSTR_LH,
+                              .label = label,
+                              .mem_instr = parse_instr_mem(instr)};
+    case 206:
+        return (struct instr){.type = INSTR_LB,
+                              .label = label,
+                              .mem_instr = parse_instr_mem(instr)};
+    case 234:
+        return (struct instr){.type = INSTR_SW,
+                              .label = label,
+                              .mem_instr = parse_instr_mem(instr)};
+    case 219:
+        return (struct instr){.type = INSTR_SH,
+                              .label = label,
+                              .mem_instr = parse_instr_mem(instr)};
+    case 213:
+        return (struct instr){.type = INSTR_SB,
+                              .label = label,
+                              .mem_instr = parse_instr_mem(instr)};
+    case 450:
+        return (struct instr){.type = INSTR_MULT,
+                              .label = label,
+                              .reg_instr = parse_instr_hilo_write(instr)};
+    case 567:
+        return (struct instr){.type = INSTR_MULTU,
+                              .label = label,
+                              .reg_instr = parse_instr_hilo_write(instr)};
+    case 323:
+        return (struct instr){.type = INSTR_DIV,
+                              .label = label,
+                              .reg_instr = parse_instr_hilo_write(instr)};
+    case 440:
+        return (struct instr){.type = INSTR_DIVU,
+                              .label = label,
+                              .reg_instr = parse_instr_hilo_write(instr)};
+    case 420:
+        return (struct instr){.type = INSTR_MFHI,
+                              .label = label,
+                              .reg_instr = parse_instr_hilo_read(instr)};
+    case 430:
+        return (struct instr){.type = INSTR_MFLO,
+                              .label = label,
+                              .reg_instr = parse_instr_hilo_read(instr)};
+    case 334:
+        return (struct instr){.type = INSTR_MUL,
+                              .label = label,
+                              .reg_instr = parse_instr_reg(instr)};
+    case 106:
+        return (struct instr){.type = INSTR_J,
+                              .label = label,
+                              .jump_instr = parse_instr_jump(instr)};
+    case 311:
+        return (struct instr){.type = INSTR_JAL,
+                              .label = label,
+                              .jump_instr = parse_instr_jump(instr)};
+    case 220:
+        return (struct instr){.type = INSTR_JR,
+                              .label = label,
+                              .reg_instr = parse_instr_jump_reg(instr)};
     default:
         RUNTIME_ERROR("Invalid instruction: %s", initial_instr);
     }
@@ -1,3 +1,5 @@
+#include <getopt.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,19 +7,72 @@
 #include <sys/stat.h>
 
 #include "abstract_instr.h"
+#include "arena.h"
+#include "bench.h"
+#include "block_cache.h"
+#include "code_stats.h"
+#include "guest_memory.h"
 #include "instr.h"
 #include "instr_parse.h"
 #include "label_storage.h"
 #include "mips_reg.h"
+#include "pc_map.h"
+#include "perf.h"
+#include "profiler.h"
+#include "promote.h"
+#include "runtime.h"
+#include "ssa.h"
 #include "str_slice.h"
 #include "vec.h"
 #include "x86_instr.h"
 
-static struct instr_vec *parse_instructions(char *source) {
-    struct instr_vec *vec = instr_vec_new();
+static size_t count_lines(const char *source) {
+    size_t lines = 1;
+
+    for (const char *c = source; *c != '\0'; c++) {
+        lines += *c == '\n';
+    }
+
+    return lines;
+}
+
+/**
+ * Room for compiling a program of 'lines' lines without the arena having to
+ * grow: the parsed instructions, the abstract ones twice over for the copies
+ * unrolling makes, and a few x86 instructions and their encoding for each.
+ */
+static size_t compile_arena_size(size_t lines) {
+    const size_t bytes_per_line =
+        sizeof(struct instr) +
+        2 * (sizeof(enum abstract_instr_type) +
+             sizeof(union abstract_instr_operands) + sizeof(uint32_t)) +
+        4 * sizeof(struct x86_instr) + 32;
+
+    return 4096 + lines * bytes_per_line;
+}
+
+/**
+ * Parse each line of 'source', recording the line number of each instruction
+ * in 'source_lines' if it isn't NULL.
+ */
+static struct instr_vec *parse_instructions(char *source, size_t lines,
+                                            struct arena *arena,
+                                            uint32_t *source_lines) {
+    struct instr_vec *vec = instr_vec_new_in(arena, lines);
+    const char *counted = source;
+    uint32_t line_number = 1;
 
     for (char *line = strtok(source, "\n"); line != NULL;
          line = strtok(NULL, "\n")) {
+        if (source_lines != NULL) {
+            // strtok skips empty lines, and ends the lines it returns with a
+            // nul instead of a newline
+            for (; counted < line; counted++) {
+                line_number += *counted == '\n' || *counted == '\0';
+            }
+            source_lines[vec->len] = line_number;
+        }
+
         instr_vec_push(vec, parse_instr(line));
     }
 
@@ -25,10 +80,19 @@ static struct instr_vec *parse_instructions(char *source) {
 }
 
 /**
- * Execute a thunk.
+ * Call code starting with the prologue at 'code', which calls 'entry'.
  */
-static void exec_thunk(struct thunk th, uint32_t *mapped_regs_store,
-                       uint32_t *unmapped_regs) {
+static void exec_code(uint8_t *code, uint8_t *entry,
+                      uint32_t *mapped_regs_store, uint32_t *unmapped_regs,
+                      struct guest_memory *mem) {
+    ((void (*)(uint32_t *, uint32_t *, uint8_t *, uint8_t *))code)(
+        unmapped_regs, mapped_regs_store, mem->base, entry);
+}
+
+/**
+ * Copy a thunk into memory it can run from, which the caller unmaps.
+ */
+static uint8_t *map_thunk(struct thunk th) {
     // allocate a writeable region
     void *buf = mmap(NULL, th.len, PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
     if (buf == MAP_FAILED) {
@@ -44,12 +108,156 @@ static void exec_thunk(struct thunk th, uint32_t *mapped_regs_store,
         exit(EXIT_FAILURE);
     }
 
+    return buf;
+}
+
+/**
+ * Execute a thunk.
+ */
+static void exec_thunk(struct thunk th, uint32_t *mapped_regs_store,
+                       uint32_t *unmapped_regs, struct guest_memory *mem,
+                       struct jit_runtime *rt) {
+    uint8_t *buf = map_thunk(th);
+    rt->code_base = buf + th.body_offset;
+
     // and call it
-    ((void (*)(uint32_t *, uint32_t *))buf)(unmapped_regs, mapped_regs_store);
+    exec_code(buf, rt->code_base, mapped_regs_store, unmapped_regs, mem);
 
     munmap(buf, th.len);
 }
 
+// code reserved for each abstract instruction when compiling directly, the
+// buffer grows if that isn't enough
+#define DIRECT_BYTES_PER_INSTR 32
+
+/**
+ * Mapped memory code is written straight into, made executable once it's
+ * done.
+ */
+struct code_buffer {
+    uint8_t *code;
+    size_t capacity;
+};
+
+static struct code_buffer code_buffer_new(size_t capacity) {
+    void *code = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANON, -1, 0);
+    if (code == MAP_FAILED) {
+        perror("Mapping code buffer failed");
+        exit(EXIT_FAILURE);
+    }
+
+    return (struct code_buffer){.code = code, .capacity = capacity};
+}
+
+/**
+ * Make room for 'size' bytes of code, moving what's written so far if the
+ * buffer has to grow.
+ */
+static void code_buffer_reserve(struct code_buffer *cb, size_t size) {
+    if (size <= cb->capacity) {
+        return;
+    }
+
+    size_t capacity = cb->capacity;
+    while (capacity < size) {
+        capacity *= 2;
+    }
+
+    struct code_buffer grown = code_buffer_new(capacity);
+    memcpy(grown.code, cb->code, cb->capacity);
+    munmap(cb->code, cb->capacity);
+    *cb = grown;
+}
+
+/**
+ * Encode the x86 instructions realized since 'start', then clear them.
+ */
+static void emit_window(struct code_buffer *cb, struct x86_instr_vec *window,
+                        uint32_t start, uint32_t end,
+                        struct x86_fixup_vec *fixups) {
+    code_buffer_reserve(cb, end);
+    emit_x86_body_with_fixups(window, &cb->code[start], start, fixups);
+    window->len = 0;
+}
+
+/**
+ * Compile the program straight into machine code, without keeping a list of
+ * its x86 instructions. Each abstract instruction is realized into a few x86
+ * instructions that are encoded at once, and jumps to labels further on are
+ * filled in at the end.
+ *
+ * Code is laid out as in the block cache: the prologue, epilogue and stubs
+ * come first, so the runtime's labels are placed before anything jumps to
+ * them, then the body from `body_offset`. Where the code for each abstract
+ * instruction starts is recorded in 'offsets' if it isn't NULL, and where the
+ * code after them starts in 'offsets[ainstrs->len]'.
+ */
+static struct code_buffer compile_direct(struct mips_x86_reg_mapping *map,
+                                         struct jit_runtime *rt,
+                                         struct abstract_instr_vec *ainstrs,
+                                         uint32_t *body_offset,
+                                         uint32_t *len, uint32_t *offsets) {
+    struct code_buffer cb = code_buffer_new(
+        X86_PRELUDE_MAX_SIZE + DIRECT_BYTES_PER_INSTR * (ainstrs->len + 1));
+    struct x86_instr_vec *window = x86_instr_vec_new_in(ainstrs->arena, 64);
+    struct x86_fixup_vec *fixups = x86_fixup_vec_new_in(ainstrs->arena, 64);
+
+    uint32_t current_offset = emit_x86_prelude(rt, cb.code);
+    *body_offset = current_offset;
+
+    struct abstract_instr current_instr;
+
+    for (size_t i = 0; abstract_instr_iter(ainstrs, i, &current_instr); i++) {
+        uint32_t start = current_offset;
+
+        if (offsets != NULL) {
+            offsets[i] = start;
+        }
+
+        if (current_instr.label != NULL) {
+            resolve_label(current_instr.label, current_offset);
+        }
+
+        realize_abstract_instruction(&current_instr, map, rt, window,
+                                     &current_offset);
+        emit_window(&cb, window, start, current_offset, fixups);
+    }
+
+    if (offsets != NULL) {
+        offsets[ainstrs->len] = current_offset;
+    }
+
+    // the epilogue is in front, so running off the end has to jump to it
+    uint32_t start = current_offset;
+    struct x86_instr exit = construct_jmp(rt->exit_label);
+    x86_instr_vec_push(window, exit);
+    current_offset += exit.size;
+    realize_trap_stubs(rt, window, &current_offset);
+    emit_window(&cb, window, start, current_offset, fixups);
+
+    patch_x86_fixups(fixups, cb.code);
+    *len = current_offset;
+
+    return cb;
+}
+
+/**
+ * Set the initial values of registers with a defined value on entry.
+ */
+static void init_regs(struct mips_x86_reg_mapping *map, uint32_t *regs_buf,
+                      uint32_t *unmapped_regs_buf) {
+    if (map->mapping[REG_SP].is_mapped) {
+        *mapped_reg_slot(map, REG_SP, regs_buf, unmapped_regs_buf) =
+            GUEST_MEMORY_SIZE;
+    }
+
+    if (map->mapping[REG_RA].is_mapped) {
+        *mapped_reg_slot(map, REG_RA, regs_buf, unmapped_regs_buf) =
+            GUEST_EXIT_ADDRESS;
+    }
+}
+
 static void print_mapping(struct mips_x86_reg_mapping *map, uint32_t *regs_buf,
                           uint32_t *unmapped_regs_buf) {
     for (enum reg_type i = SMALLEST_MIPS_REG; i <= LARGEST_MIPS_REG; i++) {
@@ -57,34 +265,73 @@ static void print_mapping(struct mips_x86_reg_mapping *map, uint32_t *regs_buf,
             continue;
         }
 
+        uint32_t value =
+            *mapped_reg_slot(map, i, regs_buf, unmapped_regs_buf);
+
         if (map->mapping[i].type == X86_REG_MAPPED) {
             enum x86_reg_type reg = map->mapping[i].x86_reg;
             printf("%s = %s = %u\n", reg_type_names[i], x86_reg_type_names[reg],
-                   regs_buf[linear_free_x86_reg_inverse_map[reg]]);
+                   value);
+        } else if (map->mapping[i].type == XMM_MAPPED) {
+            enum x86_xmm_reg_type reg = map->mapping[i].xmm_reg;
+            printf("%s = %s = %u\n", reg_type_names[i],
+                   x86_xmm_reg_type_names[reg], value);
         } else {
-            uint8_t offset = map->mapping[i].stack_offset;
-            printf("%s = [STACK + %d] = %u\n", reg_type_names[i], 4 * offset,
-                   unmapped_regs_buf[offset]);
+            printf("%s = [STACK + %d] = %u\n", reg_type_names[i],
+                   4 * map->mapping[i].stack_offset, value);
         }
     }
 }
 
+/**
+ * The part of the register buffer stack mapped registers are stored to, after
+ * the registers mapped to x86 and xmm registers.
+ */
+static uint32_t *unmapped_regs(uint32_t *regs_buf) {
+    return regs_buf + num_free_x86_regs + num_xmm_spill_regs;
+}
+
+/**
+ * Realize every abstract instruction. If 'starts' isn't NULL the index of the
+ * first x86 instruction of abstract instruction 'i' is put in 'starts[i]',
+ * and of what follows them in 'starts[ainstrs->len]'.
+ */
 static struct x86_instr_vec *
 realize_abstract_instructions(struct mips_x86_reg_mapping *map,
-                              struct abstract_instr_vec *ainstrs) {
-    struct x86_instr_vec *x86_instrs = x86_instr_vec_new();
+                              struct jit_runtime *rt,
+                              struct abstract_instr_vec *ainstrs,
+                              size_t *starts) {
+    struct x86_instr_vec *x86_instrs =
+        x86_instr_vec_new_in(ainstrs->arena, 2 * ainstrs->len);
     uint32_t current_offset = 0;
 
-    for (int i = 0; i < ainstrs->len; i++) {
-        struct abstract_instr *current_instr = &ainstrs->data[i];
-        if (current_instr->label != NULL) {
-            resolve_label(current_instr->label, current_offset);
+    struct abstract_instr current_instr;
+
+    for (size_t i = 0; abstract_instr_iter(ainstrs, i, &current_instr); i++) {
+        if (current_instr.label != NULL) {
+            resolve_label(current_instr.label, current_offset);
+        }
+
+        if (starts != NULL) {
+            starts[i] = x86_instrs->len;
         }
 
-        realize_abstract_instruction(current_instr, map, x86_instrs,
+        realize_abstract_instruction(&current_instr, map, rt, x86_instrs,
                                      &current_offset);
     }
 
+    if (starts != NULL) {
+        starts[ainstrs->len] = x86_instrs->len;
+    }
+
+    // the program ends by running off the end, so that has to skip the stubs
+    if (rt->pending_traps->len > 0) {
+        struct x86_instr skip = construct_jmp(rt->exit_label);
+        x86_instr_vec_push(x86_instrs, skip);
+        current_offset += skip.size;
+    }
+    realize_trap_stubs(rt, x86_instrs, &current_offset);
+
     return x86_instrs;
 }
 
@@ -94,12 +341,6 @@ static void print_instrs(struct instr_vec *instrs) {
     }
 }
 
-static void print_abstract_instrs(struct abstract_instr_vec *ainstrs) {
-    for (int i = 0; i < ainstrs->len; i++) {
-        print_abstract_instr(&ainstrs->data[i]);
-    }
-}
-
 static void print_x86_instrs(struct x86_instr_vec *x86_instrs) {
     for (int i = 0; i < x86_instrs->len; i++) {
         print_x86_instr(&x86_instrs->data[i]);
@@ -145,31 +386,84 @@ char *read_file_to_buf(const char *const fname) {
     return file_buf;
 }
 
-int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <input file>\n", *argv);
+/**
+ * Compile the whole program up front, straight into machine code, then run it.
+ */
+static void run_whole_program(struct abstract_instr_vec *ainstrs,
+                              struct mips_x86_reg_mapping *map,
+                              struct jit_runtime *rt, uint32_t *regs_buf,
+                              struct guest_memory *mem,
+                              struct perf_output *perf,
+                              struct pc_map *pc_map) {
+    uint32_t body_offset, len;
+    uint32_t *offsets =
+        arena_alloc(ainstrs->arena, (ainstrs->len + 1) * sizeof(uint32_t));
+    struct code_buffer cb =
+        compile_direct(map, rt, ainstrs, &body_offset, &len, offsets);
+
+    // every label is now resolved, so record where guest addresses live
+    jit_runtime_add_entries(rt, all_labels());
+
+    printf("\nencoded x86 instructions:\n");
+    print_encoded_instrs(
+        (struct thunk){.buf = cb.code, .len = len, .body_offset = body_offset});
+
+    if (mprotect(cb.code, cb.capacity, PROT_READ | PROT_EXEC) == -1) {
+        perror("Failed remapping code buffer to rx");
+        exit(EXIT_FAILURE);
     }
 
-    // read and parse mips instructions
-    char *instr_buf = read_file_to_buf(argv[1]);
-    struct instr_vec *instrs = parse_instructions(instr_buf);
+    pc_map_add_instrs(pc_map, ainstrs, 0, ainstrs->len, offsets);
+    pc_map_place(pc_map, cb.code, len);
 
-    printf("\nparsed instructions:\n");
-    print_instrs(instrs);
+    if (perf != NULL) {
+        perf_add_code(perf, "mips_jit:prelude", cb.code, body_offset);
+        perf_add_instrs(perf, cb.code, ainstrs, 0, ainstrs->len, offsets,
+                        len);
+    }
 
-    // re-encode mips enstructions as abstrac instructions
-    struct abstract_instr_vec *ainstrs = translate_instructions(instrs);
-    optimise_abstract_instrs(ainstrs);
+    rt->code_base = cb.code;
+    exec_code(cb.code, cb.code + body_offset, regs_buf,
+              unmapped_regs(regs_buf), mem);
 
-    printf("\nabstract instructions:\n");
-    print_abstract_instrs(ainstrs);
+    munmap(cb.code, cb.capacity);
+}
 
-    // perform the mapping of mips registers to x86 registers and stack offsets
-    struct mips_x86_reg_mapping map = map_regs(ainstrs);
+/**
+ * Where the code for each abstract instruction starts, from the index of its
+ * first x86 instruction in 'starts', when the body starts at 'body_offset'.
+ */
+static uint32_t *code_offsets(struct x86_instr_vec *x86_instrs, size_t *starts,
+                              size_t len, uint32_t body_offset) {
+    uint32_t *offsets = malloc((len + 1) * sizeof(uint32_t));
+    uint32_t offset = body_offset;
+    size_t x86_index = 0;
+
+    for (size_t i = 0; i <= len; i++) {
+        for (; x86_index < starts[i]; x86_index++) {
+            offset += x86_instrs->data[x86_index].size;
+        }
+        offsets[i] = offset;
+    }
 
+    return offsets;
+}
+
+/**
+ * Compile the whole program up front through a list of x86 instructions,
+ * which is printed, then run it.
+ */
+static void run_whole_program_listed(struct abstract_instr_vec *ainstrs,
+                                     struct mips_x86_reg_mapping *map,
+                                     struct jit_runtime *rt,
+                                     uint32_t *regs_buf,
+                                     struct guest_memory *mem,
+                                     struct perf_output *perf,
+                                     struct pc_map *pc_map) {
     // compile abstract instructions into x86 instructions
+    size_t *starts = malloc((ainstrs->len + 1) * sizeof(size_t));
     struct x86_instr_vec *x86_instrs =
-        realize_abstract_instructions(&map, ainstrs);
+        realize_abstract_instructions(map, rt, ainstrs, starts);
 
     printf("\nx86 instructions:\n");
     print_x86_instrs(x86_instrs);
@@ -177,24 +471,422 @@ int main(int argc, char **argv) {
     // write out the encoded x86 instructions
     uint32_t written_bytes = x86_instrs_size(x86_instrs);
     struct thunk encoded_instrs =
-        emit_x86_instructions(x86_instrs, written_bytes);
+        emit_x86_instructions(x86_instrs, written_bytes, rt, ainstrs->arena);
+
+    // every label is now resolved, so record where guest addresses live
+    jit_runtime_add_entries(rt, all_labels());
 
     printf("\nencoded x86 instructions:\n");
     print_encoded_instrs(encoded_instrs);
 
+    uint8_t *buf = map_thunk(encoded_instrs);
+    rt->code_base = buf + encoded_instrs.body_offset;
+
+    uint32_t *offsets = code_offsets(x86_instrs, starts, ainstrs->len,
+                                     encoded_instrs.body_offset);
+    pc_map_add_instrs(pc_map, ainstrs, 0, ainstrs->len, offsets);
+    pc_map_place(pc_map, buf, encoded_instrs.len);
+
+    if (perf != NULL) {
+        perf_add_code(perf, "mips_jit:prelude", buf,
+                      encoded_instrs.body_offset);
+        perf_add_instrs(perf, buf, ainstrs, 0, ainstrs->len, offsets,
+                        encoded_instrs.len);
+    }
+
+    free(offsets);
+    free(starts);
+
+    exec_code(buf, rt->code_base, regs_buf, unmapped_regs(regs_buf), mem);
+    munmap(buf, encoded_instrs.len);
+}
+
+/**
+ * Compile the whole program through a list of x86 instructions without
+ * running it, and report on the code. The report is also written to 'out' as
+ * a baseline file if it isn't NULL, with 'name' naming the program.
+ */
+static void report_code_stats(const char *name, size_t num_mips_instrs,
+                              struct abstract_instr_vec *ainstrs,
+                              struct mips_x86_reg_mapping *map,
+                              struct jit_runtime *rt, FILE *out) {
+    size_t *starts = malloc((ainstrs->len + 1) * sizeof(size_t));
+    struct x86_instr_vec *x86_instrs =
+        realize_abstract_instructions(map, rt, ainstrs, starts);
+
+    // jumps to the epilogue and stubs need their labels resolved
+    emit_x86_instructions(x86_instrs, x86_instrs_size(x86_instrs), rt,
+                          ainstrs->arena);
+
+    struct program_code_stats stats = collect_code_stats(
+        ainstrs, x86_instrs, starts, map, num_mips_instrs);
+
+    printf("\ncode stats:\n");
+    print_code_stats(&stats);
+
+    if (out != NULL) {
+        write_code_stats(&stats, name, out);
+    }
+
+    free_code_stats(&stats);
+    free(starts);
+}
+
+/**
+ * Compile and run the program a block at a time.
+ */
+static struct block_cache_stats
+run_blocks(struct abstract_instr_vec *ainstrs, struct mips_x86_reg_mapping *map,
+           struct jit_runtime *rt, uint32_t cache_size, bool traces,
+           bool dump_x86, uint32_t *regs_buf, struct guest_memory *mem,
+           struct perf_output *perf, struct pc_map *pc_map) {
+    struct block_cache *cache = block_cache_new(
+        ainstrs, map, rt, cache_size, traces, dump_x86, perf, pc_map);
+
+    block_cache_run(cache, regs_buf, unmapped_regs(regs_buf), mem);
+
+    struct block_cache_stats stats = cache->stats;
+    block_cache_free(cache);
+
+    return stats;
+}
+
+/**
+ * Compile and run the program 'reps' times through a list of x86
+ * instructions, timing each stage, then report the times. Everything is made
+ * from scratch each time, and what isn't part of a stage isn't timed.
+ */
+static void run_bench(const char *name, const char *source,
+                      struct optimise_options *options, uint32_t reps,
+                      FILE *csv) {
+    size_t lines = count_lines(source);
+    size_t source_len = strlen(source);
+    char *buf = malloc(source_len + 1);
+    struct bench *bench = bench_new(reps);
+
+    for (bench->rep = 0; bench->rep < reps; bench->rep++) {
+        // parsing splits the source up in place and labels point into it
+        memcpy(buf, source, source_len + 1);
+        clear_labels();
+
+        struct arena *arena = arena_new(compile_arena_size(lines));
+        struct optimise_stats optimise_stats = {0};
+
+        uint64_t t = bench_now();
+        struct instr_vec *instrs = parse_instructions(buf, lines, arena, NULL);
+        t = bench_lap(bench, BENCH_PARSE, t);
+
+        struct abstract_instr_vec *ainstrs = translate_instructions(instrs);
+        t = bench_lap(bench, BENCH_TRANSLATE, t);
+
+        optimise_abstract_instrs(ainstrs, options, &optimise_stats);
+        t = bench_lap(bench, BENCH_OPTIMISE, t);
+
+        struct mips_x86_reg_mapping map = map_regs(ainstrs);
+        promote_loop_regs(ainstrs, &map);
+        bench_lap(bench, BENCH_MAP_REGS, t);
+
+        bench->instrs = instrs->len;
+        bench->parsed_bytes = instrs->len * sizeof(struct instr);
+        bench->abstract_bytes = abstract_instrs_bytes(ainstrs);
+
+        uint32_t *regs_buf = calloc(num_free_x86_regs + num_xmm_spill_regs +
+                                        map.num_stack_spots,
+                                    sizeof(uint32_t));
+        init_regs(&map, regs_buf, unmapped_regs(regs_buf));
+
+        struct guest_memory mem = guest_memory_new(GUEST_MEMORY_SIZE);
+        install_guest_fault_handler(&mem);
+
+        struct jit_runtime *rt = jit_runtime_new();
+        rt->num_x86_regs = map.num_x86_regs;
+
+        t = bench_now();
+        struct x86_instr_vec *x86_instrs =
+            realize_abstract_instructions(&map, rt, ainstrs, NULL);
+        t = bench_lap(bench, BENCH_REALIZE, t);
+        bench->x86_bytes = x86_instrs->len * sizeof(struct x86_instr);
+
+        struct thunk encoded_instrs = emit_x86_instructions(
+            x86_instrs, x86_instrs_size(x86_instrs), rt, arena);
+        jit_runtime_add_entries(rt, all_labels());
+        t = bench_lap(bench, BENCH_EMIT, t);
+
+        exec_thunk(encoded_instrs, regs_buf, unmapped_regs(regs_buf), &mem,
+                   rt);
+        bench_lap(bench, BENCH_EXECUTE, t);
+
+        jit_runtime_free(rt);
+        guest_memory_free(&mem);
+        free(regs_buf);
+        arena_free(arena);
+    }
+
+    bench_print(bench);
+    if (csv != NULL) {
+        bench_write_csv(bench, name, csv);
+    }
+
+    bench_free(bench);
+    free(buf);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options] <input file>\n"
+            "  --blocks           compile a block at a time as blocks are "
+            "reached\n"
+            "  --traces           as --blocks, and trace hot loops\n"
+            "  --cache-size=SIZE  code cache size in bytes for --blocks\n"
+            "  --unroll=N         unroll counted loops N times, a power of "
+            "two (1 disables)\n"
+            "  --unroll-budget=N  most instructions an unrolled loop may "
+            "take\n"
+            "  --dump-x86         compile the whole program through a list of "
+            "x86\n"
+            "                     instructions and print it, with --blocks "
+            "print\n"
+            "                     each block's as it's compiled\n"
+            "  --code-stats       compile the whole program through a list of "
+            "x86\n"
+            "                     instructions and report on them without "
+            "running it\n"
+            "  --code-stats-out=FILE\n"
+            "                     append the --code-stats report to FILE as a "
+            "baseline\n"
+            "  --bench=N          compile and run the program N times, and "
+            "print how\n"
+            "                     long each stage took\n"
+            "  --bench-csv=FILE   append the times --bench prints to FILE as "
+            "CSV\n"
+            "  --perf             write /tmp/perf-<pid>.map and "
+            "/tmp/jit-<pid>.dump\n"
+            "                     naming the code generated for Linux perf\n"
+            "  --profile          sample where the program spends its time, "
+            "and print\n"
+            "                     the instructions and labels most samples "
+            "were in\n",
+            name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    bool blocks = false;
+    bool traces = false;
+    bool dump_x86 = false;
+    bool code_stats = false;
+    const char *code_stats_out = NULL;
+    uint32_t bench_reps = 0;
+    const char *bench_csv = NULL;
+    bool use_perf = false;
+    bool profile = false;
+    uint32_t cache_size = BLOCK_CACHE_DEFAULT_SIZE;
+    struct optimise_options options = {.unroll_factor = DEFAULT_UNROLL_FACTOR,
+                                       .unroll_budget = DEFAULT_UNROLL_BUDGET};
+
+    static const struct option long_options[] = {
+        {"blocks", no_argument, NULL, 'b'},
+        {"traces", no_argument, NULL, 't'},
+        {"cache-size", required_argument, NULL, 'c'},
+        {"unroll", required_argument, NULL, 'u'},
+        {"unroll-budget", required_argument, NULL, 'U'},
+        {"dump-x86", no_argument, NULL, 'x'},
+        {"code-stats", no_argument, NULL, 's'},
+        {"code-stats-out", required_argument, NULL, 'S'},
+        {"bench", required_argument, NULL, 'B'},
+        {"bench-csv", required_argument, NULL, 'C'},
+        {"perf", no_argument, NULL, 'p'},
+        {"profile", no_argument, NULL, 'P'},
+        {0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'b':
+            blocks = true;
+            break;
+        case 't':
+            blocks = traces = true;
+            break;
+        case 'c':
+            cache_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'u':
+            options.unroll_factor = strtoul(optarg, NULL, 0);
+            break;
+        case 'U':
+            options.unroll_budget = strtoul(optarg, NULL, 0);
+            break;
+        case 'x':
+            dump_x86 = true;
+            break;
+        case 's':
+            code_stats = true;
+            break;
+        case 'S':
+            code_stats = true;
+            code_stats_out = optarg;
+            break;
+        case 'B':
+            bench_reps = strtoul(optarg, NULL, 0);
+            break;
+        case 'C':
+            bench_csv = optarg;
+            break;
+        case 'p':
+            use_perf = true;
+            break;
+        case 'P':
+            profile = true;
+            break;
+        default:
+            usage(*argv);
+        }
+    }
+
+    if (optind != argc - 1 || options.unroll_factor == 0 ||
+        (options.unroll_factor & (options.unroll_factor - 1)) != 0) {
+        usage(*argv);
+    }
+
+    // traces are recorded by following guest addresses, which the labels
+    // added by unrolling don't have
+    if (traces) {
+        options.unroll_factor = 1;
+    }
+
+    // read and parse mips instructions
+    char *instr_buf = read_file_to_buf(argv[optind]);
+    size_t lines = count_lines(instr_buf);
+
+    if (bench_reps > 0) {
+        FILE *csv = NULL;
+        if (bench_csv != NULL && (csv = fopen(bench_csv, "a")) == NULL) {
+            perror("Failed opening bench output");
+            exit(EXIT_FAILURE);
+        }
+
+        run_bench(argv[optind], instr_buf, &options, bench_reps, csv);
+
+        if (csv != NULL) {
+            fclose(csv);
+        }
+        free(instr_buf);
+        return 0;
+    }
+
+    // everything the compilation makes is freed together at the end
+    struct arena *arena = arena_new(compile_arena_size(lines));
+    uint32_t *source_lines = arena_alloc(arena, lines * sizeof(uint32_t));
+    struct instr_vec *instrs =
+        parse_instructions(instr_buf, lines, arena, source_lines);
+
+    printf("\nparsed instructions:\n");
+    print_instrs(instrs);
+
+    // re-encode mips enstructions as abstrac instructions
+    struct abstract_instr_vec *ainstrs = translate_instructions(instrs);
+    struct optimise_stats optimise_stats = {0};
+    optimise_abstract_instrs(ainstrs, &options, &optimise_stats);
+
+    // perform the mapping of mips registers to x86 registers and stack offsets
+    struct mips_x86_reg_mapping map = map_regs(ainstrs);
+    promote_loop_regs(ainstrs, &map);
+
+    printf("\nabstract instructions:\n");
+    print_ssa_form(ainstrs);
+
     // allocate buffers for final register values & mips registers that were
     // stack allocated
     uint32_t *regs_buf =
-        calloc(map.num_stack_spots + num_free_x86_regs, sizeof(uint32_t));
-    exec_thunk(encoded_instrs, regs_buf, regs_buf + num_free_x86_regs);
+        calloc(num_free_x86_regs + num_xmm_spill_regs + map.num_stack_spots,
+               sizeof(uint32_t));
+
+    init_regs(&map, regs_buf, unmapped_regs(regs_buf));
 
-    printf("\nfinal register values:\n");
-    print_mapping(&map, regs_buf, regs_buf + num_free_x86_regs);
+    struct guest_memory mem = guest_memory_new(GUEST_MEMORY_SIZE);
+    install_guest_fault_handler(&mem);
+
+    struct jit_runtime *rt = jit_runtime_new();
+    rt->num_x86_regs = map.num_x86_regs;
+    struct block_cache_stats block_stats;
+
+    // nothing runs when only reporting on the code
+    struct perf_output *perf =
+        use_perf && !code_stats
+            ? perf_output_new(argv[optind], source_lines, instrs->len)
+            : NULL;
+
+    // faults and samples are traced back to the instruction they're in
+    struct pc_map *pc_map = pc_map_new(instrs->len, source_lines);
+    mem.pc_map = pc_map;
+
+    struct profiler *profiler =
+        profile && !code_stats ? profiler_new(pc_map) : NULL;
+    if (profiler != NULL) {
+        profiler_start(profiler);
+    }
+
+    if (code_stats) {
+        FILE *out = NULL;
+        if (code_stats_out != NULL &&
+            (out = fopen(code_stats_out, "a")) == NULL) {
+            perror("Failed opening code stats output");
+            exit(EXIT_FAILURE);
+        }
+
+        report_code_stats(argv[optind], instrs->len, ainstrs, &map, rt, out);
+
+        if (out != NULL) {
+            fclose(out);
+        }
+    } else if (blocks) {
+        block_stats = run_blocks(ainstrs, &map, rt, cache_size, traces,
+                                 dump_x86, regs_buf, &mem, perf, pc_map);
+    } else if (dump_x86) {
+        run_whole_program_listed(ainstrs, &map, rt, regs_buf, &mem, perf,
+                                 pc_map);
+    } else {
+        run_whole_program(ainstrs, &map, rt, regs_buf, &mem, perf, pc_map);
+    }
+
+    if (profiler != NULL) {
+        profiler_stop(profiler);
+    }
+
+    // nothing has run when only reporting on the code
+    if (!code_stats) {
+        printf("\nfinal register values:\n");
+        print_mapping(&map, regs_buf, unmapped_regs(regs_buf));
+    }
+
+    if (rt->ics->len > 0 && !code_stats) {
+        printf("\nindirect jumps:\n");
+        jit_runtime_print_ic_stats(rt);
+    }
+
+    if (blocks) {
+        printf("\nblock cache:\n");
+        block_cache_print_stats(&block_stats);
+    }
+
+    printf("\noptimiser:\n");
+    print_optimise_stats(&optimise_stats);
+
+    if (profiler != NULL) {
+        printf("\nprofile:\n");
+        profiler_print(profiler, instrs);
+        profiler_free(profiler);
+    }
+
+    if (perf != NULL) {
+        perf_output_free(perf);
+    }
 
+    pc_map_free(pc_map);
     free(regs_buf);
-    instr_vec_free(instrs);
-    abstract_instr_vec_free(ainstrs);
-    x86_instr_vec_free(x86_instrs);
-    free(encoded_instrs.buf);
+    guest_memory_free(&mem);
+    jit_runtime_free(rt);
+    arena_free(arena);
     free(instr_buf);
 }
@@ -0,0 +1,584 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "abstract_instr.h"
+#include "common.h"
+#include "known_bits.h"
+#include "mips_reg.h"
+
+// the bits of a value known to be zero, and known to be one
+struct known_bits {
+    uint32_t zero, one;
+};
+
+// what is known about each register before an instruction
+struct reg_bits {
+    bool reached;
+    struct known_bits regs[LARGEST_MIPS_REG + 1];
+};
+
+static struct known_bits constant_bits(uint32_t value) {
+    return (struct known_bits){.zero = ~value, .one = value};
+}
+
+static bool is_constant(struct known_bits bits) {
+    return (bits.zero | bits.one) == UINT32_MAX;
+}
+
+static struct known_bits reg_known_bits(struct reg_bits *state,
+                                        enum reg_type reg) {
+    if (reg == REG_ZERO) {
+        return constant_bits(0);
+    }
+
+    return state->regs[reg];
+}
+
+static struct known_bits storage_bits(struct reg_bits *state,
+                                      struct abstract_storage s) {
+    if (s.type == ABSTRACT_STORAGE_IMM) {
+        return constant_bits(s.imm);
+    }
+
+    return reg_known_bits(state, s.reg);
+}
+
+static struct known_bits and_bits(struct known_bits a, struct known_bits b) {
+    return (struct known_bits){.zero = a.zero | b.zero, .one = a.one & b.one};
+}
+
+static struct known_bits add_bits(struct known_bits a, struct known_bits b) {
+    // the sum is smallest with every unknown bit clear and largest with every
+    // unknown bit set. the carry into each bit only grows between the two, so
+    // where it's the same in both it's known, and so is the bit if both
+    // operands' bits are
+    uint32_t min = a.one + b.one;
+    uint32_t max = ~a.zero + ~b.zero;
+    uint32_t min_carries = min ^ a.one ^ b.one;
+    uint32_t max_carries = max ^ ~a.zero ^ ~b.zero;
+    uint32_t known =
+        (a.zero | a.one) & (b.zero | b.one) & ~(min_carries ^ max_carries);
+
+    return (struct known_bits){.zero = ~min & known, .one = min & known};
+}
+
+static struct known_bits mul_bits(struct known_bits a, struct known_bits b) {
+    if (is_constant(a) && is_constant(b)) {
+        return constant_bits(a.one * b.one);
+    }
+
+    // the product has at least as many trailing zeros as both together
+    uint32_t zeros = 0;
+    for (uint32_t bit = 1; bit != 0 && (a.zero & bit); bit <<= 1) {
+        zeros++;
+    }
+    for (uint32_t bit = 1; bit != 0 && (b.zero & bit); bit <<= 1) {
+        zeros++;
+    }
+
+    if (zeros >= 32) {
+        return constant_bits(0);
+    }
+
+    return (struct known_bits){.zero = (1u << zeros) - 1, .one = 0};
+}
+
+static struct known_bits shl_bits(struct known_bits a, uint8_t shift) {
+    return (struct known_bits){.zero = a.zero << shift | ((1u << shift) - 1),
+                               .one = a.one << shift};
+}
+
+static struct known_bits shr_bits(struct known_bits a, uint8_t shift) {
+    return (struct known_bits){.zero = a.zero >> shift | ~(UINT32_MAX >> shift),
+                               .one = a.one >> shift};
+}
+
+static struct known_bits binop_bits(struct reg_bits *state,
+                                    struct abstract_instr_binop *i) {
+    struct known_bits lhs = storage_bits(state, i->lhs);
+    struct known_bits rhs = storage_bits(state, i->rhs);
+
+    switch (i->op) {
+    case ABSTRACT_INSTR_BINOP_ADD:
+    case ABSTRACT_INSTR_BINOP_ADD_TRAP:
+        return add_bits(lhs, rhs);
+    case ABSTRACT_INSTR_BINOP_AND:
+        return and_bits(lhs, rhs);
+    case ABSTRACT_INSTR_BINOP_MUL:
+        return mul_bits(lhs, rhs);
+    case ABSTRACT_INSTR_BINOP_SCALED_ADD:
+        return add_bits(shl_bits(lhs, i->shift), rhs);
+    }
+
+    RUNTIME_ERROR("Invalid binop %d", i->op);
+}
+
+/**
+ * What is known about the register 'i' writes, if it's a binop, move or
+ * shift. Returns false for anything else.
+ */
+static bool result_bits(struct reg_bits *state, struct abstract_instr *i,
+                        enum reg_type *dest, struct known_bits *bits) {
+    switch (i->type) {
+    case ABSTRACT_INSTR_BINOP:
+        *dest = i->binop.dest;
+        *bits = binop_bits(state, &i->binop);
+        return true;
+    case ABSTRACT_INSTR_MOV:
+        *dest = i->mov.dest;
+        *bits = storage_bits(state, i->mov.source);
+        return true;
+    case ABSTRACT_INSTR_SHIFT: {
+        struct known_bits lhs = reg_known_bits(state, i->shift.lhs);
+        *dest = i->shift.dest;
+        *bits = i->shift.direction == ABSTRACT_INSTR_SHIFT_LEFT
+                    ? shl_bits(lhs, i->shift.rhs)
+                    : shr_bits(lhs, i->shift.rhs);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+/**
+ * Update 'state' to after 'i', which isn't a branch.
+ */
+static void transfer(struct reg_bits *state, struct abstract_instr *i) {
+    enum reg_type dest;
+    struct known_bits bits;
+
+    if (result_bits(state, i, &dest, &bits)) {
+        state->regs[dest] = bits;
+        return;
+    }
+
+    enum reg_type regs[ABSTRACT_INSTR_MAX_REGS];
+    size_t num_defs = abstract_instr_defs(i, regs);
+    for (size_t d = 0; d < num_defs; d++) {
+        state->regs[regs[d]] = (struct known_bits){0};
+    }
+}
+
+/**
+ * The bits a branch compares, and which of them matter. For mask tests this
+ * is lhs & mask compared against zero.
+ */
+static void branch_operands(struct reg_bits *state,
+                            struct abstract_instr_branch *b,
+                            struct known_bits *lhs, struct known_bits *rhs,
+                            uint32_t *mask) {
+    *lhs = storage_bits(state, b->lhs);
+    *rhs = storage_bits(state, b->rhs);
+    *mask = UINT32_MAX;
+
+    switch (b->type) {
+    case ABSTRACT_INSTR_BRANCH_TEST_NE:
+    case ABSTRACT_INSTR_BRANCH_TEST_EQ:
+        break;
+    case ABSTRACT_INSTR_BRANCH_TEST_LOW_NE:
+    case ABSTRACT_INSTR_BRANCH_TEST_LOW_EQ:
+        *mask = (1u << b->low_bits) - 1;
+        break;
+    case ABSTRACT_INSTR_BRANCH_TEST_MASK_ZERO:
+    case ABSTRACT_INSTR_BRANCH_TEST_MASK_NONZERO:
+        *mask = rhs->one;
+        *rhs = constant_bits(0);
+        break;
+    }
+}
+
+/**
+ * Test if a branch is taken when its operands are equal (in the bits it
+ * compares).
+ */
+static bool taken_if_equal(enum abstract_instr_branch_test_type type) {
+    switch (type) {
+    case ABSTRACT_INSTR_BRANCH_TEST_EQ:
+    case ABSTRACT_INSTR_BRANCH_TEST_LOW_EQ:
+    case ABSTRACT_INSTR_BRANCH_TEST_MASK_ZERO:
+        return true;
+    case ABSTRACT_INSTR_BRANCH_TEST_NE:
+    case ABSTRACT_INSTR_BRANCH_TEST_LOW_NE:
+    case ABSTRACT_INSTR_BRANCH_TEST_MASK_NONZERO:
+        return false;
+    }
+
+    RUNTIME_ERROR("Invalid branch test %d", type);
+}
+
+/**
+ * Work out which way a branch goes, returns false if it could go either way.
+ */
+static bool branch_outcome(struct reg_bits *state,
+                           struct abstract_instr_branch *b, bool *taken) {
+    struct known_bits lhs, rhs;
+    uint32_t mask;
+    branch_operands(state, b, &lhs, &rhs, &mask);
+
+    uint32_t differ = (lhs.zero & rhs.one) | (lhs.one & rhs.zero);
+    uint32_t known = (lhs.zero | lhs.one) & (rhs.zero | rhs.one);
+
+    if ((differ & mask) != 0) {
+        *taken = !taken_if_equal(b->type);
+        return true;
+    }
+
+    if ((known & mask) == mask) {
+        *taken = taken_if_equal(b->type);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * Record what is learnt about a register compared against a constant by a
+ * branch, on the way out of it where the compared bits are equal.
+ */
+static void learn_equal(struct reg_bits *state,
+                        struct abstract_instr_branch *b) {
+    struct known_bits lhs, rhs;
+    uint32_t mask;
+    branch_operands(state, b, &lhs, &rhs, &mask);
+
+    struct abstract_storage reg = b->lhs;
+    struct known_bits value = rhs;
+
+    // only equality tests have a constant on the left
+    if (b->lhs.type == ABSTRACT_STORAGE_IMM) {
+        reg = b->rhs;
+        value = lhs;
+    }
+
+    if (reg.type != ABSTRACT_STORAGE_REG || reg.reg == REG_ZERO ||
+        !is_constant(value)) {
+        return;
+    }
+
+    state->regs[reg.reg].zero |= value.zero & mask;
+    state->regs[reg.reg].one |= value.one & mask;
+}
+
+/**
+ * Merge 'from' into what is known before 'instrs[i]', returns true if that
+ * changed.
+ */
+static bool merge_state(struct reg_bits *states, size_t i,
+                        struct reg_bits *from) {
+    struct reg_bits *to = &states[i];
+
+    if (!to->reached) {
+        *to = *from;
+        return true;
+    }
+
+    bool changed = false;
+    for (enum reg_type reg = SMALLEST_MIPS_REG; reg <= LARGEST_MIPS_REG;
+         reg++) {
+        struct known_bits merged = {.zero = to->regs[reg].zero &
+                                            from->regs[reg].zero,
+                                    .one = to->regs[reg].one &
+                                           from->regs[reg].one};
+
+        if (merged.zero != to->regs[reg].zero ||
+            merged.one != to->regs[reg].one) {
+            to->regs[reg] = merged;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+/**
+ * Find what is known about each register before each instruction, by
+ * following control flow until nothing changes.
+ */
+static struct reg_bits *find_known_bits(struct abstract_instr_vec *instrs,
+                                        struct label_refs *refs) {
+    struct reg_bits *states = calloc(instrs->len, sizeof(struct reg_bits));
+    struct instr_worklist queued = instr_worklist_new(instrs->len);
+
+    bool jumps_indirectly = abstract_instrs_jump_indirectly(instrs);
+
+    // nothing is known at entries, which is what calloc gives
+    for (size_t i = 0; i < instrs->len; i++) {
+        if (abstract_instr_is_entry(instrs, i, jumps_indirectly)) {
+            states[i].reached = true;
+            instr_worklist_add(&queued, i);
+        }
+    }
+
+    size_t i;
+    while (instr_worklist_take(&queued, &i)) {
+        struct abstract_instr instr = abstract_instr_get(instrs, i);
+        size_t succ[2];
+        bool exits;
+        size_t num_succ =
+            abstract_instr_successors(instrs, refs, i, succ, &exits);
+
+        for (size_t s = 0; s < num_succ; s++) {
+            struct reg_bits out = states[i];
+
+            if (instr.type == ABSTRACT_INSTR_BRANCH) {
+                // the fallthrough comes first, if there is one
+                bool is_taken_edge = s > 0 || i + 1 == instrs->len;
+                bool taken;
+
+                if (branch_outcome(&out, &instr.branch, &taken)) {
+                    if (taken != is_taken_edge) {
+                        continue;
+                    }
+                } else if (is_taken_edge ==
+                           taken_if_equal(instr.branch.type)) {
+                    learn_equal(&out, &instr.branch);
+                }
+            } else {
+                transfer(&out, &instr);
+            }
+
+            if (merge_state(states, succ[s], &out)) {
+                instr_worklist_add(&queued, succ[s]);
+            }
+        }
+    }
+
+    instr_worklist_free(&queued);
+
+    return states;
+}
+
+/**
+ * Find the registers live into each instruction, as bit masks. Everything is
+ * taken to be live wherever control leaves what can be seen.
+ */
+static uint64_t *find_live_in(struct abstract_instr_vec *instrs,
+                              struct label_refs *refs) {
+    uint64_t *live_in = calloc(instrs->len, sizeof(uint64_t));
+    bool changed = true;
+
+    while (changed) {
+        changed = false;
+
+        for (size_t i = instrs->len; i-- > 0;) {
+            struct abstract_instr instr = abstract_instr_get(instrs, i);
+            enum reg_type regs[ABSTRACT_INSTR_MAX_REGS];
+            size_t succ[2];
+            bool exits;
+            size_t num_succ =
+                abstract_instr_successors(instrs, refs, i, succ, &exits);
+
+            uint64_t live = exits ? UINT64_MAX : 0;
+            for (size_t s = 0; s < num_succ; s++) {
+                live |= live_in[succ[s]];
+            }
+
+            size_t num_defs = abstract_instr_defs(&instr, regs);
+            for (size_t d = 0; d < num_defs; d++) {
+                live &= ~(1ull << regs[d]);
+            }
+
+            size_t num_uses = abstract_instr_uses(&instr, regs);
+            for (size_t u = 0; u < num_uses; u++) {
+                live |= 1ull << regs[u];
+            }
+
+            if (live != live_in[i]) {
+                live_in[i] = live;
+                changed = true;
+            }
+        }
+    }
+
+    return live_in;
+}
+
+/**
+ * Test if 'reg' may be read after the branch 'instrs[i]'.
+ */
+static bool live_after(struct abstract_instr_vec *instrs,
+                       struct label_refs *refs, uint64_t *live_in, size_t i,
+                       enum reg_type reg) {
+    size_t succ[2];
+    bool exits;
+    size_t num_succ =
+        abstract_instr_successors(instrs, refs, i, succ, &exits);
+
+    if (exits) {
+        return true;
+    }
+
+    for (size_t s = 0; s < num_succ; s++) {
+        if (live_in[succ[s]] & (1ull << reg)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * If the branch 'instrs[i]' tests `$t == 0` (or `!=`) right after
+ * `$t <- $s & mask`, and $t isn't read afterwards, branch on `$s & mask`
+ * instead. Returns true if it did, when the and is no longer needed.
+ */
+static bool fuse_mask_test(struct abstract_instr_vec *instrs,
+                           struct label_refs *refs, uint64_t *live_in,
+                           size_t i) {
+    struct abstract_instr branch = abstract_instr_get(instrs, i);
+    struct abstract_instr and = abstract_instr_get(instrs, i - 1);
+    struct abstract_storage tested = branch.branch.lhs;
+    struct abstract_storage zero = branch.branch.rhs;
+
+    if (tested.type == ABSTRACT_STORAGE_IMM) {
+        tested = branch.branch.rhs;
+        zero = branch.branch.lhs;
+    }
+
+    if ((branch.branch.type != ABSTRACT_INSTR_BRANCH_TEST_EQ &&
+         branch.branch.type != ABSTRACT_INSTR_BRANCH_TEST_NE) ||
+        branch.label != NULL || zero.type != ABSTRACT_STORAGE_IMM ||
+        zero.imm != 0 || tested.type != ABSTRACT_STORAGE_REG ||
+        and.type != ABSTRACT_INSTR_BINOP ||
+        and.binop.op != ABSTRACT_INSTR_BINOP_AND ||
+        and.binop.dest != tested.reg) {
+        return false;
+    }
+
+    struct abstract_storage source = and.binop.lhs;
+    struct abstract_storage mask = and.binop.rhs;
+
+    if (source.type == ABSTRACT_STORAGE_IMM) {
+        source = and.binop.rhs;
+        mask = and.binop.lhs;
+    }
+
+    if (source.type != ABSTRACT_STORAGE_REG ||
+        mask.type != ABSTRACT_STORAGE_IMM || source.reg == tested.reg ||
+        live_after(instrs, refs, live_in, i, tested.reg)) {
+        return false;
+    }
+
+    DEBUG_LOG("testing %s against a mask at %zu", reg_type_names[source.reg],
+              i);
+
+    branch.branch.type = branch.branch.type == ABSTRACT_INSTR_BRANCH_TEST_EQ
+                              ? ABSTRACT_INSTR_BRANCH_TEST_MASK_ZERO
+                              : ABSTRACT_INSTR_BRANCH_TEST_MASK_NONZERO;
+    branch.branch.lhs = source;
+    branch.branch.rhs = mask;
+    abstract_instr_set(instrs, i, &branch);
+
+    return true;
+}
+
+void simplify_known_bits(struct abstract_instr_vec *instrs) {
+    struct label_refs refs = find_label_refs(instrs);
+    struct reg_bits *states = find_known_bits(instrs, &refs);
+    uint64_t *live_in = find_live_in(instrs, &refs);
+    bool *removed = calloc(instrs->len, sizeof(bool));
+
+    for (size_t i = 0; i < instrs->len; i++) {
+        struct abstract_instr instr = abstract_instr_get(instrs, i);
+        struct reg_bits *state = &states[i];
+        enum reg_type dest;
+        struct known_bits bits;
+
+        if (!state->reached) {
+            continue;
+        }
+
+        if (instr.type == ABSTRACT_INSTR_BRANCH) {
+            bool taken;
+
+            if (branch_outcome(state, &instr.branch, &taken)) {
+                DEBUG_LOG("branch at %zu is %s taken", i,
+                          taken ? "always" : "never");
+
+                if (taken) {
+                    instr = (struct abstract_instr){
+                        .type = ABSTRACT_INSTR_JUMP,
+                        .label = instr.label,
+                        .guest_address = instr.guest_address,
+                        .jump = {.label = instr.branch.label}};
+                    abstract_instr_set(instrs, i, &instr);
+                } else {
+                    removed[i] = abstract_instr_is_removable(instrs, i);
+                }
+            } else if (i > 0 && !removed[i - 1] &&
+                       fuse_mask_test(instrs, &refs, live_in, i)) {
+                removed[i - 1] = abstract_instr_is_removable(instrs, i - 1);
+            }
+            continue;
+        }
+
+        if (!result_bits(state, &instr, &dest, &bits)) {
+            continue;
+        }
+
+        // trapping adds left by the range analysis may overflow, which a
+        // move wouldn't
+        bool is_move_imm = instr.type == ABSTRACT_INSTR_MOV &&
+                           instr.mov.source.type == ABSTRACT_STORAGE_IMM;
+        bool may_trap = instr.type == ABSTRACT_INSTR_BINOP &&
+                        instr.binop.op == ABSTRACT_INSTR_BINOP_ADD_TRAP;
+
+        if (is_constant(bits) && !is_move_imm && !may_trap) {
+            DEBUG_LOG("%s is always %u at %zu", reg_type_names[dest], bits.one,
+                      i);
+            instr = (struct abstract_instr){
+                .type = ABSTRACT_INSTR_MOV,
+                .label = instr.label,
+                .guest_address = instr.guest_address,
+                .mov = {.dest = dest,
+                        .source = {.type = ABSTRACT_STORAGE_IMM,
+                                   .imm = bits.one}}};
+            abstract_instr_set(instrs, i, &instr);
+            continue;
+        }
+
+        if (instr.type != ABSTRACT_INSTR_BINOP ||
+            instr.binop.op != ABSTRACT_INSTR_BINOP_AND) {
+            continue;
+        }
+
+        struct abstract_storage source = instr.binop.lhs;
+        struct abstract_storage mask = instr.binop.rhs;
+
+        if (source.type == ABSTRACT_STORAGE_IMM) {
+            source = instr.binop.rhs;
+            mask = instr.binop.lhs;
+        }
+
+        // an and that only clears bits that are already clear does nothing
+        if (source.type != ABSTRACT_STORAGE_REG ||
+            mask.type != ABSTRACT_STORAGE_IMM ||
+            (storage_bits(state, source).zero | mask.imm) != UINT32_MAX) {
+            continue;
+        }
+
+        DEBUG_LOG("mask at %zu changes nothing", i);
+
+        if (source.reg == dest) {
+            removed[i] = abstract_instr_is_removable(instrs, i);
+        } else {
+            instr = (struct abstract_instr){.type = ABSTRACT_INSTR_MOV,
+                                            .label = instr.label,
+                                            .guest_address =
+                                                instr.guest_address,
+                                            .mov = {.dest = dest,
+                                                    .source = source}};
+            abstract_instr_set(instrs, i, &instr);
+        }
+    }
+
+    remove_marked_abstract_instrs(instrs, removed);
+
+    free(removed);
+    free(live_in);
+    free(states);
+    free_label_refs(&refs);
+}
@@ -0,0 +1,35 @@
+#ifndef __KNOWN_BITS_H_
+#define __KNOWN_BITS_H_
+
+#include "abstract_instr.h"
+
+/**
+ * Known bits analysis
+ *
+ * For every register before every instruction this works out which bits are
+ * known to be zero and which are known to be one, following constants through
+ * moves, adds, ands, multiplies and shifts, and learning from the branches
+ * taken to get there (after `beq $t 5 l` falls through nothing new is known,
+ * but at `l` $t is 5).
+ *
+ * Where control can arrive from outside what the analysis can see nothing is
+ * known: at the start of the program, after calls, and at every label when
+ * the program has returns or `jr` that may land there.
+ *
+ * What is known is then used to:
+ *
+ * - replace instructions whose result is known with a move of it,
+ * - drop `andi` masks that only clear bits that are already clear,
+ * - turn branches that always go the same way into a jump, or drop them,
+ * - turn `andi $t $s mask; beq $t $zero l`, when $t isn't read afterwards,
+ *   into a single branch on `$s & mask` (a `test` and `jz`).
+ *
+ * The label of a dropped instruction moves on to the next one.
+ */
+
+/**
+ * Simplify instructions using the bits known about the registers they use.
+ */
+void simplify_known_bits(struct abstract_instr_vec *instrs);
+
+#endif // __KNOWN_BITS_H_
@@ -1,6 +1,7 @@
 #ifndef __LABEL_H_
 #define __LABEL_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "str_slice.h"
@@ -10,8 +11,10 @@ struct label {
     struct string_slice name;
     uint32_t id;
     int32_t code_position; // -1 if unallocated
+    bool has_guest_address; // if the label can be jumped to by guest code
+    uint32_t guest_address;
 };
 
-DEFINE_VEC(struct label, labels);
+DEFINE_VEC(struct label *, labels);
 
 #endif // __LABEL_H_
@@ -1,12 +1,86 @@
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "label_storage.h"
 
 static struct labels_vec *labels;
 
+// named labels by the hash of their name, open addressed, NULL for an empty
+// slot. kept at most half full
+static struct label **named;
+static size_t named_capacity;
+static size_t num_named;
+
 void init_labels(void) __attribute__((constructor));
-void init_labels(void) { labels = labels_vec_new(); }
+void init_labels(void) {
+    labels = labels_vec_new();
+    named_capacity = 64;
+    named = calloc(named_capacity, sizeof(struct label *));
+}
+
+static size_t hash_name(struct string_slice s) {
+    size_t h = 14695981039346656037ull;
+
+    for (size_t i = 0; i < s.len; i++) {
+        h = (h ^ (uint8_t)s.s[i]) * 1099511628211ull;
+    }
+
+    return h;
+}
+
+/**
+ * The slot holding the label named 's', or the empty one it would go in.
+ */
+static struct label **find_slot(struct string_slice s) {
+    size_t mask = named_capacity - 1;
+
+    for (size_t i = hash_name(s) & mask;; i = (i + 1) & mask) {
+        if (named[i] == NULL ||
+            (named[i]->name.len == s.len &&
+             !strncmp(s.s, named[i]->name.s, s.len))) {
+            return &named[i];
+        }
+    }
+}
+
+static void grow_named(void) {
+    struct label **old = named;
+    size_t old_capacity = named_capacity;
+
+    named_capacity *= 2;
+    named = calloc(named_capacity, sizeof(struct label *));
+
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i] != NULL) {
+            *find_slot(old[i]->name) = old[i];
+        }
+    }
+
+    free(old);
+}
+
+/**
+ * Allocate a new label, labels are individually allocated so pointers to them
+ * stay valid as more are added.
+ */
+static struct label *new_label(struct string_slice s) {
+    struct label *label = malloc(sizeof(struct label));
+    *label = (struct label){.name = s, .id = labels->len, .code_position = -1};
+
+    labels_vec_push(labels, label);
+
+    if (s.len > 0) {
+        if (2 * (num_named + 1) > named_capacity) {
+            grow_named();
+        }
+
+        *find_slot(s) = label;
+        num_named++;
+    }
+
+    return label;
+}
 
 struct label *add_label(struct string_slice s) {
     struct label *maybe_label = lookup_label(s);
@@ -17,27 +91,38 @@ struct label *add_label(struct string_slice s) {
 
     // not found, add label
 
-    labels_vec_push(
-        labels,
-        (struct label){.name = s, .id = labels->len, .code_position = -1});
+    return new_label(s);
+}
 
-    return &labels->data[labels->len - 1];
+struct label *add_internal_label(void) {
+    return new_label((struct string_slice){.s = "", .len = 0});
 }
 
 struct label *lookup_label(struct string_slice s) {
-    for (size_t i = 0; i < labels->len; i++) {
-        if (s.len != labels->data[i].name.len) {
-            continue;
-        }
-
-        if (!strncmp(s.s, labels->data[i].name.s, s.len)) {
-            return &labels->data[i];
-        }
+    if (s.len == 0) {
+        return NULL;
     }
 
-    return NULL;
+    return *find_slot(s);
 }
 
 void resolve_label(struct label *label, uint32_t code_position) {
     label->code_position = code_position;
 }
+
+void set_label_guest_address(struct label *label, uint32_t guest_address) {
+    label->has_guest_address = true;
+    label->guest_address = guest_address;
+}
+
+struct labels_vec *all_labels(void) { return labels; }
+
+void clear_labels(void) {
+    for (size_t i = 0; i < labels->len; i++) {
+        free(labels->data[i]);
+    }
+
+    labels->len = 0;
+    memset(named, 0, named_capacity * sizeof(struct label *));
+    num_named = 0;
+}
@@ -12,6 +12,11 @@
  */
 struct label *add_label(struct string_slice s);
 
+/**
+ * Add an anonymous label, these are never returned by `lookup_label`.
+ */
+struct label *add_internal_label(void);
+
 /**
  * Lookup a lable, returns NULL if the label is not found.
  */
@@ -22,4 +27,19 @@ struct label *lookup_label(struct string_slice s);
  */
 void resolve_label(struct label *label, uint32_t code_position);
 
+/**
+ * Declare the guest address a label refers to.
+ */
+void set_label_guest_address(struct label *label, uint32_t guest_address);
+
+/**
+ * All labels, indexed by their id.
+ */
+struct labels_vec *all_labels(void);
+
+/**
+ * Free every label, so another program can be parsed from scratch.
+ */
+void clear_labels(void);
+
 #endif // __LABEL_STORAGE_H_
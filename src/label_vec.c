@@ -1,4 +1,4 @@
 #include "label.h"
 #include "vec.h"
 
-MAKE_VEC(struct label, labels);
+MAKE_VEC(struct label *, labels);
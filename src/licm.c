@@ -0,0 +1,281 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "abstract_instr.h"
+#include "common.h"
+#include "label_storage.h"
+#include "licm.h"
+#include "mips_reg.h"
+
+/**
+ * Rotate the loop whose head is at 'start', if it is top tested. Returns true
+ * if the loop was rotated.
+ */
+static bool rotate_loop(struct abstract_instr_vec *instrs, size_t start) {
+    struct abstract_instr guard = abstract_instr_get(instrs, start);
+    struct label *head = guard.label;
+
+    if (head == NULL || guard.type != ABSTRACT_INSTR_BRANCH) {
+        return false;
+    }
+
+    // the loop is closed by `j head` just before where the guard leaves to,
+    // with at least one instruction in between
+    size_t exit = abstract_instrs_next_labelled(instrs, start + 1);
+    while (exit < instrs->len &&
+           abstract_instr_label(instrs, exit) != guard.branch.label) {
+        exit = abstract_instrs_next_labelled(instrs, exit + 1);
+    }
+
+    if (exit >= instrs->len || exit < start + 3) {
+        return false;
+    }
+
+    struct abstract_instr jump = abstract_instr_get(instrs, exit - 1);
+
+    if (jump.type != ABSTRACT_INSTR_JUMP || jump.jump.label != head) {
+        return false;
+    }
+
+    DEBUG_LOG("rotating loop at %zu", start);
+
+    // the body needs a guest address for traces to follow the new back edge
+    struct label *body = abstract_instr_label(instrs, start + 1);
+    if (body == NULL) {
+        body = add_internal_label();
+        set_label_guest_address(body, instrs->guest_addresses[start + 1]);
+        abstract_instr_set_label(instrs, start + 1, body);
+    }
+
+    struct abstract_instr_branch test = guard.branch;
+    test.type = invert_branch_test(test.type);
+    test.label = body;
+
+    struct abstract_instr back_edge = {.type = ABSTRACT_INSTR_BRANCH,
+                                       .label = jump.label,
+                                       .guest_address = jump.guest_address,
+                                       .branch = test};
+    abstract_instr_set(instrs, exit - 1, &back_edge);
+
+    return true;
+}
+
+void rotate_loops(struct abstract_instr_vec *instrs) {
+    for (size_t i = 0; i < instrs->len; i++) {
+        rotate_loop(instrs, i);
+    }
+}
+
+/**
+ * Test if 'i' can be moved out of a loop, given how many times each register
+ * is written in the loop and which are read before 'i'.
+ */
+static bool is_invariant(struct abstract_instr *i, uint32_t *defs,
+                         bool *read_before, bool loop_stores) {
+    switch (i->type) {
+    case ABSTRACT_INSTR_BINOP:
+    case ABSTRACT_INSTR_MOV:
+    case ABSTRACT_INSTR_SHIFT:
+        break;
+    case ABSTRACT_INSTR_LOAD:
+        if (loop_stores) {
+            return false;
+        }
+        break;
+    default:
+        return false;
+    }
+
+    enum reg_type regs[ABSTRACT_INSTR_MAX_REGS];
+
+    // all of these write exactly one register
+    abstract_instr_defs(i, regs);
+    if (defs[regs[0]] != 1 || read_before[regs[0]]) {
+        return false;
+    }
+
+    size_t num_uses = abstract_instr_uses(i, regs);
+    for (size_t u = 0; u < num_uses; u++) {
+        if (defs[regs[u]] != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Point jumps to 'from' in 'instrs[start..end]' at 'to' instead.
+ */
+static void retarget(struct abstract_instr_vec *instrs, size_t start,
+                     size_t end, struct label *from, struct label *to) {
+    for (size_t i = start; i <= end; i++) {
+        union abstract_instr_operands *operands = &instrs->operands[i];
+
+        if (instrs->types[i] == ABSTRACT_INSTR_BRANCH &&
+            operands->branch.label == from) {
+            operands->branch.label = to;
+        } else if (instrs->types[i] == ABSTRACT_INSTR_JUMP &&
+                   operands->jump.label == from) {
+            operands->jump.label = to;
+        }
+    }
+}
+
+/**
+ * Move invariant instructions out of the loop 'instrs[start..end]', to just
+ * before it, unless it can be entered other than from just before it
+ * ('jumps_indirectly' as for `abstract_instr_is_entry`). Returns true if
+ * anything was moved.
+ */
+static bool hoist_loop(struct abstract_instr_vec *instrs,
+                       struct label_refs *refs, bool jumps_indirectly,
+                       size_t start, size_t end) {
+    uint32_t defs[LARGEST_MIPS_REG + 1] = {0};
+    bool read_before[LARGEST_MIPS_REG + 1] = {false};
+    bool loop_stores = false;
+
+    for (size_t i = start; i <= end; i++) {
+        struct abstract_instr instr = abstract_instr_get(instrs, i);
+        struct label *label = instr.label;
+        enum reg_type regs[ABSTRACT_INSTR_MAX_REGS];
+
+        // nothing may jump into the loop from outside, through `jr` or a
+        // return either
+        if ((label != NULL && (refs->first_ref[label->id] < start ||
+                               refs->last_ref[label->id] > end)) ||
+            abstract_instr_is_entry(instrs, i, jumps_indirectly)) {
+            return false;
+        }
+
+        switch (instr.type) {
+        case ABSTRACT_INSTR_CALL:
+        case ABSTRACT_INSTR_RETURN:
+        case ABSTRACT_INSTR_JUMP_REG:
+            return false;
+        case ABSTRACT_INSTR_STORE:
+            loop_stores = true;
+            break;
+        default:
+            break;
+        }
+
+        size_t num_defs = abstract_instr_defs(&instr, regs);
+        for (size_t d = 0; d < num_defs; d++) {
+            defs[regs[d]]++;
+        }
+    }
+
+    struct abstract_instr instr = abstract_instr_get(instrs, start);
+    if (abstract_instr_target_label(&instr) != NULL) {
+        return false;
+    }
+
+    // the start of the loop up to the first label or branch runs on every
+    // iteration, before anything can leave the loop
+    size_t prefix_end = start + 1;
+    for (; prefix_end < end; prefix_end++) {
+        instr = abstract_instr_get(instrs, prefix_end);
+        if (instr.label != NULL ||
+            abstract_instr_target_label(&instr) != NULL) {
+            break;
+        }
+    }
+
+    // the prefix is put back as the hoisted instructions then the rest
+    struct abstract_instr *hoisted =
+        malloc((prefix_end - start) * sizeof(struct abstract_instr));
+    struct abstract_instr *kept =
+        malloc((prefix_end - start) * sizeof(struct abstract_instr));
+    size_t num_hoisted = 0, num_kept = 0;
+
+    for (size_t i = start; i < prefix_end; i++) {
+        enum reg_type regs[ABSTRACT_INSTR_MAX_REGS];
+
+        instr = abstract_instr_get(instrs, i);
+
+        if (is_invariant(&instr, defs, read_before, loop_stores)) {
+            // from here on its register doesn't change in the loop
+            abstract_instr_defs(&instr, regs);
+            defs[regs[0]] = 0;
+            hoisted[num_hoisted++] = instr;
+            continue;
+        }
+
+        size_t num_uses = abstract_instr_uses(&instr, regs);
+        for (size_t u = 0; u < num_uses; u++) {
+            read_before[regs[u]] = true;
+        }
+
+        kept[num_kept++] = instr;
+    }
+
+    if (num_hoisted == 0) {
+        free(hoisted);
+        free(kept);
+        return false;
+    }
+
+    DEBUG_LOG("hoisting %zu instructions out of loop at %zu", num_hoisted,
+              start);
+
+    struct label *head = hoisted[0].label;
+
+    for (size_t i = 0; i < num_hoisted; i++) {
+        abstract_instr_set(instrs, start + i, &hoisted[i]);
+    }
+    for (size_t i = 0; i < num_kept; i++) {
+        abstract_instr_set(instrs, start + num_hoisted + i, &kept[i]);
+    }
+    free(hoisted);
+    free(kept);
+
+    // if the head itself was moved out the loop starts at the first
+    // instruction left in it
+    if (head != NULL) {
+        size_t new_head = start + num_hoisted;
+        struct label *label = abstract_instr_label(instrs, new_head);
+
+        if (label == NULL) {
+            label = add_internal_label();
+            set_label_guest_address(label, instrs->guest_addresses[new_head]);
+            abstract_instr_set_label(instrs, new_head, label);
+        }
+
+        // only the loop jumped to the old head, though a guest label stays
+        // where its address says
+        retarget(instrs, new_head, end, head, label);
+        if (!head->has_guest_address) {
+            abstract_instr_set_label(instrs, start, NULL);
+        }
+    }
+
+    return true;
+}
+
+void hoist_loop_invariants(struct abstract_instr_vec *instrs) {
+    struct label_refs refs = find_label_refs(instrs);
+    bool jumps_indirectly = abstract_instrs_jump_indirectly(instrs);
+
+    // inner loops end first, so their invariants can move out of each loop
+    // in turn
+    for (size_t end = 0; end < instrs->len; end++) {
+        struct abstract_instr instr = abstract_instr_get(instrs, end);
+        struct label *head = abstract_instr_target_label(&instr);
+
+        if (head == NULL || instr.type == ABSTRACT_INSTR_CALL ||
+            refs.index[head->id] > end) {
+            continue;
+        }
+
+        if (hoist_loop(instrs, &refs, jumps_indirectly, refs.index[head->id],
+                       end)) {
+            free_label_refs(&refs);
+            refs = find_label_refs(instrs);
+        }
+    }
+
+    free_label_refs(&refs);
+}
@@ -0,0 +1,49 @@
+#ifndef __LICM_H_
+#define __LICM_H_
+
+#include "abstract_instr.h"
+
+/**
+ * Loop rotation and loop invariant code motion
+ *
+ * A loop written with its test at the top:
+ *
+ * head: beq $s $t exit
+ *       body
+ *       j head
+ * exit:
+ *
+ * is rotated so the test is repeated at the bottom, leaving one branch per
+ * iteration, and the test at the top only guards entry to the loop:
+ *
+ * head: beq $s $t exit
+ * body: body
+ *       bne $s $t body
+ * exit:
+ *
+ * The guard doesn't jump back into the loop, so the space between it and the
+ * body is somewhere to put instructions that only need to run once before the
+ * loop (a preheader).
+ *
+ * An instruction is then moved out of a loop into its preheader when:
+ *
+ * - it runs at the start of every iteration, before anything can branch,
+ * - it's pure, or a load and nothing in the loop stores to memory,
+ * - nothing else in the loop writes the register it writes, or reads that
+ *   register before it,
+ * - nothing in the loop writes the registers it reads.
+ *
+ * Loops are only changed if nothing outside the loop jumps into it.
+ */
+
+/**
+ * Rotate top tested loops so they test at the bottom.
+ */
+void rotate_loops(struct abstract_instr_vec *instrs);
+
+/**
+ * Move loop invariant instructions out of loops.
+ */
+void hoist_loop_invariants(struct abstract_instr_vec *instrs);
+
+#endif // __LICM_H_
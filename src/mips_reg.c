@@ -13,6 +13,8 @@ const char *const reg_type_names[] = {
     [REG_S3] = "REG_S3",     [REG_S4] = "REG_S4",
     [REG_S5] = "REG_S5",     [REG_S6] = "REG_S6",
     [REG_S7] = "REG_S7",     [REG_T8] = "REG_T8",
-    [REG_T9] = "REG_T9" /* , [REG_K0] = "REG_K0", */
-    /* [REG_K1] = "REG_K1",     [REG_GP] = "REG_GP", [REG_SP] = "REG_SP", */
-    /* [REG_FP] = "REG_FP",     [REG_RA] = "REG_RA" */};
+    [REG_T9] = "REG_T9", /* [REG_K0] = "REG_K0", */
+    /* [REG_K1] = "REG_K1", */ [REG_GP] = "REG_GP",
+    [REG_SP] = "REG_SP",     [REG_FP] = "REG_FP",
+    [REG_RA] = "REG_RA",     [REG_HI] = "REG_HI",
+    [REG_LO] = "REG_LO"};
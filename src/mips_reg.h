@@ -34,12 +34,17 @@ enum __attribute__((__packed__)) reg_type {
     REG_T9,
     /* REG_K0, // reserved (error if we see this) */
     /* REG_K1, // reserved (error if we see this) */
-    /* REG_GP, // global area pointer (error if we see this) */
-    /* REG_SP, // stack pointer (error if we see this) */
-    /* REG_FP, // frame pointer (error if we see this) */
-    /* REG_RA  // return address (error if we see this) */
+    REG_GP, // global area pointer
+    REG_SP, // stack pointer, starts at the top of guest memory
+    REG_FP, // frame pointer
+    REG_RA, // return address, starts as GUEST_EXIT_ADDRESS
+
+    // pseudo registers, these can't be named in source but are allocated
+    // like any other register
+    REG_HI, // high word of mult, remainder of div
+    REG_LO, // low word of mult, quotient of div
     SMALLEST_MIPS_REG = REG_ZERO,
-    LARGEST_MIPS_REG = REG_T9,
+    LARGEST_MIPS_REG = REG_LO,
 };
 
 extern const char *const reg_type_names[];
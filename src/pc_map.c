@@ -0,0 +1,166 @@
+// for REG_RIP
+#define _GNU_SOURCE
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <ucontext.h>
+
+#include "label_storage.h"
+#include "pc_map.h"
+
+MAKE_VEC(struct pc_map_entry, pc_map_entry);
+
+struct pc_map *pc_map_new(size_t num_instrs, uint32_t *source_lines) {
+    struct pc_map *map = malloc(sizeof(struct pc_map));
+
+    *map = (struct pc_map){.entries = pc_map_entry_vec_new(),
+                           .num_instrs = num_instrs,
+                           .source_lines = source_lines,
+                           .labels = calloc(num_instrs + 1,
+                                            sizeof(struct label *))};
+
+    // everything before the first instruction is the prelude
+    pc_map_entry_vec_push(map->entries, (struct pc_map_entry){
+                                            .position = 0,
+                                            .instr = PC_MAP_NO_INSTR});
+
+    struct labels_vec *labels = all_labels();
+    for (size_t i = 0; i < labels->len; i++) {
+        struct label *label = labels->data[i];
+        size_t index = label->guest_address / 4;
+
+        if (label->name.len > 0 && label->has_guest_address &&
+            index < num_instrs) {
+            map->labels[index] = label;
+        }
+    }
+
+    // instructions come under the last label before them
+    for (size_t i = 1; i < num_instrs; i++) {
+        if (map->labels[i] == NULL) {
+            map->labels[i] = map->labels[i - 1];
+        }
+    }
+
+    return map;
+}
+
+void pc_map_free(struct pc_map *map) {
+    pc_map_entry_vec_free(map->entries);
+    free(map->labels);
+    free(map);
+}
+
+void pc_map_place(struct pc_map *map, uint8_t *code, uint32_t code_len) {
+    map->code = code;
+    map->code_len = code_len;
+}
+
+/**
+ * Stop the profiler looking at the table while it changes.
+ */
+static void block_sigprof(sigset_t *old) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    sigprocmask(SIG_BLOCK, &set, old);
+}
+
+static void add_entry(struct pc_map *map, uint32_t position, uint32_t instr) {
+    struct pc_map_entry *last = &map->entries->data[map->entries->len - 1];
+
+    if (last->instr == instr) {
+        return;
+    }
+
+    if (last->position == position) {
+        // the code before had no size
+        last->instr = instr;
+        return;
+    }
+
+    pc_map_entry_vec_push(map->entries, (struct pc_map_entry){
+                                            .position = position,
+                                            .instr = instr});
+}
+
+void pc_map_add_instrs(struct pc_map *map, struct abstract_instr_vec *instrs,
+                       size_t start, size_t len, uint32_t *offsets) {
+    sigset_t old;
+    block_sigprof(&old);
+
+    for (size_t i = 0; i < len; i++) {
+        size_t index = instrs->guest_addresses[start + i] / 4;
+
+        if (offsets[i] != offsets[i + 1] && index < map->num_instrs) {
+            add_entry(map, offsets[i], index);
+        }
+    }
+
+    add_entry(map, offsets[len], PC_MAP_NO_INSTR);
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+void pc_map_truncate(struct pc_map *map, uint32_t position) {
+    sigset_t old;
+    block_sigprof(&old);
+
+    // the entry at the start of the code is always kept
+    while (map->entries->len > 1 &&
+           map->entries->data[map->entries->len - 1].position >= position) {
+        map->entries->len--;
+    }
+
+    add_entry(map, position, PC_MAP_NO_INSTR);
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+bool pc_map_lookup(struct pc_map *map, uintptr_t pc, uint32_t *instr) {
+    if (map->code == NULL || pc < (uintptr_t)map->code ||
+        pc >= (uintptr_t)map->code + map->code_len) {
+        return false;
+    }
+
+    uint32_t position = pc - (uintptr_t)map->code;
+
+    // find the last entry at or before the position
+    size_t low = 0, high = map->entries->len;
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+
+        if (map->entries->data[mid].position <= position) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    *instr = map->entries->data[low].instr;
+    return true;
+}
+
+void pc_map_describe(struct pc_map *map, uint32_t instr, char *buf,
+                     size_t len) {
+    if (instr >= map->num_instrs) {
+        snprintf(buf, len, "prelude or stubs");
+        return;
+    }
+
+    struct label *label = map->labels[instr];
+
+    if (label == NULL) {
+        snprintf(buf, len, "line %u", map->source_lines[instr]);
+        return;
+    }
+
+    snprintf(buf, len, "line %u, %.*s+%u", map->source_lines[instr],
+             (int)label->name.len, label->name.s,
+             instr - label->guest_address / 4);
+}
+
+uintptr_t signal_pc(void *ucontext) {
+    return ((ucontext_t *)ucontext)->uc_mcontext.gregs[REG_RIP];
+}
@@ -0,0 +1,95 @@
+#ifndef __PC_MAP_H_
+#define __PC_MAP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "abstract_instr.h"
+#include "label.h"
+#include "vec.h"
+
+/**
+ * Native code to MIPS instruction map
+ *
+ * A table sorted by position in the generated code, each entry saying which
+ * MIPS instruction the code from there up to the next entry came from. It's
+ * built from where the code for each abstract instruction was placed, without
+ * the generated code knowing anything about it, so a native pc (from a signal
+ * handler) can be turned back into a guest location. Code the optimiser added
+ * counts as part of the instruction before it.
+ *
+ * Lookups are made from signal handlers, so they don't allocate, and SIGPROF
+ * is blocked while the table changes.
+ */
+
+// the instruction of code that didn't come from the program: the prelude and
+// stubs
+#define PC_MAP_NO_INSTR UINT32_MAX
+
+struct pc_map_entry {
+    uint32_t position; // from the start of the code
+    uint32_t instr;    // index of the MIPS instruction, or PC_MAP_NO_INSTR
+};
+
+DEFINE_VEC(struct pc_map_entry, pc_map_entry);
+
+struct pc_map {
+    uint8_t *code; // NULL until the code is placed
+    uint32_t code_len;
+    struct pc_map_entry_vec *entries;
+
+    size_t num_instrs;
+    uint32_t *source_lines; // line of each MIPS instruction in the source
+    struct label **labels;  // the label each MIPS instruction comes under
+};
+
+/**
+ * Create an empty map for a program of 'num_instrs' MIPS instructions, where
+ * instruction 'i' is on line 'source_lines[i]' of the source. The labels are
+ * taken from the translated program.
+ */
+struct pc_map *pc_map_new(size_t num_instrs, uint32_t *source_lines);
+
+void pc_map_free(struct pc_map *map);
+
+/**
+ * Declare where the code is once it's been placed, 'code_len' bytes at
+ * 'code'.
+ */
+void pc_map_place(struct pc_map *map, uint8_t *code, uint32_t code_len);
+
+/**
+ * Record the code compiled for 'len' abstract instructions from 'start'. The
+ * code for the i-th starts at position 'offsets[i]', and what follows them
+ * (exit and trap stubs) from 'offsets[len]'. Code must be added in increasing
+ * position.
+ */
+void pc_map_add_instrs(struct pc_map *map, struct abstract_instr_vec *instrs,
+                       size_t start, size_t len, uint32_t *offsets);
+
+/**
+ * Forget the code from 'position' on, as it's about to be replaced.
+ */
+void pc_map_truncate(struct pc_map *map, uint32_t position);
+
+/**
+ * Find the MIPS instruction the code at 'pc' came from, which may be
+ * PC_MAP_NO_INSTR. Returns false if 'pc' isn't in the generated code.
+ */
+bool pc_map_lookup(struct pc_map *map, uintptr_t pc, uint32_t *instr);
+
+/**
+ * Describe where MIPS instruction 'instr' is, as its line and the label it's
+ * under.
+ */
+void pc_map_describe(struct pc_map *map, uint32_t instr, char *buf,
+                     size_t len);
+
+/**
+ * The pc a signal interrupted, from the context given to a SA_SIGINFO
+ * handler.
+ */
+uintptr_t signal_pc(void *ucontext);
+
+#endif // __PC_MAP_H_
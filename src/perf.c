@@ -0,0 +1,282 @@
+#include <elf.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "abstract_instr.h"
+#include "perf.h"
+
+// the jitdump format, as in tools/perf/util/jitdump.h in the kernel tree
+
+#define JITDUMP_MAGIC 0x4a695444 // "JiTD"
+#define JITDUMP_VERSION 1
+
+enum jitdump_record_type {
+    JIT_CODE_LOAD = 0,
+    JIT_CODE_DEBUG_INFO = 2,
+    JIT_CODE_CLOSE = 3
+};
+
+struct jitdump_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+};
+
+struct jitdump_record_header {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+};
+
+// followed by the name and the code
+struct jitdump_code_load {
+    struct jitdump_record_header header;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+};
+
+// followed by the entries
+struct jitdump_debug_info {
+    struct jitdump_record_header header;
+    uint64_t code_addr;
+    uint64_t nr_entry;
+};
+
+// followed by the source file name
+struct jitdump_debug_entry {
+    uint64_t addr;
+    int32_t lineno;
+    int32_t discrim;
+};
+
+struct perf_output {
+    FILE *map;
+    FILE *dump;
+    void *marker; // perf finds the dump by this mapping of it
+    size_t marker_len;
+    const char *source_path;
+    uint32_t *source_lines;
+    size_t num_instrs;
+    uint64_t code_index;
+    uint32_t pid;
+    uint32_t tid;
+};
+
+// code from 'addr' on came from line 'line' of the source
+struct perf_line {
+    uint64_t addr;
+    uint32_t line;
+};
+
+/**
+ * The time records are stamped with, perf has to be told to use the same
+ * clock with `perf record -k mono`.
+ */
+static uint64_t perf_timestamp(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static FILE *open_output(const char *path) {
+    FILE *file = fopen(path, "w+");
+    if (file == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+
+    return file;
+}
+
+struct perf_output *perf_output_new(const char *source_path,
+                                    uint32_t *source_lines,
+                                    size_t num_instrs) {
+    struct perf_output *perf = malloc(sizeof(struct perf_output));
+    char path[64];
+
+    *perf = (struct perf_output){.source_path = source_path,
+                                 .source_lines = source_lines,
+                                 .num_instrs = num_instrs,
+                                 .pid = getpid(),
+                                 .tid = syscall(SYS_gettid)};
+
+    snprintf(path, sizeof(path), "/tmp/perf-%u.map", perf->pid);
+    perf->map = open_output(path);
+
+    snprintf(path, sizeof(path), "/tmp/jit-%u.dump", perf->pid);
+    perf->dump = open_output(path);
+
+    struct jitdump_header header = {.magic = JITDUMP_MAGIC,
+                                    .version = JITDUMP_VERSION,
+                                    .total_size = sizeof(header),
+                                    .elf_mach = EM_X86_64,
+                                    .pid = perf->pid,
+                                    .timestamp = perf_timestamp()};
+    fwrite(&header, sizeof(header), 1, perf->dump);
+    fflush(perf->dump);
+
+    // perf record only sees files that are mapped executable
+    perf->marker_len = sysconf(_SC_PAGESIZE);
+    perf->marker = mmap(NULL, perf->marker_len, PROT_READ | PROT_EXEC,
+                        MAP_PRIVATE, fileno(perf->dump), 0);
+    if (perf->marker == MAP_FAILED) {
+        perror("Mapping jitdump failed");
+        exit(EXIT_FAILURE);
+    }
+
+    return perf;
+}
+
+void perf_output_free(struct perf_output *perf) {
+    struct jitdump_record_header close = {.id = JIT_CODE_CLOSE,
+                                          .total_size = sizeof(close),
+                                          .timestamp = perf_timestamp()};
+    fwrite(&close, sizeof(close), 1, perf->dump);
+
+    munmap(perf->marker, perf->marker_len);
+    fclose(perf->dump);
+    fclose(perf->map);
+    free(perf);
+}
+
+static void write_debug_info(struct perf_output *perf, uint8_t *code,
+                             struct perf_line *lines, size_t num_lines) {
+    size_t entry_size =
+        sizeof(struct jitdump_debug_entry) + strlen(perf->source_path) + 1;
+    struct jitdump_debug_info info = {
+        .header = {.id = JIT_CODE_DEBUG_INFO,
+                   .total_size = sizeof(info) + num_lines * entry_size,
+                   .timestamp = perf_timestamp()},
+        .code_addr = (uintptr_t)code,
+        .nr_entry = num_lines};
+    fwrite(&info, sizeof(info), 1, perf->dump);
+
+    for (size_t i = 0; i < num_lines; i++) {
+        struct jitdump_debug_entry entry = {.addr = lines[i].addr,
+                                            .lineno = lines[i].line};
+        fwrite(&entry, sizeof(entry), 1, perf->dump);
+        fwrite(perf->source_path, strlen(perf->source_path) + 1, 1,
+               perf->dump);
+    }
+}
+
+/**
+ * Name 'size' bytes at 'code', with the source lines it came from if there
+ * are any. The line info has to come before the code it's for.
+ */
+static void add_symbol(struct perf_output *perf, const char *name,
+                       uint8_t *code, uint32_t size, struct perf_line *lines,
+                       size_t num_lines) {
+    if (size == 0) {
+        return;
+    }
+
+    fprintf(perf->map, "%lx %x %s\n", (uintptr_t)code, size, name);
+
+    if (num_lines > 0) {
+        write_debug_info(perf, code, lines, num_lines);
+    }
+
+    struct jitdump_code_load load = {
+        .header = {.id = JIT_CODE_LOAD,
+                   .total_size = sizeof(load) + strlen(name) + 1 + size,
+                   .timestamp = perf_timestamp()},
+        .pid = perf->pid,
+        .tid = perf->tid,
+        .vma = (uintptr_t)code,
+        .code_addr = (uintptr_t)code,
+        .code_size = size,
+        .code_index = perf->code_index++};
+    fwrite(&load, sizeof(load), 1, perf->dump);
+    fwrite(name, strlen(name) + 1, 1, perf->dump);
+    fwrite(code, size, 1, perf->dump);
+
+    // perf may read the files while the program is still running
+    fflush(perf->map);
+    fflush(perf->dump);
+}
+
+void perf_add_code(struct perf_output *perf, const char *name, uint8_t *code,
+                   uint32_t size) {
+    add_symbol(perf, name, code, size, NULL, 0);
+}
+
+/**
+ * Test if code is named after the label on an instruction, which it is from
+ * where a guest label is.
+ */
+static bool starts_symbol(struct label *label) {
+    return label != NULL && label->name.len > 0;
+}
+
+static void symbol_name(struct label *label, uint32_t guest_address,
+                        char *name, size_t len) {
+    if (starts_symbol(label)) {
+        snprintf(name, len, "mips:%.*s", (int)label->name.len,
+                 label->name.s);
+    } else {
+        snprintf(name, len, "mips:@0x%08x", guest_address);
+    }
+}
+
+void perf_add_instrs(struct perf_output *perf, uint8_t *code,
+                     struct abstract_instr_vec *instrs, size_t first,
+                     size_t len, uint32_t *offsets, uint32_t end) {
+    struct perf_line *lines = malloc(len * sizeof(struct perf_line));
+    uint32_t *guest_addresses = &instrs->guest_addresses[first];
+
+    for (size_t start = 0; start < len;) {
+        size_t stop = start + 1;
+        while (stop < len &&
+               !starts_symbol(abstract_instr_label(instrs, first + stop))) {
+            stop++;
+        }
+
+        // a line for each instruction on a different line from the last,
+        // instructions the optimiser added carry on the line before
+        size_t num_lines = 0;
+        for (size_t i = start; i < stop; i++) {
+            size_t index = guest_addresses[i] / 4;
+
+            if (offsets[i] == offsets[i + 1] || index >= perf->num_instrs ||
+                (num_lines > 0 &&
+                 lines[num_lines - 1].line == perf->source_lines[index])) {
+                continue;
+            }
+
+            lines[num_lines++] = (struct perf_line){
+                .addr = (uintptr_t)(code + offsets[i]),
+                .line = perf->source_lines[index]};
+        }
+
+        char name[80];
+        symbol_name(abstract_instr_label(instrs, first + start),
+                    guest_addresses[start], name, sizeof(name));
+        add_symbol(perf, name, code + offsets[start],
+                   offsets[stop] - offsets[start], lines, num_lines);
+
+        start = stop;
+    }
+
+    perf_add_code(perf, "mips_jit:stubs", code + offsets[len],
+                  end - offsets[len]);
+
+    free(lines);
+}
@@ -0,0 +1,52 @@
+#ifndef __PERF_H_
+#define __PERF_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "abstract_instr.h"
+
+/**
+ * Linux perf support
+ *
+ * perf can't name code generated at run time, so each piece of code compiled
+ * is listed in `/tmp/perf-<pid>.map`, which `perf report` reads to name
+ * addresses in anonymous memory. Code is named after the MIPS label it starts
+ * at, or the guest address of its first instruction if that has no label.
+ *
+ * The code is also written to `/tmp/jit-<pid>.dump` in perf's jitdump format,
+ * with the line of the MIPS source each instruction came from. After
+ * `perf record -k mono`, `perf inject --jit` turns the dump into ELF images so
+ * `perf annotate` can show the MIPS lines the time was spent on.
+ */
+
+struct perf_output;
+
+/**
+ * Start writing the perf map and jitdump for a program read from
+ * 'source_path'. Instruction 'i' of the program is on line 'source_lines[i]'
+ * of the source, there are 'num_instrs' of them.
+ */
+struct perf_output *perf_output_new(const char *source_path,
+                                    uint32_t *source_lines, size_t num_instrs);
+
+void perf_output_free(struct perf_output *perf);
+
+/**
+ * Record 'size' bytes of code at 'code' that didn't come from the program,
+ * like the prologue and stubs.
+ */
+void perf_add_code(struct perf_output *perf, const char *name, uint8_t *code,
+                   uint32_t size);
+
+/**
+ * Record the code compiled for 'len' abstract instructions from 'first'. The
+ * code for the i-th starts at 'code + offsets[i]', and what follows them (exit
+ * and trap stubs) runs from 'code + offsets[len]' to 'code + end'.
+ */
+void perf_add_instrs(struct perf_output *perf, uint8_t *code,
+                     struct abstract_instr_vec *instrs, size_t first,
+                     size_t len, uint32_t *offsets, uint32_t end);
+
+#endif // __PERF_H_
@@ -0,0 +1,185 @@
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "label_storage.h"
+#include "profiler.h"
+
+static struct profiler *running_profiler;
+
+struct profile_row {
+    uint64_t samples;
+    uint32_t index; // MIPS instruction or label id
+};
+
+static void sample_handler(int sig, siginfo_t *info, void *ucontext) {
+    struct profiler *profiler = running_profiler;
+    uint32_t instr;
+
+    if (profiler == NULL) {
+        return;
+    }
+
+    if (!pc_map_lookup(profiler->map, signal_pc(ucontext), &instr)) {
+        profiler->outside_samples++;
+    } else if (instr == PC_MAP_NO_INSTR) {
+        profiler->stub_samples++;
+    } else {
+        profiler->samples[instr]++;
+    }
+}
+
+struct profiler *profiler_new(struct pc_map *map) {
+    struct profiler *profiler = malloc(sizeof(struct profiler));
+
+    *profiler = (struct profiler){
+        .map = map, .samples = calloc(map->num_instrs, sizeof(uint64_t))};
+
+    return profiler;
+}
+
+void profiler_free(struct profiler *profiler) {
+    free(profiler->samples);
+    free(profiler);
+}
+
+static void set_timer(uint32_t interval_us) {
+    struct itimerval timer = {
+        .it_interval = {.tv_usec = interval_us},
+        .it_value = {.tv_usec = interval_us},
+    };
+
+    if (setitimer(ITIMER_PROF, &timer, NULL) == -1) {
+        perror("Failed setting profiling timer");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void profiler_start(struct profiler *profiler) {
+    running_profiler = profiler;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = sample_handler;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+
+    if (sigaction(SIGPROF, &sa, NULL) == -1) {
+        perror("Failed installing profiling handler");
+        exit(EXIT_FAILURE);
+    }
+
+    set_timer(PROFILER_INTERVAL_US);
+}
+
+void profiler_stop(struct profiler *profiler) {
+    set_timer(0);
+    signal(SIGPROF, SIG_IGN);
+    running_profiler = NULL;
+}
+
+static int compare_rows(const void *a_, const void *b_) {
+    const struct profile_row *a = a_;
+    const struct profile_row *b = b_;
+
+    if (a->samples != b->samples) {
+        return a->samples < b->samples ? 1 : -1;
+    }
+
+    return a->index < b->index ? -1 : a->index > b->index;
+}
+
+static void print_row_start(uint64_t samples, uint64_t total) {
+    printf("%8" PRIu64 " %6.1f%%  ", samples, 100.0 * samples / total);
+}
+
+static void print_flat(struct profiler *profiler, struct instr_vec *instrs,
+                       uint64_t total) {
+    struct pc_map *map = profiler->map;
+    struct profile_row *rows =
+        malloc(map->num_instrs * sizeof(struct profile_row));
+    size_t num_rows = 0;
+
+    for (uint32_t i = 0; i < map->num_instrs; i++) {
+        if (profiler->samples[i] > 0) {
+            rows[num_rows++] = (struct profile_row){
+                .samples = profiler->samples[i], .index = i};
+        }
+    }
+
+    qsort(rows, num_rows, sizeof(struct profile_row), compare_rows);
+
+    printf(" samples       %%  where\n");
+    for (size_t i = 0; i < num_rows && i < PROFILER_TOP_INSTRS; i++) {
+        char where[96];
+        pc_map_describe(map, rows[i].index, where, sizeof(where));
+
+        print_row_start(rows[i].samples, total);
+        printf("%-24s ", where);
+        print_instr(&instrs->data[rows[i].index]);
+    }
+
+    print_row_start(profiler->stub_samples, total);
+    printf("prelude and stubs\n");
+    print_row_start(profiler->outside_samples, total);
+    printf("outside generated code\n");
+
+    free(rows);
+}
+
+static void print_by_label(struct profiler *profiler, uint64_t total) {
+    struct pc_map *map = profiler->map;
+    struct labels_vec *labels = all_labels();
+
+    // the last row is for instructions before the first label
+    size_t num_rows = labels->len + 1;
+    struct profile_row *rows = calloc(num_rows, sizeof(struct profile_row));
+
+    for (uint32_t i = 0; i < num_rows; i++) {
+        rows[i].index = i;
+    }
+
+    for (uint32_t i = 0; i < map->num_instrs; i++) {
+        struct label *label = map->labels[i];
+        rows[label != NULL ? label->id : labels->len].samples +=
+            profiler->samples[i];
+    }
+
+    qsort(rows, num_rows, sizeof(struct profile_row), compare_rows);
+
+    printf(" samples       %%  label\n");
+    for (size_t i = 0; i < num_rows && rows[i].samples > 0; i++) {
+        print_row_start(rows[i].samples, total);
+
+        if (rows[i].index == labels->len) {
+            printf("(before any label)\n");
+        } else {
+            struct label *label = labels->data[rows[i].index];
+            printf("%.*s\n", (int)label->name.len, label->name.s);
+        }
+    }
+
+    free(rows);
+}
+
+void profiler_print(struct profiler *profiler, struct instr_vec *instrs) {
+    uint64_t total = profiler->stub_samples + profiler->outside_samples;
+    for (size_t i = 0; i < profiler->map->num_instrs; i++) {
+        total += profiler->samples[i];
+    }
+
+    printf("%" PRIu64 " samples, one every %uus of CPU time\n", total,
+           PROFILER_INTERVAL_US);
+    if (total == 0) {
+        return;
+    }
+
+    printf("\nflat profile:\n");
+    print_flat(profiler, instrs, total);
+
+    printf("\nby label:\n");
+    print_by_label(profiler, total);
+}
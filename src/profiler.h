@@ -0,0 +1,50 @@
+#ifndef __PROFILER_H_
+#define __PROFILER_H_
+
+#include <stdint.h>
+
+#include "instr.h"
+#include "pc_map.h"
+
+/**
+ * Sampling profiler
+ *
+ * While running, a SIGPROF timer interrupts the program every
+ * `PROFILER_INTERVAL_US` microseconds of CPU time and the interrupted pc is
+ * looked up in the program's pc map (see `pc_map.h`), counting a sample for
+ * the MIPS instruction it's in. The generated code isn't changed at all.
+ * Samples outside the code for an instruction are counted as in the prelude
+ * and stubs, or outside the generated code altogether (the dispatcher,
+ * compiling blocks, and the rest of the runtime).
+ */
+
+#define PROFILER_INTERVAL_US 100
+
+// number of instructions the flat profile lists
+#define PROFILER_TOP_INSTRS 20
+
+struct profiler {
+    struct pc_map *map;
+    uint64_t *samples; // for each MIPS instruction
+    uint64_t stub_samples;
+    uint64_t outside_samples;
+};
+
+struct profiler *profiler_new(struct pc_map *map);
+
+void profiler_free(struct profiler *profiler);
+
+/**
+ * Start taking samples, only one profiler can be running at once.
+ */
+void profiler_start(struct profiler *profiler);
+
+void profiler_stop(struct profiler *profiler);
+
+/**
+ * Print the instructions the most samples were in, then the samples under
+ * each label. 'instrs' are the parsed MIPS instructions.
+ */
+void profiler_print(struct profiler *profiler, struct instr_vec *instrs);
+
+#endif // __PROFILER_H_
@@ -0,0 +1,220 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "abstract_instr.h"
+#include "common.h"
+#include "mips_reg.h"
+#include "promote.h"
+
+/**
+ * Find the registers used in 'instrs[start..end]', returns false if the loop
+ * can't have registers promoted ('jumps_indirectly' as for
+ * `abstract_instr_is_entry`).
+ */
+static bool count_loop_uses(struct abstract_instr_vec *instrs,
+                            struct label_refs *refs, bool jumps_indirectly,
+                            size_t start, size_t end, uint32_t *uses,
+                            bool *muldiv) {
+    for (size_t i = start; i <= end; i++) {
+        struct abstract_instr instr = abstract_instr_get(instrs, i);
+        struct label *label = instr.label;
+        struct label *target = abstract_instr_target_label(&instr);
+        enum reg_type regs[ABSTRACT_INSTR_MAX_REGS];
+
+        // only entered at the top, from just before it: a return or `jr`
+        // landing in the loop would skip the swaps, though the start of the
+        // program runs them
+        if ((label != NULL && (refs->first_ref[label->id] < start ||
+                               refs->last_ref[label->id] > end)) ||
+            (i != 0 && abstract_instr_is_entry(instrs, i, jumps_indirectly))) {
+            return false;
+        }
+
+        // only left by falling out of the bottom
+        if (target != NULL && (refs->index[target->id] < start ||
+                               refs->index[target->id] > end)) {
+            return false;
+        }
+
+        switch (instr.type) {
+        case ABSTRACT_INSTR_CALL:
+        case ABSTRACT_INSTR_RETURN:
+        case ABSTRACT_INSTR_JUMP_REG:
+            return false;
+        case ABSTRACT_INSTR_MULDIV:
+            *muldiv = true;
+            break;
+        default:
+            break;
+        }
+
+        size_t num_uses = abstract_instr_uses(&instr, regs);
+        for (size_t u = 0; u < num_uses; u++) {
+            uses[regs[u]]++;
+        }
+
+        size_t num_defs = abstract_instr_defs(&instr, regs);
+        for (size_t d = 0; d < num_defs; d++) {
+            uses[regs[d]]++;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * The most used register kept in an xmm register or stack slot that can be
+ * promoted, or REG_ZERO if there are none.
+ */
+static enum reg_type most_used_spilled_reg(struct mips_x86_reg_mapping *map,
+                                           uint32_t *uses, bool muldiv) {
+    enum reg_type best = REG_ZERO;
+
+    for (enum reg_type reg = SMALLEST_MIPS_REG; reg <= LARGEST_MIPS_REG;
+         reg++) {
+        if (reg == REG_ZERO || uses[reg] <= uses[best] ||
+            map->mapping[reg].type == X86_REG_MAPPED) {
+            continue;
+        }
+
+        if (muldiv && (reg == REG_HI || reg == REG_LO)) {
+            continue;
+        }
+
+        best = reg;
+    }
+
+    return best;
+}
+
+/**
+ * The next x86 mapped register after 'after' that isn't used in the loop, or
+ * REG_ZERO if there are none.
+ */
+static enum reg_type next_free_x86_reg(struct mips_x86_reg_mapping *map,
+                                       uint32_t *uses, enum reg_type after) {
+    for (enum reg_type reg = after + 1; reg <= LARGEST_MIPS_REG; reg++) {
+        if (uses[reg] == 0 && map->mapping[reg].is_mapped &&
+            map->mapping[reg].type == X86_REG_MAPPED) {
+            return reg;
+        }
+    }
+
+    return REG_ZERO;
+}
+
+/**
+ * Promote registers in the loop 'instrs[start..end]'. Returns the number of
+ * registers promoted, with a swap added before and after the loop for each.
+ */
+static size_t promote_loop(struct abstract_instr_vec *instrs,
+                           struct mips_x86_reg_mapping *map,
+                           struct label_refs *refs, bool jumps_indirectly,
+                           size_t start, size_t end) {
+    uint32_t uses[LARGEST_MIPS_REG + 1] = {0};
+    bool muldiv = false;
+
+    if (!count_loop_uses(instrs, refs, jumps_indirectly, start, end, uses,
+                         &muldiv)) {
+        return 0;
+    }
+
+    // $zero is never free, as reads of it are taken to be constant
+    uses[REG_ZERO] = 0;
+
+    enum reg_type promoted[LARGEST_MIPS_REG + 1], homes[LARGEST_MIPS_REG + 1];
+    size_t num_promoted = 0;
+    enum reg_type home = REG_ZERO;
+
+    for (;;) {
+        enum reg_type reg = most_used_spilled_reg(map, uses, muldiv);
+        home = next_free_x86_reg(map, uses, home);
+
+        if (reg == REG_ZERO || home == REG_ZERO) {
+            break;
+        }
+
+        DEBUG_LOG("promoting %s to %s in loop at %zu", reg_type_names[reg],
+                  reg_type_names[home], start);
+
+        uses[reg] = 0;
+        promoted[num_promoted] = reg;
+        homes[num_promoted++] = home;
+    }
+
+    if (num_promoted == 0) {
+        return 0;
+    }
+
+    for (size_t i = start; i <= end; i++) {
+        struct abstract_instr instr = abstract_instr_get(instrs, i);
+
+        for (size_t p = 0; p < num_promoted; p++) {
+            abstract_instr_rename_reg(&instr, promoted[p], homes[p]);
+        }
+
+        abstract_instr_set(instrs, i, &instr);
+    }
+
+    // the swaps before the loop are reached from what comes before, and the
+    // ones after only by leaving the loop, so each is unlabelled and needs
+    // its own guest address in case it starts a block
+    abstract_instrs_insert(instrs, end + 1, num_promoted);
+    abstract_instrs_insert(instrs, start, num_promoted);
+
+    for (size_t p = 0; p < num_promoted; p++) {
+        struct abstract_instr swap = {
+            .type = ABSTRACT_INSTR_SWAP,
+            .swap = {.a = homes[p], .b = promoted[p]}};
+
+        swap.guest_address = synthetic_guest_address();
+        abstract_instr_set(instrs, start + p, &swap);
+
+        swap.guest_address = synthetic_guest_address();
+        abstract_instr_set(instrs, end + num_promoted + 1 + p, &swap);
+    }
+
+    return num_promoted;
+}
+
+void promote_loop_regs(struct abstract_instr_vec *instrs,
+                       struct mips_x86_reg_mapping *map) {
+    if (map->num_xmm_regs == 0 && map->num_stack_spots == 0) {
+        return;
+    }
+
+    struct label_refs refs = find_label_refs(instrs);
+    bool jumps_indirectly = abstract_instrs_jump_indirectly(instrs);
+
+    // outer loops start first, so registers they promote are already in x86
+    // registers in the loops inside them, which only have to promote what's
+    // left
+    for (size_t start = abstract_instrs_next_labelled(instrs, 0);
+         start < instrs->len;
+         start = abstract_instrs_next_labelled(instrs, start + 1)) {
+        struct label *head = abstract_instr_label(instrs, start);
+
+        if (refs.first_ref[head->id] == SIZE_MAX) {
+            continue;
+        }
+
+        size_t end = refs.last_ref[head->id];
+
+        if (end < start || instrs->types[end] != ABSTRACT_INSTR_BRANCH) {
+            continue;
+        }
+
+        size_t num_promoted =
+            promote_loop(instrs, map, &refs, jumps_indirectly, start, end);
+
+        if (num_promoted > 0) {
+            // on to the head, past the swaps before it
+            start += num_promoted;
+            free_label_refs(&refs);
+            refs = find_label_refs(instrs);
+        }
+    }
+
+    free_label_refs(&refs);
+}
@@ -0,0 +1,38 @@
+#ifndef __PROMOTE_H_
+#define __PROMOTE_H_
+
+#include "abstract_instr.h"
+
+/**
+ * Loop scoped register promotion
+ *
+ * Registers are mapped once for the whole program, so a register that is only
+ * used in one loop can end up in an xmm register or on the stack while x86
+ * registers go to registers the loop never touches.
+ *
+ * For a loop that is only entered at the top, from just before it (not by a
+ * return or a `jr` to one of its guest labels), and only left by falling out of
+ * the branch at the bottom, an xmm or stack mapped register used in the loop
+ * is swapped with an x86 mapped register the loop doesn't use, just before the
+ * loop:
+ *
+ *       swap $x $s
+ * loop: add $x $x 1       (was add $s $s 1)
+ *       bne $x $t loop
+ *       swap $x $s
+ *
+ * and the loop is rewritten to use $x instead. $x's own value waits where $s
+ * was mapped until the swap after the loop puts both back.
+ *
+ * Loops containing calls, returns or indirect jumps are left alone, as is hi
+ * or lo in a loop with a multiply or divide.
+ */
+
+/**
+ * Promote xmm and stack mapped registers used in loops to x86 registers free
+ * in the loop.
+ */
+void promote_loop_regs(struct abstract_instr_vec *instrs,
+                       struct mips_x86_reg_mapping *map);
+
+#endif // __PROMOTE_H_
@@ -0,0 +1,551 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "abstract_instr.h"
+#include "common.h"
+#include "guest_memory.h"
+#include "mips_reg.h"
+#include "range.h"
+#include "runtime.h"
+
+// merges into an instruction after this many widen instead
+#define WIDEN_AFTER 3
+
+// the signed values a register may hold, none if lo > hi
+struct range {
+    int64_t lo, hi;
+};
+
+// what ranges registers are in before an instruction
+struct reg_ranges {
+    bool reached;
+    struct range regs[LARGEST_MIPS_REG + 1];
+};
+
+static const struct range full_range = {.lo = INT32_MIN, .hi = INT32_MAX};
+
+static struct range constant_range(uint32_t value) {
+    return (struct range){.lo = (int32_t)value, .hi = (int32_t)value};
+}
+
+static bool is_empty(struct range r) { return r.lo > r.hi; }
+
+static bool fits(int64_t lo, int64_t hi) {
+    return lo >= INT32_MIN && hi <= INT32_MAX;
+}
+
+static struct range reg_range(struct reg_ranges *state, enum reg_type reg) {
+    if (reg == REG_ZERO) {
+        return constant_range(0);
+    }
+
+    return state->regs[reg];
+}
+
+static struct range storage_range(struct reg_ranges *state,
+                                  struct abstract_storage s) {
+    if (s.type == ABSTRACT_STORAGE_IMM) {
+        return constant_range(s.imm);
+    }
+
+    return reg_range(state, s.reg);
+}
+
+static struct range add_range(struct range a, struct range b, bool traps) {
+    int64_t lo = a.lo + b.lo, hi = a.hi + b.hi;
+
+    // only sums that don't overflow get past an add that traps
+    if (traps) {
+        return (struct range){.lo = lo < INT32_MIN ? INT32_MIN : lo,
+                              .hi = hi > INT32_MAX ? INT32_MAX : hi};
+    }
+
+    return fits(lo, hi) ? (struct range){.lo = lo, .hi = hi} : full_range;
+}
+
+static struct range and_range(struct range a, struct range b) {
+    // anded with something not negative the result is between 0 and it
+    if (a.lo >= 0 && b.lo >= 0) {
+        return (struct range){.lo = 0, .hi = a.hi < b.hi ? a.hi : b.hi};
+    }
+
+    if (a.lo >= 0 || b.lo >= 0) {
+        return (struct range){.lo = 0, .hi = a.lo >= 0 ? a.hi : b.hi};
+    }
+
+    return full_range;
+}
+
+static struct range mul_range(struct range a, struct range b) {
+    int64_t products[] = {a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi};
+    struct range r = {.lo = products[0], .hi = products[0]};
+
+    for (size_t i = 1; i < ARRAY_SIZE(products); i++) {
+        r.lo = products[i] < r.lo ? products[i] : r.lo;
+        r.hi = products[i] > r.hi ? products[i] : r.hi;
+    }
+
+    return fits(r.lo, r.hi) ? r : full_range;
+}
+
+static struct range shl_range(struct range a, uint8_t shift) {
+    int64_t lo = a.lo * ((int64_t)1 << shift);
+    int64_t hi = a.hi * ((int64_t)1 << shift);
+
+    return fits(lo, hi) ? (struct range){.lo = lo, .hi = hi} : full_range;
+}
+
+static struct range shr_range(struct range a, uint8_t shift) {
+    if (shift == 0) {
+        return a;
+    }
+
+    // negative values shift as the large unsigned values they are
+    if (a.lo >= 0 || a.hi < 0) {
+        int64_t bias = a.lo >= 0 ? 0 : (int64_t)1 << 32;
+        return (struct range){.lo = (a.lo + bias) >> shift,
+                              .hi = (a.hi + bias) >> shift};
+    }
+
+    return (struct range){.lo = 0, .hi = UINT32_MAX >> shift};
+}
+
+static struct range load_range(enum abstract_mem_width width) {
+    switch (width) {
+    case ABSTRACT_MEM_BYTE:
+        return (struct range){.lo = INT8_MIN, .hi = INT8_MAX};
+    case ABSTRACT_MEM_HALF:
+        return (struct range){.lo = INT16_MIN, .hi = INT16_MAX};
+    case ABSTRACT_MEM_WORD:
+        return full_range;
+    }
+
+    RUNTIME_ERROR("Invalid memory width %d", width);
+}
+
+static struct range binop_range(struct reg_ranges *state,
+                                struct abstract_instr_binop *i) {
+    struct range lhs = storage_range(state, i->lhs);
+    struct range rhs = storage_range(state, i->rhs);
+
+    switch (i->op) {
+    case ABSTRACT_INSTR_BINOP_ADD:
+        return add_range(lhs, rhs, false);
+    case ABSTRACT_INSTR_BINOP_ADD_TRAP:
+        return add_range(lhs, rhs, true);
+    case ABSTRACT_INSTR_BINOP_AND:
+        return and_range(lhs, rhs);
+    case ABSTRACT_INSTR_BINOP_MUL:
+        return mul_range(lhs, rhs);
+    case ABSTRACT_INSTR_BINOP_SCALED_ADD:
+        return add_range(shl_range(lhs, i->shift), rhs, false);
+    }
+
+    RUNTIME_ERROR("Invalid binop %d", i->op);
+}
+
+/**
+ * Update 'state' to after 'i', which isn't a branch. Returns false if 'i'
+ * always traps.
+ */
+static bool transfer(struct reg_ranges *state, struct abstract_instr *i) {
+    enum reg_type regs[ABSTRACT_INSTR_MAX_REGS];
+    struct range result;
+    enum reg_type dest;
+
+    switch (i->type) {
+    case ABSTRACT_INSTR_BINOP:
+        dest = i->binop.dest;
+        result = binop_range(state, &i->binop);
+        break;
+    case ABSTRACT_INSTR_MOV:
+        dest = i->mov.dest;
+        result = storage_range(state, i->mov.source);
+        break;
+    case ABSTRACT_INSTR_SHIFT: {
+        struct range lhs = reg_range(state, i->shift.lhs);
+        dest = i->shift.dest;
+        result = i->shift.direction == ABSTRACT_INSTR_SHIFT_LEFT
+                     ? shl_range(lhs, i->shift.rhs)
+                     : shr_range(lhs, i->shift.rhs);
+        break;
+    }
+    case ABSTRACT_INSTR_LOAD:
+        dest = i->load.dest;
+        result = load_range(i->load.width);
+        break;
+    default: {
+        size_t num_defs = abstract_instr_defs(i, regs);
+        for (size_t d = 0; d < num_defs; d++) {
+            state->regs[regs[d]] = full_range;
+        }
+        return true;
+    }
+    }
+
+    state->regs[dest] = result;
+    return !is_empty(result);
+}
+
+/**
+ * Remove 'value' from 'r', if it's at either end.
+ */
+static struct range exclude(struct range r, int64_t value) {
+    if (r.lo == value) {
+        r.lo++;
+    }
+
+    if (r.hi == value) {
+        r.hi--;
+    }
+
+    return r;
+}
+
+static void set_storage_range(struct reg_ranges *state,
+                              struct abstract_storage s, struct range r) {
+    if (s.type == ABSTRACT_STORAGE_REG && s.reg != REG_ZERO) {
+        state->regs[s.reg] = r;
+    }
+}
+
+/**
+ * Narrow the ranges of the registers a branch compares on the way out of it,
+ * 'taken' or not. Returns false if control can't go that way.
+ */
+static bool refine_branch(struct reg_ranges *state,
+                          struct abstract_instr_branch *b, bool taken) {
+    if (b->type != ABSTRACT_INSTR_BRANCH_TEST_EQ &&
+        b->type != ABSTRACT_INSTR_BRANCH_TEST_NE) {
+        return true;
+    }
+
+    struct range lhs = storage_range(state, b->lhs);
+    struct range rhs = storage_range(state, b->rhs);
+    bool equal = taken == (b->type == ABSTRACT_INSTR_BRANCH_TEST_EQ);
+
+    if (equal) {
+        struct range both = {.lo = lhs.lo > rhs.lo ? lhs.lo : rhs.lo,
+                             .hi = lhs.hi < rhs.hi ? lhs.hi : rhs.hi};
+        set_storage_range(state, b->lhs, both);
+        set_storage_range(state, b->rhs, both);
+        return !is_empty(both);
+    }
+
+    // a register can only be narrowed by a single value it doesn't equal
+    struct range new_lhs = rhs.lo == rhs.hi ? exclude(lhs, rhs.lo) : lhs;
+    struct range new_rhs = lhs.lo == lhs.hi ? exclude(rhs, lhs.lo) : rhs;
+
+    set_storage_range(state, b->lhs, new_lhs);
+    set_storage_range(state, b->rhs, new_rhs);
+
+    return !is_empty(new_lhs) && !is_empty(new_rhs);
+}
+
+static int compare_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Collect the bounds widening stops at: every constant in the program and
+ * the values either side of it, sorted. Returns how many there are.
+ */
+static size_t find_thresholds(struct abstract_instr_vec *instrs,
+                              int64_t **thresholds) {
+    // each instruction has at most two constants
+    int64_t *values = malloc((instrs->len * 6 + 3) * sizeof(int64_t));
+    size_t count = 0;
+
+    values[count++] = -1;
+    values[count++] = 0;
+    values[count++] = 1;
+
+    for (size_t i = 0; i < instrs->len; i++) {
+        union abstract_instr_operands *operands = &instrs->operands[i];
+        struct abstract_storage storages[2];
+        size_t num_storages = 0;
+
+        switch (instrs->types[i]) {
+        case ABSTRACT_INSTR_BINOP:
+            storages[num_storages++] = operands->binop.lhs;
+            storages[num_storages++] = operands->binop.rhs;
+            break;
+        case ABSTRACT_INSTR_BRANCH:
+            storages[num_storages++] = operands->branch.lhs;
+            storages[num_storages++] = operands->branch.rhs;
+            break;
+        case ABSTRACT_INSTR_MOV:
+            storages[num_storages++] = operands->mov.source;
+            break;
+        default:
+            break;
+        }
+
+        for (size_t s = 0; s < num_storages; s++) {
+            if (storages[s].type == ABSTRACT_STORAGE_IMM) {
+                int64_t value = (int32_t)storages[s].imm;
+                values[count++] = value - 1;
+                values[count++] = value;
+                values[count++] = value + 1;
+            }
+        }
+    }
+
+    qsort(values, count, sizeof(int64_t), compare_int64);
+
+    size_t unique = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique == 0 || values[i] != values[unique - 1]) {
+            values[unique++] = values[i];
+        }
+    }
+
+    *thresholds = values;
+    return unique;
+}
+
+/**
+ * The index of the first of the sorted 'thresholds' that is at least 'value',
+ * 'num_thresholds' if there isn't one.
+ */
+static size_t lower_bound(int64_t *thresholds, size_t num_thresholds,
+                          int64_t value) {
+    size_t low = 0, high = num_thresholds;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+
+        if (thresholds[mid] < value) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/**
+ * Widen 'old' to cover 'merged', moving each bound that grew out to the next
+ * threshold past it, or the limit.
+ */
+static struct range widen(struct range old, struct range merged,
+                          int64_t *thresholds, size_t num_thresholds) {
+    struct range r = merged;
+
+    if (merged.lo < old.lo) {
+        // the last threshold at or below the bound
+        size_t i = lower_bound(thresholds, num_thresholds, merged.lo + 1);
+        r.lo = i == 0 || thresholds[i - 1] < INT32_MIN ? INT32_MIN
+                                                       : thresholds[i - 1];
+    }
+
+    if (merged.hi > old.hi) {
+        size_t i = lower_bound(thresholds, num_thresholds, merged.hi);
+        r.hi = i == num_thresholds || thresholds[i] > INT32_MAX
+                   ? INT32_MAX
+                   : thresholds[i];
+    }
+
+    return r;
+}
+
+/**
+ * Merge 'from' into the ranges before an instruction, widening once it has
+ * been merged into 'merges' times. Returns true if that changed them.
+ */
+static bool merge_state(struct reg_ranges *to, struct reg_ranges *from,
+                        uint32_t merges, int64_t *thresholds,
+                        size_t num_thresholds) {
+    if (!to->reached) {
+        *to = *from;
+        return true;
+    }
+
+    bool changed = false;
+    for (enum reg_type reg = SMALLEST_MIPS_REG; reg <= LARGEST_MIPS_REG;
+         reg++) {
+        struct range old = to->regs[reg];
+        struct range merged = {
+            .lo = old.lo < from->regs[reg].lo ? old.lo : from->regs[reg].lo,
+            .hi = old.hi > from->regs[reg].hi ? old.hi : from->regs[reg].hi};
+
+        if (merges >= WIDEN_AFTER) {
+            merged = widen(old, merged, thresholds, num_thresholds);
+        }
+
+        if (merged.lo != old.lo || merged.hi != old.hi) {
+            to->regs[reg] = merged;
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+/**
+ * The ranges registers are in when the program starts, which are 0 apart from
+ * $sp and $ra.
+ */
+static void initial_ranges(struct reg_ranges *state) {
+    for (enum reg_type reg = SMALLEST_MIPS_REG; reg <= LARGEST_MIPS_REG;
+         reg++) {
+        state->regs[reg] = constant_range(0);
+    }
+
+    state->regs[REG_SP] = constant_range(GUEST_MEMORY_SIZE);
+    state->regs[REG_RA] = constant_range(GUEST_EXIT_ADDRESS);
+}
+
+/**
+ * Find the range of each register before each instruction, by following
+ * control flow until nothing changes.
+ */
+static struct reg_ranges *find_ranges(struct abstract_instr_vec *instrs,
+                                      struct label_refs *refs) {
+    struct reg_ranges *states = calloc(instrs->len, sizeof(struct reg_ranges));
+    uint32_t *merges = calloc(instrs->len, sizeof(uint32_t));
+    struct instr_worklist queued = instr_worklist_new(instrs->len);
+
+    int64_t *thresholds;
+    size_t num_thresholds = find_thresholds(instrs, &thresholds);
+    bool jumps_indirectly = abstract_instrs_jump_indirectly(instrs);
+
+    for (size_t i = 0; i < instrs->len; i++) {
+        if (!abstract_instr_is_entry(instrs, i, jumps_indirectly)) {
+            continue;
+        }
+
+        struct label *label = abstract_instr_label(instrs, i);
+
+        if (i == 0 && !(jumps_indirectly && label != NULL &&
+                        label->has_guest_address)) {
+            initial_ranges(&states[i]);
+        } else {
+            for (enum reg_type reg = SMALLEST_MIPS_REG;
+                 reg <= LARGEST_MIPS_REG; reg++) {
+                states[i].regs[reg] = full_range;
+            }
+        }
+
+        states[i].reached = true;
+        instr_worklist_add(&queued, i);
+    }
+
+    size_t i;
+    while (instr_worklist_take(&queued, &i)) {
+        struct abstract_instr instr = abstract_instr_get(instrs, i);
+        size_t succ[2];
+        bool exits;
+        size_t num_succ =
+            abstract_instr_successors(instrs, refs, i, succ, &exits);
+
+        for (size_t s = 0; s < num_succ; s++) {
+            struct reg_ranges out = states[i];
+            bool feasible;
+
+            if (instr.type == ABSTRACT_INSTR_BRANCH) {
+                // the fallthrough comes first, if there is one
+                bool taken = s > 0 || i + 1 == instrs->len;
+                feasible = refine_branch(&out, &instr.branch, taken);
+            } else {
+                feasible = transfer(&out, &instr);
+            }
+
+            if (feasible && merge_state(&states[succ[s]], &out,
+                                        merges[succ[s]]++, thresholds,
+                                        num_thresholds)) {
+                instr_worklist_add(&queued, succ[s]);
+            }
+        }
+    }
+
+    free(thresholds);
+    instr_worklist_free(&queued);
+    free(merges);
+
+    return states;
+}
+
+/**
+ * Test if the add in a shift-and-add multiply loop at 'start' can't overflow,
+ * from the ranges of its registers as it's entered. Widening loses how the
+ * multiplier and multiplicand move together, but each add is of the
+ * multiplicand shifted up to a bit set in the multiplier, so when neither is
+ * negative the sum never gets past acc + multiplier * multiplicand.
+ */
+static bool mul_loop_fits(struct abstract_instr_vec *instrs,
+                          struct reg_ranges *states, bool jumps_indirectly,
+                          size_t start) {
+    struct abstract_instr_mul_loop loop;
+
+    if (start == 0 || !states[start - 1].reached ||
+        !find_mul_loop(instrs, start, &loop)) {
+        return false;
+    }
+
+    // only entered by falling in from the instruction before
+    struct abstract_instr before = abstract_instr_get(instrs, start - 1);
+    struct reg_ranges entry = states[start - 1];
+
+    if (abstract_instr_is_entry(instrs, start, jumps_indirectly) ||
+        !only_branch_to(instrs, abstract_instr_label(instrs, start),
+                        start + MUL_LOOP_LEN - 1)) {
+        return false;
+    }
+
+    switch (before.type) {
+    case ABSTRACT_INSTR_JUMP:
+    case ABSTRACT_INSTR_RETURN:
+    case ABSTRACT_INSTR_JUMP_REG:
+        return false;
+    case ABSTRACT_INSTR_BRANCH:
+        if (!refine_branch(&entry, &before.branch, false)) {
+            return false;
+        }
+        break;
+    default:
+        if (!transfer(&entry, &before)) {
+            return false;
+        }
+        break;
+    }
+
+    struct range acc = reg_range(&entry, loop.acc);
+    struct range multiplier = reg_range(&entry, loop.multiplier);
+    struct range multiplicand = reg_range(&entry, loop.multiplicand);
+
+    return multiplier.lo >= 0 && multiplicand.lo >= 0 &&
+           fits(acc.lo, acc.hi + multiplier.hi * multiplicand.hi);
+}
+
+void elide_overflow_checks(struct abstract_instr_vec *instrs) {
+    struct label_refs refs = find_label_refs(instrs);
+    struct reg_ranges *states = find_ranges(instrs, &refs);
+    bool jumps_indirectly = abstract_instrs_jump_indirectly(instrs);
+
+    for (size_t i = 0; i < instrs->len; i++) {
+        if (!states[i].reached || instrs->types[i] != ABSTRACT_INSTR_BINOP ||
+            instrs->operands[i].binop.op != ABSTRACT_INSTR_BINOP_ADD_TRAP) {
+            continue;
+        }
+
+        struct abstract_instr_binop add = instrs->operands[i].binop;
+        struct range lhs = storage_range(&states[i], add.lhs);
+        struct range rhs = storage_range(&states[i], add.rhs);
+
+        // the add of a multiply loop is its third instruction
+        if (fits(lhs.lo + rhs.lo, lhs.hi + rhs.hi) ||
+            (i >= 2 &&
+             mul_loop_fits(instrs, states, jumps_indirectly, i - 2))) {
+            DEBUG_LOG("add at %zu can't overflow", i);
+            instrs->operands[i].binop.op = ABSTRACT_INSTR_BINOP_ADD;
+        }
+    }
+
+    free(states);
+    free_label_refs(&refs);
+}
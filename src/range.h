@@ -0,0 +1,42 @@
+#ifndef __RANGE_H_
+#define __RANGE_H_
+
+#include "abstract_instr.h"
+
+/**
+ * Value range analysis
+ *
+ * `add` and `addi` trap on signed overflow, so each is compiled with a `jo` to
+ * an out of line stub. Most of them can never overflow, and the passes that
+ * match adds (counting loops, unrolling, lea) only match adds that can't trap,
+ * so the checks are dropped wherever this can prove them unnecessary.
+ *
+ * For every register before every instruction this works out the range of
+ * signed values it may hold, starting from the registers' initial values,
+ * following them through moves, adds, ands, multiplies, shifts and loads, and
+ * narrowing them on each way out of a `beq` or `bne`: after
+ * `bne $t $s loop` falls through $t equals $s, and at `loop` it doesn't, so if
+ * $t was at most $s it is now at most $s - 1.
+ *
+ *       addi $t0 $zero 0
+ * loop: ...
+ *       addi $t0 $t0 1     ($t0 is 0 to 99 before, never overflows)
+ *       bne $t0 $t1 loop   ($t1 is 100)
+ *
+ * Loops are handled by widening: once an instruction's ranges have grown a few
+ * times, bounds that keep moving jump straight to the next constant in the
+ * program (or a constant one either side of it), and then to the limits. The
+ * add in a shift-and-add multiply loop (see `struct abstract_instr_mul_loop`)
+ * is bounded from the ranges on entry to the loop instead, by the product.
+ *
+ * Where control can arrive from outside what the analysis can see, after calls
+ * and at every label when the program has returns or `jr`, anything is
+ * possible.
+ */
+
+/**
+ * Turn adds that trap into plain adds where they can't overflow.
+ */
+void elide_overflow_checks(struct abstract_instr_vec *instrs);
+
+#endif // __RANGE_H_
@@ -0,0 +1,278 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "label_storage.h"
+#include "runtime.h"
+#include "vec.h"
+
+MAKE_VEC(struct jit_ic *, jit_ic);
+MAKE_VEC(struct jit_trap, jit_trap);
+
+// capacity of a new entry map, grown when it becomes half full
+#define GUEST_MAP_INITIAL_CAPACITY 64
+
+struct guest_map guest_map_new(uint32_t capacity) {
+    struct guest_map map = {
+        .guest_addresses = malloc(capacity * sizeof(uint32_t)),
+        .code_positions = malloc(capacity * sizeof(uint32_t)),
+        .capacity = capacity,
+        .len = 0};
+
+    for (uint32_t i = 0; i < capacity; i++) {
+        map.guest_addresses[i] = GUEST_NO_ADDRESS;
+    }
+
+    return map;
+}
+
+void guest_map_free(struct guest_map *map) {
+    free(map->guest_addresses);
+    free(map->code_positions);
+}
+
+static uint32_t guest_map_hash(uint32_t guest_address) {
+    // the low two bits are always zero
+    return (guest_address >> 2) * 2654435761u;
+}
+
+/**
+ * Find the slot for a guest address, which is either the slot holding it or
+ * the empty slot it would be inserted into.
+ */
+static uint32_t guest_map_slot(struct guest_map *map, uint32_t guest_address) {
+    uint32_t mask = map->capacity - 1;
+    uint32_t slot = guest_map_hash(guest_address) & mask;
+
+    while (map->guest_addresses[slot] != guest_address &&
+           map->guest_addresses[slot] != GUEST_NO_ADDRESS) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+void guest_map_clear(struct guest_map *map) {
+    for (uint32_t i = 0; i < map->capacity; i++) {
+        map->guest_addresses[i] = GUEST_NO_ADDRESS;
+    }
+
+    map->len = 0;
+}
+
+static void guest_map_grow(struct guest_map *map) {
+    struct guest_map grown = guest_map_new(map->capacity * 2);
+
+    for (uint32_t i = 0; i < map->capacity; i++) {
+        if (map->guest_addresses[i] != GUEST_NO_ADDRESS) {
+            guest_map_insert(&grown, map->guest_addresses[i],
+                             map->code_positions[i]);
+        }
+    }
+
+    guest_map_free(map);
+    *map = grown;
+}
+
+void guest_map_insert(struct guest_map *map, uint32_t guest_address,
+                      uint32_t code_position) {
+    if (2 * (map->len + 1) > map->capacity) {
+        guest_map_grow(map);
+    }
+
+    uint32_t slot = guest_map_slot(map, guest_address);
+
+    if (map->guest_addresses[slot] == GUEST_NO_ADDRESS) {
+        map->len++;
+    }
+
+    map->guest_addresses[slot] = guest_address;
+    map->code_positions[slot] = code_position;
+}
+
+void guest_map_remove(struct guest_map *map, uint32_t guest_address) {
+    uint32_t mask = map->capacity - 1;
+    uint32_t slot = guest_map_slot(map, guest_address);
+
+    if (map->guest_addresses[slot] == GUEST_NO_ADDRESS) {
+        return;
+    }
+
+    // shift later entries of the probe sequence back into the hole, so every
+    // entry stays reachable from its home slot
+    uint32_t hole = slot;
+    for (uint32_t next = (hole + 1) & mask;
+         map->guest_addresses[next] != GUEST_NO_ADDRESS;
+         next = (next + 1) & mask) {
+        uint32_t home = guest_map_hash(map->guest_addresses[next]) & mask;
+
+        // move it unless its home lies cyclically in (hole, next]
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            map->guest_addresses[hole] = map->guest_addresses[next];
+            map->code_positions[hole] = map->code_positions[next];
+            hole = next;
+        }
+    }
+
+    map->guest_addresses[hole] = GUEST_NO_ADDRESS;
+    map->len--;
+}
+
+bool guest_map_lookup(struct guest_map *map, uint32_t guest_address,
+                      uint32_t *code_position) {
+    uint32_t slot = guest_map_slot(map, guest_address);
+
+    if (map->guest_addresses[slot] == GUEST_NO_ADDRESS) {
+        return false;
+    }
+
+    *code_position = map->code_positions[slot];
+    return true;
+}
+
+struct jit_runtime *jit_runtime_new(void) {
+    struct jit_runtime *rt = malloc(sizeof(struct jit_runtime));
+
+    *rt = (struct jit_runtime){
+        .dispatch_label = add_internal_label(),
+        .ic_miss_label = add_internal_label(),
+        .exit_label = add_internal_label(),
+        .overflow_label = add_internal_label(),
+        .pending_traps = jit_trap_vec_new(),
+        .entries = guest_map_new(GUEST_MAP_INITIAL_CAPACITY),
+        .ics = jit_ic_vec_new()};
+
+    return rt;
+}
+
+void jit_runtime_free(struct jit_runtime *rt) {
+    for (size_t i = 0; i < rt->ics->len; i++) {
+        free(rt->ics->data[i]);
+    }
+
+    jit_ic_vec_free(rt->ics);
+    jit_trap_vec_free(rt->pending_traps);
+    guest_map_free(&rt->entries);
+    free(rt);
+}
+
+void jit_runtime_add_entries(struct jit_runtime *rt,
+                             struct labels_vec *labels) {
+    for (size_t i = 0; i < labels->len; i++) {
+        struct label *label = labels->data[i];
+
+        if (!label->has_guest_address || label->code_position < 0) {
+            continue;
+        }
+
+        guest_map_insert(&rt->entries, label->guest_address,
+                         label->code_position);
+    }
+}
+
+struct jit_ic *jit_runtime_new_ic(struct jit_runtime *rt,
+                                  uint32_t site_address) {
+    struct jit_ic *ic = malloc(sizeof(struct jit_ic));
+
+    *ic = (struct jit_ic){.site_address = site_address};
+
+    for (int i = 0; i < JIT_IC_ENTRIES; i++) {
+        ic->guest_addresses[i] = GUEST_NO_ADDRESS;
+    }
+
+    jit_ic_vec_push(rt->ics, ic);
+
+    return ic;
+}
+
+/**
+ * Find the code for a guest address, returns false if there is none yet and
+ * the program has to leave generated code to compile it.
+ */
+static bool lookup_target(struct jit_runtime *rt, uint32_t guest_address,
+                          uint8_t **target) {
+    uint32_t code_position;
+
+    if (guest_address == GUEST_EXIT_ADDRESS) {
+        code_position = rt->exit_label->code_position;
+    } else if (!guest_map_lookup(&rt->entries, guest_address,
+                                 &code_position)) {
+        if (!rt->compiles_on_demand) {
+            RUNTIME_ERROR("Jump to invalid guest address 0x%08x",
+                          guest_address);
+        }
+
+        rt->next_pc = guest_address;
+        *target = rt->code_base + rt->exit_label->code_position;
+        return false;
+    }
+
+    *target = rt->code_base + code_position;
+    return true;
+}
+
+uint8_t *jit_dispatch(struct jit_runtime *rt, uint32_t guest_address) {
+    DEBUG_LOG("dispatching to 0x%08x", guest_address);
+
+    uint8_t *target;
+    lookup_target(rt, guest_address, &target);
+
+    return target;
+}
+
+uint8_t *jit_dispatch_ic(struct jit_runtime *rt, struct jit_ic *ic,
+                         uint32_t guest_address) {
+    uint8_t *target;
+
+    ic->misses++;
+
+    if (!lookup_target(rt, guest_address, &target)) {
+        return target;
+    }
+
+    // fill empty entries first, then replace them round robin
+    int entry = -1;
+    for (int i = 0; i < JIT_IC_ENTRIES; i++) {
+        if (ic->guest_addresses[i] == GUEST_NO_ADDRESS) {
+            entry = i;
+            break;
+        }
+    }
+
+    if (entry == -1) {
+        entry = ic->next_victim;
+        ic->next_victim = (ic->next_victim + 1) % JIT_IC_ENTRIES;
+    }
+
+    ic->guest_addresses[entry] = guest_address;
+    ic->targets[entry] = target;
+
+    return target;
+}
+
+void jit_overflow(uint32_t guest_address) {
+    fprintf(stderr,
+            "Runtime Error: integer overflow in add at guest address "
+            "0x%08x\n",
+            guest_address);
+    exit(1);
+}
+
+void jit_runtime_clear_ics(struct jit_runtime *rt) {
+    for (size_t i = 0; i < rt->ics->len; i++) {
+        for (int entry = 0; entry < JIT_IC_ENTRIES; entry++) {
+            rt->ics->data[i]->guest_addresses[entry] = GUEST_NO_ADDRESS;
+        }
+    }
+}
+
+void jit_runtime_print_ic_stats(struct jit_runtime *rt) {
+    for (size_t i = 0; i < rt->ics->len; i++) {
+        struct jit_ic *ic = rt->ics->data[i];
+
+        printf("jr at 0x%08x: %lu jumps, %lu hits, %lu misses\n",
+               ic->site_address, ic->executions,
+               ic->executions - ic->misses, ic->misses);
+    }
+}
@@ -0,0 +1,165 @@
+#ifndef __RUNTIME_H_
+#define __RUNTIME_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "label.h"
+#include "vec.h"
+
+/**
+ * Runtime support for generated code
+ *
+ * Guest code can jump to a guest address held in a register (`jr`), so at run
+ * time we need to find the native code for a guest address. Every label guest
+ * code can reach this way is recorded in a hash map from guest address to code
+ * position, and `jit_dispatch` (called through a stub at the end of the
+ * generated code) looks them up.
+ *
+ * Each `jr` site other than a return also gets an inline cache of the last few
+ * targets it jumped to, checked by the generated code before falling back to
+ * the map.
+ */
+
+// $ra holds this when the program starts, jumping to it ends the program
+#define GUEST_EXIT_ADDRESS 0xfffffffcu
+
+// marks an empty slot in the entry map and inline caches, guest addresses are
+// always word aligned so this is never a real one
+#define GUEST_NO_ADDRESS 0xffffffffu
+
+// number of targets remembered by each inline cache
+#define JIT_IC_ENTRIES 4
+
+// bytes of host stack guest calls may use, each takes 16 (the guest and native
+// return addresses) and calls that never return leave them behind
+#define JIT_CALL_STACK_SIZE (1 << 20)
+
+/**
+ * Open addressing hash map from guest address to code position.
+ */
+struct guest_map {
+    uint32_t *guest_addresses; // GUEST_NO_ADDRESS for empty slots
+    uint32_t *code_positions;
+    uint32_t capacity; // always a power of two
+    uint32_t len;
+};
+
+/**
+ * Inline cache for one indirect jump site, the first three fields are read and
+ * updated by the generated code.
+ */
+struct jit_ic {
+    uint32_t guest_addresses[JIT_IC_ENTRIES];
+    uint8_t *targets[JIT_IC_ENTRIES];
+    uint64_t executions;
+    uint64_t misses;
+    uint32_t site_address; // guest address of the jump
+    uint8_t next_victim;   // entry replaced on the next miss once full
+};
+
+struct guest_map guest_map_new(uint32_t capacity);
+void guest_map_free(struct guest_map *map);
+void guest_map_clear(struct guest_map *map);
+void guest_map_insert(struct guest_map *map, uint32_t guest_address,
+                      uint32_t code_position);
+void guest_map_remove(struct guest_map *map, uint32_t guest_address);
+
+/**
+ * Look up a guest address, returns false if it isn't in the map.
+ */
+bool guest_map_lookup(struct guest_map *map, uint32_t guest_address,
+                      uint32_t *code_position);
+
+DEFINE_VEC(struct jit_ic *, jit_ic);
+
+/**
+ * An overflow check waiting for its out of line stub, which reports the guest
+ * address of the add that overflowed.
+ */
+struct jit_trap {
+    struct label *label; // the check jumps here
+    uint32_t guest_address;
+};
+
+DEFINE_VEC(struct jit_trap, jit_trap);
+
+struct jit_runtime {
+    uint8_t *code_base; // address code positions are relative to
+    uint64_t host_rsp;  // host stack pointer after the prologue
+
+    // guest calls below the limit first drop every frame, resetting the stack
+    // pointer to the one guest code is entered with. the base is read at an
+    // offset from the limit so they're kept together.
+    uint64_t call_stack_base;
+    uint64_t call_stack_limit;
+
+    // how many allocatable registers hold mips registers, the prologue,
+    // epilogue and dispatch stubs only touch these
+    int num_x86_regs;
+
+    // when code is compiled on demand, dispatching to a guest address with no
+    // entry leaves generated code with the address here instead of failing
+    bool compiles_on_demand;
+    uint32_t next_pc;
+
+    struct label *dispatch_label; // jump here with a guest address in eax
+    struct label *ic_miss_label;  // same, with the missing cache in rcx
+    struct label *exit_label;     // jump here to end the program
+    struct label *overflow_label; // jump here with a trapping add's address
+
+    // overflow checks compiled since their stubs were last written
+    struct jit_trap_vec *pending_traps;
+
+    struct guest_map entries;
+
+    // individually allocated so generated code can point at them
+    struct jit_ic_vec *ics;
+};
+
+struct jit_runtime *jit_runtime_new(void);
+
+void jit_runtime_free(struct jit_runtime *rt);
+
+/**
+ * Record every resolved label that has a guest address as an entry.
+ */
+void jit_runtime_add_entries(struct jit_runtime *rt, struct labels_vec *labels);
+
+/**
+ * Create the inline cache for the indirect jump at a guest address.
+ */
+struct jit_ic *jit_runtime_new_ic(struct jit_runtime *rt,
+                                  uint32_t site_address);
+
+/**
+ * Find the native code for a guest address, this is called from generated
+ * code and does not return if the address isn't an entry.
+ */
+uint8_t *jit_dispatch(struct jit_runtime *rt, uint32_t guest_address);
+
+/**
+ * As `jit_dispatch`, for a jump that missed its inline cache. The target is
+ * added to the cache.
+ */
+uint8_t *jit_dispatch_ic(struct jit_runtime *rt, struct jit_ic *ic,
+                         uint32_t guest_address);
+
+/**
+ * Report the add at a guest address overflowing and end the program, as the
+ * guest would trap. This is called from generated code.
+ */
+void jit_overflow(uint32_t guest_address) __attribute__((noreturn));
+
+/**
+ * Forget every target remembered by inline caches, needed once the code they
+ * point to is discarded.
+ */
+void jit_runtime_clear_ics(struct jit_runtime *rt);
+
+/**
+ * Print the hit and miss counts of every inline cache.
+ */
+void jit_runtime_print_ic_stats(struct jit_runtime *rt);
+
+#endif // __RUNTIME_H_
@@ -0,0 +1,708 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "abstract_instr.h"
+#include "common.h"
+#include "mips_reg.h"
+#include "ssa.h"
+#include "vec.h"
+
+MAKE_VEC(struct ssa_value, ssa_value);
+MAKE_VEC(struct ssa_phi, ssa_phi);
+
+#define NUM_REGS (LARGEST_MIPS_REG + 1)
+
+// edges between blocks, stored by their source
+struct ssa_edges {
+    uint32_t *start; // the edges of block b are [start[b], start[b + 1])
+    uint32_t *to;
+};
+
+static void free_edges(struct ssa_edges *edges) {
+    free(edges->start);
+    free(edges->to);
+}
+
+/**
+ * Test if a block has to end after 'i', as control may go somewhere other
+ * than the next instruction.
+ */
+static bool ends_block(enum abstract_instr_type type) {
+    switch (type) {
+    case ABSTRACT_INSTR_BRANCH:
+    case ABSTRACT_INSTR_JUMP:
+    case ABSTRACT_INSTR_CALL:
+    case ABSTRACT_INSTR_RETURN:
+    case ABSTRACT_INSTR_JUMP_REG:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Split 'instrs' into basic blocks after the root, followed by an empty block
+ * in front of each entry other than the first instruction, which starts and
+ * ends at the entry. Sets 'num_real' to the number of blocks before those.
+ */
+static void split_blocks(struct abstract_instr_vec *instrs,
+                         struct ssa_form *ssa, bool jumps_indirectly,
+                         uint32_t *num_real) {
+    uint32_t num_leaders = 0, num_entries = 0;
+
+    for (size_t i = 0; i < instrs->len; i++) {
+        if (i == 0 || abstract_instr_label(instrs, i) != NULL ||
+            ends_block(instrs->types[i - 1])) {
+            num_leaders++;
+        }
+        if (i > 0 && abstract_instr_is_entry(instrs, i, jumps_indirectly)) {
+            num_entries++;
+        }
+    }
+
+    *num_real = 1 + num_leaders;
+    ssa->num_blocks = *num_real + num_entries;
+    ssa->blocks = calloc(ssa->num_blocks, sizeof(struct ssa_block));
+    ssa->block_of = malloc(instrs->len * sizeof(uint32_t));
+
+    uint32_t b = 0, stub = *num_real;
+    for (size_t i = 0; i < instrs->len; i++) {
+        if (i == 0 || abstract_instr_label(instrs, i) != NULL ||
+            ends_block(instrs->types[i - 1])) {
+            ssa->blocks[++b].start = i;
+        }
+        ssa->blocks[b].end = i + 1;
+        ssa->block_of[i] = b;
+
+        if (i > 0 && abstract_instr_is_entry(instrs, i, jumps_indirectly)) {
+            ssa->blocks[stub].start = ssa->blocks[stub].end = i;
+            stub++;
+        }
+    }
+}
+
+/**
+ * Find the edges between blocks. The root leads to the first block and every
+ * entry's empty block, and those lead to their entry.
+ */
+static struct ssa_edges find_succs(struct abstract_instr_vec *instrs,
+                                   struct label_refs *refs,
+                                   struct ssa_form *ssa, uint32_t num_real,
+                                   bool *exits) {
+    struct ssa_edges succs = {
+        .start = malloc((ssa->num_blocks + 1) * sizeof(uint32_t)),
+        .to = malloc((2 * ssa->num_blocks + 1) * sizeof(uint32_t))};
+    uint32_t num_edges = 0;
+
+    for (uint32_t b = 0; b < ssa->num_blocks; b++) {
+        struct ssa_block *block = &ssa->blocks[b];
+        succs.start[b] = num_edges;
+
+        if (b == 0) {
+            if (instrs->len > 0) {
+                succs.to[num_edges++] = 1;
+            }
+            for (uint32_t stub = num_real; stub < ssa->num_blocks; stub++) {
+                succs.to[num_edges++] = stub;
+            }
+        } else if (b < num_real) {
+            size_t succ[2];
+            size_t num_succ = abstract_instr_successors(
+                instrs, refs, block->end - 1, succ, &exits[b]);
+
+            for (size_t s = 0; s < num_succ; s++) {
+                succs.to[num_edges++] = ssa->block_of[succ[s]];
+            }
+        } else {
+            succs.to[num_edges++] = ssa->block_of[block->start];
+        }
+    }
+    succs.start[ssa->num_blocks] = num_edges;
+
+    return succs;
+}
+
+/**
+ * Number the blocks reachable from the root in reverse postorder, returning
+ * how many there are.
+ */
+static uint32_t reverse_postorder(struct ssa_form *ssa, struct ssa_edges *succs,
+                                  uint32_t *order) {
+    uint32_t *stack = malloc(ssa->num_blocks * sizeof(uint32_t));
+    uint32_t *next_edge = malloc(ssa->num_blocks * sizeof(uint32_t));
+    uint32_t depth = 0, num_done = 0;
+
+    stack[depth++] = 0;
+    next_edge[0] = succs->start[0];
+    ssa->blocks[0].reached = true;
+
+    while (depth > 0) {
+        uint32_t b = stack[depth - 1];
+
+        if (next_edge[b] == succs->start[b + 1]) {
+            order[num_done++] = b;
+            depth--;
+            continue;
+        }
+
+        uint32_t to = succs->to[next_edge[b]++];
+        if (!ssa->blocks[to].reached) {
+            ssa->blocks[to].reached = true;
+            next_edge[to] = succs->start[to];
+            stack[depth++] = to;
+        }
+    }
+
+    for (uint32_t i = 0; i < num_done / 2; i++) {
+        uint32_t tmp = order[i];
+        order[i] = order[num_done - 1 - i];
+        order[num_done - 1 - i] = tmp;
+    }
+
+    free(stack);
+    free(next_edge);
+
+    return num_done;
+}
+
+/**
+ * Record the reached predecessors of every block.
+ */
+static void find_preds(struct ssa_form *ssa, struct ssa_edges *succs) {
+    for (uint32_t b = 0; b < ssa->num_blocks; b++) {
+        if (!ssa->blocks[b].reached) {
+            continue;
+        }
+        for (uint32_t e = succs->start[b]; e < succs->start[b + 1]; e++) {
+            ssa->blocks[succs->to[e]].num_preds++;
+        }
+    }
+
+    for (uint32_t b = 0; b < ssa->num_blocks; b++) {
+        ssa->blocks[b].preds =
+            malloc(ssa->blocks[b].num_preds * sizeof(uint32_t));
+        ssa->blocks[b].num_preds = 0;
+    }
+
+    for (uint32_t b = 0; b < ssa->num_blocks; b++) {
+        if (!ssa->blocks[b].reached) {
+            continue;
+        }
+        for (uint32_t e = succs->start[b]; e < succs->start[b + 1]; e++) {
+            struct ssa_block *to = &ssa->blocks[succs->to[e]];
+            to->preds[to->num_preds++] = b;
+        }
+    }
+}
+
+static uint32_t intersect(struct ssa_form *ssa, uint32_t *rpo_index,
+                          uint32_t a, uint32_t b) {
+    while (a != b) {
+        while (rpo_index[a] > rpo_index[b]) {
+            a = ssa->blocks[a].idom;
+        }
+        while (rpo_index[b] > rpo_index[a]) {
+            b = ssa->blocks[b].idom;
+        }
+    }
+
+    return a;
+}
+
+/**
+ * Find the immediate dominator of every reached block (Cooper, Harvey and
+ * Kennedy's iterative algorithm).
+ */
+static void find_idoms(struct ssa_form *ssa, uint32_t *rpo,
+                       uint32_t num_reached) {
+    uint32_t *rpo_index = malloc(ssa->num_blocks * sizeof(uint32_t));
+
+    for (uint32_t b = 0; b < ssa->num_blocks; b++) {
+        ssa->blocks[b].idom = SSA_NO_BLOCK;
+    }
+    for (uint32_t i = 0; i < num_reached; i++) {
+        rpo_index[rpo[i]] = i;
+    }
+
+    ssa->blocks[0].idom = 0;
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        for (uint32_t i = 1; i < num_reached; i++) {
+            struct ssa_block *block = &ssa->blocks[rpo[i]];
+            uint32_t idom = SSA_NO_BLOCK;
+
+            for (uint32_t p = 0; p < block->num_preds; p++) {
+                uint32_t pred = block->preds[p];
+
+                if (ssa->blocks[pred].idom == SSA_NO_BLOCK) {
+                    continue;
+                }
+
+                idom = idom == SSA_NO_BLOCK
+                           ? pred
+                           : intersect(ssa, rpo_index, pred, idom);
+            }
+
+            if (idom != block->idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+
+    ssa->blocks[0].idom = SSA_NO_BLOCK;
+
+    free(rpo_index);
+}
+
+/**
+ * Order the reached blocks by a depth first walk of the dominator tree.
+ */
+static void find_dom_order(struct ssa_form *ssa, uint32_t num_reached) {
+    uint32_t *first_child = malloc(ssa->num_blocks * sizeof(uint32_t));
+    uint32_t *next_sibling = malloc(ssa->num_blocks * sizeof(uint32_t));
+    uint32_t *stack = malloc(ssa->num_blocks * sizeof(uint32_t));
+    uint32_t depth = 0;
+
+    for (uint32_t b = 0; b < ssa->num_blocks; b++) {
+        first_child[b] = SSA_NO_BLOCK;
+    }
+
+    // linked backwards, so children come out in block order
+    for (uint32_t b = ssa->num_blocks; b-- > 1;) {
+        uint32_t idom = ssa->blocks[b].idom;
+
+        if (ssa->blocks[b].reached) {
+            next_sibling[b] = first_child[idom];
+            first_child[idom] = b;
+        }
+    }
+
+    ssa->dom_order = malloc(num_reached * sizeof(uint32_t));
+    ssa->num_dom_order = 0;
+    stack[depth++] = 0;
+
+    while (depth > 0) {
+        uint32_t b = stack[--depth];
+        ssa->dom_order[ssa->num_dom_order++] = b;
+
+        // pushed in reverse so they are popped in order
+        uint32_t num_children = 0;
+        for (uint32_t c = first_child[b]; c != SSA_NO_BLOCK;
+             c = next_sibling[c]) {
+            stack[depth + num_children++] = c;
+        }
+        for (uint32_t i = 0; i < num_children / 2; i++) {
+            uint32_t tmp = stack[depth + i];
+            stack[depth + i] = stack[depth + num_children - 1 - i];
+            stack[depth + num_children - 1 - i] = tmp;
+        }
+        depth += num_children;
+    }
+
+    free(first_child);
+    free(next_sibling);
+    free(stack);
+}
+
+/**
+ * Find the registers live into each block with instructions, as bit masks.
+ * Everything is taken to be live wherever control leaves what can be seen.
+ */
+static uint64_t *find_live_in(struct abstract_instr_vec *instrs,
+                              struct ssa_form *ssa, struct ssa_edges *succs,
+                              uint32_t num_real, bool *exits) {
+    uint64_t *live_in = calloc(ssa->num_blocks, sizeof(uint64_t));
+    uint64_t *uses = calloc(ssa->num_blocks, sizeof(uint64_t));
+    uint64_t *defs = calloc(ssa->num_blocks, sizeof(uint64_t));
+
+    for (uint32_t b = 1; b < num_real; b++) {
+        for (size_t i = ssa->blocks[b].start; i < ssa->blocks[b].end; i++) {
+            struct abstract_instr instr = abstract_instr_get(instrs, i);
+            enum reg_type regs[ABSTRACT_INSTR_MAX_REGS];
+
+            size_t num_uses = abstract_instr_uses(&instr, regs);
+            for (size_t u = 0; u < num_uses; u++) {
+                uses[b] |= (1ull << regs[u]) & ~defs[b];
+            }
+
+            size_t num_defs = abstract_instr_defs(&instr, regs);
+            for (size_t d = 0; d < num_defs; d++) {
+                defs[b] |= 1ull << regs[d];
+            }
+        }
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        for (uint32_t b = num_real; b-- > 1;) {
+            uint64_t live_out = exits[b] ? UINT64_MAX : 0;
+            for (uint32_t e = succs->start[b]; e < succs->start[b + 1]; e++) {
+                live_out |= live_in[succs->to[e]];
+            }
+
+            uint64_t live = uses[b] | (live_out & ~defs[b]);
+            if (live != live_in[b]) {
+                live_in[b] = live;
+                changed = true;
+            }
+        }
+    }
+
+    free(uses);
+    free(defs);
+
+    return live_in;
+}
+
+/**
+ * Find where each register needs a phi, as bit masks: at the joins in the
+ * dominance frontier of its writes (Cytron et al.), those where it is live in
+ * 'phis' and the rest in 'dead'.
+ */
+static void place_phis(struct abstract_instr_vec *instrs, struct ssa_form *ssa,
+                       uint64_t *live_in, uint64_t written, uint32_t num_real,
+                       uint64_t *phis, uint64_t *dead) {
+    // the dominance frontier of each block, as edges
+    uint32_t *frontier_count = calloc(ssa->num_blocks + 1, sizeof(uint32_t));
+    struct ssa_edges frontier = {.start = frontier_count};
+    uint32_t num_frontier = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t b = 0; b < ssa->num_blocks; b++) {
+            struct ssa_block *block = &ssa->blocks[b];
+
+            if (!block->reached || block->num_preds < 2) {
+                continue;
+            }
+
+            for (uint32_t p = 0; p < block->num_preds; p++) {
+                for (uint32_t runner = block->preds[p]; runner != block->idom;
+                     runner = ssa->blocks[runner].idom) {
+                    if (pass == 0) {
+                        frontier_count[runner + 1]++;
+                    } else {
+                        frontier.to[frontier_count[runner]++] = b;
+                    }
+                }
+            }
+        }
+
+        if (pass == 0) {
+            for (uint32_t b = 0; b < ssa->num_blocks; b++) {
+                frontier_count[b + 1] += frontier_count[b];
+            }
+            num_frontier = frontier_count[ssa->num_blocks];
+            frontier.to = malloc((num_frontier + 1) * sizeof(uint32_t));
+        }
+    }
+
+    // filling in moved every start along to the next block's
+    memmove(&frontier_count[1], &frontier_count[0],
+            ssa->num_blocks * sizeof(uint32_t));
+    frontier_count[0] = 0;
+
+    // blocks writing each register, the root and empty entry blocks write
+    // everything the program does
+    uint64_t *writes = calloc(ssa->num_blocks, sizeof(uint64_t));
+    for (uint32_t b = 0; b < ssa->num_blocks; b++) {
+        if (b == 0 || b >= num_real) {
+            writes[b] = written;
+            continue;
+        }
+
+        for (size_t i = ssa->blocks[b].start; i < ssa->blocks[b].end; i++) {
+            enum reg_type regs[ABSTRACT_INSTR_MAX_REGS];
+            struct abstract_instr instr = abstract_instr_get(instrs, i);
+            size_t num_defs = abstract_instr_defs(&instr, regs);
+            for (size_t d = 0; d < num_defs; d++) {
+                writes[b] |= 1ull << regs[d];
+            }
+        }
+    }
+
+    uint32_t *worklist = malloc(ssa->num_blocks * sizeof(uint32_t));
+    bool *queued = malloc(ssa->num_blocks * sizeof(bool));
+
+    for (enum reg_type reg = SMALLEST_MIPS_REG; reg <= LARGEST_MIPS_REG;
+         reg++) {
+        uint64_t bit = 1ull << reg;
+        uint32_t num_queued = 0;
+
+        if (!(written & bit)) {
+            continue;
+        }
+
+        for (uint32_t b = 0; b < ssa->num_blocks; b++) {
+            queued[b] = ssa->blocks[b].reached && (writes[b] & bit);
+            if (queued[b]) {
+                worklist[num_queued++] = b;
+            }
+        }
+
+        while (num_queued > 0) {
+            uint32_t b = worklist[--num_queued];
+
+            for (uint32_t f = frontier.start[b]; f < frontier.start[b + 1];
+                 f++) {
+                uint32_t join = frontier.to[f];
+
+                if ((phis[join] | dead[join]) & bit) {
+                    continue;
+                }
+
+                if (live_in[join] & bit) {
+                    phis[join] |= bit;
+                } else {
+                    dead[join] |= bit;
+                }
+
+                // the join now writes the register too
+                if (!queued[join]) {
+                    queued[join] = true;
+                    worklist[num_queued++] = join;
+                }
+            }
+        }
+    }
+
+    free(worklist);
+    free(queued);
+    free(writes);
+    free_edges(&frontier);
+}
+
+static uint32_t new_value(struct ssa_form *ssa, uint32_t *next_version,
+                          struct ssa_value value) {
+    value.version = next_version[value.reg]++;
+    ssa_value_vec_push(ssa->values, value);
+
+    return ssa->values->len - 1;
+}
+
+/**
+ * Number every value, walking the dominator tree so each block starts with
+ * the values its immediate dominator ends with.
+ */
+static void rename_values(struct abstract_instr_vec *instrs,
+                          struct ssa_form *ssa, uint64_t written,
+                          uint32_t num_real, uint64_t *phis, uint64_t *dead) {
+    uint32_t next_version[NUM_REGS] = {0};
+    uint32_t(*out)[NUM_REGS] = malloc(ssa->num_blocks * sizeof(*out));
+
+    for (uint32_t d = 0; d < ssa->num_dom_order; d++) {
+        uint32_t b = ssa->dom_order[d];
+        struct ssa_block *block = &ssa->blocks[b];
+
+        for (enum reg_type reg = SMALLEST_MIPS_REG; reg <= LARGEST_MIPS_REG;
+             reg++) {
+            uint64_t bit = 1ull << reg;
+            struct ssa_value value = {.reg = reg, .block = b};
+
+            if (b == 0 || (b >= num_real && (written & bit))) {
+                value.type = SSA_VALUE_ENTRY;
+                block->in[reg] = new_value(ssa, next_version, value);
+            } else if (phis[b] & bit) {
+                value.type = SSA_VALUE_PHI;
+                block->in[reg] = new_value(ssa, next_version, value);
+                ssa_phi_vec_push(block->phis,
+                                 (struct ssa_phi){.value = block->in[reg]});
+            } else if (dead[b] & bit) {
+                block->in[reg] = SSA_NO_VALUE;
+            } else {
+                block->in[reg] = out[block->idom][reg];
+            }
+        }
+
+        memcpy(out[b], block->in, sizeof(block->in));
+
+        for (size_t i = block->start; i < block->end; i++) {
+            enum reg_type regs[ABSTRACT_INSTR_MAX_REGS];
+            struct abstract_instr instr = abstract_instr_get(instrs, i);
+            size_t num_defs = abstract_instr_defs(&instr, regs);
+
+            for (size_t k = 0; k < num_defs; k++) {
+                ssa->defs[i][k] = new_value(
+                    ssa, next_version,
+                    (struct ssa_value){
+                        .reg = regs[k], .type = SSA_VALUE_INSTR, .instr = i});
+                out[b][regs[k]] = ssa->defs[i][k];
+            }
+        }
+    }
+
+    for (uint32_t d = 0; d < ssa->num_dom_order; d++) {
+        struct ssa_block *block = &ssa->blocks[ssa->dom_order[d]];
+
+        for (size_t p = 0; p < block->phis->len; p++) {
+            struct ssa_phi *phi = &block->phis->data[p];
+            enum reg_type reg = ssa->values->data[phi->value].reg;
+
+            phi->args = malloc(block->num_preds * sizeof(uint32_t));
+            for (uint32_t k = 0; k < block->num_preds; k++) {
+                phi->args[k] = out[block->preds[k]][reg];
+            }
+        }
+    }
+
+    free(out);
+}
+
+struct ssa_form build_ssa(struct abstract_instr_vec *instrs) {
+    struct ssa_form ssa = {.values = ssa_value_vec_new()};
+    struct label_refs refs = find_label_refs(instrs);
+    bool jumps_indirectly = abstract_instrs_jump_indirectly(instrs);
+    uint32_t num_real;
+
+    split_blocks(instrs, &ssa, jumps_indirectly, &num_real);
+
+    for (uint32_t b = 0; b < ssa.num_blocks; b++) {
+        ssa.blocks[b].phis = ssa_phi_vec_new();
+        for (enum reg_type reg = SMALLEST_MIPS_REG; reg <= LARGEST_MIPS_REG;
+             reg++) {
+            ssa.blocks[b].in[reg] = SSA_NO_VALUE;
+        }
+    }
+
+    ssa.defs = malloc(instrs->len * sizeof(*ssa.defs));
+    memset(ssa.defs, 0xff, instrs->len * sizeof(*ssa.defs));
+
+    bool *exits = calloc(ssa.num_blocks, sizeof(bool));
+    struct ssa_edges succs = find_succs(instrs, &refs, &ssa, num_real, exits);
+    uint32_t *rpo = malloc(ssa.num_blocks * sizeof(uint32_t));
+    uint32_t num_reached = reverse_postorder(&ssa, &succs, rpo);
+
+    find_preds(&ssa, &succs);
+    find_idoms(&ssa, rpo, num_reached);
+    find_dom_order(&ssa, num_reached);
+
+    uint64_t written = 0;
+    for (size_t i = 0; i < instrs->len; i++) {
+        enum reg_type regs[ABSTRACT_INSTR_MAX_REGS];
+        struct abstract_instr instr = abstract_instr_get(instrs, i);
+        size_t num_defs = abstract_instr_defs(&instr, regs);
+        for (size_t d = 0; d < num_defs; d++) {
+            written |= 1ull << regs[d];
+        }
+    }
+
+    uint64_t *live_in = find_live_in(instrs, &ssa, &succs, num_real, exits);
+    uint64_t *phis = calloc(ssa.num_blocks, sizeof(uint64_t));
+    uint64_t *dead = calloc(ssa.num_blocks, sizeof(uint64_t));
+
+    place_phis(instrs, &ssa, live_in, written, num_real, phis, dead);
+    rename_values(instrs, &ssa, written, num_real, phis, dead);
+
+    free(phis);
+    free(dead);
+    free(live_in);
+    free(rpo);
+    free(exits);
+    free_edges(&succs);
+    free_label_refs(&refs);
+
+    return ssa;
+}
+
+void free_ssa(struct ssa_form *ssa) {
+    for (uint32_t b = 0; b < ssa->num_blocks; b++) {
+        for (size_t p = 0; p < ssa->blocks[b].phis->len; p++) {
+            free(ssa->blocks[b].phis->data[p].args);
+        }
+        ssa_phi_vec_free(ssa->blocks[b].phis);
+        free(ssa->blocks[b].preds);
+    }
+
+    free(ssa->blocks);
+    free(ssa->block_of);
+    free(ssa->defs);
+    free(ssa->dom_order);
+    ssa_value_vec_free(ssa->values);
+}
+
+void ssa_step(struct ssa_form *ssa, struct abstract_instr_vec *instrs,
+              size_t i, uint32_t values[LARGEST_MIPS_REG + 1]) {
+    enum reg_type regs[ABSTRACT_INSTR_MAX_REGS];
+    struct abstract_instr instr = abstract_instr_get(instrs, i);
+    size_t num_defs = abstract_instr_defs(&instr, regs);
+
+    for (size_t d = 0; d < num_defs; d++) {
+        values[regs[d]] = ssa->defs[i][d];
+    }
+}
+
+// long enough for any register name, a dot and a version
+#define SSA_NAME_LEN 24
+
+static void value_name(struct ssa_form *ssa, enum reg_type reg, uint32_t value,
+                       char name[SSA_NAME_LEN]) {
+    if (value == SSA_NO_VALUE) {
+        snprintf(name, SSA_NAME_LEN, "%s", reg_type_names[reg]);
+    } else {
+        snprintf(name, SSA_NAME_LEN, "%s.%u", reg_type_names[reg],
+                 ssa->values->data[value].version);
+    }
+}
+
+static void print_phi(struct ssa_form *ssa, struct ssa_block *block,
+                      struct ssa_phi *phi) {
+    char name[SSA_NAME_LEN];
+    enum reg_type reg = ssa->values->data[phi->value].reg;
+
+    value_name(ssa, reg, phi->value, name);
+    printf("<phi %s <- ", name);
+
+    for (uint32_t k = 0; k < block->num_preds; k++) {
+        value_name(ssa, reg, phi->args[k], name);
+        printf(k == 0 ? "%s" : ", %s", name);
+    }
+
+    printf(">\n");
+}
+
+void print_ssa_form(struct abstract_instr_vec *instrs) {
+    struct ssa_form ssa = build_ssa(instrs);
+    uint32_t values[NUM_REGS];
+    char use_buf[NUM_REGS][SSA_NAME_LEN], def_buf[NUM_REGS][SSA_NAME_LEN];
+    const char *use_names[NUM_REGS], *def_names[NUM_REGS];
+
+    struct abstract_instr instr;
+
+    for (size_t i = 0; abstract_instr_iter(instrs, i, &instr); i++) {
+        struct ssa_block *block = &ssa.blocks[ssa.block_of[i]];
+
+        if (i == block->start) {
+            memcpy(values, block->in, sizeof(values));
+
+            for (size_t p = 0; p < block->phis->len; p++) {
+                print_phi(&ssa, block, &block->phis->data[p]);
+            }
+        }
+
+        for (enum reg_type reg = SMALLEST_MIPS_REG; reg <= LARGEST_MIPS_REG;
+             reg++) {
+            value_name(&ssa, reg, values[reg], use_buf[reg]);
+            use_names[reg] = def_names[reg] = use_buf[reg];
+        }
+
+        enum reg_type regs[ABSTRACT_INSTR_MAX_REGS];
+        size_t num_defs = abstract_instr_defs(&instr, regs);
+        for (size_t d = 0; d < num_defs; d++) {
+            value_name(&ssa, regs[d], ssa.defs[i][d], def_buf[regs[d]]);
+            def_names[regs[d]] = def_buf[regs[d]];
+        }
+
+        print_abstract_instr_named(&instr, use_names, def_names);
+        ssa_step(&ssa, instrs, i, values);
+    }
+
+    free_ssa(&ssa);
+}
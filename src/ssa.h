@@ -0,0 +1,124 @@
+#ifndef __SSA_H_
+#define __SSA_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "abstract_instr.h"
+#include "mips_reg.h"
+#include "vec.h"
+
+/**
+ * Static single assignment form
+ *
+ * Abstract instructions name MIPS registers, so a register read in one place
+ * may hold the result of any of several writes. SSA form gives every write its
+ * own value, named after the register and numbered in the order they are
+ * found: `$t0.0` is what $t0 holds at the start of the program, `$t0.1` the
+ * first write of it and so on. Where paths carrying different values of a
+ * register join, a phi makes a new value out of them, one argument per
+ * predecessor:
+ *
+ *       addi $t0 $zero 10      $t0.1 <- 10
+ * loop: ...                    $t0.2 <- phi($t0.1, $t0.3)
+ *       addi $t0 $t0 -1        $t0.3 <- $t0.2 - 1
+ *       bne $t0 $zero loop
+ *
+ * The instructions themselves aren't changed: this sits alongside them as the
+ * value of every register at the start of each basic block, and the values
+ * each instruction writes. Every value lives in the register it is named after
+ * until that register is written again, so there are no copies to insert to
+ * leave SSA form. A pass that wants to read a value from somewhere else has to
+ * find a register that still holds it, by following the values down a block.
+ *
+ * Phis are only placed where the register is live. A register that isn't
+ * holds no value at the join (SSA_NO_VALUE), which is never equal to any
+ * other.
+ *
+ * Where control can arrive from somewhere the instructions don't show (after
+ * calls, and at guest labels when the program has returns or `jr`), every
+ * register the program writes holds a new value, joined by a phi with the
+ * values from any predecessors. These come from an empty block in front of
+ * the entry, so phi arguments still line up with predecessors.
+ */
+
+#define SSA_NO_VALUE UINT32_MAX
+#define SSA_NO_BLOCK UINT32_MAX
+
+enum __attribute__((__packed__)) ssa_value_type {
+    SSA_VALUE_ENTRY, // held where control arrives from outside
+    SSA_VALUE_INSTR,
+    SSA_VALUE_PHI
+};
+
+struct ssa_value {
+    enum reg_type reg;
+    enum ssa_value_type type;
+    uint32_t version; // counts up from 0 per register
+    uint32_t block;   // where a phi or entry value is defined
+    size_t instr;     // the instruction writing it, for SSA_VALUE_INSTR
+};
+
+DEFINE_VEC(struct ssa_value, ssa_value);
+
+struct ssa_phi {
+    uint32_t value;
+    uint32_t *args; // one per predecessor of the block, in the same order
+};
+
+DEFINE_VEC(struct ssa_phi, ssa_phi);
+
+/**
+ * A basic block, or an empty block control arrives at from outside.
+ */
+struct ssa_block {
+    size_t start, end; // instructions [start, end)
+    uint32_t idom;     // immediate dominator, SSA_NO_BLOCK for the root
+    bool reached;      // from the root, nothing else is filled in if not
+
+    uint32_t *preds;
+    uint32_t num_preds;
+
+    struct ssa_phi_vec *phis;
+
+    // the value of each register once the phis are done
+    uint32_t in[LARGEST_MIPS_REG + 1];
+};
+
+struct ssa_form {
+    struct ssa_block *blocks; // the root first
+    uint32_t num_blocks;
+
+    uint32_t *block_of; // the block each instruction is in
+
+    // values written by each instruction, in `abstract_instr_defs` order
+    uint32_t (*defs)[ABSTRACT_INSTR_MAX_REGS];
+
+    struct ssa_value_vec *values;
+
+    // reached blocks, each after its immediate dominator
+    uint32_t *dom_order;
+    uint32_t num_dom_order;
+};
+
+/**
+ * Put 'instrs' into SSA form.
+ */
+struct ssa_form build_ssa(struct abstract_instr_vec *instrs);
+
+void free_ssa(struct ssa_form *ssa);
+
+/**
+ * Update 'values', the value of each register before 'instrs[i]', to after
+ * it.
+ */
+void ssa_step(struct ssa_form *ssa, struct abstract_instr_vec *instrs,
+              size_t i, uint32_t values[LARGEST_MIPS_REG + 1]);
+
+/**
+ * Print the instructions with the phis at the start of each block, and every
+ * register read or written named by its value.
+ */
+void print_ssa_form(struct abstract_instr_vec *instrs);
+
+#endif // __SSA_H_
@@ -0,0 +1,350 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "abstract_instr.h"
+#include "block_cache.h"
+#include "common.h"
+#include "label_storage.h"
+#include "runtime.h"
+#include "trace.h"
+
+static uint32_t *reg_slot(struct guest_state *state, enum reg_type reg) {
+    return mapped_reg_slot(state->map, reg, state->regs, state->unmapped_regs);
+}
+
+static uint32_t read_storage(struct guest_state *state,
+                             struct abstract_storage s) {
+    switch (s.type) {
+    case ABSTRACT_STORAGE_REG:
+        return *reg_slot(state, s.reg);
+    case ABSTRACT_STORAGE_IMM:
+        return s.imm;
+    }
+
+    RUNTIME_ERROR("Invalid storage type %d", s.type);
+}
+
+/**
+ * Address guest memory the same way generated code does, so out of range
+ * accesses fault the same way.
+ */
+static uint8_t *guest_pointer(struct guest_state *state,
+                              struct abstract_storage base, int16_t offset) {
+    return state->memory + (uint64_t)read_storage(state, base) + offset;
+}
+
+static bool branch_taken(struct guest_state *state,
+                         struct abstract_instr_branch *b) {
+    uint32_t difference =
+        read_storage(state, b->lhs) ^ read_storage(state, b->rhs);
+    uint32_t masked = read_storage(state, b->lhs) & read_storage(state, b->rhs);
+
+    switch (b->type) {
+    case ABSTRACT_INSTR_BRANCH_TEST_NE:
+        return difference != 0;
+    case ABSTRACT_INSTR_BRANCH_TEST_EQ:
+        return difference == 0;
+    case ABSTRACT_INSTR_BRANCH_TEST_LOW_NE:
+        return (difference & ((1u << b->low_bits) - 1)) != 0;
+    case ABSTRACT_INSTR_BRANCH_TEST_LOW_EQ:
+        return (difference & ((1u << b->low_bits) - 1)) == 0;
+    case ABSTRACT_INSTR_BRANCH_TEST_MASK_ZERO:
+        return masked == 0;
+    case ABSTRACT_INSTR_BRANCH_TEST_MASK_NONZERO:
+        return masked != 0;
+    }
+
+    RUNTIME_ERROR("Invalid branch test %d", b->type);
+}
+
+static void execute_muldiv(struct guest_state *state,
+                           struct abstract_instr_muldiv *i) {
+    uint32_t lhs = read_storage(state, i->lhs);
+    uint32_t rhs = read_storage(state, i->rhs);
+    uint64_t hilo;
+
+    switch (i->op) {
+    case ABSTRACT_INSTR_MULDIV_MULT:
+        hilo = (int64_t)(int32_t)lhs * (int32_t)rhs;
+        break;
+    case ABSTRACT_INSTR_MULDIV_MULTU:
+        hilo = (uint64_t)lhs * rhs;
+        break;
+    case ABSTRACT_INSTR_MULDIV_DIV: {
+        // as generated code, dividing by zero divides by one
+        int64_t divisor = rhs == 0 ? 1 : (int32_t)rhs;
+        int64_t quotient = (int32_t)lhs / divisor;
+        int64_t remainder = (int32_t)lhs % divisor;
+        hilo = (uint64_t)(uint32_t)remainder << 32 | (uint32_t)quotient;
+        break;
+    }
+    case ABSTRACT_INSTR_MULDIV_DIVU: {
+        uint32_t divisor = rhs == 0 ? 1 : rhs;
+        hilo = (uint64_t)(lhs % divisor) << 32 | lhs / divisor;
+        break;
+    }
+    }
+
+    *reg_slot(state, REG_LO) = hilo;
+    *reg_slot(state, REG_HI) = hilo >> 32;
+}
+
+static void execute_induction(struct guest_state *state,
+                              struct abstract_instr_induction *i) {
+    uint32_t trips;
+
+    if (!induction_trip_count(*reg_slot(state, i->counter), i->limit, i->step,
+                              &trips)) {
+        // the loop never ends
+        for (;;) {
+        }
+    }
+
+    *reg_slot(state, i->dest) += trips * i->delta;
+}
+
+static void execute_mul_loop(struct guest_state *state,
+                             struct abstract_instr_mul_loop *i) {
+    uint32_t multiplier = *reg_slot(state, i->multiplier);
+    uint32_t multiplicand = *reg_slot(state, i->multiplicand);
+    int top_bit = 31 - __builtin_clz(multiplier | 1);
+
+    *reg_slot(state, i->acc) += multiplier * multiplicand;
+    *reg_slot(state, i->multiplicand) = (multiplicand << top_bit) << 1;
+    *reg_slot(state, i->bit) = multiplier != 0;
+    *reg_slot(state, i->multiplier) = 0;
+}
+
+/**
+ * Execute an abstract instruction, returns true if it jumped, setting
+ * `target` to the guest address jumped to.
+ */
+static bool execute(struct guest_state *state, struct abstract_instr *i,
+                    uint32_t *target) {
+    switch (i->type) {
+    case ABSTRACT_INSTR_BINOP: {
+        uint32_t lhs = read_storage(state, i->binop.lhs);
+        uint32_t rhs = read_storage(state, i->binop.rhs);
+        uint32_t *dest = reg_slot(state, i->binop.dest);
+
+        switch (i->binop.op) {
+        case ABSTRACT_INSTR_BINOP_ADD:
+            *dest = lhs + rhs;
+            break;
+        case ABSTRACT_INSTR_BINOP_ADD_TRAP: {
+            int32_t sum;
+            if (__builtin_add_overflow((int32_t)lhs, (int32_t)rhs, &sum)) {
+                jit_overflow(i->guest_address);
+            }
+            *dest = sum;
+            break;
+        }
+        case ABSTRACT_INSTR_BINOP_AND:
+            *dest = lhs & rhs;
+            break;
+        case ABSTRACT_INSTR_BINOP_MUL:
+            *dest = lhs * rhs;
+            break;
+        case ABSTRACT_INSTR_BINOP_SCALED_ADD:
+            *dest = (lhs << i->binop.shift) + rhs;
+            break;
+        }
+        return false;
+    }
+    case ABSTRACT_INSTR_BRANCH:
+        *target = i->branch.label->guest_address;
+        return branch_taken(state, &i->branch);
+    case ABSTRACT_INSTR_MOV:
+        *reg_slot(state, i->mov.dest) = read_storage(state, i->mov.source);
+        return false;
+    case ABSTRACT_INSTR_SHIFT: {
+        uint32_t lhs = *reg_slot(state, i->shift.lhs);
+        *reg_slot(state, i->shift.dest) =
+            i->shift.direction == ABSTRACT_INSTR_SHIFT_LEFT
+                ? lhs << i->shift.rhs
+                : lhs >> i->shift.rhs;
+        return false;
+    }
+    case ABSTRACT_INSTR_LOAD: {
+        uint8_t *p = guest_pointer(state, i->load.base, i->load.offset);
+        uint32_t *dest = reg_slot(state, i->load.dest);
+
+        switch (i->load.width) {
+        case ABSTRACT_MEM_BYTE:
+            *dest = *(int8_t *)p;
+            break;
+        case ABSTRACT_MEM_HALF:
+            *dest = *(int16_t *)p;
+            break;
+        case ABSTRACT_MEM_WORD:
+            *dest = *(uint32_t *)p;
+            break;
+        }
+        return false;
+    }
+    case ABSTRACT_INSTR_STORE: {
+        uint8_t *p = guest_pointer(state, i->store.base, i->store.offset);
+        uint32_t value = read_storage(state, i->store.value);
+
+        switch (i->store.width) {
+        case ABSTRACT_MEM_BYTE:
+            *p = value;
+            break;
+        case ABSTRACT_MEM_HALF:
+            *(uint16_t *)p = value;
+            break;
+        case ABSTRACT_MEM_WORD:
+            *(uint32_t *)p = value;
+            break;
+        }
+        return false;
+    }
+    case ABSTRACT_INSTR_MULDIV:
+        execute_muldiv(state, &i->muldiv);
+        return false;
+    case ABSTRACT_INSTR_MUL_LOOP:
+        execute_mul_loop(state, &i->mul_loop);
+        return false;
+    case ABSTRACT_INSTR_INDUCTION:
+        execute_induction(state, &i->induction);
+        return false;
+    case ABSTRACT_INSTR_JUMP:
+        *target = i->jump.label->guest_address;
+        return true;
+    case ABSTRACT_INSTR_CALL:
+        // the return address was already moved into $ra
+        *target = i->call.label->guest_address;
+        return true;
+    case ABSTRACT_INSTR_RETURN:
+    case ABSTRACT_INSTR_JUMP_REG:
+        *target = read_storage(state, i->jump_reg.target);
+        return true;
+    case ABSTRACT_INSTR_SWAP: {
+        uint32_t a = *reg_slot(state, i->swap.a);
+        *reg_slot(state, i->swap.a) = *reg_slot(state, i->swap.b);
+        *reg_slot(state, i->swap.b) = a;
+        return false;
+    }
+    }
+
+    RUNTIME_ERROR("Invalid abstract instruction type %d", i->type);
+}
+
+/**
+ * Add the executed instruction 'instr', at 'index' in the program, to a trace.
+ * Returns false if the trace can't continue.
+ */
+static bool record(struct block_cache *cache, struct abstract_instr_vec *trace,
+                   struct abstract_instr *instr, size_t index, bool jumped) {
+    if (trace->len >= TRACE_MAX_LENGTH) {
+        return false;
+    }
+
+    struct abstract_instr recorded = *instr;
+    recorded.label = NULL;
+
+    switch (instr->type) {
+    case ABSTRACT_INSTR_CALL:
+    case ABSTRACT_INSTR_RETURN:
+    case ABSTRACT_INSTR_JUMP_REG:
+        return false;
+    case ABSTRACT_INSTR_JUMP:
+        // the trace just continues at the target
+        return true;
+    case ABSTRACT_INSTR_BRANCH:
+        if (jumped) {
+            // guard that the branch is still taken, leaving to the
+            // fallthrough otherwise
+            struct label *fallthrough = add_internal_label();
+            set_label_guest_address(fallthrough,
+                                    index + 1 < cache->ainstrs->len
+                                        ? cache->entry_addresses[index + 1]
+                                        : GUEST_EXIT_ADDRESS);
+
+            recorded.branch.type = invert_branch_test(instr->branch.type);
+            recorded.branch.label = fallthrough;
+        }
+        // an untaken branch already leaves the trace when it is taken
+        break;
+    default:
+        break;
+    }
+
+    abstract_instr_vec_push(trace, recorded);
+    return true;
+}
+
+static size_t entry_index(struct block_cache *cache, uint32_t guest_address) {
+    uint32_t index;
+
+    if (!guest_map_lookup(&cache->entry_indices, guest_address, &index)) {
+        RUNTIME_ERROR("Jump to invalid guest address 0x%08x", guest_address);
+    }
+
+    return index;
+}
+
+struct abstract_instr_vec *trace_record(struct block_cache *cache,
+                                        uint32_t head,
+                                        struct guest_state *state,
+                                        uint32_t *next_pc) {
+    struct abstract_instr_vec *ainstrs = cache->ainstrs;
+    struct abstract_instr_vec *trace =
+        abstract_instr_vec_new_in(cache->arena, 64);
+    size_t head_index = entry_index(cache, head);
+    size_t index = head_index;
+    bool recording = true;
+
+    for (;;) {
+        if (index >= ainstrs->len) {
+            recording = false;
+            *next_pc = GUEST_EXIT_ADDRESS;
+            break;
+        }
+
+        // once recording stops, interpret up to the start of a block
+        if (!recording && cache->is_entry[index]) {
+            *next_pc = cache->entry_addresses[index];
+            break;
+        }
+
+        struct abstract_instr instr = abstract_instr_get(ainstrs, index);
+        uint32_t target;
+        bool jumped = execute(state, &instr, &target);
+
+        if (recording) {
+            recording = record(cache, trace, &instr, index, jumped);
+        }
+
+        if (!jumped) {
+            index++;
+        } else if (target == GUEST_EXIT_ADDRESS) {
+            recording = false;
+            *next_pc = GUEST_EXIT_ADDRESS;
+            break;
+        } else {
+            index = entry_index(cache, target);
+        }
+
+        if (recording && index == head_index) {
+            *next_pc = head;
+            break;
+        }
+    }
+
+    if (!recording) {
+        return NULL;
+    }
+
+    // loop back to the start of the trace
+    struct label *head_label = abstract_instr_label(ainstrs, head_index);
+    abstract_instr_set_label(trace, 0, head_label);
+    abstract_instr_vec_push(
+        trace, (struct abstract_instr){.type = ABSTRACT_INSTR_JUMP,
+                                       .guest_address = head,
+                                       .jump = {.label = head_label}});
+
+    return trace;
+}
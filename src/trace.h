@@ -0,0 +1,47 @@
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include <stdint.h>
+
+#include "abstract_instr.h"
+#include "block_cache.h"
+
+/**
+ * Trace recording
+ *
+ * When tracing, jumps to loop heads go through the dispatcher until the head
+ * has been reached TRACE_HOT_THRESHOLD times. The next iteration is then run
+ * by an interpreter over the abstract instructions, which records the path it
+ * takes as a straight line trace: jumps are dropped and each conditional
+ * branch becomes a guard that leaves the trace if it would go the other way.
+ * The trace ends by jumping back to its start, and is compiled in place of the
+ * loop head's block.
+ *
+ * Calls, returns and indirect jumps aren't traced through.
+ */
+
+// longest trace recorded, in abstract instructions
+#define TRACE_MAX_LENGTH 256
+
+/**
+ * Where the guest registers and memory are while outside of generated code.
+ */
+struct guest_state {
+    struct mips_x86_reg_mapping *map;
+    uint32_t *regs;
+    uint32_t *unmapped_regs;
+    uint8_t *memory;
+};
+
+/**
+ * Run one iteration of the loop at `head` and record it as a trace, in the
+ * cache's arena. Returns NULL if the iteration couldn't be traced, either way
+ * `next_pc` is set to where execution continues, which is always the start of
+ * a block.
+ */
+struct abstract_instr_vec *trace_record(struct block_cache *cache,
+                                        uint32_t head,
+                                        struct guest_state *state,
+                                        uint32_t *next_pc);
+
+#endif // __TRACE_H_
@@ -0,0 +1,517 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "abstract_instr.h"
+#include "common.h"
+#include "label_storage.h"
+#include "mips_reg.h"
+#include "unroll.h"
+
+struct counted_loop {
+    size_t start; // the head of the loop
+    size_t end;   // the closing branch
+    enum reg_type counter;
+    uint32_t limit, step;
+};
+
+/**
+ * Find a loop starting at 'start' that can be unrolled.
+ */
+static bool find_counted_loop(struct abstract_instr_vec *instrs, size_t start,
+                              struct counted_loop *loop) {
+    struct label *head = abstract_instr_label(instrs, start);
+
+    if (head == NULL) {
+        return false;
+    }
+
+    struct abstract_instr i;
+    size_t end = start;
+    for (; abstract_instr_iter(instrs, end, &i); end++) {
+        if (end != start && i.label) {
+            return false;
+        }
+
+        if (i.type == ABSTRACT_INSTR_BRANCH) {
+            break;
+        }
+
+        if (abstract_instr_target_label(&i) != NULL ||
+            i.type == ABSTRACT_INSTR_RETURN ||
+            i.type == ABSTRACT_INSTR_JUMP_REG) {
+            return false;
+        }
+    }
+
+    if (end == start || end == instrs->len ||
+        !counted_loop_exit(&i, head, &loop->counter, &loop->limit)) {
+        return false;
+    }
+
+    // the counter may only change by constants
+    loop->step = 0;
+    for (size_t j = start; j < end; j++) {
+        enum reg_type defs[ABSTRACT_INSTR_MAX_REGS];
+        enum reg_type reg;
+        uint32_t delta;
+
+        i = abstract_instr_get(instrs, j);
+        size_t num_defs = abstract_instr_defs(&i, defs);
+
+        if (abstract_instr_affine_update(&i, &reg, &delta)) {
+            if (reg == loop->counter) {
+                loop->step += delta;
+            }
+            continue;
+        }
+
+        for (size_t d = 0; d < num_defs; d++) {
+            if (defs[d] == loop->counter) {
+                return false;
+            }
+        }
+    }
+
+    loop->start = start;
+    loop->end = end;
+
+    return loop->step != 0;
+}
+
+/**
+ * Append a copy of the loop body, with 'label' on its first instruction.
+ */
+static void copy_body(struct abstract_instr_vec *instrs,
+                      struct counted_loop *loop, struct label *label,
+                      struct abstract_instr_vec *out) {
+    for (size_t i = loop->start; i < loop->end; i++) {
+        struct abstract_instr copy = abstract_instr_get(instrs, i);
+        copy.label = i == loop->start ? label : NULL;
+        abstract_instr_vec_push(out, copy);
+    }
+}
+
+/**
+ * A branch comparing the loop counter against the limit.
+ */
+static struct abstract_instr
+loop_branch(struct counted_loop *loop,
+            enum abstract_instr_branch_test_type type, uint8_t low_bits,
+            struct label *label, uint32_t guest_address) {
+    return (struct abstract_instr){
+        .type = ABSTRACT_INSTR_BRANCH,
+        .guest_address = guest_address,
+        .branch = {.type = type,
+                   .lhs = {.type = ABSTRACT_STORAGE_REG, .reg = loop->counter},
+                   .rhs = {.type = ABSTRACT_STORAGE_IMM, .imm = loop->limit},
+                   .low_bits = low_bits,
+                   .label = label}};
+}
+
+static struct abstract_instr add_imm(enum reg_type reg, uint32_t imm,
+                                     uint32_t guest_address) {
+    return (struct abstract_instr){
+        .type = ABSTRACT_INSTR_BINOP,
+        .guest_address = guest_address,
+        .binop = {.op = ABSTRACT_INSTR_BINOP_ADD,
+                  .dest = reg,
+                  .lhs = {.type = ABSTRACT_STORAGE_REG, .reg = reg},
+                  .rhs = {.type = ABSTRACT_STORAGE_IMM, .imm = imm}}};
+}
+
+/**
+ * Fold 'pending' into the offset of a memory access based on 'reg', returns
+ * false if the access doesn't only read 'reg' as its base, or the offset
+ * wouldn't fit.
+ *
+ * NOTE: this assumes the guest doesn't rely on a base register wrapping
+ * around the top of the address space.
+ */
+static bool fold_into_offset(struct abstract_instr *i, enum reg_type reg,
+                             uint32_t pending) {
+    struct abstract_storage base;
+    int16_t *offset;
+
+    if (i->type == ABSTRACT_INSTR_LOAD) {
+        base = i->load.base;
+        offset = &i->load.offset;
+    } else if (i->type == ABSTRACT_INSTR_STORE &&
+               !(i->store.value.type == ABSTRACT_STORAGE_REG &&
+                 i->store.value.reg == reg)) {
+        base = i->store.base;
+        offset = &i->store.offset;
+    } else {
+        return false;
+    }
+
+    int64_t folded = (int64_t)*offset + (int32_t)pending;
+
+    if (base.type != ABSTRACT_STORAGE_REG || base.reg != reg ||
+        folded < INT16_MIN || folded > INT16_MAX) {
+        return false;
+    }
+
+    *offset = folded;
+    return true;
+}
+
+/**
+ * Put off constant adds in the straight line code 'out[from..]' until the
+ * register is read.
+ */
+static void defer_affine_updates(struct abstract_instr_vec *out, size_t from) {
+    uint32_t pending[LARGEST_MIPS_REG + 1] = {0};
+    uint32_t guest_address = out->guest_addresses[out->len - 1];
+
+    // an add is only put back after at least one was taken out, so 'len'
+    // never overtakes 'i'
+    size_t len = from;
+
+    for (size_t i = from; i < out->len; i++) {
+        struct abstract_instr instr = abstract_instr_get(out, i);
+        enum reg_type regs[ABSTRACT_INSTR_MAX_REGS];
+        enum reg_type reg;
+        uint32_t delta;
+
+        if (abstract_instr_affine_update(&instr, &reg, &delta)) {
+            pending[reg] += delta;
+            continue;
+        }
+
+        size_t num_uses = abstract_instr_uses(&instr, regs);
+        for (size_t u = 0; u < num_uses; u++) {
+            reg = regs[u];
+            if (pending[reg] != 0 &&
+                !fold_into_offset(&instr, reg, pending[reg])) {
+                struct abstract_instr add =
+                    add_imm(reg, pending[reg], instr.guest_address);
+                abstract_instr_set(out, len++, &add);
+                pending[reg] = 0;
+            }
+        }
+
+        size_t num_defs = abstract_instr_defs(&instr, regs);
+        for (size_t d = 0; d < num_defs; d++) {
+            pending[regs[d]] = 0;
+        }
+
+        abstract_instr_set(out, len++, &instr);
+    }
+
+    // everything is applied by the end
+    for (enum reg_type reg = SMALLEST_MIPS_REG; reg <= LARGEST_MIPS_REG;
+         reg++) {
+        if (pending[reg] != 0) {
+            struct abstract_instr add =
+                add_imm(reg, pending[reg], guest_address);
+            abstract_instr_set(out, len++, &add);
+        }
+    }
+
+    abstract_instrs_remove(out, len, out->len - len);
+}
+
+/**
+ * Drop writes in the straight line code 'out[from..]' that are overwritten
+ * before they are read, everything is assumed to be read afterwards.
+ */
+static void remove_dead_writes(struct abstract_instr_vec *out, size_t from) {
+    bool live[LARGEST_MIPS_REG + 1];
+    bool *dead = calloc(out->len, sizeof(bool));
+
+    for (enum reg_type reg = SMALLEST_MIPS_REG; reg <= LARGEST_MIPS_REG;
+         reg++) {
+        live[reg] = true;
+    }
+
+    for (size_t i = out->len; i-- > from;) {
+        struct abstract_instr instr = abstract_instr_get(out, i);
+        enum reg_type regs[ABSTRACT_INSTR_MAX_REGS];
+        size_t num_defs = abstract_instr_defs(&instr, regs);
+
+        // loads are kept as they may fault, and adds as they may trap
+        if (((instr.type == ABSTRACT_INSTR_BINOP &&
+              instr.binop.op != ABSTRACT_INSTR_BINOP_ADD_TRAP) ||
+             instr.type == ABSTRACT_INSTR_MOV ||
+             instr.type == ABSTRACT_INSTR_SHIFT) &&
+            !live[regs[0]]) {
+            dead[i] = true;
+            continue;
+        }
+
+        for (size_t d = 0; d < num_defs; d++) {
+            live[regs[d]] = false;
+        }
+
+        size_t num_uses = abstract_instr_uses(&instr, regs);
+        for (size_t u = 0; u < num_uses; u++) {
+            live[regs[u]] = true;
+        }
+    }
+
+    // nothing after 'from' has a label yet
+    size_t len = from;
+    for (size_t i = from; i < out->len; i++) {
+        if (!dead[i]) {
+            out->types[len] = out->types[i];
+            out->operands[len] = out->operands[i];
+            out->guest_addresses[len++] = out->guest_addresses[i];
+        }
+    }
+    abstract_instrs_remove(out, len, out->len - len);
+
+    free(dead);
+}
+
+/**
+ * Append 'copies' copies of the loop body as straight line code, cleaned up
+ * between copies.
+ */
+static void unrolled_body(struct abstract_instr_vec *instrs,
+                          struct counted_loop *loop, uint32_t copies,
+                          struct label *label, struct abstract_instr_vec *out) {
+    size_t from = out->len;
+
+    for (uint32_t c = 0; c < copies; c++) {
+        copy_body(instrs, loop, NULL, out);
+    }
+
+    defer_affine_updates(out, from);
+    remove_dead_writes(out, from);
+
+    // something is always left: the body isn't only adds (or it would have
+    // been replaced by its closed form), and nothing can be dead in the last
+    // copy
+    abstract_instr_set_label(out, from, label);
+
+    // blocks are entered at the address of the instruction a guest label is
+    // on
+    if (label->has_guest_address) {
+        out->guest_addresses[from] = label->guest_address;
+    }
+}
+
+/**
+ * Append the unrolled loop: 'copies' copies of the body closed by a branch
+ * back to their start.
+ */
+static void unrolled_loop(struct abstract_instr_vec *instrs,
+                          struct counted_loop *loop, uint32_t copies,
+                          struct label *label, struct abstract_instr_vec *out) {
+    unrolled_body(instrs, loop, copies, label, out);
+    abstract_instr_vec_push(
+        out, loop_branch(loop, ABSTRACT_INSTR_BRANCH_TEST_NE, 0, label,
+                         instrs->guest_addresses[loop->end]));
+}
+
+/**
+ * The size of a loop unrolled 'factor' times when the trip count is known.
+ */
+static uint64_t known_unrolled_size(uint64_t trips, uint32_t factor,
+                                    size_t body_len) {
+    uint64_t size = trips % factor * body_len;
+
+    if (trips >= factor) {
+        size += factor * body_len + 1;
+    }
+
+    return size;
+}
+
+/**
+ * Unroll a loop whose trip count is known, appending it to 'out'.
+ */
+static bool unroll_known(struct abstract_instr_vec *instrs,
+                         struct counted_loop *loop, uint32_t start_value,
+                         uint32_t factor, uint32_t budget,
+                         struct abstract_instr_vec *out) {
+    size_t body_len = loop->end - loop->start;
+    uint32_t trips_mod;
+
+    if (!induction_trip_count(start_value, loop->limit, loop->step,
+                              &trips_mod)) {
+        return false;
+    }
+
+    uint64_t trips = trips_mod == 0 ? 1ull << 32 : trips_mod;
+
+    while (factor > 1 &&
+           known_unrolled_size(trips, factor, body_len) > budget) {
+        factor >>= 1;
+    }
+
+    if (factor <= 1) {
+        return false;
+    }
+
+    DEBUG_LOG("unrolling loop at %zu by %u, %llu trips", loop->start, factor,
+              (unsigned long long)trips);
+
+    struct label *head = abstract_instr_label(instrs, loop->start);
+    uint32_t remainder = trips % factor;
+
+    if (remainder != 0) {
+        unrolled_body(instrs, loop, remainder, head, out);
+    }
+
+    if (trips >= factor) {
+        unrolled_loop(instrs, loop, factor,
+                      remainder != 0 ? add_internal_label() : head, out);
+    }
+
+    return true;
+}
+
+/**
+ * Unroll a loop whose trip count is only known at runtime, appending it to
+ * 'out'.
+ */
+static bool unroll_runtime(struct abstract_instr_vec *instrs,
+                           struct counted_loop *loop, uint32_t factor,
+                           uint32_t budget, struct abstract_instr_vec *out) {
+    size_t body_len = loop->end - loop->start;
+
+    // the loop is left through the instruction after it
+    if (loop->end + 1 >= instrs->len) {
+        return false;
+    }
+
+    while (factor > 1 && (factor + 1) * body_len + 4 > budget) {
+        factor >>= 1;
+    }
+
+    // the trips left are a multiple of the factor when the counter is the
+    // limit modulo factor * step (ignoring the odd part of the step)
+    int low_bits = __builtin_ctz(factor) + __builtin_ctz(loop->step);
+
+    if (factor <= 1 || low_bits >= 32) {
+        return false;
+    }
+
+    DEBUG_LOG("unrolling loop at %zu by %u", loop->start, factor);
+
+    uint32_t guest_address = instrs->guest_addresses[loop->end];
+    struct label *after = abstract_instr_label(instrs, loop->end + 1);
+    struct label *head = abstract_instr_label(instrs, loop->start);
+    struct label *remainder = add_internal_label();
+    struct label *unrolled = add_internal_label();
+
+    if (after == NULL) {
+        after = add_internal_label();
+        abstract_instr_set_label(instrs, loop->end + 1, after);
+    }
+
+    // head: if counter == limit in the low bits goto unrolled
+    struct abstract_instr branch =
+        loop_branch(loop, ABSTRACT_INSTR_BRANCH_TEST_LOW_EQ, low_bits,
+                    unrolled, guest_address);
+    branch.label = head;
+    branch.guest_address = instrs->guest_addresses[loop->start];
+    abstract_instr_vec_push(out, branch);
+
+    // remainder: body
+    //            if counter != limit in the low bits goto remainder
+    //            if counter == limit goto after
+    copy_body(instrs, loop, remainder, out);
+    abstract_instr_vec_push(out, loop_branch(loop,
+                                             ABSTRACT_INSTR_BRANCH_TEST_LOW_NE,
+                                             low_bits, remainder,
+                                             guest_address));
+    abstract_instr_vec_push(out,
+                            loop_branch(loop, ABSTRACT_INSTR_BRANCH_TEST_EQ, 0,
+                                        after, guest_address));
+
+    // unrolled: body * factor
+    //           if counter != limit goto unrolled
+    unrolled_loop(instrs, loop, factor, unrolled, out);
+
+    return true;
+}
+
+/**
+ * Find the constant the counter is set to before the loop, looking back over
+ * the straight line code that falls into it. Returns false if the counter
+ * isn't set to a constant there, or the head can be reached some other way
+ * ('jumps_indirectly' as for `abstract_instr_is_entry`).
+ */
+static bool counter_start_value(struct abstract_instr_vec *instrs,
+                                struct counted_loop *loop,
+                                bool jumps_indirectly, uint32_t *value) {
+    // anything else jumping to the head could bring another value, `jr`
+    // included
+    if (!only_branch_to(instrs, abstract_instr_label(instrs, loop->start),
+                        loop->end) ||
+        abstract_instr_is_entry(instrs, loop->start, jumps_indirectly)) {
+        return false;
+    }
+
+    for (size_t i = loop->start; i-- > 0;) {
+        struct abstract_instr instr = abstract_instr_get(instrs, i);
+        enum reg_type defs[ABSTRACT_INSTR_MAX_REGS];
+
+        switch (instr.type) {
+        case ABSTRACT_INSTR_JUMP:
+        case ABSTRACT_INSTR_CALL:
+        case ABSTRACT_INSTR_RETURN:
+        case ABSTRACT_INSTR_JUMP_REG:
+            return false;
+        default:
+            break;
+        }
+
+        size_t num_defs = abstract_instr_defs(&instr, defs);
+        for (size_t d = 0; d < num_defs; d++) {
+            if (defs[d] == loop->counter) {
+                return instr.type == ABSTRACT_INSTR_MOV &&
+                       abstract_storage_constant(instr.mov.source, value);
+            }
+        }
+
+        // code before a label isn't the only way here
+        if (instr.label != NULL) {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+void unroll_loops(struct abstract_instr_vec *instrs, uint32_t factor,
+                  uint32_t budget) {
+    if (factor <= 1) {
+        return;
+    }
+
+    struct abstract_instr_vec *out =
+        abstract_instr_vec_new_in(instrs->arena, instrs->len);
+    bool jumps_indirectly = abstract_instrs_jump_indirectly(instrs);
+
+    for (size_t i = 0; i < instrs->len;) {
+        struct counted_loop loop;
+
+        if (!find_counted_loop(instrs, i, &loop)) {
+            abstract_instr_vec_push(out, abstract_instr_get(instrs, i++));
+            continue;
+        }
+
+        uint32_t start_value;
+        bool known =
+            counter_start_value(instrs, &loop, jumps_indirectly, &start_value);
+
+        if (known ? unroll_known(instrs, &loop, start_value, factor, budget,
+                                 out)
+                  : unroll_runtime(instrs, &loop, factor, budget, out)) {
+            i = loop.end + 1;
+        } else {
+            abstract_instr_vec_push(out, abstract_instr_get(instrs, i++));
+        }
+    }
+
+    // 'out' takes the old instructions to be freed, in an arena they're
+    // freed with it
+    struct abstract_instr_vec old = *instrs;
+    *instrs = *out;
+    *out = old;
+    abstract_instr_vec_free(out);
+}
@@ -0,0 +1,38 @@
+#ifndef __UNROLL_H_
+#define __UNROLL_H_
+
+#include <stdint.h>
+
+#include "abstract_instr.h"
+
+/**
+ * Loop unrolling
+ *
+ * A loop that is a single block closed by `bne $counter limit head`, where
+ * the body only changes the counter by adding constants to it, runs a number
+ * of times fixed by the counter's value on entry (see `induction_trip_count`).
+ * Such a loop is unrolled so that one trip around it runs 'factor' copies of
+ * the body, with the closing branch only tested after the last.
+ *
+ * The trips that don't make up a whole unrolled iteration are run first:
+ *
+ * - if the counter is set to a constant in the straight line code leading
+ *   into the loop the trip count is known, and these copies are laid out
+ *   straight before the loop.
+ *
+ * - otherwise the trips left are a multiple of the factor exactly when the low
+ *   bits of the counter match the limit's, so a copy of the original loop
+ *   runs until they do before entering the unrolled loop.
+ *
+ * Within the unrolled copies constant adds to a register are put off until
+ * the register is next read, and folded into the offsets of loads and stores
+ * meanwhile, so the counter and any pointers are only bumped once per trip.
+ * Writes that are overwritten before being read are then dropped.
+ *
+ * Loops that would grow past 'budget' abstract instructions are unrolled by a
+ * smaller factor, or not at all.
+ */
+void unroll_loops(struct abstract_instr_vec *instrs, uint32_t factor,
+                  uint32_t budget);
+
+#endif // __UNROLL_H_
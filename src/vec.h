@@ -2,6 +2,16 @@
 #define __VEC_H_
 
 #include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+/**
+ * Vectors made with `NAME##_vec_new_in` and an arena live in it: growing
+ * copies the data into a new allocation from the arena, and freeing them does
+ * nothing as the arena frees them. Without an arena they're on the heap like
+ * those made with `NAME##_vec_new`, but start out with the given capacity.
+ */
 
 #define DEFINE_VEC(TYPE, NAME)                                                 \
                                                                                \
@@ -9,9 +19,11 @@
         TYPE *data;                                                            \
         size_t cap;                                                            \
         size_t len;                                                            \
+        struct arena *arena; /* NULL if on the heap */                         \
     };                                                                         \
                                                                                \
     struct NAME##_vec *NAME##_vec_new(void);                                   \
+    struct NAME##_vec *NAME##_vec_new_in(struct arena *arena, size_t cap);     \
     void NAME##_vec_push(struct NAME##_vec *vec, TYPE i);                      \
     void NAME##_vec_free(struct NAME##_vec *vec)
 
@@ -19,12 +31,25 @@
     struct NAME##_vec *NAME##_vec_new(void) {                                  \
         const size_t initial_cap = 8;                                          \
                                                                                \
-        TYPE *data = calloc(initial_cap, sizeof(TYPE));                        \
-        struct NAME##_vec *vec = malloc(sizeof(struct NAME##_vec));            \
+        return NAME##_vec_new_in(NULL, initial_cap);                           \
+    }                                                                          \
+                                                                               \
+    struct NAME##_vec *NAME##_vec_new_in(struct arena *arena, size_t cap) {    \
+        struct NAME##_vec *vec;                                                \
+                                                                               \
+        cap = cap > 0 ? cap : 1;                                               \
+                                                                               \
+        if (arena != NULL) {                                                   \
+            vec = arena_alloc(arena, sizeof(struct NAME##_vec));               \
+            vec->data = arena_calloc(arena, cap * sizeof(TYPE));               \
+        } else {                                                               \
+            vec = malloc(sizeof(struct NAME##_vec));                           \
+            vec->data = calloc(cap, sizeof(TYPE));                             \
+        }                                                                      \
                                                                                \
         vec->len = 0;                                                          \
-        vec->cap = initial_cap;                                                \
-        vec->data = data;                                                      \
+        vec->cap = cap;                                                        \
+        vec->arena = arena;                                                    \
                                                                                \
         return vec;                                                            \
     }                                                                          \
@@ -32,13 +57,24 @@
     void NAME##_vec_push(struct NAME##_vec *vec, TYPE i) {                     \
         if (vec->len == vec->cap) {                                            \
             vec->cap <<= 1;                                                    \
-            vec->data = realloc(vec->data, vec->cap * sizeof(TYPE));           \
+                                                                               \
+            if (vec->arena != NULL) {                                          \
+                TYPE *data = arena_alloc(vec->arena, vec->cap * sizeof(TYPE)); \
+                memcpy(data, vec->data, vec->len * sizeof(TYPE));              \
+                vec->data = data;                                              \
+            } else {                                                           \
+                vec->data = realloc(vec->data, vec->cap * sizeof(TYPE));       \
+            }                                                                  \
         }                                                                      \
                                                                                \
         vec->data[vec->len++] = i;                                             \
     }                                                                          \
                                                                                \
     void NAME##_vec_free(struct NAME##_vec *vec) {                             \
+        if (vec->arena != NULL) {                                              \
+            return;                                                            \
+        }                                                                      \
+                                                                               \
         free(vec->data);                                                       \
         free(vec);                                                             \
     }
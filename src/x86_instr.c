@@ -1,3 +1,5 @@
+#include <stddef.h>
+
 #include "common.h"
 #include "label.h"
 #include "label_storage.h"
@@ -6,6 +8,7 @@
 #include "x86_reg.h"
 
 MAKE_VEC(struct x86_instr, x86_instr);
+MAKE_VEC(struct x86_fixup, x86_fixup);
 
 #define WRITE_BYTES(BUF, ...)                                                  \
     do {                                                                       \
@@ -16,136 +19,729 @@ MAKE_VEC(struct x86_instr, x86_instr);
         }                                                                      \
     } while (0)
 
+/**
+ * How the operands of an instruction are encoded, and which member of the
+ * instruction's union holds them. Instructions with a single register operand
+ * read it through `reg`, which shares its first member with `reg_imm`.
+ */
+enum __attribute__((__packed__)) x86_operands {
+    X86_OPERANDS_NONE,         // only the immediate in reg_imm, if any
+    X86_OPERANDS_ABS,          // a 64 bit immediate in abs
+    X86_OPERANDS_MR,           // reg_reg, modrm.reg = src, modrm.rm = dest
+    X86_OPERANDS_RM,           // reg_reg, modrm.reg = dest, modrm.rm = src
+    X86_OPERANDS_SAME,         // reg, in both modrm.reg and modrm.rm
+    X86_OPERANDS_EXT,          // reg, modrm.reg is the opcode extension
+    X86_OPERANDS_GROUP1,       // as EXT, shortened to 83 and an imm8 if it fits
+    X86_OPERANDS_OPCODE_REG,   // reg, in the low bits of the opcode
+    X86_OPERANDS_COND_BYTE,    // setcc, cond added to the opcode
+    X86_OPERANDS_COND_REL,     // jump, cond added to the opcode, rel32 to label
+    X86_OPERANDS_REL,          // jump, rel32 to the label
+    X86_OPERANDS_XMM,          // reg_xmm, modrm.reg = xmm, modrm.rm = reg
+    X86_OPERANDS_STACK_IMM,    // stack_imm, [rbp + 4 * offset]
+    X86_OPERANDS_STACK_LOAD,   // reg_stack, [rbp + 4 * offset]
+    X86_OPERANDS_STACK_STORE,  // stack_reg, [rbp + 4 * offset]
+    X86_OPERANDS_PTR,          // ptr, modrm.reg = reg, modrm.rm = [base + disp]
+    X86_OPERANDS_PTR_EXT,      // ptr, as EXT with modrm.rm = [base + disp]
+    X86_OPERANDS_ABS_REG,      // abs, reg in the low bits of the opcode
+    X86_OPERANDS_COND_SKIP,    // skip, cond added to the opcode, rel8 = len
+    X86_OPERANDS_GUEST_LOAD,   // reg_mem, opcode by width
+    X86_OPERANDS_GUEST_STORE,  // reg_mem, opcode by width
+    X86_OPERANDS_LEA,          // lea
+    X86_OPERANDS_SEQUENCE      // see `x86_instr_sequence`
+};
+
+struct x86_encoding {
+    enum x86_operands operands;
+    uint8_t prefix; // legacy prefix, 0 if none
+    bool wide;      // REX.W
+    bool escape;    // 0f opcode escape
+    uint8_t opcode;
+    uint8_t ext; // modrm.reg of the /digit forms
+    uint8_t imm_size;
+};
+
+/**
+ * The encoding of every instruction type, both the sizes of constructed
+ * instructions and the bytes emitted for them come from here.
+ *
+ * X(TYPE, OPERANDS, PREFIX, WIDE, ESCAPE, OPCODE, EXT, IMM_SIZE)
+ */
+#define X86_ENCODINGS(X)                                                       \
+    X(ZERO_REG, SAME, 0, 0, 0, 0x31, 0, 0)                                     \
+    X(MOV_REG_IMM, OPCODE_REG, 0, 0, 0, 0xb8, 0, 4)                            \
+    X(MOV_STACK_IMM, STACK_IMM, 0, 0, 0, 0xc7, 0, 4)                           \
+    X(MOV_REG_REG, MR, 0, 0, 0, 0x89, 0, 0)                                    \
+    X(MOV_REG_STACK, STACK_LOAD, 0, 0, 0, 0x8b, 0, 0)                          \
+    X(MOV_STACK_REG, STACK_STORE, 0, 0, 0, 0x89, 0, 0)                         \
+    X(ADD_REG_REG, MR, 0, 0, 0, 0x01, 0, 0)                                    \
+    X(AND_REG_REG, MR, 0, 0, 0, 0x21, 0, 0)                                    \
+    X(SHR_REG_IMM, EXT, 0, 0, 0, 0xc1, 5, 1)                                   \
+    X(SHL_REG_IMM, EXT, 0, 0, 0, 0xc1, 4, 1)                                   \
+    X(CMP_REG_REG, MR, 0, 0, 0, 0x39, 0, 0)                                    \
+    X(JUMP, COND_REL, 0, 0, 1, 0x80, 0, 4)                                     \
+    X(MOV_REG_MEM, GUEST_LOAD, 0, 0, 0, 0x8b, 0, 0)                            \
+    X(MOV_MEM_REG, GUEST_STORE, 0, 0, 0, 0x89, 0, 0)                           \
+    X(IMUL_REG_REG, RM, 0, 0, 1, 0xaf, 0, 0)                                   \
+    X(IMUL64_REG_REG, RM, 0, 1, 1, 0xaf, 0, 0)                                 \
+    X(MOVSXD_REG_REG, RM, 0, 1, 0, 0x63, 0, 0)                                 \
+    X(SHR64_REG_IMM, EXT, 0, 1, 0, 0xc1, 5, 1)                                 \
+    X(CMP_REG_IMM, GROUP1, 0, 0, 0, 0x81, 7, 4)                                \
+    X(ADC_REG_IMM, EXT, 0, 0, 0, 0x83, 2, 1)                                   \
+    X(OR_REG_IMM, EXT, 0, 0, 0, 0x83, 1, 1)                                    \
+    X(TEST_REG_REG, MR, 0, 0, 0, 0x85, 0, 0)                                   \
+    X(BSR_REG_REG, RM, 0, 0, 1, 0xbd, 0, 0)                                    \
+    X(SHL_REG_CL, EXT, 0, 0, 0, 0xd3, 4, 0)                                    \
+    X(SETCC_REG, COND_BYTE, 0, 0, 1, 0x90, 0, 0)                               \
+    X(PUSH_REG, OPCODE_REG, 0, 0, 0, 0x50, 0, 0)                               \
+    X(POP_REG, OPCODE_REG, 0, 0, 0, 0x58, 0, 0)                                \
+    X(CQO, NONE, 0, 1, 0, 0x99, 0, 0)                                          \
+    X(IDIV64_REG, EXT, 0, 1, 0, 0xf7, 7, 0)                                    \
+    X(DIV_REG, EXT, 0, 0, 0, 0xf7, 6, 0)                                       \
+    X(PUSH_IMM, NONE, 0, 0, 0, 0x68, 0, 4)                                     \
+    X(ADD_RSP_IMM, EXT, 0, 1, 0, 0x83, 0, 1)                                   \
+    X(CMP_SHADOW_REG, PTR, 0, 0, 0, 0x39, 0, 0)                                \
+    X(CALL, REL, 0, 0, 0, 0xe8, 0, 4)                                          \
+    X(RET, NONE, 0, 0, 0, 0xc3, 0, 0)                                          \
+    X(JMP, REL, 0, 0, 0, 0xe9, 0, 4)                                           \
+    X(IC_JUMP, SEQUENCE, 0, 0, 0, 0, 0, 0)                                     \
+    X(MOV_ABS_EAX, ABS, 0, 0, 0, 0xa3, 0, 8)                                   \
+    X(ADD_REG_IMM, GROUP1, 0, 0, 0, 0x81, 0, 4)                                \
+    X(AND_REG_IMM, GROUP1, 0, 0, 0, 0x81, 4, 4)                                \
+    X(MOVD_REG_XMM, XMM, 0x66, 0, 1, 0x7e, 0, 0)                               \
+    X(MOVD_XMM_REG, XMM, 0x66, 0, 1, 0x6e, 0, 0)                               \
+    X(LEA_REG_MEM, LEA, 0, 0, 0, 0x8d, 0, 0)                                   \
+    X(TEST_REG_IMM, EXT, 0, 0, 0, 0xf7, 0, 4)                                  \
+    X(BOUND_CALLS, SEQUENCE, 0, 0, 0, 0, 0, 0)                                 \
+    X(MOV_REG_IMM64, ABS_REG, 0, 1, 0, 0xb8, 0, 8)                             \
+    X(MOV64_REG_PTR, PTR, 0, 1, 0, 0x8b, 0, 0)                                 \
+    X(CMP_PTR_REG, PTR, 0, 0, 0, 0x39, 0, 0)                                   \
+    X(CMP64_PTR_REG, PTR, 0, 1, 0, 0x39, 0, 0)                                 \
+    X(ADD64_PTR_IMM, PTR_EXT, 0, 1, 0, 0x83, 0, 1)                             \
+    X(JMP_PTR, PTR_EXT, 0, 0, 0, 0xff, 4, 0)                                   \
+    X(JCC_SKIP, COND_SKIP, 0, 0, 0, 0x70, 0, 1)
+
+static const struct x86_encoding x86_encodings[] = {
+#define X(TYPE, OPERANDS, PREFIX, WIDE, ESCAPE, OPCODE, EXT, IMM_SIZE)         \
+    [TYPE] = {.operands = X86_OPERANDS_##OPERANDS,                             \
+              .prefix = PREFIX,                                                \
+              .wide = WIDE,                                                    \
+              .escape = ESCAPE,                                                \
+              .opcode = OPCODE,                                                \
+              .ext = EXT,                                                      \
+              .imm_size = IMM_SIZE},
+    X86_ENCODINGS(X)
+#undef X
+};
+
+// what MOV_REG_MEM and MOV_MEM_REG change to for byte and word accesses
+static const struct x86_encoding x86_movsx_encoding = {
+    .operands = X86_OPERANDS_GUEST_LOAD, .escape = true};
+static const struct x86_encoding x86_mov16_encoding = {
+    .operands = X86_OPERANDS_GUEST_STORE, .prefix = 0x66};
+
+#define NUM_ENCODED_REGS 16
+
+// F(ARGS, reg) for every encoded register, the two are the same so rows of
+// registers can be built from columns of them
+#define EACH_ENCODED_REG(F, ...)                                               \
+    F(__VA_ARGS__, 0), F(__VA_ARGS__, 1), F(__VA_ARGS__, 2),                   \
+        F(__VA_ARGS__, 3), F(__VA_ARGS__, 4), F(__VA_ARGS__, 5),               \
+        F(__VA_ARGS__, 6), F(__VA_ARGS__, 7), F(__VA_ARGS__, 8),               \
+        F(__VA_ARGS__, 9), F(__VA_ARGS__, 10), F(__VA_ARGS__, 11),             \
+        F(__VA_ARGS__, 12), F(__VA_ARGS__, 13), F(__VA_ARGS__, 14),            \
+        F(__VA_ARGS__, 15)
+#define EACH_ENCODED_ROW(F, ...)                                               \
+    F(__VA_ARGS__, 0), F(__VA_ARGS__, 1), F(__VA_ARGS__, 2),                   \
+        F(__VA_ARGS__, 3), F(__VA_ARGS__, 4), F(__VA_ARGS__, 5),               \
+        F(__VA_ARGS__, 6), F(__VA_ARGS__, 7), F(__VA_ARGS__, 8),               \
+        F(__VA_ARGS__, 9), F(__VA_ARGS__, 10), F(__VA_ARGS__, 11),             \
+        F(__VA_ARGS__, 12), F(__VA_ARGS__, 13), F(__VA_ARGS__, 14),            \
+        F(__VA_ARGS__, 15)
+
+#define REX_PREFIX(WIDE, REG, RM)                                              \
+    ((WIDE) || (REG) >= R8D || (RM) >= R8D                                     \
+         ? 0x40 | (WIDE) << 3 | ((REG) >= R8D) << 2 | ((RM) >= R8D)            \
+         : 0)
+#define REX_PREFIX_ROW(WIDE, REG) {EACH_ENCODED_REG(REX_PREFIX, WIDE, REG)}
+#define DIRECT_MODRM(REG, RM) (0b11 << 6 | ((REG) & 7) << 3 | ((RM) & 7))
+#define DIRECT_MODRM_ROW(_, REG) {EACH_ENCODED_REG(DIRECT_MODRM, REG)}
+#define REX_INDEX(_, INDEX) ((INDEX) >= R8D ? 0x42 : 0)
+
+/**
+ * The REX prefix (0 if none is needed) by REX.W, then the modrm.reg and
+ * modrm.rm registers, and the register direct modrm byte by modrm.reg and
+ * modrm.rm. Opcode extensions index these as registers, as do xmm registers.
+ * The REX prefix bits a sib index register needs are ORed in from
+ * `rex_indexes`.
+ */
+static const uint8_t rex_prefixes[2][NUM_ENCODED_REGS][NUM_ENCODED_REGS] = {
+    {EACH_ENCODED_ROW(REX_PREFIX_ROW, false)},
+    {EACH_ENCODED_ROW(REX_PREFIX_ROW, true)}};
+static const uint8_t direct_modrms[NUM_ENCODED_REGS][NUM_ENCODED_REGS] = {
+    EACH_ENCODED_ROW(DIRECT_MODRM_ROW, 0)};
+static const uint8_t rex_indexes[NUM_ENCODED_REGS] = {
+    EACH_ENCODED_REG(REX_INDEX, 0)};
+
+/**
+ * The low three bits of a register number, as used in modrm/sib bytes.
+ */
+static uint8_t reg_bits(enum x86_reg_type reg) { return reg & 7; }
+
+static uint8_t rex_size(bool wide, uint8_t reg, uint8_t rm) {
+    return rex_prefixes[wide][reg][rm] != 0;
+}
+
+/**
+ * Emit a REX prefix for an instruction with the given modrm.reg and modrm.rm
+ * registers, if one is needed.
+ */
+static uint8_t *emit_rex(bool wide, enum x86_reg_type reg, enum x86_reg_type rm,
+                         uint8_t *buf) {
+    if (rex_size(wide, reg, rm)) {
+        WRITE_BYTES(buf, rex_prefixes[wide][reg][rm]);
+    }
+
+    return buf;
+}
+
+/**
+ * The REX prefix (0 if none is needed) of an instruction addressing memory
+ * through a sib byte.
+ */
+static uint8_t sib_rex(bool wide, enum x86_reg_type reg, enum x86_reg_type base,
+                       bool has_index, enum x86_reg_type index) {
+    return rex_prefixes[wide][reg][base] | (has_index ? rex_indexes[index] : 0);
+}
+
+/**
+ * The REX prefix of a setcc, bpl, sil and dil need one to be addressed as
+ * bytes.
+ */
+static uint8_t setcc_rex(enum x86_reg_type reg) {
+    return rex_prefixes[false][EAX][reg] | (reg >= EBP) << 6;
+}
+
+/**
+ * Whether an immediate operand of the 81 group of instructions can use the
+ * short 83 encoding, which sign extends an imm8.
+ */
+static bool imm_fits_imm8(uint32_t imm) { return (int8_t)imm == (int32_t)imm; }
+
+/**
+ * Size of the displacement of a guest memory operand.
+ */
+static uint8_t guest_mem_disp_size(int16_t disp) {
+    if (disp == 0) {
+        return 0;
+    }
+
+    return (disp >= INT8_MIN && disp <= INT8_MAX) ? 1 : 4;
+}
+
+/**
+ * Size of the displacement of an address with the given base, rbp and r13
+ * need one even when it is zero.
+ */
+static uint8_t lea_disp_size(enum x86_reg_type base, int32_t disp) {
+    if (disp == 0 && (base & 7) != EBP) {
+        return 0;
+    }
+
+    return (disp >= INT8_MIN && disp <= INT8_MAX) ? 1 : 4;
+}
+
+/**
+ * The mod of a modrm byte addressing memory with a displacement of the given
+ * size.
+ */
+static uint8_t disp_mod(uint8_t disp_size) {
+    return disp_size == 0 ? 0b00 : disp_size == 1 ? 0b01 : 0b10;
+}
+
+// the most instructions `x86_instr_sequence` makes one of
+#define X86_MAX_SEQUENCE (3 + 3 * JIT_IC_ENTRIES)
+
+static size_t x86_instr_sequence(struct x86_instr *i, struct x86_instr *parts);
+
+/**
+ * Size of the modrm and what follows it for the operand [base + disp8], rsp
+ * needs a sib byte.
+ */
+static uint8_t ptr_operand_size(enum x86_reg_type base, int8_t disp) {
+    return 1 + ((base & 7) == ESP) + lea_disp_size(base, disp);
+}
+
+/**
+ * The number of bytes `encode_x86_instr` writes for 'i'.
+ */
+static uint8_t x86_instr_size(struct x86_instr *i) {
+    const struct x86_encoding *enc = &x86_encodings[i->type];
+    // legacy prefix, escape, opcode and immediate
+    uint8_t size = (enc->prefix != 0) + enc->escape + 1 + enc->imm_size;
+
+    switch (enc->operands) {
+    case X86_OPERANDS_NONE:
+        return size + enc->wide;
+    case X86_OPERANDS_ABS:
+    case X86_OPERANDS_COND_REL:
+    case X86_OPERANDS_REL:
+        return size;
+    case X86_OPERANDS_MR:
+    case X86_OPERANDS_RM:
+        return size + rex_size(enc->wide, i->reg_reg.dest, i->reg_reg.src) + 1;
+    case X86_OPERANDS_SAME:
+    case X86_OPERANDS_EXT:
+        return size + rex_size(enc->wide, EAX, i->reg.reg) + 1;
+    case X86_OPERANDS_GROUP1:
+        return size + rex_size(enc->wide, EAX, i->reg_imm.dest) + 1 -
+               (imm_fits_imm8(i->reg_imm.imm) ? 3 : 0);
+    case X86_OPERANDS_OPCODE_REG:
+        return size + rex_size(enc->wide, EAX, i->reg.reg);
+    case X86_OPERANDS_COND_BYTE:
+        return size + (setcc_rex(i->setcc.reg) != 0) + 1;
+    case X86_OPERANDS_XMM:
+        return size + rex_size(enc->wide, i->reg_xmm.xmm, i->reg_xmm.reg) + 1;
+    case X86_OPERANDS_STACK_IMM:
+        return size + 2;
+    case X86_OPERANDS_STACK_LOAD:
+        return size + rex_size(false, i->reg_stack.dest, EBP) + 2;
+    case X86_OPERANDS_STACK_STORE:
+        return size + rex_size(false, i->stack_reg.src, EBP) + 2;
+    case X86_OPERANDS_PTR:
+        return size + rex_size(enc->wide, i->ptr.reg, i->ptr.base) +
+               ptr_operand_size(i->ptr.base, i->ptr.disp);
+    case X86_OPERANDS_PTR_EXT:
+        return size + rex_size(enc->wide, enc->ext, i->ptr.base) +
+               ptr_operand_size(i->ptr.base, i->ptr.disp);
+    case X86_OPERANDS_ABS_REG:
+        return size + rex_size(enc->wide, EAX, i->abs.reg);
+    case X86_OPERANDS_COND_SKIP:
+        return size;
+    case X86_OPERANDS_GUEST_LOAD:
+        return size + (i->reg_mem.width != X86_MEM_DWORD) +
+               (sib_rex(false, i->reg_mem.reg, R15D, true,
+                        i->reg_mem.index) != 0) +
+               2 + guest_mem_disp_size(i->reg_mem.disp);
+    case X86_OPERANDS_GUEST_STORE:
+        return size + (i->reg_mem.width == X86_MEM_WORD) +
+               (sib_rex(false, i->reg_mem.reg, R15D, true,
+                        i->reg_mem.index) != 0) +
+               2 + guest_mem_disp_size(i->reg_mem.disp);
+    case X86_OPERANDS_LEA:
+        return size +
+               (sib_rex(false, i->lea.dest, i->lea.base, i->lea.has_index,
+                        i->lea.index) != 0) +
+               2 + lea_disp_size(i->lea.base, i->lea.disp);
+    case X86_OPERANDS_SEQUENCE: {
+        struct x86_instr parts[X86_MAX_SEQUENCE];
+        size_t num_parts = x86_instr_sequence(i, parts);
+
+        // nothing comes from the table's entry
+        size = 0;
+        for (size_t p = 0; p < num_parts; p++) {
+            size += parts[p].size;
+        }
+
+        return size;
+    }
+    }
+
+    RUNTIME_ERROR("Invalid x86 instruction %d", i->type);
+}
+
+/**
+ * Fill in the size of a constructed instruction.
+ */
+static struct x86_instr sized(struct x86_instr *i) {
+    i->size = x86_instr_size(i);
+    return *i;
+}
+
 struct x86_instr construct_zero_reg(enum x86_reg_type reg) {
-    // if dest is old: [31, 0b11(reg : 3)(reg : 3)]
-    // if dest is new: [45, 31, 0b11(reg - r8d : 3)(reg - r8d : 3)]
-    return (struct x86_instr){
-        .type = ZERO_REG, .size = 2 + x86_reg_is_new[reg], .reg = {.reg = reg}};
+    struct x86_instr i = {.type = ZERO_REG, .reg = {.reg = reg}};
+    return sized(&i);
 }
 
 struct x86_instr construct_mov_reg_imm(enum x86_reg_type dest, uint32_t imm) {
-    // if dest is old: [b8 + dest, imm.0, imm.1, imm.2, imm.3]
-    // if dest is new: [41, b8 + dest - r8d, imm.0, imm.1, imm.2, imm.3]
-
-    return (struct x86_instr){.type = MOV_REG_IMM,
-                              .size = 5 + x86_reg_is_new[dest],
-                              .reg_imm = {.dest = dest, .imm = imm}};
+    struct x86_instr i = {.type = MOV_REG_IMM,
+                          .reg_imm = {.dest = dest, .imm = imm}};
+    return sized(&i);
 }
 
 struct x86_instr construct_mov_stack_imm(uint8_t dest_offset, uint32_t imm) {
-    // NOTE: for memory offset instrs, make sure value is converted to a signed
-    // type and inverted
-    // [67, c7, 45, -dest_offset, imm.0, imm.1, imm.2, imm.3]
-
     if (dest_offset > 0x80) {
         RUNTIME_ERROR("Invalid offset, must be less than 0x80: %d",
                       dest_offset);
     }
 
-    return (struct x86_instr){
+    struct x86_instr i = {
         .type = MOV_STACK_IMM,
-        .size = 7,
         .stack_imm = {.dest_offset = dest_offset, .imm = imm}};
+    return sized(&i);
 }
 
 struct x86_instr construct_mov_reg_reg(enum x86_reg_type dest,
                                        enum x86_reg_type src) {
-    // if src and dest are old: [89,     0b11(src : 3)(dest : 3)]
-    // if src is old, dest new: [41, 89, 0b11(src : 3)(dest - r8d : 3)]
-    // if src is new, dest old: [44, 89, 0b11(src - r8d : 3)(dest : 3)]
-    // if src and dest are new: [45, 89, 0b11(src - r8d : 3)(dest - r8d : 3)]
-
-    return (struct x86_instr){
-        .type = MOV_REG_REG,
-        .size = 2 + (x86_reg_is_new[src] | x86_reg_is_new[dest]),
-        .reg_reg = {.dest = dest, .src = src}};
+    struct x86_instr i = {.type = MOV_REG_REG,
+                          .reg_reg = {.dest = dest, .src = src}};
+    return sized(&i);
 }
 
 struct x86_instr construct_mov_reg_stack(enum x86_reg_type dest,
                                          uint8_t src_offset) {
-    // if dest is old: [67,     8b, 0b01(dest : 3)101, -src_offset]
-    // if dest is new: [67, 44, 8b, 0b01(dest - r8d : 3)101, -src_offset]
-
-    return (struct x86_instr){
+    struct x86_instr i = {
         .type = MOV_REG_STACK,
-        .size = 3 + x86_reg_is_new[dest],
         .reg_stack = {.dest = dest, .src_offset = src_offset}};
+    return sized(&i);
 }
 
 struct x86_instr construct_mov_stack_reg(uint8_t dest_offset,
                                          enum x86_reg_type src) {
-    // if src is old: [67,     89, 0b01(src : 3)101, -dest_offset]
-    // if src is new: [67, 44, 89, 0b01(src - r8d : 3)101, -dest_offset]
-
-    return (struct x86_instr){
+    struct x86_instr i = {
         .type = MOV_STACK_REG,
-        .size = 3 + x86_reg_is_new[src],
         .stack_reg = {.src = src, .dest_offset = dest_offset}};
+    return sized(&i);
 }
 
 struct x86_instr construct_add_reg_reg(enum x86_reg_type dest,
                                        enum x86_reg_type src) {
-    // if src and dest are old: [01,     0b11(src : 3)(dest : 3)]
-    // if src is old, dest new: [41, 01, 0b11(src : 3)(dest - r8d : 3)]
-    // if src is new, dest old: [44, 01, 0b11(src - r8d : 3)(dest : 3)]
-    // if src and dest are new: [45, 01, 0b11(src - r8d : 3)(dest - r8d : 3)]
-
-    return (struct x86_instr){
-        .type = ADD_REG_REG,
-        .size = 2 + (x86_reg_is_new[src] | x86_reg_is_new[dest]),
-        .reg_reg = {.dest = dest, .src = src}};
+    struct x86_instr i = {.type = ADD_REG_REG,
+                          .reg_reg = {.dest = dest, .src = src}};
+    return sized(&i);
 }
 
 struct x86_instr construct_and_reg_reg(enum x86_reg_type dest,
                                        enum x86_reg_type src) {
-    // if src and dest are old: [21,     0b11(src : 3)(dest : 3)]
-    // if src is old, dest new: [41, 21, 0b11(src : 3)(dest - r8d : 3)]
-    // if src is new, dest old: [44, 21, 0b11(src - r8d : 3)(dest : 3)]
-    // if src and dest are new: [45, 21, 0b11(src - r8d : 3)(dest - r8d : 3)]
-
-    return (struct x86_instr){
-        .type = AND_REG_REG,
-        .size = 2 + (x86_reg_is_new[src] | x86_reg_is_new[dest]),
-        .reg_reg = {.dest = dest, .src = src}};
+    struct x86_instr i = {.type = AND_REG_REG,
+                          .reg_reg = {.dest = dest, .src = src}};
+    return sized(&i);
 }
 
 struct x86_instr construct_shr_reg_imm(enum x86_reg_type reg, uint16_t imm) {
-    // if reg is old: [c1,     0b11101(reg : 3), imm]
-    // if reg is new: [41, 01, 0b11101(reg - r8d : 3)]
-
-    return (struct x86_instr){.type = SHR_REG_IMM,
-                              .size = 3 + x86_reg_is_new[reg],
-                              .reg_imm = {.dest = reg, .imm = imm}};
+    struct x86_instr i = {.type = SHR_REG_IMM,
+                          .reg_imm = {.dest = reg, .imm = imm}};
+    return sized(&i);
 }
 
 struct x86_instr construct_shl_reg_imm(enum x86_reg_type reg, uint16_t imm) {
-    // if reg is old: [c1,     0b11100(reg : 3), imm]
-    // if reg is new: [41, 01, 0b11100(reg - r8d : 3)]
-
-    return (struct x86_instr){.type = SHL_REG_IMM,
-                              .size = 3 + x86_reg_is_new[reg],
-                              .reg_imm = {.dest = reg, .imm = imm}};
+    struct x86_instr i = {.type = SHL_REG_IMM,
+                          .reg_imm = {.dest = reg, .imm = imm}};
+    return sized(&i);
 }
 
 struct x86_instr construct_cmp_reg_reg(enum x86_reg_type dest,
                                        enum x86_reg_type src) {
-    // if src and dest are old: [39,     0b11(src : 3)(dest : 3)]
-    // if src is old, dest new: [41, 39, 0b11(src : 3)(dest - r8d : 3)]
-    // if src is new, dest old: [44, 39, 0b11(src - r8d : 3)(dest : 3)]
-    // if src and dest are new: [45, 39, 0b11(src - r8d : 3)(dest - r8d : 3)]
+    struct x86_instr i = {.type = CMP_REG_REG,
+                          .reg_reg = {.dest = dest, .src = src}};
+    return sized(&i);
+}
+
+struct x86_instr construct_jump(enum x86_cond_type cond, struct label *label) {
+    struct x86_instr i = {.type = JUMP, .jump = {.cond = cond, .label = label}};
+    return sized(&i);
+}
+
+struct x86_instr construct_mov_reg_mem(enum x86_reg_type dest,
+                                       enum x86_reg_type index, int16_t disp,
+                                       enum x86_mem_width width) {
+    struct x86_instr i = {
+        .type = MOV_REG_MEM,
+        .reg_mem = {.reg = dest, .index = index, .width = width, .disp = disp}};
+    return sized(&i);
+}
+
+struct x86_instr construct_mov_mem_reg(enum x86_reg_type index, int16_t disp,
+                                       enum x86_reg_type src,
+                                       enum x86_mem_width width) {
+    struct x86_instr i = {
+        .type = MOV_MEM_REG,
+        .reg_mem = {.reg = src, .index = index, .width = width, .disp = disp}};
+    return sized(&i);
+}
+
+struct x86_instr construct_imul_reg_reg(enum x86_reg_type dest,
+                                        enum x86_reg_type src) {
+    struct x86_instr i = {.type = IMUL_REG_REG,
+                          .reg_reg = {.dest = dest, .src = src}};
+    return sized(&i);
+}
+
+struct x86_instr construct_imul64_reg_reg(enum x86_reg_type dest,
+                                          enum x86_reg_type src) {
+    struct x86_instr i = {.type = IMUL64_REG_REG,
+                          .reg_reg = {.dest = dest, .src = src}};
+    return sized(&i);
+}
+
+struct x86_instr construct_movsxd_reg_reg(enum x86_reg_type dest,
+                                          enum x86_reg_type src) {
+    struct x86_instr i = {.type = MOVSXD_REG_REG,
+                          .reg_reg = {.dest = dest, .src = src}};
+    return sized(&i);
+}
+
+struct x86_instr construct_shr64_reg_imm(enum x86_reg_type reg, uint16_t imm) {
+    struct x86_instr i = {.type = SHR64_REG_IMM,
+                          .reg_imm = {.dest = reg, .imm = imm}};
+    return sized(&i);
+}
+
+struct x86_instr construct_cmp_reg_imm(enum x86_reg_type reg, uint32_t imm) {
+    struct x86_instr i = {.type = CMP_REG_IMM,
+                          .reg_imm = {.dest = reg, .imm = imm}};
+    return sized(&i);
+}
+
+struct x86_instr construct_add_reg_imm(enum x86_reg_type reg, uint32_t imm) {
+    struct x86_instr i = {.type = ADD_REG_IMM,
+                          .reg_imm = {.dest = reg, .imm = imm}};
+    return sized(&i);
+}
+
+struct x86_instr construct_and_reg_imm(enum x86_reg_type reg, uint32_t imm) {
+    struct x86_instr i = {.type = AND_REG_IMM,
+                          .reg_imm = {.dest = reg, .imm = imm}};
+    return sized(&i);
+}
+
+struct x86_instr construct_adc_reg_imm(enum x86_reg_type reg, int8_t imm) {
+    struct x86_instr i = {.type = ADC_REG_IMM,
+                          .reg_imm = {.dest = reg, .imm = imm}};
+    return sized(&i);
+}
+
+struct x86_instr construct_or_reg_imm(enum x86_reg_type reg, int8_t imm) {
+    struct x86_instr i = {.type = OR_REG_IMM,
+                          .reg_imm = {.dest = reg, .imm = imm}};
+    return sized(&i);
+}
+
+struct x86_instr construct_test_reg_reg(enum x86_reg_type dest,
+                                        enum x86_reg_type src) {
+    struct x86_instr i = {.type = TEST_REG_REG,
+                          .reg_reg = {.dest = dest, .src = src}};
+    return sized(&i);
+}
+
+struct x86_instr construct_test_reg_imm(enum x86_reg_type reg, uint32_t imm) {
+    struct x86_instr i = {.type = TEST_REG_IMM,
+                          .reg_imm = {.dest = reg, .imm = imm}};
+    return sized(&i);
+}
+
+struct x86_instr construct_bsr_reg_reg(enum x86_reg_type dest,
+                                       enum x86_reg_type src) {
+    struct x86_instr i = {.type = BSR_REG_REG,
+                          .reg_reg = {.dest = dest, .src = src}};
+    return sized(&i);
+}
+
+struct x86_instr construct_shl_reg_cl(enum x86_reg_type reg) {
+    struct x86_instr i = {.type = SHL_REG_CL, .reg = {.reg = reg}};
+    return sized(&i);
+}
+
+struct x86_instr construct_setcc_reg(enum x86_cond_type cond,
+                                     enum x86_reg_type reg) {
+    struct x86_instr i = {.type = SETCC_REG,
+                          .setcc = {.cond = cond, .reg = reg}};
+    return sized(&i);
+}
+
+struct x86_instr construct_push_reg(enum x86_reg_type reg) {
+    struct x86_instr i = {.type = PUSH_REG, .reg = {.reg = reg}};
+    return sized(&i);
+}
+
+struct x86_instr construct_pop_reg(enum x86_reg_type reg) {
+    struct x86_instr i = {.type = POP_REG, .reg = {.reg = reg}};
+    return sized(&i);
+}
+
+struct x86_instr construct_cqo(void) {
+    struct x86_instr i = {.type = CQO};
+    return sized(&i);
+}
+
+struct x86_instr construct_idiv64_reg(enum x86_reg_type reg) {
+    struct x86_instr i = {.type = IDIV64_REG, .reg = {.reg = reg}};
+    return sized(&i);
+}
+
+struct x86_instr construct_div_reg(enum x86_reg_type reg) {
+    struct x86_instr i = {.type = DIV_REG, .reg = {.reg = reg}};
+    return sized(&i);
+}
+
+struct x86_instr construct_push_imm(uint32_t imm) {
+    struct x86_instr i = {.type = PUSH_IMM,
+                          .reg_imm = {.dest = EAX, .imm = imm}};
+    return sized(&i);
+}
+
+struct x86_instr construct_add_rsp_imm(int8_t imm) {
+    struct x86_instr i = {.type = ADD_RSP_IMM,
+                          .reg_imm = {.dest = ESP, .imm = imm}};
+    return sized(&i);
+}
 
-    return (struct x86_instr){
-        .type = CMP_REG_REG,
-        .size = 2 + (x86_reg_is_new[src] | x86_reg_is_new[dest]),
-        .reg_reg = {.dest = dest, .src = src}};
+struct x86_instr construct_cmp_shadow_reg(enum x86_reg_type reg) {
+    struct x86_instr i = {.type = CMP_SHADOW_REG,
+                          .ptr = {.reg = reg, .base = ESP, .disp = 8}};
+    return sized(&i);
 }
 
-struct x86_instr construct_jump(bool is_eq, struct label *label) {
-    // if je:  [0f, 84, 4 bytes of: offset - 6]
-    // if jne: [0f, 85, 4 bytes of: offset - 6]
+struct x86_instr construct_call(struct label *label) {
+    struct x86_instr i = {.type = CALL, .jump = {.label = label}};
+    return sized(&i);
+}
+
+struct x86_instr construct_ret(void) {
+    struct x86_instr i = {.type = RET};
+    return sized(&i);
+}
+
+struct x86_instr construct_jmp(struct label *label) {
+    struct x86_instr i = {.type = JMP, .jump = {.label = label}};
+    return sized(&i);
+}
+
+struct x86_instr construct_ic_jump(struct jit_ic *ic,
+                                   struct label *miss_label) {
+    struct x86_instr i = {.type = IC_JUMP,
+                          .ic_jump = {.ic = ic, .miss_label = miss_label}};
+    return sized(&i);
+}
+
+struct x86_instr construct_mov_abs_eax(void *address) {
+    struct x86_instr i = {.type = MOV_ABS_EAX,
+                          .abs = {.address = (uint64_t)address}};
+    return sized(&i);
+}
+
+struct x86_instr construct_bound_calls(struct jit_runtime *rt) {
+    struct x86_instr i = {.type = BOUND_CALLS,
+                          .abs = {.address = (uint64_t)&rt->call_stack_limit}};
+    return sized(&i);
+}
+
+static struct x86_instr construct_mov_reg_imm64(enum x86_reg_type reg,
+                                                void *address) {
+    struct x86_instr i = {.type = MOV_REG_IMM64,
+                          .abs = {.address = (uint64_t)address, .reg = reg}};
+    return sized(&i);
+}
+
+/**
+ * Construct an instruction of 'type' with a [base + disp] operand.
+ */
+static struct x86_instr construct_ptr(enum x86_instr_type type,
+                                      enum x86_reg_type reg,
+                                      enum x86_reg_type base, int8_t disp,
+                                      uint8_t imm) {
+    struct x86_instr i = {
+        .type = type,
+        .ptr = {.reg = reg, .base = base, .disp = disp, .imm = imm}};
+    return sized(&i);
+}
+
+static struct x86_instr construct_jcc_skip(enum x86_cond_type cond,
+                                           uint8_t len) {
+    struct x86_instr i = {.type = JCC_SKIP,
+                          .skip = {.cond = cond, .len = len}};
+    return sized(&i);
+}
+
+/**
+ * Split an instruction encoded as a sequence into 'parts', returning how many
+ * there are.
+ *
+ * An IC_JUMP counts the jump then checks each entry of its inline cache,
+ * jumping to the target of the first holding the guest address in eax, and
+ * otherwise jumps to the miss label with the cache in rcx.
+ *
+ * A BOUND_CALLS resets rsp to `call_stack_base` if it's at or below
+ * `call_stack_limit`, using rax.
+ */
+static size_t x86_instr_sequence(struct x86_instr *i, struct x86_instr *parts) {
+    size_t len = 0;
+
+    switch (i->type) {
+    case IC_JUMP: {
+        struct jit_ic *ic = i->ic_jump.ic;
+
+        parts[len++] = construct_mov_reg_imm64(ECX, ic);
+        parts[len++] = construct_ptr(ADD64_PTR_IMM, EAX, ECX,
+                                     offsetof(struct jit_ic, executions), 1);
+
+        for (int entry = 0; entry < JIT_IC_ENTRIES; entry++) {
+            struct x86_instr jump = construct_ptr(
+                JMP_PTR, EAX, ECX,
+                offsetof(struct jit_ic, targets) + 8 * entry, 0);
+
+            parts[len++] = construct_ptr(
+                CMP_PTR_REG, EAX, ECX,
+                offsetof(struct jit_ic, guest_addresses) + 4 * entry, 0);
+            parts[len++] = construct_jcc_skip(X86_COND_NE, jump.size);
+            parts[len++] = jump;
+        }
+
+        parts[len++] = construct_jmp(i->ic_jump.miss_label);
+        break;
+    }
+    case BOUND_CALLS: {
+        struct x86_instr reset = construct_ptr(
+            MOV64_REG_PTR, ESP, EAX,
+            (int)offsetof(struct jit_runtime, call_stack_base) -
+                (int)offsetof(struct jit_runtime, call_stack_limit),
+            0);
+
+        parts[len++] =
+            construct_mov_reg_imm64(EAX, (void *)i->abs.address);
+        parts[len++] = construct_ptr(CMP64_PTR_REG, ESP, EAX, 0, 0);
+        parts[len++] = construct_jcc_skip(X86_COND_B, reset.size);
+        parts[len++] = reset;
+        break;
+    }
+    default:
+        RUNTIME_ERROR("Not a sequence x86 instruction %d", i->type);
+    }
+
+    return len;
+}
+
+struct x86_instr construct_movd_reg_xmm(enum x86_reg_type reg,
+                                        enum x86_xmm_reg_type xmm) {
+    struct x86_instr i = {.type = MOVD_REG_XMM,
+                          .reg_xmm = {.reg = reg, .xmm = xmm}};
+    return sized(&i);
+}
+
+struct x86_instr construct_movd_xmm_reg(enum x86_xmm_reg_type xmm,
+                                        enum x86_reg_type reg) {
+    struct x86_instr i = {.type = MOVD_XMM_REG,
+                          .reg_xmm = {.reg = reg, .xmm = xmm}};
+    return sized(&i);
+}
+
+struct x86_instr construct_lea_reg_disp(enum x86_reg_type dest,
+                                        enum x86_reg_type base, int32_t disp) {
+    struct x86_instr i = {.type = LEA_REG_MEM,
+                          .lea = {.dest = dest, .base = base, .disp = disp}};
+    return sized(&i);
+}
 
-    return (struct x86_instr){
-        .type = JUMP, .size = 6, .jump = {.is_eq = is_eq, .label = label}};
+struct x86_instr construct_lea_reg_index(enum x86_reg_type dest,
+                                         enum x86_reg_type base,
+                                         enum x86_reg_type index,
+                                         uint8_t shift) {
+    struct x86_instr i = {.type = LEA_REG_MEM,
+                          .lea = {.dest = dest,
+                                  .base = base,
+                                  .index = index,
+                                  .has_index = true,
+                                  .shift = shift}};
+    return sized(&i);
 }
 
 #define WRITE_INSTRUCTION(RESULT_INSTRS, CURRENT_OFFSET, FN, ...)              \
@@ -156,7 +752,8 @@ struct x86_instr construct_jump(bool is_eq, struct label *label) {
     } while (0)
 
 /**
- * Load an immediate, stack mapped or register mapped 'value' into a register.
+ * Load an immediate, stack mapped, xmm mapped or register mapped 'value' into
+ * a register.
  * If the value is already present in an x86 register, this is a noop.
  * Otherwise the value is loaded into the 'fallback_reg' paramater.
  *
@@ -185,6 +782,13 @@ static enum x86_reg_type ready_value(struct abstract_storage value,
         return fallback_reg;
     }
 
+    if (map->mapping[value.reg].type == XMM_MAPPED) {
+        WRITE_INSTRUCTION(result_instrs, current_offset,
+                          construct_movd_reg_xmm, fallback_reg,
+                          map->mapping[value.reg].xmm_reg);
+        return fallback_reg;
+    }
+
     return map->mapping[value.reg].x86_reg;
 }
 
@@ -199,320 +803,1275 @@ static void store_value(enum x86_reg_type src, enum reg_type dest,
         WRITE_INSTRUCTION(result_instrs, current_offset,
                           construct_mov_stack_reg,
                           map->mapping[dest].stack_offset, src);
+    } else if (map->mapping[dest].type == XMM_MAPPED) {
+        WRITE_INSTRUCTION(result_instrs, current_offset,
+                          construct_movd_xmm_reg, map->mapping[dest].xmm_reg,
+                          src);
     } else if (map->mapping[dest].x86_reg != src) {
         WRITE_INSTRUCTION(result_instrs, current_offset, construct_mov_reg_reg,
                           map->mapping[dest].x86_reg, src);
     }
 }
 
-void realize_abstract_instruction(struct abstract_instr *i,
-                                  struct mips_x86_reg_mapping *map,
-                                  struct x86_instr_vec *result_instrs,
-                                  uint32_t *current_offset) {
-
-    switch (i->type) {
-    case ABSTRACT_INSTR_BINOP: {
-        enum x86_reg_type lhs =
-            ready_value(i->binop.lhs, map, EAX, result_instrs, current_offset);
-        enum x86_reg_type rhs =
-            ready_value(i->binop.rhs, map, ECX, result_instrs, current_offset);
-
-        // perform:
-        // if lhs != eax: mov eax, LHS;
-        // add eax, RHS;
-        // mov DEST, eax
-
-        if (lhs != EAX) {
-            WRITE_INSTRUCTION(result_instrs, current_offset,
-                              construct_mov_reg_reg, EAX, lhs);
-        }
-
-        switch (i->binop.op) {
-        case ABSTRACT_INSTR_BINOP_ADD:
-            WRITE_INSTRUCTION(result_instrs, current_offset,
-                              construct_add_reg_reg, EAX, rhs);
-            break;
-        case ABSTRACT_INSTR_BINOP_AND:
+/**
+ * Load 'value' into exactly the register 'reg'.
+ */
+static void ready_value_into(struct abstract_storage value,
+                             struct mips_x86_reg_mapping *map,
+                             enum x86_reg_type reg,
+                             struct x86_instr_vec *result_instrs,
+                             uint32_t *current_offset) {
+    enum x86_reg_type loaded =
+        ready_value(value, map, reg, result_instrs, current_offset);
+
+    if (loaded != reg) {
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_mov_reg_reg,
+                          reg, loaded);
+    }
+}
 
-            WRITE_INSTRUCTION(result_instrs, current_offset,
-                              construct_and_reg_reg, EAX, rhs);
-            break;
-        }
+static struct abstract_storage reg_storage(enum reg_type reg) {
+    return (struct abstract_storage){.type = ABSTRACT_STORAGE_REG, .reg = reg};
+}
 
-        store_value(EAX, i->binop.dest, map, result_instrs, current_offset);
-        break;
-    }
-    case ABSTRACT_INSTR_MOV: {
-        if (i->mov.source.type != ABSTRACT_STORAGE_IMM) {
-            enum x86_reg_type src = ready_value(i->mov.source, map, EAX,
-                                                result_instrs, current_offset);
-            store_value(src, i->mov.dest, map, result_instrs, current_offset);
-            break;
-        }
+static struct abstract_storage imm_storage(uint32_t imm) {
+    return (struct abstract_storage){.type = ABSTRACT_STORAGE_IMM, .imm = imm};
+}
 
-        // special case for moving immediates into registers
-        if (map->mapping[i->mov.dest].type == X86_REG_MAPPED) {
-            if (i->mov.source.imm == 0) {
-                // zeroing register
-                WRITE_INSTRUCTION(result_instrs, current_offset,
-                                  construct_zero_reg,
-                                  map->mapping[i->mov.dest].x86_reg);
-            } else {
-                // moving a non zero value
-                WRITE_INSTRUCTION(
-                    result_instrs, current_offset, construct_mov_reg_imm,
-                    map->mapping[i->mov.dest].x86_reg, i->mov.source.imm);
-            }
-        } else {
-            // moving imm into stack loc
-            WRITE_INSTRUCTION(
-                result_instrs, current_offset, construct_mov_stack_imm,
-                map->mapping[i->mov.dest].stack_offset, i->mov.source.imm);
-        }
+/**
+ * Realize hi:lo <- lhs * rhs and lo, hi <- lhs / rhs, lhs % rhs.
+ *
+ * Multiplies are done as a 64 bit imul of the (sign or zero) extended
+ * operands, so EDX (which is allocatable) is left alone. Divides need rdx, so
+ * it is saved around the divide.
+ *
+ * MIPS leaves the result of a divide by zero unpredictable, rather than
+ * branching around the divide we bump a zero divisor to one.
+ */
+static void realize_muldiv(struct abstract_instr_muldiv *i,
+                           struct mips_x86_reg_mapping *map,
+                           struct x86_instr_vec *result_instrs,
+                           uint32_t *current_offset) {
+    ready_value_into(i->lhs, map, EAX, result_instrs, current_offset);
+    ready_value_into(i->rhs, map, ECX, result_instrs, current_offset);
+
+    switch (i->op) {
+    case ABSTRACT_INSTR_MULDIV_MULT:
+        WRITE_INSTRUCTION(result_instrs, current_offset,
+                          construct_movsxd_reg_reg, EAX, EAX);
+        WRITE_INSTRUCTION(result_instrs, current_offset,
+                          construct_movsxd_reg_reg, ECX, ECX);
+        // fallthrough
+    case ABSTRACT_INSTR_MULDIV_MULTU:
+        WRITE_INSTRUCTION(result_instrs, current_offset,
+                          construct_imul64_reg_reg, EAX, ECX);
+        store_value(EAX, REG_LO, map, result_instrs, current_offset);
+        WRITE_INSTRUCTION(result_instrs, current_offset,
+                          construct_shr64_reg_imm, EAX, 32);
+        store_value(EAX, REG_HI, map, result_instrs, current_offset);
+        return;
+    case ABSTRACT_INSTR_MULDIV_DIV:
+    case ABSTRACT_INSTR_MULDIV_DIVU:
         break;
     }
-    case ABSTRACT_INSTR_SHIFT: {
-        enum x86_reg_type val =
-            ready_value((struct abstract_storage){.type = ABSTRACT_STORAGE_REG,
-                                                  .reg = i->shift.lhs},
-                        map, EAX, result_instrs, current_offset);
-
-        // special case for when source == dest (we can do the in place shift on
-        // the source register without swapping through eax)
-        if (map->mapping[i->shift.dest].type != X86_REG_MAPPED &&
-            map->mapping[i->shift.dest].x86_reg != val && val != EAX) {
-            WRITE_INSTRUCTION(result_instrs, current_offset,
-                              construct_mov_reg_reg, EAX, val);
-            val = EAX;
-        }
-
-        if (i->shift.direction == ABSTRACT_INSTR_SHIFT_LEFT) {
-            WRITE_INSTRUCTION(result_instrs, current_offset,
-                              construct_shl_reg_imm, val, i->shift.rhs);
-        } else {
 
-            WRITE_INSTRUCTION(result_instrs, current_offset,
-                              construct_shr_reg_imm, val, i->shift.rhs);
-        }
+    // ecx += (ecx == 0)
+    WRITE_INSTRUCTION(result_instrs, current_offset, construct_cmp_reg_imm,
+                      ECX, 1);
+    WRITE_INSTRUCTION(result_instrs, current_offset, construct_adc_reg_imm,
+                      ECX, 0);
+    WRITE_INSTRUCTION(result_instrs, current_offset, construct_push_reg, EDX);
 
-        store_value(val, i->shift.dest, map, result_instrs, current_offset);
-        break;
+    if (i->op == ABSTRACT_INSTR_MULDIV_DIV) {
+        // the 64 bit divide can't overflow on INT_MIN / -1
+        WRITE_INSTRUCTION(result_instrs, current_offset,
+                          construct_movsxd_reg_reg, EAX, EAX);
+        WRITE_INSTRUCTION(result_instrs, current_offset,
+                          construct_movsxd_reg_reg, ECX, ECX);
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_cqo);
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_idiv64_reg,
+                          ECX);
+    } else {
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_zero_reg,
+                          EDX);
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_div_reg,
+                          ECX);
     }
-    case ABSTRACT_INSTR_BRANCH: {
-        enum x86_reg_type lhs =
-            ready_value(i->branch.lhs, map, EAX, result_instrs, current_offset);
-        enum x86_reg_type rhs =
-            ready_value(i->branch.rhs, map, ECX, result_instrs, current_offset);
 
-        WRITE_INSTRUCTION(result_instrs, current_offset, construct_cmp_reg_reg,
-                          lhs, rhs);
-        WRITE_INSTRUCTION(result_instrs, current_offset, construct_jump,
-                          i->branch.type == ABSTRACT_INSTR_BRANCH_TEST_EQ,
-                          i->branch.label);
-        break;
-    }
-    }
+    WRITE_INSTRUCTION(result_instrs, current_offset, construct_mov_reg_reg,
+                      ECX, EDX);
+    WRITE_INSTRUCTION(result_instrs, current_offset, construct_pop_reg, EDX);
+    store_value(EAX, REG_LO, map, result_instrs, current_offset);
+    store_value(ECX, REG_HI, map, result_instrs, current_offset);
 }
 
 /**
- * Emit an instruction that is in the format [opcode, 0b11(dest : 3, src : 3)].
- *
- * Returns a pointer to after the last written instruction in the array 'buf'
- *    as such to allow `buf = emit_reg_reg_instruction(i, opcode, buf);`
- */
-static uint8_t *emit_reg_reg_instruction(struct x86_reg_reg i, uint8_t opcode,
-                                         uint8_t *buf) {
-    if (x86_reg_is_new[i.dest]) {
-        if (x86_reg_is_new[i.src]) {
-            // (dest: new, src: new)
-            uint8_t reg_val = 0b11 << 6 | (i.src - R8D) << 3 | (i.dest - R8D);
-            WRITE_BYTES(buf, 0x45, opcode, reg_val);
+ * Realize the closed form of a shift-and-add multiply loop, see `struct
+ * abstract_instr_mul_loop`.
+ */
+static void realize_mul_loop(struct abstract_instr_mul_loop *i,
+                             struct mips_x86_reg_mapping *map,
+                             struct jit_runtime *rt,
+                             struct x86_instr_vec *result_instrs,
+                             uint32_t *current_offset) {
+    // acc += multiplier * multiplicand
+    ready_value_into(reg_storage(i->multiplicand), map, EAX, result_instrs,
+                     current_offset);
+    enum x86_reg_type multiplier = ready_value(
+        reg_storage(i->multiplier), map, ECX, result_instrs, current_offset);
+    WRITE_INSTRUCTION(result_instrs, current_offset, construct_imul_reg_reg,
+                      EAX, multiplier);
+    enum x86_reg_type acc = ready_value(reg_storage(i->acc), map, ECX,
+                                        result_instrs, current_offset);
+    WRITE_INSTRUCTION(result_instrs, current_offset, construct_add_reg_reg,
+                      EAX, acc);
+    store_value(EAX, i->acc, map, result_instrs, current_offset);
+
+    // the loop runs once per significant bit of the multiplier (at least
+    // once), shifting the multiplicand each time:
+    // multiplicand <<= bsr(multiplier | 1) + 1
+    ready_value_into(reg_storage(i->multiplier), map, ECX, result_instrs,
+                     current_offset);
+    WRITE_INSTRUCTION(result_instrs, current_offset, construct_or_reg_imm, ECX,
+                      1);
+    WRITE_INSTRUCTION(result_instrs, current_offset, construct_bsr_reg_reg,
+                      ECX, ECX);
+    ready_value_into(reg_storage(i->multiplicand), map, EAX, result_instrs,
+                     current_offset);
+    WRITE_INSTRUCTION(result_instrs, current_offset, construct_shl_reg_cl, EAX);
+    WRITE_INSTRUCTION(result_instrs, current_offset, construct_shl_reg_imm,
+                      EAX, 1);
+    store_value(EAX, i->multiplicand, map, result_instrs, current_offset);
+
+    // the last bit tested is the top set bit, unless the multiplier was zero
+    WRITE_INSTRUCTION(result_instrs, current_offset, construct_zero_reg, EAX);
+    multiplier = ready_value(reg_storage(i->multiplier), map, ECX,
+                             result_instrs, current_offset);
+    WRITE_INSTRUCTION(result_instrs, current_offset, construct_test_reg_reg,
+                      multiplier, multiplier);
+    WRITE_INSTRUCTION(result_instrs, current_offset, construct_setcc_reg,
+                      X86_COND_NE, EAX);
+    store_value(EAX, i->bit, map, result_instrs, current_offset);
+
+    realize_abstract_instruction(
+        &(struct abstract_instr){
+            .type = ABSTRACT_INSTR_MOV,
+            .mov = {.dest = i->multiplier,
+                    .source = {.type = ABSTRACT_STORAGE_IMM, .imm = 0}}},
+        map, rt, result_instrs, current_offset);
+}
+
+/**
+ * Realize dest += trips * delta for a counting loop, see `struct
+ * abstract_instr_induction` and `induction_trip_count`.
+ *
+ * With step = odd << shift the trip count is (limit - counter) / 2^shift *
+ * odd_inverse(odd), modulo 2^(32 - shift) and taken in [1, 2^(32 - shift)].
+ * This is computed from counter - limit, so the inverse is negated.
+ */
+static void realize_induction(struct abstract_instr_induction *i,
+                              struct mips_x86_reg_mapping *map,
+                              struct x86_instr_vec *result_instrs,
+                              uint32_t *current_offset) {
+    int shift = __builtin_ctz(i->step);
+    uint32_t inverse = odd_inverse(i->step >> shift);
+
+    // eax <- counter - limit
+    ready_value_into(reg_storage(i->counter), map, EAX, result_instrs,
+                     current_offset);
+    ready_value_into(imm_storage(-i->limit), map, ECX, result_instrs,
+                     current_offset);
+    WRITE_INSTRUCTION(result_instrs, current_offset, construct_add_reg_reg,
+                      EAX, ECX);
+
+    if (shift == 0) {
+        // eax <- trips * delta
+        ready_value_into(imm_storage(-inverse * i->delta), map, ECX,
+                         result_instrs, current_offset);
+        WRITE_INSTRUCTION(result_instrs, current_offset,
+                          construct_imul_reg_reg, EAX, ECX);
+    } else {
+        // the counter skips over the limit forever if the distance isn't a
+        // multiple of 2^shift
+        struct label *spin = add_internal_label();
+        ready_value_into(imm_storage((1u << shift) - 1), map, ECX,
+                         result_instrs, current_offset);
+        WRITE_INSTRUCTION(result_instrs, current_offset,
+                          construct_test_reg_reg, EAX, ECX);
+        resolve_label(spin, *current_offset);
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_jump,
+                          X86_COND_NE, spin);
+
+        // eax <- (((eax >> shift) * -inverse - 1) & mask) + 1
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_shr_reg_imm,
+                          EAX, shift);
+        ready_value_into(imm_storage(-inverse), map, ECX, result_instrs,
+                         current_offset);
+        WRITE_INSTRUCTION(result_instrs, current_offset,
+                          construct_imul_reg_reg, EAX, ECX);
+        ready_value_into(imm_storage(-1), map, ECX, result_instrs,
+                         current_offset);
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_add_reg_reg,
+                          EAX, ECX);
+        ready_value_into(imm_storage(UINT32_MAX >> shift), map, ECX,
+                         result_instrs, current_offset);
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_and_reg_reg,
+                          EAX, ECX);
+        ready_value_into(imm_storage(1), map, ECX, result_instrs,
+                         current_offset);
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_add_reg_reg,
+                          EAX, ECX);
+
+        // eax <- trips * delta
+        ready_value_into(imm_storage(i->delta), map, ECX, result_instrs,
+                         current_offset);
+        WRITE_INSTRUCTION(result_instrs, current_offset,
+                          construct_imul_reg_reg, EAX, ECX);
+    }
+
+    enum x86_reg_type dest = ready_value(reg_storage(i->dest), map, ECX,
+                                         result_instrs, current_offset);
+    WRITE_INSTRUCTION(result_instrs, current_offset, construct_add_reg_reg,
+                      EAX, dest);
+    store_value(EAX, i->dest, map, result_instrs, current_offset);
+}
+
+static const enum x86_mem_width abstract_mem_width_to_x86[] = {
+    [ABSTRACT_MEM_BYTE] = X86_MEM_BYTE,
+    [ABSTRACT_MEM_HALF] = X86_MEM_WORD,
+    [ABSTRACT_MEM_WORD] = X86_MEM_DWORD};
+
+/**
+ * Test if 'value' is a register kept in an x86 register.
+ */
+static bool in_x86_reg(struct abstract_storage value,
+                       struct mips_x86_reg_mapping *map) {
+    return value.type == ABSTRACT_STORAGE_REG &&
+           map->mapping[value.reg].type == X86_REG_MAPPED;
+}
+
+/**
+ * Write 'dest <- dest op src'.
+ */
+static void write_binop_reg_reg(enum abstract_instr_binop_op op,
+                                enum x86_reg_type dest, enum x86_reg_type src,
+                                struct x86_instr_vec *result_instrs,
+                                uint32_t *current_offset) {
+    switch (op) {
+    case ABSTRACT_INSTR_BINOP_ADD:
+    case ABSTRACT_INSTR_BINOP_ADD_TRAP:
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_add_reg_reg,
+                          dest, src);
+        break;
+    case ABSTRACT_INSTR_BINOP_AND:
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_and_reg_reg,
+                          dest, src);
+        break;
+    case ABSTRACT_INSTR_BINOP_MUL:
+        WRITE_INSTRUCTION(result_instrs, current_offset,
+                          construct_imul_reg_reg, dest, src);
+        break;
+    case ABSTRACT_INSTR_BINOP_SCALED_ADD:
+        RUNTIME_ERROR("Scaled adds have no two operand form");
+    }
+}
+
+/**
+ * Jump to an out of line stub reporting the add at 'guest_address' if the
+ * last instruction overflowed. The stub is written by `realize_trap_stubs`.
+ */
+static void realize_overflow_check(uint32_t guest_address,
+                                   struct jit_runtime *rt,
+                                   struct x86_instr_vec *result_instrs,
+                                   uint32_t *current_offset) {
+    struct jit_trap trap = {.label = add_internal_label(),
+                            .guest_address = guest_address};
+
+    jit_trap_vec_push(rt->pending_traps, trap);
+    WRITE_INSTRUCTION(result_instrs, current_offset, construct_jump,
+                      X86_COND_O, trap.label);
+}
+
+/**
+ * Realize dest <- lhs op rhs.
+ *
+ * If dest is kept in an x86 register the op is done there: in place if an
+ * operand is already in it (every op commutes), as a single lea for an add
+ * that doesn't overwrite an operand, otherwise by moving lhs in first.
+ * Otherwise the op is done in eax, with rhs in ecx.
+ *
+ * Adds that trap are never a lea, as lea doesn't set the overflow flag, and
+ * are checked before the result is stored.
+ */
+static void realize_binop(struct abstract_instr_binop *i,
+                          uint32_t guest_address,
+                          struct mips_x86_reg_mapping *map,
+                          struct jit_runtime *rt,
+                          struct x86_instr_vec *result_instrs,
+                          uint32_t *current_offset) {
+    struct abstract_storage lhs_value = i->lhs;
+    struct abstract_storage rhs_value = i->rhs;
+    struct abstract_storage tmp;
+
+    enum x86_reg_type dest = EAX;
+    if (map->mapping[i->dest].type == X86_REG_MAPPED) {
+        dest = map->mapping[i->dest].x86_reg;
+    }
+
+    if (i->op == ABSTRACT_INSTR_BINOP_SCALED_ADD) {
+        enum x86_reg_type index =
+            ready_value(lhs_value, map, EAX, result_instrs, current_offset);
+        enum x86_reg_type base =
+            ready_value(rhs_value, map, ECX, result_instrs, current_offset);
+        WRITE_INSTRUCTION(result_instrs, current_offset,
+                          construct_lea_reg_index, dest, base, index,
+                          i->shift);
+        store_value(dest, i->dest, map, result_instrs, current_offset);
+        return;
+    }
+
+    // keep a constant on the right where it can be an immediate operand, and
+    // an operand already in dest on the left where it can be worked on in
+    // place
+    if (lhs_value.type == ABSTRACT_STORAGE_IMM ||
+        (dest != EAX && in_x86_reg(rhs_value, map) &&
+         map->mapping[rhs_value.reg].x86_reg == dest)) {
+        tmp = lhs_value;
+        lhs_value = rhs_value;
+        rhs_value = tmp;
+    }
+
+    if (dest != EAX && i->op == ABSTRACT_INSTR_BINOP_ADD &&
+        in_x86_reg(lhs_value, map) &&
+        map->mapping[lhs_value.reg].x86_reg != dest) {
+        enum x86_reg_type lhs = map->mapping[lhs_value.reg].x86_reg;
+
+        if (rhs_value.type == ABSTRACT_STORAGE_IMM) {
+            WRITE_INSTRUCTION(result_instrs, current_offset,
+                              construct_lea_reg_disp, dest, lhs,
+                              (int32_t)rhs_value.imm);
+            return;
+        }
+
+        if (in_x86_reg(rhs_value, map)) {
+            WRITE_INSTRUCTION(result_instrs, current_offset,
+                              construct_lea_reg_index, dest, lhs,
+                              map->mapping[rhs_value.reg].x86_reg, 0);
+            return;
+        }
+    }
+
+    // perform:
+    // if lhs != dest: mov dest, LHS;
+    // add dest, RHS;
+    // if dest is eax: mov DEST, eax
+    // leaving eax free for rhs when dest isn't eax, otherwise it goes in ecx
+    ready_value_into(lhs_value, map, dest, result_instrs, current_offset);
+
+    if (rhs_value.type == ABSTRACT_STORAGE_IMM &&
+        i->op != ABSTRACT_INSTR_BINOP_MUL) {
+        if (i->op != ABSTRACT_INSTR_BINOP_AND) {
+            WRITE_INSTRUCTION(result_instrs, current_offset,
+                              construct_add_reg_imm, dest, rhs_value.imm);
         } else {
-            // (dest: new, src: old)
-            uint8_t reg_val = 0b11 << 6 | i.src << 3 | (i.dest - R8D);
-            WRITE_BYTES(buf, 0x41, opcode, reg_val);
+            WRITE_INSTRUCTION(result_instrs, current_offset,
+                              construct_and_reg_imm, dest, rhs_value.imm);
         }
     } else {
-        if (x86_reg_is_new[i.src]) {
-            // (dest: old, src: new)
-            uint8_t reg_val = 0b11 << 6 | i.src << 3 | i.dest;
-            WRITE_BYTES(buf, 0x44, opcode, reg_val);
-        } else {
-            // (dest: old, src: old)
-            uint8_t reg_val = 0b11 << 6 | i.src << 3 | i.dest;
-            WRITE_BYTES(buf, opcode, reg_val);
+        enum x86_reg_type rhs = ready_value(rhs_value, map,
+                                            dest == EAX ? ECX : EAX,
+                                            result_instrs, current_offset);
+        write_binop_reg_reg(i->op, dest, rhs, result_instrs, current_offset);
+    }
+
+    if (i->op == ABSTRACT_INSTR_BINOP_ADD_TRAP) {
+        realize_overflow_check(guest_address, rt, result_instrs,
+                               current_offset);
+    }
+
+    store_value(dest, i->dest, map, result_instrs, current_offset);
+}
+
+bool abstract_instr_needs_ecx(struct abstract_instr *i,
+                              struct mips_x86_reg_mapping *map) {
+    // this follows where realize_abstract_instruction readies values into ecx
+    switch (i->type) {
+    case ABSTRACT_INSTR_BINOP: {
+        struct abstract_storage rhs = i->binop.rhs;
+
+        // ops done in their destination use eax for rhs
+        if (i->binop.op != ABSTRACT_INSTR_BINOP_SCALED_ADD &&
+            map->mapping[i->binop.dest].type == X86_REG_MAPPED) {
+            return false;
+        }
+
+        if (i->binop.lhs.type == ABSTRACT_STORAGE_IMM) {
+            rhs = i->binop.lhs;
+        }
+
+        if (rhs.type == ABSTRACT_STORAGE_IMM) {
+            return i->binop.op == ABSTRACT_INSTR_BINOP_MUL;
+        }
+
+        return !in_x86_reg(rhs, map);
+    }
+    case ABSTRACT_INSTR_BRANCH: {
+        struct abstract_storage rhs = i->branch.rhs;
+
+        if (i->branch.lhs.type == ABSTRACT_STORAGE_IMM) {
+            rhs = i->branch.lhs;
         }
+
+        return rhs.type != ABSTRACT_STORAGE_IMM && !in_x86_reg(rhs, map);
+    }
+    case ABSTRACT_INSTR_STORE:
+        return !in_x86_reg(i->store.value, map);
+    case ABSTRACT_INSTR_SWAP:
+        return map->mapping[i->swap.a].type != X86_REG_MAPPED &&
+               map->mapping[i->swap.b].type != X86_REG_MAPPED;
+    case ABSTRACT_INSTR_MULDIV:
+    case ABSTRACT_INSTR_MUL_LOOP:
+    case ABSTRACT_INSTR_INDUCTION:
+    case ABSTRACT_INSTR_JUMP_REG: // the inline cache is addressed from rcx
+        return true;
+    case ABSTRACT_INSTR_MOV:
+    case ABSTRACT_INSTR_SHIFT:
+    case ABSTRACT_INSTR_LOAD:
+    case ABSTRACT_INSTR_JUMP:
+    case ABSTRACT_INSTR_CALL:
+    case ABSTRACT_INSTR_RETURN:
+        break;
     }
 
-    return buf;
+    return false;
 }
 
-static uint32_t emit_x86_instruction(struct x86_instr *i, uint8_t *buf,
-                                     uint32_t bytes_written) {
-    uint8_t *base_buf = buf;
+void realize_abstract_instruction(struct abstract_instr *i,
+                                  struct mips_x86_reg_mapping *map,
+                                  struct jit_runtime *rt,
+                                  struct x86_instr_vec *result_instrs,
+                                  uint32_t *current_offset) {
 
     switch (i->type) {
-    case ZERO_REG:
-        if (x86_reg_is_new[i->reg.reg]) {
-            uint8_t reg_val =
-                0b11 << 6 | (i->reg.reg - R8D) << 3 | (i->reg.reg - R8D);
-            WRITE_BYTES(buf, 0x45, 0x31, reg_val);
+    case ABSTRACT_INSTR_BINOP:
+        realize_binop(&i->binop, i->guest_address, map, rt, result_instrs,
+                      current_offset);
+        break;
+    case ABSTRACT_INSTR_MOV: {
+        // xmm registers can't be set to an immediate directly
+        if (i->mov.source.type != ABSTRACT_STORAGE_IMM ||
+            map->mapping[i->mov.dest].type == XMM_MAPPED) {
+            enum x86_reg_type src = ready_value(i->mov.source, map, EAX,
+                                                result_instrs, current_offset);
+            store_value(src, i->mov.dest, map, result_instrs, current_offset);
+            break;
+        }
+
+        // special case for moving immediates into registers
+        if (map->mapping[i->mov.dest].type == X86_REG_MAPPED) {
+            if (i->mov.source.imm == 0) {
+                // zeroing register
+                WRITE_INSTRUCTION(result_instrs, current_offset,
+                                  construct_zero_reg,
+                                  map->mapping[i->mov.dest].x86_reg);
+            } else {
+                // moving a non zero value
+                WRITE_INSTRUCTION(
+                    result_instrs, current_offset, construct_mov_reg_imm,
+                    map->mapping[i->mov.dest].x86_reg, i->mov.source.imm);
+            }
         } else {
-            uint8_t reg_val = 0b11 << 6 | i->reg.reg << 3 | i->reg.reg;
-            WRITE_BYTES(buf, 0x31, reg_val);
+            // moving imm into stack loc
+            WRITE_INSTRUCTION(
+                result_instrs, current_offset, construct_mov_stack_imm,
+                map->mapping[i->mov.dest].stack_offset, i->mov.source.imm);
         }
         break;
-    case MOV_REG_IMM:
-        if (x86_reg_is_new[i->reg_imm.dest]) {
-            WRITE_BYTES(buf, 0x41, 0xb8 + i->reg_imm.dest - R8D);
+    }
+    case ABSTRACT_INSTR_SHIFT: {
+        // shift in the destination register if it has one, otherwise in eax
+        enum x86_reg_type val = EAX;
+        if (map->mapping[i->shift.dest].type == X86_REG_MAPPED) {
+            val = map->mapping[i->shift.dest].x86_reg;
+        }
+
+        ready_value_into(reg_storage(i->shift.lhs), map, val, result_instrs,
+                         current_offset);
+
+        if (i->shift.direction == ABSTRACT_INSTR_SHIFT_LEFT) {
+            WRITE_INSTRUCTION(result_instrs, current_offset,
+                              construct_shl_reg_imm, val, i->shift.rhs);
         } else {
-            WRITE_BYTES(buf, 0xb8 + i->reg_imm.dest);
+
+            WRITE_INSTRUCTION(result_instrs, current_offset,
+                              construct_shr_reg_imm, val, i->shift.rhs);
         }
-        *(uint32_t *)buf = i->reg_imm.imm;
-        buf += sizeof(uint32_t);
-        break;
-    case MOV_STACK_IMM:
-        WRITE_BYTES(buf, 0xc7, 0x45, 4 * (int8_t)i->stack_imm.dest_offset);
-        *(uint32_t *)buf = i->stack_imm.imm;
-        buf += sizeof(uint32_t);
-        break;
-    case MOV_REG_REG:
-        buf = emit_reg_reg_instruction(i->reg_reg, 0x89, buf);
+
+        store_value(val, i->shift.dest, map, result_instrs, current_offset);
         break;
-    case MOV_REG_STACK:
-        if (x86_reg_is_new[i->reg_stack.dest]) {
-            uint8_t reg_val = 0b01000101 | (i->reg_stack.dest - R8D) << 3;
-            WRITE_BYTES(buf, 0x44, 0x8b, reg_val, 4 * i->reg_stack.src_offset);
+    }
+    case ABSTRACT_INSTR_BRANCH: {
+        struct abstract_storage lhs_value = i->branch.lhs;
+        struct abstract_storage rhs_value = i->branch.rhs;
+        enum x86_reg_type lhs;
+        enum x86_cond_type cond = X86_COND_NE;
+
+        switch (i->branch.type) {
+        case ABSTRACT_INSTR_BRANCH_TEST_EQ:
+            cond = X86_COND_E;
+            // fallthrough
+        case ABSTRACT_INSTR_BRANCH_TEST_NE:
+            // both tests are symmetric, so keep a constant on the right where
+            // it can be an immediate operand
+            if (lhs_value.type == ABSTRACT_STORAGE_IMM) {
+                lhs_value = i->branch.rhs;
+                rhs_value = i->branch.lhs;
+            }
+            lhs = ready_value(lhs_value, map, EAX, result_instrs,
+                              current_offset);
+            break;
+        case ABSTRACT_INSTR_BRANCH_TEST_LOW_EQ:
+            cond = X86_COND_E;
+            // fallthrough
+        case ABSTRACT_INSTR_BRANCH_TEST_LOW_NE: {
+            // cmp (lhs & mask), (rhs & mask)
+            uint32_t mask = (1u << i->branch.low_bits) - 1;
+            lhs = EAX;
+            ready_value_into(lhs_value, map, EAX, result_instrs,
+                             current_offset);
+            WRITE_INSTRUCTION(result_instrs, current_offset,
+                              construct_and_reg_imm, EAX, mask);
+            rhs_value = imm_storage(rhs_value.imm & mask);
+            break;
+        }
+        case ABSTRACT_INSTR_BRANCH_TEST_MASK_ZERO:
+            cond = X86_COND_E;
+            // fallthrough
+        case ABSTRACT_INSTR_BRANCH_TEST_MASK_NONZERO:
+            lhs = ready_value(lhs_value, map, EAX, result_instrs,
+                              current_offset);
+            break;
+        }
+
+        if (i->branch.type == ABSTRACT_INSTR_BRANCH_TEST_MASK_ZERO ||
+            i->branch.type == ABSTRACT_INSTR_BRANCH_TEST_MASK_NONZERO) {
+            // test sets the flags from lhs & mask, leaving lhs alone
+            WRITE_INSTRUCTION(result_instrs, current_offset,
+                              construct_test_reg_imm, lhs, rhs_value.imm);
+        } else if (rhs_value.type == ABSTRACT_STORAGE_IMM) {
+            WRITE_INSTRUCTION(result_instrs, current_offset,
+                              construct_cmp_reg_imm, lhs, rhs_value.imm);
         } else {
-            uint8_t reg_val = 0b01000101 | i->reg_stack.dest << 3;
-            WRITE_BYTES(buf, 0x8b, reg_val, 4 * i->reg_stack.src_offset);
+            enum x86_reg_type rhs = ready_value(rhs_value, map, ECX,
+                                                result_instrs, current_offset);
+            WRITE_INSTRUCTION(result_instrs, current_offset,
+                              construct_cmp_reg_reg, lhs, rhs);
         }
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_jump, cond,
+                          i->branch.label);
         break;
-    case MOV_STACK_REG:
-        if (x86_reg_is_new[i->stack_reg.src]) {
-            uint8_t reg_val = 0b01000101 | (i->stack_reg.src - R8D) << 3;
-            WRITE_BYTES(buf, 0x44, 0x89, reg_val, 4 * i->stack_reg.dest_offset);
-        } else {
-            uint8_t reg_val = 0b01000101 | i->stack_reg.src << 3;
-            WRITE_BYTES(buf, 0x89, reg_val, 4 * i->stack_reg.dest_offset);
+    }
+    case ABSTRACT_INSTR_LOAD: {
+        enum x86_reg_type base =
+            ready_value(i->load.base, map, EAX, result_instrs, current_offset);
+
+        // load straight into the destination if it lives in a register
+        enum x86_reg_type dest = EAX;
+        if (map->mapping[i->load.dest].type == X86_REG_MAPPED) {
+            dest = map->mapping[i->load.dest].x86_reg;
         }
+
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_mov_reg_mem,
+                          dest, base, i->load.offset,
+                          abstract_mem_width_to_x86[i->load.width]);
+        store_value(dest, i->load.dest, map, result_instrs, current_offset);
         break;
-    case ADD_REG_REG:
-        buf = emit_reg_reg_instruction(i->reg_reg, 0x01, buf);
+    }
+    case ABSTRACT_INSTR_STORE: {
+        enum x86_reg_type base =
+            ready_value(i->store.base, map, EAX, result_instrs, current_offset);
+        enum x86_reg_type value = ready_value(i->store.value, map, ECX,
+                                              result_instrs, current_offset);
+
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_mov_mem_reg,
+                          base, i->store.offset, value,
+                          abstract_mem_width_to_x86[i->store.width]);
         break;
-    case AND_REG_REG:
-        buf = emit_reg_reg_instruction(i->reg_reg, 0x21, buf);
+    }
+    case ABSTRACT_INSTR_MULDIV:
+        realize_muldiv(&i->muldiv, map, result_instrs, current_offset);
         break;
-    case SHR_REG_IMM:
-        if (x86_reg_is_new[i->reg_imm.dest]) {
-            uint8_t reg_val = 0b11101 << 3 | (i->reg_imm.dest - R8D);
-            WRITE_BYTES(buf, 0x41, 0xc1, reg_val, i->reg_imm.imm);
-        } else {
-            uint8_t reg_val = 0b11101 << 3 | i->reg_imm.dest;
-            WRITE_BYTES(buf, 0xc1, reg_val, i->reg_imm.imm);
-        }
+    case ABSTRACT_INSTR_MUL_LOOP:
+        realize_mul_loop(&i->mul_loop, map, rt, result_instrs,
+                         current_offset);
         break;
-    case SHL_REG_IMM:
-        if (x86_reg_is_new[i->reg_imm.dest]) {
-            uint8_t reg_val = 0b11100 << 3 | (i->reg_imm.dest - R8D);
-            WRITE_BYTES(buf, 0x41, 0xc1, reg_val, i->reg_imm.imm);
+    case ABSTRACT_INSTR_INDUCTION:
+        realize_induction(&i->induction, map, result_instrs, current_offset);
+        break;
+    case ABSTRACT_INSTR_JUMP:
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_jmp,
+                          i->jump.label);
+        break;
+    case ABSTRACT_INSTR_CALL:
+        // push the guest return address then call, leaving the native return
+        // address at [rsp] and the guest one at [rsp + 8] for the return to
+        // check against. frames are only popped by a matching return, so the
+        // stack is bounded first.
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_bound_calls,
+                          rt);
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_push_imm,
+                          i->call.return_label->guest_address);
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_call,
+                          i->call.label);
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_add_rsp_imm,
+                          8);
+        // when reached through dispatch nothing was pushed, so guest entry
+        // comes in after the pop
+        resolve_label(i->call.return_label, *current_offset);
+        break;
+    case ABSTRACT_INSTR_RETURN:
+        // if the guest return address still matches the innermost call
+        // return natively, so the host return stack predicts it. otherwise
+        // (the guest changed $ra, or there is no call) go through dispatch.
+        ready_value_into(i->jump_reg.target, map, EAX, result_instrs,
+                         current_offset);
+        WRITE_INSTRUCTION(result_instrs, current_offset,
+                          construct_cmp_shadow_reg, EAX);
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_jump,
+                          X86_COND_NE, rt->dispatch_label);
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_ret);
+        break;
+    case ABSTRACT_INSTR_JUMP_REG:
+        ready_value_into(i->jump_reg.target, map, EAX, result_instrs,
+                         current_offset);
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_ic_jump,
+                          jit_runtime_new_ic(rt, i->jump_reg.site_address),
+                          rt->ic_miss_label);
+        break;
+    case ABSTRACT_INSTR_SWAP: {
+        // a is copied out first as storing to it may overwrite it. if a is in
+        // an x86 register b is loaded straight into it, leaving ecx alone.
+        enum reg_type a = i->swap.a, b = i->swap.b;
+        if (map->mapping[a].type != X86_REG_MAPPED) {
+            a = i->swap.b;
+            b = i->swap.a;
+        }
+
+        ready_value_into(reg_storage(a), map, EAX, result_instrs,
+                         current_offset);
+
+        if (map->mapping[a].type == X86_REG_MAPPED) {
+            ready_value_into(reg_storage(b), map, map->mapping[a].x86_reg,
+                             result_instrs, current_offset);
         } else {
-            uint8_t reg_val = 0b11100 << 3 | i->reg_imm.dest;
-            WRITE_BYTES(buf, 0xc1, reg_val, i->reg_imm.imm);
+            enum x86_reg_type loaded = ready_value(
+                reg_storage(b), map, ECX, result_instrs, current_offset);
+            store_value(loaded, a, map, result_instrs, current_offset);
         }
+
+        store_value(EAX, b, map, result_instrs, current_offset);
         break;
-    case CMP_REG_REG:
-        buf = emit_reg_reg_instruction(i->reg_reg, 0x39, buf);
+    }
+    }
+}
+
+void realize_trap_stubs(struct jit_runtime *rt,
+                        struct x86_instr_vec *result_instrs,
+                        uint32_t *current_offset) {
+    for (size_t i = 0; i < rt->pending_traps->len; i++) {
+        struct jit_trap *trap = &rt->pending_traps->data[i];
+
+        resolve_label(trap->label, *current_offset);
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_mov_reg_imm,
+                          EAX, trap->guest_address);
+        WRITE_INSTRUCTION(result_instrs, current_offset, construct_jmp,
+                          rt->overflow_label);
+    }
+
+    rt->pending_traps->len = 0;
+}
+/**
+ * Emit the legacy prefix, 'rex' (if not 0), opcode escape and 'opcode' of an
+ * instruction encoded as 'enc'.
+ */
+static uint8_t *emit_opcode(const struct x86_encoding *enc, uint8_t rex,
+                            uint8_t opcode, uint8_t *buf) {
+    if (enc->prefix != 0) {
+        *buf++ = enc->prefix;
+    }
+    if (rex != 0) {
+        *buf++ = rex;
+    }
+    if (enc->escape) {
+        *buf++ = 0x0f;
+    }
+    *buf++ = opcode;
+
+    return buf;
+}
+
+/**
+ * Emit an instruction with a register direct modrm, 'reg' is either a
+ * register or an opcode extension.
+ */
+static uint8_t *emit_direct(const struct x86_encoding *enc, uint8_t opcode,
+                            uint8_t reg, uint8_t rm, uint8_t *buf) {
+    buf = emit_opcode(enc, rex_prefixes[enc->wide][reg][rm], opcode, buf);
+    *buf++ = direct_modrms[reg][rm];
+
+    return buf;
+}
+
+static uint8_t *emit_imm(uint64_t imm, uint8_t size, uint8_t *buf) {
+    switch (size) {
+    case 1:
+        *buf = imm;
         break;
-    case JUMP:
-        WRITE_BYTES(buf, 0x0f, 0x85 - i->jump.is_eq);
-        int32_t off = i->jump.label->code_position - bytes_written - 6;
-        *(uint32_t *)buf = (uint32_t)off;
-        buf += sizeof(uint32_t);
+    case 4:
+        *(uint32_t *)buf = imm;
+        break;
+    case 8:
+        *(uint64_t *)buf = imm;
         break;
     }
 
-    return buf - base_buf;
+    return buf + size;
 }
 
 /**
- * Emit a vector of x86 instructions into an array of bytes, along with the
- * header and footer instructions to allow execution of the generated code.
- */
-struct thunk emit_x86_instructions(struct x86_instr_vec *instrs, uint32_t len) {
-    const uint8_t prefix_bytes[] = {
-        0x53,             // push rbx
-        0x54,             // push rsp
-        0x55,             // push rbp
-        0x41, 0x54,       // push r12
-        0x41, 0x55,       // push r13
-        0x41, 0x56,       // push r14
-        0x41, 0x57,       // push r15
-        0x56,             // push rsi
-        0x48, 0x89, 0xfd, // mov rbp, rdi (non-mapped registers)
-    };
-
-    const uint8_t postfix_bytes[] = {
-        0x58, // pop rax (pop pushed value of rsi into rax)
-
-        // after running our function we move the registers mapped to mips
-        // registers into an array
-
-        0x89, 0x10,             // mov dword [rax], edx
-        0x89, 0x58, 0x04,       // mov dword [rax + 4], ebx
-        0x89, 0x70, 0x08,       // mov dword [rax + 8], esi
-        0x89, 0x78, 0x0c,       // mov dword [rax + 12], edi
-        0x44, 0x89, 0x40, 0x10, // mov dword [rax + 16], r8d
-        0x44, 0x89, 0x48, 0x14, // mov dword [rax + 20], r9d
-        0x44, 0x89, 0x50, 0x18, // mov dword [rax + 24], r10d
-        0x44, 0x89, 0x58, 0x1c, // mov dword [rax + 28], r11d
-        0x44, 0x89, 0x60, 0x20, // mov dword [rax + 32], r12d
-        0x44, 0x89, 0x68, 0x24, // mov dword [rax + 36], r13d
-        0x44, 0x89, 0x70, 0x28, // mov dword [rax + 40], r14d
-        0x44, 0x89, 0x78, 0x2c, // mov dword [rax + 44], r15d
-
-        0x41, 0x5f, // pop r15
-        0x41, 0x5e, // pop r14
-        0x41, 0x5d, // pop r13
-        0x41, 0x5c, // pop r12
-        0x5d,       // pop rbp
-        0x5c,       // pop rsp
-        0x5b,       // pop rbx
-        0xc3,       // ret
-    };
-
-    const uint32_t prefix_len = sizeof(prefix_bytes);
-    const uint32_t postfix_len = sizeof(postfix_bytes);
+ * Emit 'reg' (a register or an opcode extension) against [base + disp8].
+ */
+static uint8_t *emit_ptr_operand(const struct x86_encoding *enc, uint8_t reg,
+                                 enum x86_reg_type base, int8_t disp,
+                                 uint8_t *buf) {
+    uint8_t disp_size = lea_disp_size(base, disp);
+
+    buf = emit_opcode(enc, rex_prefixes[enc->wide][reg][base], enc->opcode,
+                      buf);
+    WRITE_BYTES(buf, disp_mod(disp_size) << 6 | reg_bits(reg) << 3 |
+                         reg_bits(base));
+    if (reg_bits(base) == ESP) {
+        WRITE_BYTES(buf, 0x24); // sib for [rsp]
+    }
 
-    printf("function size: %d\n", len);
+    return emit_imm((int32_t)disp, disp_size, buf);
+}
+
+/**
+ * Emit 'reg' against [rbp + 4 * offset], where the stack slots are.
+ */
+static uint8_t *emit_stack_operand(const struct x86_encoding *enc, uint8_t reg,
+                                   uint8_t offset, uint8_t *buf) {
+    return emit_ptr_operand(enc, reg, EBP, 4 * offset, buf);
+}
+
+/**
+ * Emit an access to the guest memory operand [r15 + index + disp], REX.B is
+ * always set as the base register is r15.
+ */
+static uint8_t *emit_guest_mem(const struct x86_encoding *enc, uint8_t opcode,
+                               struct x86_reg_mem m, uint8_t *buf) {
+    uint8_t rex = sib_rex(false, m.reg, R15D, true, m.index);
+    uint8_t disp_size = guest_mem_disp_size(m.disp);
 
-    uint8_t *buf = malloc(prefix_len + len + postfix_len);
+    buf = emit_opcode(enc, rex, opcode, buf);
+    WRITE_BYTES(buf, disp_mod(disp_size) << 6 | reg_bits(m.reg) << 3 | 0b100,
+                reg_bits(m.index) << 3 | 0b111);
 
-    uint32_t bytes_written = 0;
+    return emit_imm((int32_t)m.disp, disp_size, buf);
+}
+
+static uint8_t *emit_lea(const struct x86_encoding *enc, struct x86_lea l,
+                         uint8_t *buf) {
+    // an index of 0b100 is no index, unless rex.x picks r12
+    uint8_t index = l.has_index ? reg_bits(l.index) : 0b100;
+    uint8_t rex = sib_rex(false, l.dest, l.base, l.has_index, l.index);
+    uint8_t disp_size = lea_disp_size(l.base, l.disp);
+
+    buf = emit_opcode(enc, rex, enc->opcode, buf);
+    WRITE_BYTES(buf, disp_mod(disp_size) << 6 | reg_bits(l.dest) << 3 | 0b100,
+                l.shift << 6 | index << 3 | reg_bits(l.base));
+
+    return emit_imm(l.disp, disp_size, buf);
+}
+
+/**
+ * Emit the rel32 to 'label' ending a jump, which started at 'start' in the
+ * buffer and at 'position' relative to the positions labels are resolved to.
+ */
+static uint8_t *emit_rel32(struct label *label, uint32_t position,
+                           uint8_t *start, uint8_t *buf) {
+    int32_t off = label->code_position - (position + (buf - start) + 4);
+    return emit_imm((uint32_t)off, 4, buf);
+}
+
+/**
+ * Emit 'i' as given by its entry in `x86_encodings`, at 'position' relative to
+ * the positions labels are resolved to. Returns a pointer to after the last
+ * byte written.
+ */
+static uint8_t *encode_x86_instr(struct x86_instr *i, uint32_t position,
+                                 uint8_t *buf) {
+    const struct x86_encoding *enc = &x86_encodings[i->type];
+    uint8_t *start = buf;
+
+    switch (enc->operands) {
+    case X86_OPERANDS_NONE:
+        buf = emit_opcode(enc, rex_prefixes[enc->wide][EAX][EAX], enc->opcode,
+                          buf);
+        return emit_imm(i->reg_imm.imm, enc->imm_size, buf);
+    case X86_OPERANDS_ABS:
+        buf = emit_opcode(enc, 0, enc->opcode, buf);
+        return emit_imm(i->abs.address, enc->imm_size, buf);
+    case X86_OPERANDS_MR:
+        return emit_direct(enc, enc->opcode, i->reg_reg.src, i->reg_reg.dest,
+                           buf);
+    case X86_OPERANDS_RM:
+        return emit_direct(enc, enc->opcode, i->reg_reg.dest, i->reg_reg.src,
+                           buf);
+    case X86_OPERANDS_SAME:
+        return emit_direct(enc, enc->opcode, i->reg.reg, i->reg.reg, buf);
+    case X86_OPERANDS_EXT:
+        buf = emit_direct(enc, enc->opcode, enc->ext, i->reg.reg, buf);
+        return emit_imm(i->reg_imm.imm, enc->imm_size, buf);
+    case X86_OPERANDS_GROUP1:
+        if (imm_fits_imm8(i->reg_imm.imm)) {
+            buf = emit_direct(enc, 0x83, enc->ext, i->reg_imm.dest, buf);
+            return emit_imm(i->reg_imm.imm, 1, buf);
+        }
+
+        buf = emit_direct(enc, enc->opcode, enc->ext, i->reg_imm.dest, buf);
+        return emit_imm(i->reg_imm.imm, enc->imm_size, buf);
+    case X86_OPERANDS_OPCODE_REG:
+        buf = emit_opcode(enc, rex_prefixes[enc->wide][EAX][i->reg.reg],
+                          enc->opcode + reg_bits(i->reg.reg), buf);
+        return emit_imm(i->reg_imm.imm, enc->imm_size, buf);
+    case X86_OPERANDS_COND_BYTE:
+        buf = emit_opcode(enc, setcc_rex(i->setcc.reg),
+                          enc->opcode + i->setcc.cond, buf);
+        *buf++ = direct_modrms[0][i->setcc.reg];
+        return buf;
+    case X86_OPERANDS_COND_REL:
+        buf = emit_opcode(enc, 0, enc->opcode + i->jump.cond, buf);
+        return emit_rel32(i->jump.label, position, start, buf);
+    case X86_OPERANDS_REL:
+        buf = emit_opcode(enc, 0, enc->opcode, buf);
+        return emit_rel32(i->jump.label, position, start, buf);
+    case X86_OPERANDS_XMM:
+        return emit_direct(enc, enc->opcode, i->reg_xmm.xmm, i->reg_xmm.reg,
+                           buf);
+    case X86_OPERANDS_STACK_IMM:
+        buf = emit_stack_operand(enc, enc->ext, i->stack_imm.dest_offset, buf);
+        return emit_imm(i->stack_imm.imm, enc->imm_size, buf);
+    case X86_OPERANDS_STACK_LOAD:
+        return emit_stack_operand(enc, i->reg_stack.dest,
+                                  i->reg_stack.src_offset, buf);
+    case X86_OPERANDS_STACK_STORE:
+        return emit_stack_operand(enc, i->stack_reg.src,
+                                  i->stack_reg.dest_offset, buf);
+    case X86_OPERANDS_PTR:
+        return emit_ptr_operand(enc, i->ptr.reg, i->ptr.base, i->ptr.disp,
+                                buf);
+    case X86_OPERANDS_PTR_EXT:
+        buf = emit_ptr_operand(enc, enc->ext, i->ptr.base, i->ptr.disp, buf);
+        return emit_imm(i->ptr.imm, enc->imm_size, buf);
+    case X86_OPERANDS_ABS_REG:
+        buf = emit_opcode(enc, rex_prefixes[enc->wide][EAX][i->abs.reg],
+                          enc->opcode + reg_bits(i->abs.reg), buf);
+        return emit_imm(i->abs.address, enc->imm_size, buf);
+    case X86_OPERANDS_COND_SKIP:
+        buf = emit_opcode(enc, 0, enc->opcode + i->skip.cond, buf);
+        return emit_imm(i->skip.len, enc->imm_size, buf);
+    case X86_OPERANDS_GUEST_LOAD:
+        // sub dword loads are movsx
+        switch (i->reg_mem.width) {
+        case X86_MEM_BYTE:
+            return emit_guest_mem(&x86_movsx_encoding, 0xbe, i->reg_mem, buf);
+        case X86_MEM_WORD:
+            return emit_guest_mem(&x86_movsx_encoding, 0xbf, i->reg_mem, buf);
+        case X86_MEM_DWORD:
+            return emit_guest_mem(enc, enc->opcode, i->reg_mem, buf);
+        }
+        break;
+    case X86_OPERANDS_GUEST_STORE:
+        switch (i->reg_mem.width) {
+        case X86_MEM_BYTE:
+            return emit_guest_mem(enc, 0x88, i->reg_mem, buf);
+        case X86_MEM_WORD:
+            return emit_guest_mem(&x86_mov16_encoding, enc->opcode, i->reg_mem,
+                                  buf);
+        case X86_MEM_DWORD:
+            return emit_guest_mem(enc, enc->opcode, i->reg_mem, buf);
+        }
+        break;
+    case X86_OPERANDS_LEA:
+        return emit_lea(enc, i->lea, buf);
+    case X86_OPERANDS_SEQUENCE: {
+        struct x86_instr parts[X86_MAX_SEQUENCE];
+        size_t num_parts = x86_instr_sequence(i, parts);
+
+        for (size_t p = 0; p < num_parts; p++) {
+            buf = encode_x86_instr(&parts[p], position + (buf - start), buf);
+        }
+
+        return buf;
+    }
+    }
+
+    RUNTIME_ERROR("Invalid x86 instruction %d", i->type);
+}
+
+/**
+ * Emit 'movabs REG, imm64'.
+ */
+static uint8_t *emit_mov_reg_imm64(enum x86_reg_type reg, uint64_t imm,
+                                   uint8_t *buf) {
+    buf = emit_rex(true, EAX, reg, buf);
+    WRITE_BYTES(buf, 0xb8 + reg_bits(reg));
+    *(uint64_t *)buf = imm;
+    return buf + sizeof(uint64_t);
+}
+
+/**
+ * Emit 'mov REG, [rax + disp8]' (or the store, 'mov [rax + disp8], REG').
+ */
+static uint8_t *emit_rax_disp_instruction(enum x86_reg_type reg, int8_t disp,
+                                          bool is_store, uint8_t *buf) {
+    buf = emit_rex(false, reg, EAX, buf);
+    WRITE_BYTES(buf, is_store ? 0x89 : 0x8b, 0b01000000 | reg_bits(reg) << 3,
+                disp);
+    return buf;
+}
+
+/**
+ * Emit 'movd XMM, [rax + disp8]' (or the store, 'movd [rax + disp8], XMM'),
+ * addressing from rsp instead of rax if 'from_rsp'.
+ */
+static uint8_t *emit_xmm_disp_instruction(enum x86_xmm_reg_type xmm,
+                                          bool from_rsp, int8_t disp,
+                                          bool is_store, uint8_t *buf) {
+    WRITE_BYTES(buf, 0x66);
+    if (xmm >= XMM8) {
+        WRITE_BYTES(buf, 0x44);
+    }
+    WRITE_BYTES(buf, 0x0f, is_store ? 0x7e : 0x6e,
+                0b01000000 | (xmm & 7) << 3 | (from_rsp ? 0b100 : 0));
+    if (from_rsp) {
+        WRITE_BYTES(buf, 0x24); // sib for [rsp]
+    }
+    WRITE_BYTES(buf, disp);
+    return buf;
+}
+
+/**
+ * Entered as 'void thunk(uint32_t *unmapped_regs, uint32_t *mapped_regs,
+ * uint8_t *guest_memory, uint8_t *entry)', records the host stack pointer so
+ * the program can be exited from any call depth, and the stack pointer guest
+ * code starts with and how far its calls may take it. Then it loads the mapped
+ * registers.
+ *
+ * The entry point is then called as if by a guest call returning to
+ * GUEST_EXIT_ADDRESS, so a final 'jr $ra' returns natively into a jump to the
+ * epilogue, which is `len` bytes after the end of the prologue. It is called
+ * from the stack, as rcx may have been loaded with a mapped register.
+ */
+static uint8_t *emit_prologue(struct jit_runtime *rt, uint32_t len,
+                              uint8_t *buf) {
+    WRITE_BYTES(buf, 0x53,       // push rbx
+                 0x54,           // push rsp
+                 0x55,           // push rbp
+                 0x41, 0x54,     // push r12
+                 0x41, 0x55,     // push r13
+                 0x41, 0x56,     // push r14
+                 0x41, 0x57,     // push r15
+                 0x56,           // push rsi
+                 0x48, 0x89, 0xfd, // mov rbp, rdi (non-mapped registers)
+                 0x49, 0x89, 0xd7  // mov r15, rdx (guest memory base)
+    );
+
+    buf = emit_mov_reg_imm64(EAX, (uint64_t)&rt->host_rsp, buf);
+    WRITE_BYTES(buf, 0x48, 0x89, 0x20); // mov [rax], rsp
+
+    // guest code is entered below the entry, the exit address and the native
+    // return address
+    int8_t base_disp = offsetof(struct jit_runtime, call_stack_base) -
+                       offsetof(struct jit_runtime, host_rsp);
+    int8_t limit_disp = offsetof(struct jit_runtime, call_stack_limit) -
+                        offsetof(struct jit_runtime, host_rsp);
+    WRITE_BYTES(buf, 0x48, 0x8d, 0x54, 0x24, -24, // lea rdx, [rsp - 24]
+                0x48, 0x89, 0x50, base_disp,      // mov [rax + base], rdx
+                0x48, 0x8d, 0x92);                // lea rdx, [rdx - size]
+    buf = emit_imm(-JIT_CALL_STACK_SIZE, 4, buf);
+    WRITE_BYTES(buf, 0x48, 0x89, 0x50, limit_disp, // mov [rax + limit], rdx
+                0x51,                              // push rcx (entry)
+                0x68);                 // push GUEST_EXIT_ADDRESS
+    *(uint32_t *)buf = GUEST_EXIT_ADDRESS;
+    buf += sizeof(uint32_t);
+    WRITE_BYTES(buf, 0x48, 0x89, 0xf0); // mov rax, rsi (mapped registers)
+
+    for (int i = 0; i < rt->num_x86_regs; i++) {
+        buf = emit_rax_disp_instruction(linear_free_x86_reg_map[i], 4 * i,
+                                        false, buf);
+    }
+
+    for (int i = 0; i < num_xmm_spill_regs; i++) {
+        buf = emit_xmm_disp_instruction(i, false, 4 * (num_free_x86_regs + i),
+                                        false, buf);
+    }
+
+    WRITE_BYTES(buf, 0xff, 0x54, 0x24, 0x08, // call [rsp + 8]
+                0xe9);                       // jmp epilogue
+    *(uint32_t *)buf = len;
+    buf += sizeof(uint32_t);
+
+    return buf;
+}
+
+/**
+ * Store the mapped registers back and return, the host stack pointer is reset
+ * first as we may be exiting from inside guest calls.
+ */
+static uint8_t *emit_epilogue(struct jit_runtime *rt, uint8_t *buf) {
+    buf = emit_mov_reg_imm64(EAX, (uint64_t)&rt->host_rsp, buf);
+    WRITE_BYTES(buf, 0x48, 0x8b, 0x20, // mov rsp, [rax]
+                0x58); // pop rax (pop pushed value of rsi into rax)
+
+    for (int i = 0; i < rt->num_x86_regs; i++) {
+        buf = emit_rax_disp_instruction(linear_free_x86_reg_map[i], 4 * i,
+                                        true, buf);
+    }
+
+    for (int i = 0; i < num_xmm_spill_regs; i++) {
+        buf = emit_xmm_disp_instruction(i, false, 4 * (num_free_x86_regs + i),
+                                        true, buf);
+    }
+
+    WRITE_BYTES(buf, 0x41, 0x5f, // pop r15
+                0x41, 0x5e,      // pop r14
+                0x41, 0x5d,      // pop r13
+                0x41, 0x5c,      // pop r12
+                0x5d,            // pop rbp
+                0x5c,            // pop rsp
+                0x5b,            // pop rbx
+                0xc3);           // ret
+
+    return buf;
+}
+
+/**
+ * Jumped to with a guest address in eax, calls `jit_dispatch` and jumps to the
+ * native code it returns. Mapped registers the C calling convention doesn't
+ * preserve are saved around the call, and the stack is realigned as guest
+ * calls leave it at any alignment.
+ *
+ * The inline cache miss stub is the same, but calls `jit_dispatch_ic` with the
+ * cache from rcx.
+ */
+static uint8_t *emit_dispatch_stub(struct jit_runtime *rt, bool is_ic_miss,
+                                   uint8_t *buf) {
+    for (int i = 0; i < rt->num_x86_regs; i++) {
+        enum x86_reg_type reg = linear_free_x86_reg_map[i];
+        if (x86_reg_is_caller_saved[reg]) {
+            buf = emit_rex(false, EAX, reg, buf);
+            WRITE_BYTES(buf, 0x50 + reg_bits(reg)); // push reg
+        }
+    }
+
+    // every xmm register is caller saved
+    WRITE_BYTES(buf, 0x48, 0x83, 0xec, 4 * num_xmm_spill_regs); // sub rsp, n
+    for (int i = 0; i < num_xmm_spill_regs; i++) {
+        buf = emit_xmm_disp_instruction(i, true, 4 * i, true, buf);
+    }
+
+    if (is_ic_miss) {
+        WRITE_BYTES(buf, 0x89, 0xc2,  // mov edx, eax
+                    0x48, 0x89, 0xce); // mov rsi, rcx
+    } else {
+        WRITE_BYTES(buf, 0x89, 0xc6); // mov esi, eax
+    }
+    buf = emit_mov_reg_imm64(EDI, (uint64_t)rt, buf);
+    WRITE_BYTES(buf, 0x48, 0x89, 0xe0, // mov rax, rsp
+                0x48, 0x83, 0xe4, 0xf0, // and rsp, -16
+                0x50,                   // push rax
+                0x50);                  // push rax
+    buf = emit_mov_reg_imm64(
+        EAX, is_ic_miss ? (uint64_t)jit_dispatch_ic : (uint64_t)jit_dispatch,
+        buf);
+    WRITE_BYTES(buf, 0xff, 0xd0, // call rax
+                0x5c);           // pop rsp
+
+    for (int i = 0; i < num_xmm_spill_regs; i++) {
+        buf = emit_xmm_disp_instruction(i, true, 4 * i, false, buf);
+    }
+    WRITE_BYTES(buf, 0x48, 0x83, 0xc4, 4 * num_xmm_spill_regs); // add rsp, n
+
+    for (int i = rt->num_x86_regs - 1; i >= 0; i--) {
+        enum x86_reg_type reg = linear_free_x86_reg_map[i];
+        if (x86_reg_is_caller_saved[reg]) {
+            buf = emit_rex(false, EAX, reg, buf);
+            WRITE_BYTES(buf, 0x58 + reg_bits(reg)); // pop reg
+        }
+    }
+
+    WRITE_BYTES(buf, 0xff, 0xe0); // jmp rax
+
+    return buf;
+}
+
+/**
+ * Jumped to with the guest address of an add that overflowed in eax, calls
+ * `jit_overflow`, which doesn't return, so nothing is saved.
+ */
+static uint8_t *emit_overflow_stub(uint8_t *buf) {
+    WRITE_BYTES(buf, 0x89, 0xc7,         // mov edi, eax
+                0x48, 0x83, 0xe4, 0xf0); // and rsp, -16
+    buf = emit_mov_reg_imm64(EAX, (uint64_t)jit_overflow, buf);
+    WRITE_BYTES(buf, 0xff, 0xd0); // call rax
+
+    return buf;
+}
 
-    for (int i = 0; i < prefix_len; i++, bytes_written++) {
-        buf[bytes_written] = prefix_bytes[i];
+/**
+ * The label the rel32 an instruction ends with is relative to, NULL if it
+ * doesn't have one.
+ */
+static struct label *x86_instr_rel_label(struct x86_instr *i) {
+    switch (i->type) {
+    case JUMP:
+    case JMP:
+    case CALL:
+        return i->jump.label;
+    case IC_JUMP:
+        return i->ic_jump.miss_label;
+    default:
+        return NULL;
     }
+}
 
-    // the offset of the main body of code (so we know jump offsets)
-    uint32_t main_body_offset = 0;
+uint32_t emit_x86_body_with_fixups(struct x86_instr_vec *instrs, uint8_t *buf,
+                                   uint32_t position,
+                                   struct x86_fixup_vec *fixups) {
+    uint32_t bytes_written = 0;
 
     for (int i = 0; i < instrs->len; i++) {
-        uint32_t bytes_written_this_loop = emit_x86_instruction(
-            &instrs->data[i], &buf[bytes_written], main_body_offset);
-        main_body_offset += bytes_written_this_loop;
+        uint32_t bytes_written_this_loop =
+            encode_x86_instr(&instrs->data[i], position + bytes_written,
+                             &buf[bytes_written]) -
+            &buf[bytes_written];
+
+        if (bytes_written_this_loop != instrs->data[i].size) {
+            RUNTIME_ERROR("Instruction size mismatch, expected %d, wrote %d",
+                          instrs->data[i].size, bytes_written_this_loop);
+        }
+
         bytes_written += bytes_written_this_loop;
+
+        struct label *label = x86_instr_rel_label(&instrs->data[i]);
+
+        if (fixups != NULL && label != NULL && label->code_position < 0) {
+            x86_fixup_vec_push(fixups,
+                               (struct x86_fixup){
+                                   .end = position + bytes_written,
+                                   .label = label});
+        }
     }
 
-    for (int i = 0; i < postfix_len; i++, bytes_written++) {
-        buf[bytes_written] = postfix_bytes[i];
+    return bytes_written;
+}
+
+uint32_t emit_x86_body(struct x86_instr_vec *instrs, uint8_t *buf,
+                       uint32_t position) {
+    return emit_x86_body_with_fixups(instrs, buf, position, NULL);
+}
+
+void patch_x86_fixups(struct x86_fixup_vec *fixups, uint8_t *code) {
+    for (size_t i = 0; i < fixups->len; i++) {
+        struct x86_fixup *fixup = &fixups->data[i];
+
+        if (fixup->label->code_position < 0) {
+            RUNTIME_ERROR("Jump to label %u which was never placed",
+                          fixup->label->id);
+        }
+
+        *(int32_t *)&code[fixup->end - 4] =
+            fixup->label->code_position - fixup->end;
     }
+}
+
+uint32_t emit_x86_prelude(struct jit_runtime *rt, uint8_t *buf) {
+    uint8_t *base_buf = buf;
+
+    // nothing lies between the prologue and epilogue
+    buf = emit_prologue(rt, 0, buf);
+    resolve_label(rt->exit_label, buf - base_buf);
+    buf = emit_epilogue(rt, buf);
+    resolve_label(rt->dispatch_label, buf - base_buf);
+    buf = emit_dispatch_stub(rt, false, buf);
+    resolve_label(rt->ic_miss_label, buf - base_buf);
+    buf = emit_dispatch_stub(rt, true, buf);
+    resolve_label(rt->overflow_label, buf - base_buf);
+    buf = emit_overflow_stub(buf);
+
+    return buf - base_buf;
+}
+
+struct thunk emit_x86_instructions(struct x86_instr_vec *instrs, uint32_t len,
+                                   struct jit_runtime *rt,
+                                   struct arena *arena) {
+    // the prologue, epilogue and stub don't depend on the body, so size them
+    // by emitting them into a scratch buffer
+    uint8_t scratch[X86_PRELUDE_MAX_SIZE];
+    const uint32_t prefix_len = emit_prologue(rt, len, scratch) - scratch;
+    const uint32_t postfix_len = emit_epilogue(rt, scratch) - scratch;
+    const uint32_t stub_len = emit_dispatch_stub(rt, false, scratch) - scratch;
+    const uint32_t ic_stub_len =
+        emit_dispatch_stub(rt, true, scratch) - scratch;
+    const uint32_t overflow_stub_len = emit_overflow_stub(scratch) - scratch;
+
+    // the epilogue and stubs follow the body
+    resolve_label(rt->exit_label, len);
+    resolve_label(rt->dispatch_label, len + postfix_len);
+    resolve_label(rt->ic_miss_label, len + postfix_len + stub_len);
+    resolve_label(rt->overflow_label,
+                  len + postfix_len + stub_len + ic_stub_len);
+
+    printf("function size: %d\n", len);
 
-    return (struct thunk){.buf = buf, .len = prefix_len + len + postfix_len};
+    uint8_t *buf = arena_alloc(arena, prefix_len + len + postfix_len +
+                                          stub_len + ic_stub_len +
+                                          overflow_stub_len);
+
+    uint32_t bytes_written = emit_prologue(rt, len, buf) - buf;
+
+    // jump offsets are relative to the start of the body
+    bytes_written += emit_x86_body(instrs, &buf[bytes_written], 0);
+
+    bytes_written +=
+        emit_epilogue(rt, &buf[bytes_written]) - &buf[bytes_written];
+    bytes_written += emit_dispatch_stub(rt, false, &buf[bytes_written]) -
+                     &buf[bytes_written];
+    bytes_written += emit_dispatch_stub(rt, true, &buf[bytes_written]) -
+                     &buf[bytes_written];
+    bytes_written +=
+        emit_overflow_stub(&buf[bytes_written]) - &buf[bytes_written];
+
+    return (struct thunk){
+        .buf = buf, .len = bytes_written, .body_offset = prefix_len};
 }
 
+const char *const x86_cond_type_names[] = {
+    [X86_COND_O] = "o",   [X86_COND_NO] = "no", [X86_COND_B] = "b",
+    [X86_COND_AE] = "ae", [X86_COND_E] = "e",   [X86_COND_NE] = "ne",
+    [X86_COND_BE] = "be", [X86_COND_A] = "a",   [X86_COND_S] = "s",
+    [X86_COND_NS] = "ns", [X86_COND_P] = "p",   [X86_COND_NP] = "np",
+    [X86_COND_L] = "l",   [X86_COND_GE] = "ge", [X86_COND_LE] = "le",
+    [X86_COND_G] = "g"};
+
+static const char *const x86_mem_width_names[] = {
+    [X86_MEM_BYTE] = "byte", [X86_MEM_WORD] = "word", [X86_MEM_DWORD] = "dword"};
+
 static void print_maybe_resolved_label(struct label *label) {
-    if (label->code_position > 0) {
+    if (label->code_position >= 0) {
         printf("%d", label->code_position);
     } else {
         printf("<unresolved_label: %d>", label->id);
@@ -566,9 +2125,170 @@ void print_x86_instr(struct x86_instr *i) {
                x86_reg_type_names[i->reg_reg.src]);
         break;
     case JUMP:
-        printf("%s ", i->jump.is_eq ? "je" : "jne");
+        printf("j%s ", x86_cond_type_names[i->jump.cond]);
         print_maybe_resolved_label(i->jump.label);
         printf("\n");
         break;
+    case MOV_REG_MEM:
+        printf("%s %s, %s [R15 + %s + %d]\n",
+               i->reg_mem.width == X86_MEM_DWORD ? "mov" : "movsx",
+               x86_reg_type_names[i->reg_mem.reg],
+               x86_mem_width_names[i->reg_mem.width],
+               x86_reg_type_names[i->reg_mem.index], i->reg_mem.disp);
+        break;
+    case MOV_MEM_REG:
+        printf("mov %s [R15 + %s + %d], %s\n",
+               x86_mem_width_names[i->reg_mem.width],
+               x86_reg_type_names[i->reg_mem.index], i->reg_mem.disp,
+               x86_reg_type_names[i->reg_mem.reg]);
+        break;
+    case IMUL_REG_REG:
+        printf("imul %s, %s\n", x86_reg_type_names[i->reg_reg.dest],
+               x86_reg_type_names[i->reg_reg.src]);
+        break;
+    case IMUL64_REG_REG:
+        printf("imul %sq, %sq\n", x86_reg_type_names[i->reg_reg.dest],
+               x86_reg_type_names[i->reg_reg.src]);
+        break;
+    case MOVSXD_REG_REG:
+        printf("movsxd %sq, %s\n", x86_reg_type_names[i->reg_reg.dest],
+               x86_reg_type_names[i->reg_reg.src]);
+        break;
+    case SHR64_REG_IMM:
+        printf("shr %sq, %d\n", x86_reg_type_names[i->reg_imm.dest],
+               i->reg_imm.imm);
+        break;
+    case CMP_REG_IMM:
+        printf("cmp %s, %d\n", x86_reg_type_names[i->reg_imm.dest],
+               (int32_t)i->reg_imm.imm);
+        break;
+    case ADC_REG_IMM:
+        printf("adc %s, %d\n", x86_reg_type_names[i->reg_imm.dest],
+               (int8_t)i->reg_imm.imm);
+        break;
+    case OR_REG_IMM:
+        printf("or %s, %d\n", x86_reg_type_names[i->reg_imm.dest],
+               (int8_t)i->reg_imm.imm);
+        break;
+    case TEST_REG_REG:
+        printf("test %s, %s\n", x86_reg_type_names[i->reg_reg.dest],
+               x86_reg_type_names[i->reg_reg.src]);
+        break;
+    case TEST_REG_IMM:
+        printf("test %s, 0x%x\n", x86_reg_type_names[i->reg_imm.dest],
+               i->reg_imm.imm);
+        break;
+    case BSR_REG_REG:
+        printf("bsr %s, %s\n", x86_reg_type_names[i->reg_reg.dest],
+               x86_reg_type_names[i->reg_reg.src]);
+        break;
+    case SHL_REG_CL:
+        printf("shl %s, cl\n", x86_reg_type_names[i->reg.reg]);
+        break;
+    case SETCC_REG:
+        printf("set%s %sb\n", x86_cond_type_names[i->setcc.cond],
+               x86_reg_type_names[i->setcc.reg]);
+        break;
+    case PUSH_REG:
+        printf("push %sq\n", x86_reg_type_names[i->reg.reg]);
+        break;
+    case POP_REG:
+        printf("pop %sq\n", x86_reg_type_names[i->reg.reg]);
+        break;
+    case CQO:
+        printf("cqo\n");
+        break;
+    case IDIV64_REG:
+        printf("idiv %sq\n", x86_reg_type_names[i->reg.reg]);
+        break;
+    case DIV_REG:
+        printf("div %s\n", x86_reg_type_names[i->reg.reg]);
+        break;
+    case PUSH_IMM:
+        printf("push %d\n", i->reg_imm.imm);
+        break;
+    case ADD_RSP_IMM:
+        printf("add rsp, %d\n", (int8_t)i->reg_imm.imm);
+        break;
+    case CMP_SHADOW_REG:
+        printf("cmp [rsp + 8], %s\n", x86_reg_type_names[i->ptr.reg]);
+        break;
+    case CALL:
+        printf("call ");
+        print_maybe_resolved_label(i->jump.label);
+        printf("\n");
+        break;
+    case RET:
+        printf("ret\n");
+        break;
+    case JMP:
+        printf("jmp ");
+        print_maybe_resolved_label(i->jump.label);
+        printf("\n");
+        break;
+    case MOV_ABS_EAX:
+        printf("mov [%p], EAX\n", (void *)i->abs.address);
+        break;
+    case BOUND_CALLS:
+        printf("reset rsp if below [%p]\n", (void *)i->abs.address);
+        break;
+    case MOV_REG_IMM64:
+        printf("mov %sq, %p\n", x86_reg_type_names[i->abs.reg],
+               (void *)i->abs.address);
+        break;
+    case MOV64_REG_PTR:
+        printf("mov %sq, [%sq + %d]\n", x86_reg_type_names[i->ptr.reg],
+               x86_reg_type_names[i->ptr.base], i->ptr.disp);
+        break;
+    case CMP_PTR_REG:
+        printf("cmp [%sq + %d], %s\n", x86_reg_type_names[i->ptr.base],
+               i->ptr.disp, x86_reg_type_names[i->ptr.reg]);
+        break;
+    case CMP64_PTR_REG:
+        printf("cmp [%sq + %d], %sq\n", x86_reg_type_names[i->ptr.base],
+               i->ptr.disp, x86_reg_type_names[i->ptr.reg]);
+        break;
+    case ADD64_PTR_IMM:
+        printf("add qword [%sq + %d], %d\n", x86_reg_type_names[i->ptr.base],
+               i->ptr.disp, i->ptr.imm);
+        break;
+    case JMP_PTR:
+        printf("jmp [%sq + %d]\n", x86_reg_type_names[i->ptr.base],
+               i->ptr.disp);
+        break;
+    case JCC_SKIP:
+        printf("j%s +%d\n", x86_cond_type_names[i->skip.cond], i->skip.len);
+        break;
+    case ADD_REG_IMM:
+        printf("add %s, %d\n", x86_reg_type_names[i->reg_imm.dest],
+               (int32_t)i->reg_imm.imm);
+        break;
+    case AND_REG_IMM:
+        printf("and %s, %d\n", x86_reg_type_names[i->reg_imm.dest],
+               (int32_t)i->reg_imm.imm);
+        break;
+    case MOVD_REG_XMM:
+        printf("movd %s, %s\n", x86_reg_type_names[i->reg_xmm.reg],
+               x86_xmm_reg_type_names[i->reg_xmm.xmm]);
+        break;
+    case MOVD_XMM_REG:
+        printf("movd %s, %s\n", x86_xmm_reg_type_names[i->reg_xmm.xmm],
+               x86_reg_type_names[i->reg_xmm.reg]);
+        break;
+    case LEA_REG_MEM:
+        printf("lea %s, [%s", x86_reg_type_names[i->lea.dest],
+               x86_reg_type_names[i->lea.base]);
+        if (i->lea.has_index) {
+            printf(" + %s * %d", x86_reg_type_names[i->lea.index],
+                   1 << i->lea.shift);
+        }
+        printf(" + %d]\n", i->lea.disp);
+        break;
+    case IC_JUMP:
+        printf("jmp EAX via inline cache for 0x%08x, else ",
+               i->ic_jump.ic->site_address);
+        print_maybe_resolved_label(i->ic_jump.miss_label);
+        printf("\n");
+        break;
     }
 }
@@ -1,10 +1,13 @@
 #ifndef __X86_INSTR_H_
 #define __X86_INSTR_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "abstract_instr.h"
+#include "arena.h"
 #include "label.h"
+#include "runtime.h"
 #include "vec.h"
 #include "x86_reg.h"
 
@@ -34,7 +37,81 @@ enum __attribute__((__packed__)) x86_instr_type {
     /* SLL_REG_STACK, */
     CMP_REG_REG,
     /* CMP_REG_STACK */
-    JUMP
+    JUMP,
+    MOV_REG_MEM,    // mov REG0, [r15 + REG1 + DISP] (sign extending loads)
+    MOV_MEM_REG,    // mov [r15 + REG1 + DISP], REG0
+    IMUL_REG_REG,   // imul REG0, REG1
+    IMUL64_REG_REG, // imul REG0q, REG1q
+    MOVSXD_REG_REG, // movsxd REG0q, REG1
+    SHR64_REG_IMM,  // shr REG0q, IMM
+    CMP_REG_IMM,    // cmp REG0, IMM (an imm8 if it fits, else an imm32)
+    ADC_REG_IMM,    // adc REG0, IMM8
+    OR_REG_IMM,     // or REG0, IMM8
+    TEST_REG_REG,   // test REG0, REG1
+    BSR_REG_REG,    // bsr REG0, REG1
+    SHL_REG_CL,     // shl REG0, cl
+    SETCC_REG,      // setCC REG0 (low byte)
+    PUSH_REG,       // push REG0q
+    POP_REG,        // pop REG0q
+    CQO,            // cqo (rdx:rax <- sign extended rax)
+    IDIV64_REG,     // idiv REG0q (rax <- rdx:rax / REG0q, rdx <- remainder)
+    DIV_REG,        // div REG0 (eax <- edx:eax / REG0, edx <- remainder)
+    PUSH_IMM,       // push IMM (sign extended to 64 bits)
+    ADD_RSP_IMM,    // add rsp, IMM8
+    CMP_SHADOW_REG, // cmp [rsp + 8], REG0 (guest return address of a call)
+    CALL,           // call LABEL
+    RET,            // ret
+    JMP,            // jmp LABEL
+    IC_JUMP,        // jump to eax through inline cache IC, else to LABEL
+    MOV_ABS_EAX,    // mov [ADDRESS], eax (64 bit absolute address)
+    ADD_REG_IMM,    // add REG0, IMM (an imm8 if it fits, else an imm32)
+    AND_REG_IMM,    // and REG0, IMM (an imm8 if it fits, else an imm32)
+    MOVD_REG_XMM,   // movd REG0, XMM
+    MOVD_XMM_REG,   // movd XMM, REG0
+    LEA_REG_MEM,    // lea REG0, [BASE + INDEX << SHIFT + DISP]
+    TEST_REG_IMM,   // test REG0, IMM32
+    BOUND_CALLS,    // reset rsp if guest calls have used up their stack
+    // the rest only make up IC_JUMP and BOUND_CALLS, reaching runtime data
+    MOV_REG_IMM64, // mov REG0q, ADDRESS
+    MOV64_REG_PTR, // mov REG0q, [BASE + DISP]
+    CMP_PTR_REG,   // cmp [BASE + DISP], REG0
+    CMP64_PTR_REG, // cmp [BASE + DISP], REG0q
+    ADD64_PTR_IMM, // add qword [BASE + DISP], IMM8
+    JMP_PTR,       // jmp [BASE + DISP]
+    JCC_SKIP       // jCC over the next LEN bytes
+};
+
+// enough space for the prologue, epilogue and dispatch stubs
+#define X86_PRELUDE_MAX_SIZE 1024
+
+/**
+ * Condition codes, the values are the low nibble of the jcc/setcc opcodes.
+ */
+enum __attribute__((__packed__)) x86_cond_type {
+    X86_COND_O = 0x0,
+    X86_COND_NO,
+    X86_COND_B,
+    X86_COND_AE,
+    X86_COND_E,
+    X86_COND_NE,
+    X86_COND_BE,
+    X86_COND_A,
+    X86_COND_S,
+    X86_COND_NS,
+    X86_COND_P,
+    X86_COND_NP,
+    X86_COND_L,
+    X86_COND_GE,
+    X86_COND_LE,
+    X86_COND_G
+};
+
+extern const char *const x86_cond_type_names[];
+
+enum __attribute__((__packed__)) x86_mem_width {
+    X86_MEM_BYTE,
+    X86_MEM_WORD,
+    X86_MEM_DWORD
 };
 
 struct x86_reg {
@@ -66,11 +143,63 @@ struct x86_stack_reg {
     enum x86_reg_type src;
 };
 
+struct x86_reg_xmm {
+    enum x86_reg_type reg;
+    enum x86_xmm_reg_type xmm;
+};
+
+// a guest memory operand, [r15 + index + disp]
+struct x86_reg_mem {
+    enum x86_reg_type reg;
+    enum x86_reg_type index;
+    enum x86_mem_width width;
+    int16_t disp;
+};
+
+// an address computed without touching memory, [base + index << shift + disp]
+// or [base + disp] if there's no index
+struct x86_lea {
+    enum x86_reg_type dest;
+    enum x86_reg_type base;
+    enum x86_reg_type index;
+    bool has_index;
+    uint8_t shift;
+    int32_t disp;
+};
+
 struct x86_jump {
-    bool is_eq;
+    enum x86_cond_type cond;
     struct label *label;
 };
 
+struct x86_setcc {
+    enum x86_cond_type cond;
+    enum x86_reg_type reg;
+};
+
+struct x86_abs {
+    uint64_t address;
+    enum x86_reg_type reg;
+};
+
+// an operand in runtime data rather than guest memory, [base + disp8]
+struct x86_ptr {
+    enum x86_reg_type reg;
+    enum x86_reg_type base;
+    int8_t disp;
+    uint8_t imm;
+};
+
+struct x86_skip {
+    enum x86_cond_type cond;
+    uint8_t len;
+};
+
+struct x86_ic_jump {
+    struct jit_ic *ic;
+    struct label *miss_label; // entered with the cache in rcx
+};
+
 struct x86_instr {
     enum x86_instr_type type;
     uint8_t size;
@@ -82,12 +211,21 @@ struct x86_instr {
         struct x86_reg_stack reg_stack;
         struct x86_stack_reg stack_reg;
         struct x86_jump jump;
+        struct x86_reg_mem reg_mem;
+        struct x86_setcc setcc;
+        struct x86_ic_jump ic_jump;
+        struct x86_abs abs;
+        struct x86_reg_xmm reg_xmm;
+        struct x86_lea lea;
+        struct x86_ptr ptr;
+        struct x86_skip skip;
     };
 };
 
 struct thunk {
     uint8_t *buf;
     size_t len;
+    uint32_t body_offset; // offset of the first instruction of the body
 };
 
 DEFINE_VEC(struct x86_instr, x86_instr);
@@ -109,7 +247,65 @@ struct x86_instr construct_shr_reg_imm(enum x86_reg_type reg, uint16_t imm);
 struct x86_instr construct_shl_reg_imm(enum x86_reg_type reg, uint16_t imm);
 struct x86_instr construct_cmp_reg_reg(enum x86_reg_type dest,
                                        enum x86_reg_type src);
-struct x86_instr construct_jump(bool is_eq, struct label *label);
+struct x86_instr construct_jump(enum x86_cond_type cond, struct label *label);
+struct x86_instr construct_mov_reg_mem(enum x86_reg_type dest,
+                                       enum x86_reg_type index, int16_t disp,
+                                       enum x86_mem_width width);
+struct x86_instr construct_mov_mem_reg(enum x86_reg_type index, int16_t disp,
+                                       enum x86_reg_type src,
+                                       enum x86_mem_width width);
+struct x86_instr construct_imul_reg_reg(enum x86_reg_type dest,
+                                        enum x86_reg_type src);
+struct x86_instr construct_imul64_reg_reg(enum x86_reg_type dest,
+                                          enum x86_reg_type src);
+struct x86_instr construct_movsxd_reg_reg(enum x86_reg_type dest,
+                                          enum x86_reg_type src);
+struct x86_instr construct_shr64_reg_imm(enum x86_reg_type reg, uint16_t imm);
+struct x86_instr construct_cmp_reg_imm(enum x86_reg_type reg, uint32_t imm);
+struct x86_instr construct_add_reg_imm(enum x86_reg_type reg, uint32_t imm);
+struct x86_instr construct_and_reg_imm(enum x86_reg_type reg, uint32_t imm);
+struct x86_instr construct_adc_reg_imm(enum x86_reg_type reg, int8_t imm);
+struct x86_instr construct_or_reg_imm(enum x86_reg_type reg, int8_t imm);
+struct x86_instr construct_test_reg_reg(enum x86_reg_type dest,
+                                        enum x86_reg_type src);
+struct x86_instr construct_test_reg_imm(enum x86_reg_type reg, uint32_t imm);
+struct x86_instr construct_bsr_reg_reg(enum x86_reg_type dest,
+                                       enum x86_reg_type src);
+struct x86_instr construct_shl_reg_cl(enum x86_reg_type reg);
+struct x86_instr construct_setcc_reg(enum x86_cond_type cond,
+                                     enum x86_reg_type reg);
+struct x86_instr construct_push_reg(enum x86_reg_type reg);
+struct x86_instr construct_pop_reg(enum x86_reg_type reg);
+struct x86_instr construct_cqo(void);
+struct x86_instr construct_idiv64_reg(enum x86_reg_type reg);
+struct x86_instr construct_div_reg(enum x86_reg_type reg);
+struct x86_instr construct_push_imm(uint32_t imm);
+struct x86_instr construct_add_rsp_imm(int8_t imm);
+struct x86_instr construct_cmp_shadow_reg(enum x86_reg_type reg);
+struct x86_instr construct_call(struct label *label);
+struct x86_instr construct_ret(void);
+struct x86_instr construct_jmp(struct label *label);
+struct x86_instr construct_ic_jump(struct jit_ic *ic,
+                                   struct label *miss_label);
+struct x86_instr construct_mov_abs_eax(void *address);
+struct x86_instr construct_bound_calls(struct jit_runtime *rt);
+struct x86_instr construct_movd_reg_xmm(enum x86_reg_type reg,
+                                        enum x86_xmm_reg_type xmm);
+struct x86_instr construct_movd_xmm_reg(enum x86_xmm_reg_type xmm,
+                                        enum x86_reg_type reg);
+struct x86_instr construct_lea_reg_disp(enum x86_reg_type dest,
+                                        enum x86_reg_type base, int32_t disp);
+struct x86_instr construct_lea_reg_index(enum x86_reg_type dest,
+                                         enum x86_reg_type base,
+                                         enum x86_reg_type index,
+                                         uint8_t shift);
+
+/**
+ * Test if realizing 'i' under 'map' uses ECX as a temporary. EAX is always
+ * free for temporaries, ECX only when this is false for every instruction.
+ */
+bool abstract_instr_needs_ecx(struct abstract_instr *i,
+                              struct mips_x86_reg_mapping *map);
 
 /**
  * Convert an abstract instruction into an x86 instruction.
@@ -118,10 +314,69 @@ struct x86_instr construct_jump(bool is_eq, struct label *label);
  */
 void realize_abstract_instruction(struct abstract_instr *i,
                                   struct mips_x86_reg_mapping *map,
+                                  struct jit_runtime *rt,
                                   struct x86_instr_vec *result_instrs,
                                   uint32_t *current_offset);
 
-struct thunk emit_x86_instructions(struct x86_instr_vec *instrs, uint32_t len);
+/**
+ * Write the out of line stubs for the overflow checks realized since the last
+ * call, each passing the guest address of its add to the overflow stub. Code
+ * that may contain checks must be followed by these.
+ */
+void realize_trap_stubs(struct jit_runtime *rt,
+                        struct x86_instr_vec *result_instrs,
+                        uint32_t *current_offset);
+
+/**
+ * Emit a vector of x86 instructions into an array of bytes, along with the
+ * prologue and epilogue that load and store the mapped registers, and the
+ * stubs generated code calls `jit_dispatch` and `jit_overflow` through. The
+ * bytes are allocated from 'arena'.
+ */
+struct thunk emit_x86_instructions(struct x86_instr_vec *instrs, uint32_t len,
+                                   struct jit_runtime *rt,
+                                   struct arena *arena);
+
+/**
+ * Emit x86 instructions without a prologue or epilogue, `position` is where
+ * the first instruction will be relative to the positions labels are resolved
+ * to. Returns the number of bytes written.
+ */
+uint32_t emit_x86_body(struct x86_instr_vec *instrs, uint8_t *buf,
+                       uint32_t position);
+
+/**
+ * A jump encoded before the label it goes to was resolved, the rel32 ending at
+ * `end` is filled in by `patch_x86_fixups` once it is.
+ */
+struct x86_fixup {
+    uint32_t end;
+    struct label *label;
+};
+
+DEFINE_VEC(struct x86_fixup, x86_fixup);
+
+/**
+ * As `emit_x86_body`, but jumps to labels that aren't resolved yet are added
+ * to 'fixups'.
+ */
+uint32_t emit_x86_body_with_fixups(struct x86_instr_vec *instrs, uint8_t *buf,
+                                   uint32_t position,
+                                   struct x86_fixup_vec *fixups);
+
+/**
+ * Fill in the jumps in 'fixups', 'code' is where position 0 is. Every label
+ * they go to has to be resolved by now.
+ */
+void patch_x86_fixups(struct x86_fixup_vec *fixups, uint8_t *code);
+
+/**
+ * Emit the prologue, epilogue and dispatch stubs on their own (at most
+ * X86_PRELUDE_MAX_SIZE bytes), for code compiled separately that jumps to the
+ * runtime labels, which are resolved relative to the start of `buf`. Returns
+ * the number of bytes written.
+ */
+uint32_t emit_x86_prelude(struct jit_runtime *rt, uint8_t *buf);
 
 void print_x86_instr(struct x86_instr *i);
 
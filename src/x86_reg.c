@@ -4,23 +4,34 @@
 #include "x86_reg.h"
 
 const enum x86_reg_type linear_free_x86_reg_map[] = {
-    EDX, EBX, ESI, EDI, R8D, R9D, R10D, R11D, R12D, R13D, R14D, R15D,
+    EDX, EBX, ESI, EDI, R8D, R9D, R10D, R11D, R12D, R13D, R14D, EBP, ECX,
 };
 
 const uint8_t linear_free_x86_reg_inverse_map[] = {
-    [EDX] = 0,  [EBX] = 1,  [ESI] = 2,  [EDI] = 3,  [R8D] = 4,   [R9D] = 5,
-    [R10D] = 6, [R11D] = 7, [R12D] = 8, [R13D] = 9, [R14D] = 10, [R15D] = 11,
+    [EDX] = 0,   [EBX] = 1,  [ESI] = 2,  [EDI] = 3,  [R8D] = 4,
+    [R9D] = 5,   [R10D] = 6, [R11D] = 7, [R12D] = 8, [R13D] = 9,
+    [R14D] = 10, [EBP] = 11, [ECX] = 12,
 };
 
-const int num_free_x86_regs = 12;
+const int num_free_x86_regs = 13;
+const int num_always_free_x86_regs = 11;
 
 const char *const x86_reg_type_names[] = {
     [EAX] = "EAX",   [ECX] = "ECX",   [EDX] = "EDX",   [EBX] = "EBX",
-    [ESI] = "ESI",   [EDI] = "EDI",   [R8D] = "R8D",   [R9D] = "R9D",
-    [R10D] = "R10D", [R11D] = "R11D", [R12D] = "R12D", [R13D] = "R13D",
-    [R14D] = "R14D", [R15D] = "R15D"};
-
-const bool x86_reg_is_new[] = {
-    [EAX] = false, [ECX] = false, [EDX] = false, [EBX] = false, [ESI] = false,
-    [EDI] = false, [R8D] = true,  [R9D] = true,  [R10D] = true, [R11D] = true,
-    [R12D] = true, [R13D] = true, [R14D] = true, [R15D] = true};
+    [ESP] = "ESP",   [EBP] = "EBP",   [ESI] = "ESI",   [EDI] = "EDI",
+    [R8D] = "R8D",   [R9D] = "R9D",   [R10D] = "R10D", [R11D] = "R11D",
+    [R12D] = "R12D", [R13D] = "R13D", [R14D] = "R14D", [R15D] = "R15D"};
+
+const int num_xmm_spill_regs = 16;
+
+const char *const x86_xmm_reg_type_names[] = {
+    [XMM0] = "XMM0",   [XMM1] = "XMM1",   [XMM2] = "XMM2",   [XMM3] = "XMM3",
+    [XMM4] = "XMM4",   [XMM5] = "XMM5",   [XMM6] = "XMM6",   [XMM7] = "XMM7",
+    [XMM8] = "XMM8",   [XMM9] = "XMM9",   [XMM10] = "XMM10", [XMM11] = "XMM11",
+    [XMM12] = "XMM12", [XMM13] = "XMM13", [XMM14] = "XMM14", [XMM15] = "XMM15"};
+
+const bool x86_reg_is_caller_saved[] = {
+    [EAX] = true,   [ECX] = true,   [EDX] = true,   [EBX] = false,
+    [EBP] = false,  [ESI] = true,   [EDI] = true,   [R8D] = true,
+    [R9D] = true,   [R10D] = true,  [R11D] = true,  [R12D] = false,
+    [R13D] = false, [R14D] = false, [R15D] = false};
@@ -10,10 +10,12 @@
 
 enum __attribute__((__packed__)) x86_reg_type {
     EAX = 0,
-    ECX, // NOTE: EAX and ECX is reserved for temporaries
+    ECX, // NOTE: EAX is reserved for temporaries, as is ECX unless allocated
     EDX,
     EBX,
-    ESI = 6,
+    ESP, // NOTE: never allocated, only encoded by instructions using the stack
+    EBP, // NOTE: RBP points at the stack slots unless allocated
+    ESI,
     EDI,
     R8D,
     R9D,
@@ -22,21 +24,53 @@ enum __attribute__((__packed__)) x86_reg_type {
     R12D,
     R13D,
     R14D,
-    R15D,
+    R15D, // NOTE: R15 is reserved for the guest memory base
 };
 
 /**
  * Array of allocatable x86 registers
+ *
+ * The first `num_always_free_x86_regs` are always allocated. The last two,
+ * EBP then ECX, are only allocated when no stack slots are needed and when no
+ * instruction needs ECX as a temporary (see `map_regs`).
  */
 extern const enum x86_reg_type linear_free_x86_reg_map[];
 extern const uint8_t linear_free_x86_reg_inverse_map[];
 extern const int num_free_x86_regs;
+extern const int num_always_free_x86_regs;
 
 extern const char *const x86_reg_type_names[];
 
 /**
- * Registers which are 'new' (meaning they need a different encoding sometimes)
+ * XMM registers, which hold mips registers left over once the allocatable
+ * registers run out, before stack slots are used.
  */
-extern const bool x86_reg_is_new[];
+enum __attribute__((__packed__)) x86_xmm_reg_type {
+    XMM0 = 0,
+    XMM1,
+    XMM2,
+    XMM3,
+    XMM4,
+    XMM5,
+    XMM6,
+    XMM7,
+    XMM8,
+    XMM9,
+    XMM10,
+    XMM11,
+    XMM12,
+    XMM13,
+    XMM14,
+    XMM15
+};
+
+extern const int num_xmm_spill_regs;
+
+extern const char *const x86_xmm_reg_type_names[];
+
+/**
+ * Registers the C calling convention doesn't preserve across calls.
+ */
+extern const bool x86_reg_is_caller_saved[];
 
 #endif // __X86_REG_H_